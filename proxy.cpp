@@ -0,0 +1,136 @@
+/*
+ * proxy.cpp -- command-line entry point of the proxy server.
+ *
+ * Usage: proxy [-b address] [-p port] [-t threads] [-c MiB] [-k count] [-n] [-u] [-T file]
+ *             [-m port] [-d docroot] [-D dir] [-C MiB]
+ *
+ *   -b address  IPv4 address to listen on (default 0.0.0.0)
+ *   -p port     port to listen on (default 8080)
+ *   -t threads  worker threads (default: one per online CPU)
+ *   -c MiB      response cache size; 0 disables caching (default 64)
+ *   -k count    idle origin connections kept per host:port and worker;
+ *               0 disables connection reuse (default 8)
+ *   -n          do not pin worker threads to CPUs
+ *   -u          use io_uring instead of epoll where the kernel supports it
+ *   -T file     where SIGUSR1 dumps the trace (default proxy-<pid>.trace)
+ *   -m port     serve Prometheus metrics at http://127.0.0.1:port/metrics
+ *   -d docroot  answer origin-form requests with the files under docroot;
+ *               absolute-form requests are still proxied
+ *   -D dir      keep a persistent second tier of the response cache in dir,
+ *               which a restarted server answers hits from at once
+ *   -C MiB      size of the disk tier (default 1024)
+ *
+ * The server runs until it receives SIGINT or SIGTERM. On SIGUSR1 it writes
+ * the recent TRACE() events of every thread to the trace file, for
+ * proxy_tracedump, and keeps running.
+ */
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "proxy_server.hpp"
+#include "proxy_trace.hpp"
+
+static void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-b address] [-p port] [-t threads] [-c MiB] [-k count] [-n] [-u] [-T file] [-m port] [-d docroot] [-D dir] [-C MiB]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+    ServerConfig config;
+    std::string trace_path = "proxy-" + std::to_string(getpid()) + ".trace";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:t:c:k:nuT:m:d:D:C:")) != -1) {
+        switch (opt) {
+        case 'b':
+            config.bindAddress = optarg;
+            break;
+        case 'p': {
+            long port = strtol(optarg, nullptr, 10);
+            if (port <= 0 || port > 65535) {
+                usage(argv[0]);
+                return 1;
+            }
+            config.port = static_cast<uint16_t>(port);
+            break;
+        }
+        case 't':
+            config.threads = strtoul(optarg, nullptr, 10);
+            break;
+        case 'c':
+            config.cacheBytes = static_cast<size_t>(strtoul(optarg, nullptr, 10)) << 20;
+            break;
+        case 'k':
+            config.upstreamMaxIdlePerHost = strtoul(optarg, nullptr, 10);
+            break;
+        case 'n':
+            config.pinThreads = false;
+            break;
+        case 'u':
+            config.engine = ServerConfig::Engine::IoUring;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'm': {
+            long port = strtol(optarg, nullptr, 10);
+            if (port <= 0 || port > 65535) {
+                usage(argv[0]);
+                return 1;
+            }
+            config.metricsPort = static_cast<uint16_t>(port);
+            break;
+        }
+        case 'd':
+            config.docroot = optarg;
+            break;
+        case 'D':
+            config.diskCacheDir = optarg;
+            break;
+        case 'C':
+            config.diskCacheBytes = static_cast<size_t>(strtoul(optarg, nullptr, 10)) << 20;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Writes to closed sockets must fail with EPIPE rather than kill us.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Block the shutdown and dump signals before any worker exists so that
+    // every thread inherits the mask and only sigwait() below sees them.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    ProxyServer server(config);
+    if (server.start() < 0) {
+        fprintf(stderr, "failed to start on %s:%u: %s\n", config.bindAddress.c_str(),
+                static_cast<unsigned>(config.port), strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "listening on %s:%u with %zu workers\n", config.bindAddress.c_str(),
+            static_cast<unsigned>(config.port), server.workerCount());
+
+    int sig = 0;
+    while (sigwait(&signals, &sig) == 0 && sig == SIGUSR1) {
+        if (traceDump(trace_path.c_str()) < 0) {
+            fprintf(stderr, "failed to write the trace to %s: %s\n", trace_path.c_str(), strerror(errno));
+        } else {
+            fprintf(stderr, "trace written to %s\n", trace_path.c_str());
+        }
+    }
+    server.stop();
+    return 0;
+}
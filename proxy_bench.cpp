@@ -0,0 +1,416 @@
+/*
+ * proxy_bench.cpp -- microbenchmarks for the request parsing library.
+ *
+ * Runs every operation of ParsedRequest that sits on the request path, and
+ * the zero-copy ParsedRequestView / RequestParser path next to it, over a
+ * few corpora of realistic requests:
+ *
+ *   curl      - the minimal proxy request curl sends.
+ *   chrome    - a browser navigation with client hints and a large Cookie.
+ *   8k        - a header block of about 8 KB, close to what origins accept.
+ *   pipelined - 16 subresource requests sent back to back on one connection.
+ *
+ * Besides the time per iteration, every benchmark reports
+ *
+ *   time/req    - time per request of the corpus,
+ *   bytes/s     - request bytes handled per second,
+ *   allocs/req  - heap allocations per request, counted by the global
+ *                 operator new below.
+ *
+ * so that an optimization shows up in the unit it is about. The trace
+ * benchmark times one TRACE() event with the arguments of a typical call
+ * site, without echoing it. Compare runs
+ * with benchmark's tools/compare.py or --benchmark_out.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "proxy_parse.hpp"
+#include "proxy_scan.hpp"
+#include "proxy_trace.hpp"
+
+/*
+ * Allocation counting
+ *
+ * Every allocation made through operator new, by the library or the
+ * standard containers it uses, bumps a counter the benchmarks sample around
+ * their timed loop.
+ */
+
+namespace {
+std::atomic<size_t> allocations{0};
+} // namespace
+
+// None of these are inlined: GCC would then see std::malloc() paired with
+// operator delete, or operator new with std::free(), and warn about it.
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size > 0 ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+/*
+ * Corpora
+ */
+
+struct Corpus {
+    const char* name;
+    std::vector<std::string> requests; // Each one a complete request head.
+    std::string wire;                  // All of them back to back.
+};
+
+std::string curlRequest() {
+    return "GET http://example.com/ HTTP/1.1\r\n"
+           "Host: example.com\r\n"
+           "User-Agent: curl/8.5.0\r\n"
+           "Accept: */*\r\n"
+           "Proxy-Connection: Keep-Alive\r\n"
+           "\r\n";
+}
+
+// The header lines of a Chrome navigation, Host and request line excluded.
+std::string chromeHeaders() {
+    return "Connection: keep-alive\r\n"
+           "Cache-Control: max-age=0\r\n"
+           "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+           "sec-ch-ua-mobile: ?0\r\n"
+           "sec-ch-ua-platform: \"Linux\"\r\n"
+           "Upgrade-Insecure-Requests: 1\r\n"
+           "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+           "Chrome/124.0.0.0 Safari/537.36\r\n"
+           "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,"
+           "image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+           "Sec-Fetch-Site: same-origin\r\n"
+           "Sec-Fetch-Mode: navigate\r\n"
+           "Sec-Fetch-User: ?1\r\n"
+           "Sec-Fetch-Dest: document\r\n"
+           "Referer: http://www.example.com/news/world/2024/05/index.html\r\n"
+           "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+           "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+           "Cookie: _ga=GA1.2.1548205389.1712345678; _gid=GA1.2.2077421846.1715432100; "
+           "session_id=9f2c4e7a1b3d5f6e8a0c2e4f6a8b0d1e; csrftoken=Xk3pQ9vR2mT7wL5yZ8bN4cF6hJ1dG0sA; "
+           "prefs=theme%3Ddark%26lang%3Den%26tz%3DEurope%252FBerlin; "
+           "_fbp=fb.1.1712345678901.1234567890; consent=analytics%3A1%2Cads%3A0\r\n"
+           "If-None-Match: W/\"5e1-18f3a2b4c5d\"\r\n"
+           "If-Modified-Since: Tue, 14 May 2024 08:12:45 GMT\r\n";
+}
+
+std::string chromeRequest() {
+    return "GET http://www.example.com/news/world/2024/05/article-1234.html HTTP/1.1\r\n"
+           "Host: www.example.com\r\n" +
+           chromeHeaders() + "\r\n";
+}
+
+// A Chrome request padded with tracing headers and a larger cookie to
+// about 8 KB, within the parser's header count limit.
+std::string largeRequest() {
+    std::string request = "POST http://api.example.com/v2/graphql?operation=FeedQuery HTTP/1.1\r\n"
+                          "Host: api.example.com\r\n" +
+                          chromeHeaders() + "Content-Type: application/json\r\nContent-Length: 0\r\n";
+    for (int i = 0; request.size() < 7 * 1024; ++i) {
+        request += "X-Trace-Context-" + std::to_string(i) + ": ";
+        request.append(150, static_cast<char>('a' + i % 26));
+        request += "\r\n";
+    }
+    request += "X-Session-State: ";
+    request.append(8 * 1024 - 4 - request.size(), 'z');
+    request += "\r\n\r\n";
+    return request;
+}
+
+std::vector<std::string> pipelinedRequests() {
+    std::vector<std::string> requests;
+    for (int i = 0; i < 16; ++i) {
+        requests.push_back("GET /static/" + std::string(i % 2 ? "js/chunk-" : "img/sprite-") +
+                           std::to_string(i) + (i % 2 ? ".js" : ".webp") + " HTTP/1.1\r\n"
+                           "Host: www.example.com\r\n"
+                           "Connection: keep-alive\r\n"
+                           "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+                           "like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+                           "Accept: */*\r\n"
+                           "Sec-Fetch-Site: same-origin\r\n"
+                           "Sec-Fetch-Mode: no-cors\r\n"
+                           "Referer: http://www.example.com/news/world/2024/05/article-1234.html\r\n"
+                           "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+                           "Accept-Language: en-US,en;q=0.9\r\n"
+                           "\r\n");
+    }
+    return requests;
+}
+
+Corpus makeCorpus(const char* name, std::vector<std::string> requests) {
+    Corpus corpus{name, std::move(requests), std::string()};
+    for (const std::string& request : corpus.requests) corpus.wire += request;
+    return corpus;
+}
+
+const std::vector<Corpus>& corpora() {
+    static const std::vector<Corpus> all = {
+        makeCorpus("curl", {curlRequest()}),
+        makeCorpus("chrome", {chromeRequest()}),
+        makeCorpus("8k", {largeRequest()}),
+        makeCorpus("pipelined", pipelinedRequests()),
+    };
+    return all;
+}
+
+// The corpus parsed into owning requests, for the benchmarks that start
+// from a parsed request.
+std::vector<ParsedRequest> parsedCorpus(const Corpus& corpus) {
+    std::vector<ParsedRequest> parsed(corpus.requests.size());
+    for (size_t i = 0; i < parsed.size(); ++i) {
+        if (parsed[i].parse(corpus.requests[i]) < 0) {
+            std::fprintf(stderr, "corpus %s: request %zu does not parse\n", corpus.name, i);
+            std::abort();
+        }
+    }
+    return parsed;
+}
+
+/*
+ * Reporting
+ */
+
+// Samples the allocation counter around a benchmark's timed loop.
+class AllocationMeter {
+public:
+    AllocationMeter() : start(allocations.load(std::memory_order_relaxed)) {}
+
+    size_t count() const { return allocations.load(std::memory_order_relaxed) - start; }
+
+private:
+    size_t start;
+};
+
+// Sets the counters every benchmark reports, for `state.iterations()`
+// passes over `corpus`.
+void report(benchmark::State& state, const Corpus& corpus, const AllocationMeter& meter) {
+    const double requests = static_cast<double>(corpus.requests.size());
+    const double passes = static_cast<double>(state.iterations());
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(corpus.requests.size()));
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(corpus.wire.size()));
+    state.counters["time/req"] = benchmark::Counter(
+        requests, benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+    state.counters["allocs/req"] = benchmark::Counter(passes > 0 ? meter.count() / (passes * requests) : 0);
+}
+
+/*
+ * Benchmarks
+ *
+ * Each one takes the corpus it runs over, and makes one pass over all of its
+ * requests per iteration.
+ */
+
+// ParsedRequest::parse(): parsing into owning strings, reusing the request
+// object as a keep-alive connection would.
+void BM_Parse(benchmark::State& state, const Corpus* corpus) {
+    ParsedRequest request;
+    AllocationMeter meter;
+    for (auto _ : state) {
+        for (const std::string& raw : corpus->requests) {
+            benchmark::DoNotOptimize(request.parse(raw));
+        }
+    }
+    report(state, *corpus, meter);
+}
+
+// ParsedRequestView::parse(): zero-copy parsing of each complete request.
+void BM_ParseView(benchmark::State& state, const Corpus* corpus) {
+    ParsedRequestView view;
+    AllocationMeter meter;
+    for (auto _ : state) {
+        for (const std::string& raw : corpus->requests) {
+            benchmark::DoNotOptimize(view.parse(raw));
+        }
+    }
+    report(state, *corpus, meter);
+}
+
+// RequestParser::feed() over the whole wire buffer, one request after the
+// other, the way a worker takes requests out of its receive buffer.
+void BM_Feed(benchmark::State& state, const Corpus* corpus) {
+    std::string_view wire = corpus->wire;
+    RequestParser parser;
+    ParsedRequestView view;
+    AllocationMeter meter;
+    for (auto _ : state) {
+        size_t offset = 0;
+        while (offset < wire.size()) {
+            parser.reset();
+            if (parser.feed(wire.substr(offset), view) != ParseStatus::Done) {
+                state.SkipWithError("corpus does not parse");
+                return;
+            }
+            offset += parser.consumed();
+        }
+        benchmark::DoNotOptimize(view);
+    }
+    report(state, *corpus, meter);
+}
+
+void BM_Unparse(benchmark::State& state, const Corpus* corpus) {
+    std::vector<ParsedRequest> parsed = parsedCorpus(*corpus);
+    AllocationMeter meter;
+    for (auto _ : state) {
+        for (const ParsedRequest& request : parsed) {
+            benchmark::DoNotOptimize(request.unparse());
+        }
+    }
+    report(state, *corpus, meter);
+}
+
+void BM_UnparseHeaders(benchmark::State& state, const Corpus* corpus) {
+    std::vector<ParsedRequest> parsed = parsedCorpus(*corpus);
+    AllocationMeter meter;
+    for (auto _ : state) {
+        for (const ParsedRequest& request : parsed) {
+            benchmark::DoNotOptimize(request.unparseHeaders());
+        }
+    }
+    report(state, *corpus, meter);
+}
+
+// ParsedRequest::unparseTo(), the scatter-gather form the workers use.
+void BM_UnparseTo(benchmark::State& state, const Corpus* corpus) {
+    std::vector<ParsedRequest> parsed = parsedCorpus(*corpus);
+    std::vector<iovec> iov(4 * ParsedRequestView::kMaxHeaders + 16);
+    AllocationMeter meter;
+    for (auto _ : state) {
+        for (const ParsedRequest& request : parsed) {
+            benchmark::DoNotOptimize(request.unparseTo(iov.data(), iov.size()));
+        }
+        benchmark::ClobberMemory();
+    }
+    report(state, *corpus, meter);
+}
+
+void BM_TotalLen(benchmark::State& state, const Corpus* corpus) {
+    std::vector<ParsedRequest> parsed = parsedCorpus(*corpus);
+    AllocationMeter meter;
+    for (auto _ : state) {
+        for (const ParsedRequest& request : parsed) {
+            benchmark::DoNotOptimize(request.totalLen());
+        }
+    }
+    report(state, *corpus, meter);
+}
+
+// getHeader() by name for headers early, late and not at all in the
+// request, as a header filter or cache key builder would ask.
+void BM_GetHeader(benchmark::State& state, const Corpus* corpus) {
+    std::vector<ParsedRequest> parsed = parsedCorpus(*corpus);
+    const std::string names[] = {"Host", "User-Agent", "Accept-Language", "Cookie", "X-Missing"};
+    AllocationMeter meter;
+    for (auto _ : state) {
+        for (const ParsedRequest& request : parsed) {
+            for (const std::string& name : names) benchmark::DoNotOptimize(request.getHeader(name));
+        }
+    }
+    report(state, *corpus, meter);
+}
+
+// ParsedRequestView::getHeader() by name, in another letter case than on
+// the wire, for names that do and do not have a HeaderId.
+void BM_GetHeaderView(benchmark::State& state, const Corpus* corpus) {
+    std::vector<ParsedRequestView> views(corpus->requests.size());
+    for (size_t i = 0; i < views.size(); ++i) views[i].parse(corpus->requests[i]);
+    constexpr std::string_view names[] = {"host", "ACCEPT-LANGUAGE", "sec-fetch-mode", "SEC-CH-UA-PLATFORM",
+                                          "x-missing-header"};
+    AllocationMeter meter;
+    for (auto _ : state) {
+        for (const ParsedRequestView& request : views) {
+            for (std::string_view name : names) benchmark::DoNotOptimize(request.getHeader(name));
+        }
+    }
+    report(state, *corpus, meter);
+}
+
+// The header rewrite a proxy does: replace Connection, drop the hop-by-hop
+// headers, add a Via. Every pass restores the original headers, so the
+// pass after it does exactly the same work.
+void BM_RewriteHeaders(benchmark::State& state, const Corpus* corpus) {
+    std::vector<ParsedRequest> parsed = parsedCorpus(*corpus);
+    const std::string connection = "Connection", proxy_connection = "Proxy-Connection",
+                      via = "Via", close = "close", via_value = "1.1 proxy";
+    std::vector<std::string> original(parsed.size());
+    for (size_t i = 0; i < parsed.size(); ++i) {
+        const ParsedHeader* header = parsed[i].getHeader(connection);
+        original[i] = header != nullptr ? header->value : "keep-alive";
+    }
+    AllocationMeter meter;
+    for (auto _ : state) {
+        for (size_t i = 0; i < parsed.size(); ++i) {
+            ParsedRequest& request = parsed[i];
+            request.setHeader(connection, close);
+            request.removeHeader(proxy_connection);
+            request.setHeader(via, via_value);
+            benchmark::DoNotOptimize(request.getHeader(via));
+            request.removeHeader(via);
+            request.setHeader(connection, original[i]);
+        }
+    }
+    report(state, *corpus, meter);
+}
+
+void BM_Trace(benchmark::State& state) {
+    traceEchoing.store(false);
+    const std::string host = "static.example.com";
+    size_t worker = 3;
+    AllocationMeter meter;
+    for (auto _ : state) {
+        TRACE("worker %zu: cannot connect to %s:%s: %s", worker, host, "443", "Connection refused");
+        benchmark::ClobberMemory();
+    }
+    state.counters["allocs/event"] =
+        benchmark::Counter(static_cast<double>(meter.count()) / static_cast<double>(state.iterations()));
+}
+
+template <class Benchmark>
+void registerForCorpora(const char* name, Benchmark benchmark) {
+    for (const Corpus& corpus : corpora()) {
+        std::string full = std::string(name) + "/" + corpus.name;
+        benchmark::RegisterBenchmark(full.c_str(), benchmark, &corpus);
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    registerForCorpora("parse", BM_Parse);
+    registerForCorpora("parse_view", BM_ParseView);
+    registerForCorpora("feed", BM_Feed);
+    registerForCorpora("unparse", BM_Unparse);
+    registerForCorpora("unparse_headers", BM_UnparseHeaders);
+    registerForCorpora("unparse_to", BM_UnparseTo);
+    registerForCorpora("total_len", BM_TotalLen);
+    registerForCorpora("get_header", BM_GetHeader);
+    registerForCorpora("get_header_view", BM_GetHeaderView);
+    registerForCorpora("rewrite_headers", BM_RewriteHeaders);
+    benchmark::RegisterBenchmark("trace", BM_Trace);
+
+    benchmark::AddCustomContext("scan_kernel", scanKernelName());
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
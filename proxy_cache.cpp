@@ -0,0 +1,631 @@
+/*
+ * proxy_cache.cpp -- shared in-memory cache of origin responses.
+ */
+
+#include "proxy_cache.hpp"
+
+#include <algorithm>
+#include <ctime>
+
+#include "proxy_disk.hpp"
+#include "proxy_metrics.hpp"
+
+namespace {
+
+// Bookkeeping charged per entry on top of its strings: the list node, the
+// index node and the shared_ptr control block.
+constexpr size_t kEntryOverhead = 128;
+
+// Slots in the index of an empty shard.
+constexpr size_t kMinTableSize = 16;
+
+// Statuses a shared cache may store given an explicit freshness lifetime.
+bool isCacheableStatus(int status) {
+    switch (status) {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return true;
+    default:
+        return false;
+    }
+}
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+// Calls f(item) for every item of a comma-separated list, blanks around it
+// trimmed; commas inside quotes do not split.
+template <class F>
+void forEachListItem(std::string_view list, F&& f) {
+    size_t i = 0;
+    while (i < list.size()) {
+        size_t end = i;
+        bool quoted = false;
+        while (end < list.size() && (quoted || list[end] != ',')) {
+            if (list[end] == '"') quoted = !quoted;
+            ++end;
+        }
+        std::string_view item = trim(list.substr(i, end - i));
+        i = end + 1;
+        if (!item.empty()) f(item);
+    }
+}
+
+// Calls f(name, value) for every directive of a Cache-Control style list
+// ("no-cache, max-age=60, private=\"Set-Cookie\""). Quotes are removed from
+// values.
+template <class F>
+void forEachDirective(std::string_view list, F&& f) {
+    forEachListItem(list, [&](std::string_view item) {
+        size_t eq = item.find('=');
+        std::string_view name = trim(item.substr(0, eq));
+        std::string_view value;
+        if (eq != std::string_view::npos) {
+            value = trim(item.substr(eq + 1));
+            if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+                value = value.substr(1, value.size() - 2);
+            }
+        }
+        f(name, value);
+    });
+}
+
+// Parses delta-seconds; returns -1 if `s` is not a number. Values too large
+// to represent saturate, as RFC 9111 asks.
+long long parseSeconds(std::string_view s) {
+    if (s.empty()) return -1;
+    long long n = 0;
+    for (char c : s) {
+        if (c < '0' || c > '9') return -1;
+        if (n < 0x7fffffff) n = n * 10 + (c - '0');
+    }
+    return n < 0x7fffffff ? n : 0x7fffffff;
+}
+
+// Headers a 304 carries over from the response it stands for.
+bool isNotModifiedHeader(HeaderId id) {
+    switch (id) {
+    case HeaderId::CacheControl: case HeaderId::ContentLocation: case HeaderId::Date: case HeaderId::ETag:
+    case HeaderId::Expires: case HeaderId::LastModified: case HeaderId::Vary:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Headers of a 304 that describe it rather than the stored response.
+bool isFramingHeader(HeaderId id) {
+    switch (id) {
+    case HeaderId::ContentLength: case HeaderId::TransferEncoding: case HeaderId::Connection:
+    case HeaderId::KeepAlive:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The opaque tag of an entity tag, without its weakness prefix, as weak
+// comparison looks at it.
+std::string_view opaqueTag(std::string_view tag) {
+    tag = trim(tag);
+    if (tag.size() >= 2 && tag[0] == 'W' && tag[1] == '/') tag.remove_prefix(2);
+    return tag;
+}
+
+void appendHeader(std::string& out, const ParsedHeaderView& header) {
+    out.append(header.key).append(": ").append(header.value).append("\r\n");
+}
+
+} // namespace
+
+/*
+ * Free functions
+ */
+
+size_t CachedResponse::charge() const {
+    size_t n = sizeof(*this) + kEntryOverhead + key.size() + response.size();
+    for (const auto& [name, value] : vary) n += name.size() + value.size();
+    return n + etag.size() + lastModified.size() + notModified.size();
+}
+
+bool parseHttpDate(std::string_view text, CacheClock::time_point& out) {
+    std::string s(trim(text));
+    std::tm tm{};
+    const char* end = strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == nullptr || *end != '\0') return false;
+    out = CacheClock::from_time_t(timegm(&tm));
+    return true;
+}
+
+bool requestNotModified(std::string_view if_none_match, std::string_view if_modified_since, std::string_view etag,
+                        std::string_view last_modified) {
+    if (!trim(if_none_match).empty()) {
+        if (etag.empty()) return false;
+        if (trim(if_none_match) == "*") return true;
+        bool match = false;
+        // Entity tags may contain '=', so the list is not split like
+        // Cache-Control.
+        forEachListItem(if_none_match, [&](std::string_view tag) {
+            if (opaqueTag(tag) == opaqueTag(etag)) match = true;
+        });
+        return match;
+    }
+    CacheClock::time_point since, modified;
+    if (last_modified.empty() || !parseHttpDate(if_modified_since, since) || !parseHttpDate(last_modified, modified)) {
+        return false;
+    }
+    return modified <= since;
+}
+
+std::string notModifiedResponse(std::string_view response) {
+    ParsedResponseView view;
+    if (view.parse(response) != 0) return std::string();
+    std::string out = "HTTP/1.1 304 Not Modified\r\n";
+    for (const ParsedHeaderView& header : view.headers) {
+        if (isNotModifiedHeader(header.id)) appendHeader(out, header);
+    }
+    return out + "\r\n";
+}
+
+std::string updateStoredResponse(std::string_view stored, std::string_view not_modified) {
+    ParsedResponseView old_view, new_view;
+    if (old_view.parse(stored) != 0 || new_view.parse(not_modified) != 0) return std::string(stored);
+    auto updated = [&](const ParsedHeaderView& header) {
+        if (header.id == HeaderId::Age) return true;
+        for (const ParsedHeaderView& fresh : new_view.headers) {
+            if (!isFramingHeader(fresh.id) && equalsIgnoreCase(fresh.key, header.key)) return true;
+        }
+        return false;
+    };
+
+    std::string out(old_view.buf.substr(0, old_view.buf.find("\r\n") + 2));
+    for (const ParsedHeaderView& header : old_view.headers) {
+        if (!updated(header)) appendHeader(out, header);
+    }
+    for (const ParsedHeaderView& header : new_view.headers) {
+        if (!isFramingHeader(header.id)) appendHeader(out, header);
+    }
+    out.append("\r\n").append(stored.substr(old_view.buf.size()));
+    return out;
+}
+
+bool responseSharable(std::string_view response) {
+    ParsedResponseView view;
+    if (view.parse(response) != 0 || !isCacheableStatus(view.status)) return false;
+    bool sharable = true;
+    for (const ParsedHeaderView& header : view.headers) {
+        switch (header.id) {
+        case HeaderId::SetCookie:
+        case HeaderId::Vary:
+            return false;
+        case HeaderId::CacheControl:
+            forEachDirective(header.value, [&](std::string_view name, std::string_view) {
+                if (equalsIgnoreCase(name, "no-store") || equalsIgnoreCase(name, "no-cache") ||
+                    equalsIgnoreCase(name, "private")) {
+                    sharable = false;
+                }
+            });
+            break;
+        default:
+            break;
+        }
+    }
+    return sharable;
+}
+
+bool requestBypassesCache(std::string_view cache_control, std::string_view pragma, bool for_store) {
+    bool no_store = false;
+    bool no_cache = false;
+    forEachDirective(cache_control, [&](std::string_view name, std::string_view value) {
+        if (equalsIgnoreCase(name, "no-store")) no_store = true;
+        else if (equalsIgnoreCase(name, "no-cache")) no_cache = true;
+        else if (equalsIgnoreCase(name, "max-age") && parseSeconds(value) == 0) no_cache = true;
+    });
+    // Pragma only matters to HTTP/1.0 clients that send no Cache-Control.
+    if (cache_control.empty()) {
+        forEachDirective(pragma, [&](std::string_view name, std::string_view) {
+            if (equalsIgnoreCase(name, "no-cache")) no_cache = true;
+        });
+    }
+    return for_store ? no_store : no_store || no_cache;
+}
+
+ResponsePolicy parseResponsePolicy(std::string_view response, CacheClock::time_point now) {
+    ResponsePolicy policy;
+
+    ParsedResponseView view;
+    if (view.parse(response) != 0) return policy;
+    size_t body_len = response.size() - view.buf.size();
+    if (!isCacheableStatus(view.status)) return policy;
+
+    std::string cache_control;
+    std::string vary;
+    std::string_view expires, date, age, content_length;
+    bool validated = false;
+    for (const ParsedHeaderView& header : view.headers) {
+        std::string_view value = header.value;
+        switch (header.id) {
+        case HeaderId::CacheControl:
+            if (!cache_control.empty()) cache_control.append(", ");
+            cache_control.append(value);
+            break;
+        case HeaderId::Vary:
+            if (!vary.empty()) vary.append(", ");
+            vary.append(value);
+            break;
+        case HeaderId::Expires:
+            if (expires.empty()) expires = value;
+            break;
+        case HeaderId::Date:
+            if (date.empty()) date = value;
+            break;
+        case HeaderId::Age:
+            if (age.empty()) age = value;
+            break;
+        case HeaderId::ContentLength:
+            content_length = value;
+            break;
+        case HeaderId::ETag:
+        case HeaderId::LastModified:
+            validated = true;
+            break;
+        case HeaderId::SetCookie:
+            // Per-user state must not be handed to other clients.
+            return policy;
+        default:
+            break;
+        }
+    }
+
+    // A response cut short must not be served to anyone else.
+    long long expected = parseSeconds(content_length);
+    if (expected >= 0 && static_cast<size_t>(expected) != body_len) return policy;
+
+    bool forbidden = false;
+    bool no_cache = false;
+    long long max_age = -1;
+    long long s_maxage = -1;
+    forEachDirective(cache_control, [&](std::string_view name, std::string_view value) {
+        if (equalsIgnoreCase(name, "no-store") || equalsIgnoreCase(name, "private")) {
+            forbidden = true;
+        } else if (equalsIgnoreCase(name, "no-cache")) {
+            // Revalidated on every use, which takes a validator.
+            no_cache = true;
+        } else if (equalsIgnoreCase(name, "max-age")) {
+            max_age = parseSeconds(value);
+        } else if (equalsIgnoreCase(name, "s-maxage")) {
+            s_maxage = parseSeconds(value);
+        }
+    });
+    if (forbidden) return policy;
+
+    // Freshness lifetime: s-maxage, then max-age, then Expires relative to
+    // the origin's Date. An unparseable Expires means already expired, and
+    // none at all means stale from the start: such a response is stored
+    // only if it can be revalidated.
+    long long lifetime = 0;
+    if (no_cache) {
+        lifetime = 0;
+    } else if (s_maxage >= 0) {
+        lifetime = s_maxage;
+    } else if (max_age >= 0) {
+        lifetime = max_age;
+    } else if (!expires.empty()) {
+        CacheClock::time_point expires_at, date_at = now;
+        if (parseHttpDate(expires, expires_at)) {
+            if (!date.empty() && !parseHttpDate(date, date_at)) date_at = now;
+            lifetime = std::chrono::duration_cast<std::chrono::seconds>(expires_at - date_at).count();
+        }
+    }
+
+    long long current_age = parseSeconds(age);
+    if (current_age < 0) current_age = 0;
+    if (lifetime <= current_age && !validated) return policy;
+
+    bool vary_any = false;
+    forEachDirective(vary, [&](std::string_view name, std::string_view) {
+        if (name == "*") vary_any = true;
+        else policy.varyHeaders.emplace_back(name);
+    });
+    if (vary_any) return policy;
+
+    policy.expires = now + std::chrono::seconds(std::max(lifetime - current_age, 0LL));
+    policy.storable = true;
+    return policy;
+}
+
+/*
+ * ResponseCache
+ */
+
+// Nodes are created and linked by writers, and never modified afterwards
+// except for `referenced`, the only field readers write.
+struct ResponseCache::Node {
+    Entry entry;
+    size_t hash;
+    size_t charge;
+    std::list<Node*>::iterator lru; // Written under the shard lock only.
+    std::atomic<bool> referenced{false};
+    Node* nextUnlinked = nullptr; // See Unlinked.
+};
+
+// Linear probing over a power-of-two array of slots. A slot is empty, holds
+// a node, or holds a tombstone left by a removal, which probes skip. Used
+// slots (nodes plus tombstones) are kept below half of the array, so every
+// probe ends at an empty slot.
+struct ResponseCache::Table {
+    explicit Table(size_t size) : mask(size - 1), slots(new std::atomic<Node*>[size]) {
+        for (size_t i = 0; i < size; ++i) slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    size_t mask;
+    std::unique_ptr<std::atomic<Node*>[]> slots;
+    size_t live = 0;       // Written under the shard lock only.
+    size_t tombstones = 0; // Written under the shard lock only.
+};
+
+ResponseCache::Unlinked::~Unlinked() {
+    while (nodes != nullptr) {
+        Node* node = nodes;
+        nodes = node->nextUnlinked;
+        Epoch::retire(node);
+    }
+    if (table != nullptr) Epoch::retire(table);
+}
+
+ResponseCache::Node* ResponseCache::tombstone() {
+    return reinterpret_cast<Node*>(uintptr_t{1});
+}
+
+ResponseCache::ResponseCache(size_t capacity, size_t shard_count)
+    : shards(new Shard[shard_count > 0 ? shard_count : 1]),
+      shardCount(shard_count > 0 ? shard_count : 1),
+      shardCapacity(capacity / shardCount) {
+    for (size_t i = 0; i < shardCount; ++i) {
+        shards[i].table.store(new Table(kMinTableSize), std::memory_order_release);
+    }
+}
+
+ResponseCache::~ResponseCache() {
+    // No reader is left; retired nodes and tables belong to proxy_epoch.
+    for (size_t i = 0; i < shardCount; ++i) {
+        for (Node* node : shards[i].lru) delete node;
+        delete shards[i].table.load(std::memory_order_relaxed);
+    }
+}
+
+ResponseCache::Entry ResponseCache::find(Shard& shard, std::string_view key, size_t hash,
+                                         CacheClock::time_point now, bool stale, bool& stored) {
+    Entry entry;
+    bool expired = false;
+    {
+        Epoch::Guard guard;
+        const Table* table = shard.table.load(std::memory_order_acquire);
+        for (size_t i = hash / shardCount;; ++i) {
+            Node* node = table->slots[i & table->mask].load(std::memory_order_acquire);
+            if (node == nullptr) break;
+            if (node == tombstone() || node->hash != hash || node->entry->key != key) continue;
+            stored = true;
+            if (node->entry->expires <= now && !(stale && node->entry->validated())) {
+                // One that can be revalidated stays for the next request.
+                expired = !node->entry->validated();
+            } else {
+                // Only write the shared line when the bit actually changes.
+                if (!node->referenced.load(std::memory_order_relaxed)) {
+                    node->referenced.store(true, std::memory_order_relaxed);
+                }
+                entry = node->entry;
+            }
+            break;
+        }
+    }
+
+    // Dropping an expired entry is left to writers when one is busy already.
+    if (expired) {
+        Unlinked unlinked;
+        std::unique_lock<std::mutex> lock(shard.mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            Node* node = locate(shard, key, hash);
+            if (node != nullptr && node->entry->expires <= now) unlink(shard, node, unlinked);
+        }
+    }
+    return entry;
+}
+
+ResponseCache::Entry ResponseCache::findOnDisk(const HashedKey& key, CacheClock::time_point now, bool stale) {
+    std::shared_ptr<CachedResponse> entry = disk->load(key.text, key.hash);
+    if (entry == nullptr) return nullptr;
+    setValidators(*entry);
+    if (entry->expires <= now && !entry->validated()) {
+        disk->erase(key.text, key.hash);
+        return nullptr;
+    }
+    countEvent(Counter::DiskCacheLoads);
+    bool usable = entry->expires > now || stale;
+    insert(entry, static_cast<size_t>(key.hash));
+    return usable ? std::move(entry) : nullptr;
+}
+
+void ResponseCache::setValidators(CachedResponse& entry) {
+    ParsedResponseView view;
+    if (view.parse(entry.response) != 0) return;
+    if (const ParsedHeaderView* etag = view.getHeader(HeaderId::ETag)) entry.etag = etag->value;
+    if (const ParsedHeaderView* modified = view.getHeader(HeaderId::LastModified)) entry.lastModified = modified->value;
+    entry.notModified = notModifiedResponse(entry.response);
+}
+
+void ResponseCache::makeConditional(ParsedRequestView& request, const CachedResponse& entry) {
+    request.removeHeader("If-None-Match");
+    request.removeHeader("If-Modified-Since");
+    if (!entry.etag.empty()) request.setHeader("If-None-Match", entry.etag);
+    if (!entry.lastModified.empty()) request.setHeader("If-Modified-Since", entry.lastModified);
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::revalidate(const std::shared_ptr<const CachedResponse>& stale,
+                                                                std::string_view not_modified,
+                                                                CacheClock::time_point now) {
+    auto entry = std::make_shared<CachedResponse>();
+    entry->key = stale->key;
+    entry->response = updateStoredResponse(stale->response, not_modified);
+    entry->vary = stale->vary;
+    setValidators(*entry);
+
+    // Vary values can only be kept if the 304 names the same headers.
+    ResponsePolicy policy = parseResponsePolicy(entry->response, now);
+    bool same_vary = policy.varyHeaders.size() == entry->vary.size();
+    for (size_t i = 0; same_vary && i < entry->vary.size(); ++i) {
+        same_vary = equalsIgnoreCase(policy.varyHeaders[i], entry->vary[i].first);
+    }
+    entry->expires = policy.expires;
+    if (policy.storable && same_vary) {
+        size_t hash = static_cast<size_t>(hashKey(entry->key));
+        if (!admit(entry, hash)) erase(entry->key);
+    } else {
+        erase(entry->key);
+    }
+    return entry;
+}
+
+ResponseCache::Node* ResponseCache::locate(Shard& shard, std::string_view key, size_t hash) {
+    Table* table = shard.table.load(std::memory_order_relaxed);
+    for (size_t i = hash / shardCount;; ++i) {
+        Node* node = table->slots[i & table->mask].load(std::memory_order_relaxed);
+        if (node == nullptr) return nullptr;
+        if (node != tombstone() && node->hash == hash && node->entry->key == key) return node;
+    }
+}
+
+bool ResponseCache::admit(Entry entry, size_t hash) {
+    // What is too large for memory would only be loaded from disk to be
+    // dropped again on every miss. Another insert may evict the entry as
+    // soon as it is in, hence the reference held here.
+    Entry kept = entry;
+    if (!insert(std::move(entry), hash)) return false;
+    if (disk != nullptr) disk->save(std::move(kept), hash);
+    return true;
+}
+
+bool ResponseCache::insert(Entry entry, size_t hash) {
+    size_t charge = entry->charge();
+    if (charge > shardCapacity) return false;
+
+    Shard& shard = shardFor(hash);
+    auto* node = new Node{std::move(entry), hash, charge, {}, {false}};
+
+    Unlinked unlinked;
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (Node* old = locate(shard, node->entry->key, hash)) unlink(shard, old, unlinked);
+
+    Table* table = shard.table.load(std::memory_order_relaxed);
+    if ((table->live + table->tombstones + 1) * 2 > table->mask + 1) {
+        table = rebuild(shard, table->live + 1, unlinked);
+    }
+    for (size_t i = hash / shardCount;; ++i) {
+        std::atomic<Node*>& slot = table->slots[i & table->mask];
+        Node* current = slot.load(std::memory_order_relaxed);
+        if (current != nullptr && current != tombstone()) continue;
+        if (current == tombstone()) --table->tombstones;
+        ++table->live;
+        slot.store(node, std::memory_order_release);
+        break;
+    }
+    shard.lru.push_front(node);
+    node->lru = shard.lru.begin();
+    shard.bytes += charge;
+
+    // Second chance: an entry referenced since it last came by is moved to
+    // the front instead of being evicted, at most once per entry per insert
+    // so that readers setting bits cannot keep this loop going.
+    size_t chances = shard.lru.size();
+    while (shard.bytes > shardCapacity) {
+        Node* victim = shard.lru.back();
+        // The entry being inserted is never the victim. It fits on its own,
+        // so while the shard is too full there is another one to evict.
+        if (victim == node ||
+            (chances > 0 && victim->referenced.exchange(false, std::memory_order_relaxed))) {
+            if (victim != node) --chances;
+            shard.lru.splice(shard.lru.begin(), shard.lru, victim->lru);
+            continue;
+        }
+        unlink(shard, victim, unlinked);
+    }
+    return true;
+}
+
+void ResponseCache::unlink(Shard& shard, Node* node, Unlinked& unlinked) {
+    Table* table = shard.table.load(std::memory_order_relaxed);
+    for (size_t i = node->hash / shardCount;; ++i) {
+        std::atomic<Node*>& slot = table->slots[i & table->mask];
+        Node* current = slot.load(std::memory_order_relaxed);
+        if (current == nullptr) break;
+        if (current != node) continue;
+        slot.store(tombstone(), std::memory_order_release);
+        --table->live;
+        ++table->tombstones;
+        break;
+    }
+    shard.lru.erase(node->lru);
+    shard.bytes -= node->charge;
+    node->nextUnlinked = unlinked.nodes;
+    unlinked.nodes = node;
+}
+
+ResponseCache::Table* ResponseCache::rebuild(Shard& shard, size_t entries, Unlinked& unlinked) {
+    size_t size = kMinTableSize;
+    while (size < entries * 4) size *= 2;
+
+    auto* table = new Table(size);
+    for (Node* node : shard.lru) {
+        size_t i = node->hash / shardCount;
+        while (table->slots[i & table->mask].load(std::memory_order_relaxed) != nullptr) ++i;
+        table->slots[i & table->mask].store(node, std::memory_order_relaxed);
+        ++table->live;
+    }
+    // Readers still probing the old table see the same nodes.
+    Table* old = shard.table.exchange(table, std::memory_order_acq_rel);
+    if (unlinked.table != nullptr) Epoch::retire(unlinked.table);
+    unlinked.table = old;
+    return table;
+}
+
+void ResponseCache::erase(std::string_view key) {
+    size_t hash = static_cast<size_t>(hashKey(key));
+    Shard& shard = shardFor(hash);
+    Unlinked unlinked;
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (Node* node = locate(shard, key, hash)) unlink(shard, node, unlinked);
+    if (disk != nullptr) disk->erase(key, hash);
+}
+
+size_t ResponseCache::bytes() const {
+    size_t total = 0;
+    for (size_t i = 0; i < shardCount; ++i) {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        total += shards[i].bytes;
+    }
+    return total;
+}
+
+size_t ResponseCache::entries() const {
+    size_t total = 0;
+    for (size_t i = 0; i < shardCount; ++i) {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        total += shards[i].lru.size();
+    }
+    return total;
+}
+
+uint64_t ResponseCache::hits() const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < shardCount; ++i) total += shards[i].hits.load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t ResponseCache::misses() const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < shardCount; ++i) total += shards[i].misses.load(std::memory_order_relaxed);
+    return total;
+}
@@ -0,0 +1,456 @@
+/*
+ * proxy_cache.hpp -- shared in-memory cache of origin responses.
+ *
+ * Responses to repeatable GET requests are kept in a ResponseCache shared by
+ * all workers, so that the same object is fetched from its origin once per
+ * freshness lifetime rather than once per client.
+ *
+ *   - Entries are keyed on the normalized host, port and path of the request,
+ *     the resource key of its NormalizedTarget (see proxy_uri.hpp), whose
+ *     precomputed hash picks the shard and the slot.
+ *   - The cache is bounded in bytes, not entries: a handful of large objects
+ *     must not be able to push memory use past the configured budget.
+ *   - It is split into shards selected by the hash of the key. Lookups take
+ *     no lock at all: each shard has an open-addressed index that readers
+ *     probe inside an Epoch::Guard, so hits are served from any core in
+ *     parallel. Writers (stores, evictions) serialize on the shard's mutex
+ *     and retire what they unlink to proxy_epoch, which frees it once no
+ *     reader can hold it.
+ *   - Replacement is LRU with a second chance (the CLOCK approximation): a
+ *     hit only sets the entry's referenced bit, since moving it in a list
+ *     would need the lock; eviction moves referenced entries back to the
+ *     front instead of dropping them.
+ *   - Responses with an explicit freshness lifetime (Cache-Control
+ *     s-maxage or max-age, or Expires) are stored, and Cache-Control
+ *     no-store / no-cache / private and Vary are honoured on both sides.
+ *     Responses with a validator (ETag or Last-Modified) are stored without
+ *     one, or with no-cache, too, but are stale from the start.
+ *   - Conditional requests: a client's If-None-Match or If-Modified-Since
+ *     that a fresh entry meets is answered with the entry's precomputed 304,
+ *     without its body. A stale entry with a validator is not dropped but
+ *     revalidated: the request goes to the origin with the entry's
+ *     validators in place of the client's, and a 304 from the origin makes
+ *     revalidate() refresh the entry's headers and freshness lifetime, so
+ *     that the body is never sent again by the origin.
+ *   - With a DiskCache attached (see proxy_disk.hpp), every entry stored is
+ *     queued to be written through to it, and a miss in memory looks there
+ *     before giving up; what is found is brought back into memory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "proxy_epoch.hpp"
+#include "proxy_parse.hpp"
+#include "proxy_uri.hpp"
+
+using CacheClock = std::chrono::system_clock;
+
+class DiskCache;
+
+/*
+ * CachedResponse struct
+ *
+ * One stored response. Entries are immutable once in the cache and handed
+ * out as shared pointers, so a worker can keep sending one while it is
+ * evicted or replaced.
+ */
+struct CachedResponse {
+    std::string key;      // NormalizedTarget::resource of the request.
+    std::string response; // Status line, headers and body as sent by the origin.
+    CacheClock::time_point expires;
+
+    // The request headers named by the response's Vary header, with the
+    // values they had in the request the response was stored for. A request
+    // must carry the same values to be served this entry.
+    std::vector<std::pair<std::string, std::string>> vary;
+
+    // Validators of the response, empty if it has none, and the head of the
+    // 304 answering a request whose conditions they meet.
+    std::string etag;
+    std::string lastModified;
+    std::string notModified;
+
+    // The entry can be revalidated with the origin.
+    bool validated() const { return !etag.empty() || !lastModified.empty(); }
+
+    // Bytes charged against the cache capacity for this entry.
+    size_t charge() const;
+};
+
+/*
+ * parseHttpDate() function: Parses an IMF-fixdate ("Sun, 06 Nov 1994
+ * 08:49:37 GMT"), the only date format HTTP/1.1 senders may generate.
+ * Returns true on success.
+ */
+bool parseHttpDate(std::string_view text, CacheClock::time_point& out);
+
+/*
+ * requestNotModified() function: True if a GET or HEAD request carrying
+ * `if_none_match` and `if_modified_since` (empty if absent) is answered
+ * with 304 by a representation with `etag` and `last_modified` (empty if
+ * unknown), as RFC 9110 13.2.2 evaluates them: entity tags by weak
+ * comparison, and the date only if there is no If-None-Match.
+ */
+bool requestNotModified(std::string_view if_none_match, std::string_view if_modified_since, std::string_view etag,
+                        std::string_view last_modified);
+
+/*
+ * requestNotModified() function: The same for the conditional headers of
+ * `request`, a ParsedRequest or ParsedRequestView; false for other methods.
+ */
+template <class Request>
+bool requestNotModified(const Request& request, std::string_view etag, std::string_view last_modified) {
+    std::string_view method = request.method;
+    if (method != "GET" && method != "HEAD") return false;
+    const auto* if_none_match = request.getHeader(HeaderId::IfNoneMatch);
+    const auto* if_modified_since = request.getHeader(HeaderId::IfModifiedSince);
+    if (if_none_match == nullptr && if_modified_since == nullptr) return false;
+    return requestNotModified(if_none_match != nullptr ? std::string_view(if_none_match->value) : std::string_view(),
+                              if_modified_since != nullptr ? std::string_view(if_modified_since->value)
+                                                           : std::string_view(),
+                              etag, last_modified);
+}
+
+/*
+ * notModifiedResponse() function: The 304 for a stored `response`: an
+ * HTTP/1.1 status line and those of its headers a 304 carries
+ * (Cache-Control, Content-Location, Date, ETag, Expires, Last-Modified and
+ * Vary), and the blank line ending the head.
+ */
+std::string notModifiedResponse(std::string_view response);
+
+/*
+ * updateStoredResponse() function: `stored` with its headers updated from
+ * `not_modified`, the 304 that revalidated it (RFC 9111 4.3.4): headers the
+ * 304 has replace those of the same name, except those that frame the body
+ * or the connection, and a stale Age is dropped.
+ */
+std::string updateStoredResponse(std::string_view stored, std::string_view not_modified);
+
+/*
+ * ResponsePolicy struct
+ *
+ * What a response allows a shared cache to do, as determined by
+ * parseResponsePolicy().
+ */
+struct ResponsePolicy {
+    bool storable = false;                 // May be stored at all.
+    CacheClock::time_point expires;        // End of its freshness lifetime; `now` if stale already.
+    std::vector<std::string> varyHeaders;  // Request headers named by Vary.
+};
+
+/*
+ * parseResponsePolicy() function: Reads the status line and the
+ * Cache-Control, Expires, Date, Age, Vary, ETag, Last-Modified and
+ * Set-Cookie headers of a complete response received at `now`.
+ */
+ResponsePolicy parseResponsePolicy(std::string_view response, CacheClock::time_point now);
+
+/*
+ * responseSharable() function: True if the response that `response`
+ * starts with, whose head must be complete, may be handed as it is to
+ * other clients that asked for the same resource at the same time: its
+ * status is one the cache may store, it sets no cookie and has no Vary, and
+ * Cache-Control does not make it private or ask for it to be revalidated
+ * (no-cache, no-store).
+ */
+bool responseSharable(std::string_view response);
+
+/*
+ * requestBypassesCache() function: True if a request with these
+ * Cache-Control and Pragma values must not be served from the cache or,
+ * with `for_store`, must not have its response stored.
+ */
+bool requestBypassesCache(std::string_view cache_control, std::string_view pragma, bool for_store);
+
+/*
+ * ResponseCache class
+ *
+ * Thread-safe, sharded, byte-bounded LRU cache of origin responses with a
+ * lock-free lookup path. The request-facing methods are templates accepting
+ * ParsedRequest or ParsedRequestView.
+ */
+class ResponseCache {
+public:
+    static constexpr size_t kDefaultShards = 16;
+
+    /*
+     * Constructor: `capacity` bytes in total, split evenly between
+     * `shards` shards. An entry larger than one shard is never stored.
+     */
+    explicit ResponseCache(size_t capacity, size_t shards = kDefaultShards);
+    ~ResponseCache();
+
+    ResponseCache(const ResponseCache&) = delete;
+    ResponseCache& operator=(const ResponseCache&) = delete;
+
+    /*
+     * setDiskTier() method: Writes entries through to `tier` and falls back
+     * to it on misses; null detaches it. Only before the cache is shared.
+     */
+    void setDiskTier(DiskCache* tier) { disk = tier; }
+
+    /*
+     * mayServe() method: True if `request` may be answered from the cache:
+     * a GET without credentials that does not ask to bypass caches
+     * (Cache-Control no-cache, no-store or max-age=0, or Pragma: no-cache).
+     */
+    template <class Request>
+    static bool mayServe(const Request& request);
+
+    /*
+     * mayStore() method: True if the response to `request` may be stored:
+     * a GET without credentials and without Cache-Control: no-store.
+     */
+    template <class Request>
+    static bool mayStore(const Request& request);
+
+    /*
+     * lookup() method: The fresh entry stored under `key` whose Vary values
+     * match `request`, or null. Counts a hit or a miss. Takes no lock unless
+     * it misses and has a disk tier to look in, which may block.
+     */
+    template <class Request>
+    std::shared_ptr<const CachedResponse> lookup(const HashedKey& key, const Request& request,
+                                                 CacheClock::time_point now = CacheClock::now());
+
+    /*
+     * lookupStale() method: The entry stored under `key` whose Vary values
+     * match `request`, fresh or not, if it has a validator: what a request
+     * that missed, or that may not be served without revalidation, can be
+     * made conditional on. Null otherwise. Takes no lock unless it misses
+     * and has a disk tier to look in.
+     */
+    template <class Request>
+    std::shared_ptr<const CachedResponse> lookupStale(const HashedKey& key, const Request& request);
+
+    /*
+     * mayRevalidate() method: True if `request`, which may have its response
+     * stored, may have its conditions replaced by those of an entry with
+     * makeConditional(): it asks for no range and has no precondition
+     * (If-Match, If-Unmodified-Since) on the state of the resource.
+     */
+    template <class Request>
+    static bool mayRevalidate(const Request& request);
+
+    /*
+     * makeConditional() method: Replaces the If-None-Match and
+     * If-Modified-Since headers of `request` by the validators of `entry`,
+     * which must outlive it.
+     */
+    static void makeConditional(ParsedRequestView& request, const CachedResponse& entry);
+
+    /*
+     * revalidate() method: Replaces `stale`, which the origin has just
+     * confirmed with the 304 `not_modified`, by a copy with updated headers
+     * and a new freshness lifetime, or drops it if the updated response may
+     * no longer be stored. Returns the copy, which answers the request that
+     * revalidated it either way.
+     */
+    std::shared_ptr<const CachedResponse> revalidate(const std::shared_ptr<const CachedResponse>& stale,
+                                                     std::string_view not_modified,
+                                                     CacheClock::time_point now = CacheClock::now());
+
+    /*
+     * store() method: Stores the complete `response` to `request` under
+     * `key`, replacing any previous entry, if the response allows it.
+     * Returns true if it was stored.
+     */
+    template <class Request>
+    bool store(HashedKey key, const Request& request, std::string response,
+               CacheClock::time_point now = CacheClock::now());
+
+    /*
+     * erase() method: Drops the entry stored under `key`, if any.
+     */
+    void erase(std::string_view key);
+
+    // Bytes currently charged, and number of entries, over all shards.
+    size_t bytes() const;
+    size_t entries() const;
+
+    // Lookups that found, and did not find, a usable entry.
+    uint64_t hits() const;
+    uint64_t misses() const;
+
+private:
+    using Entry = std::shared_ptr<const CachedResponse>;
+
+    struct Node;  // An entry and its place in the LRU list.
+    struct Table; // Open-addressed index from keys to nodes.
+
+    // One part of the cache. Readers only load `table` and the nodes it
+    // points to, and bump the counters, which get a cache line of their own
+    // so that they do not keep invalidating `table`. Everything else is
+    // guarded by `mutex`.
+    struct alignas(64) Shard {
+        std::atomic<Table*> table{nullptr};
+
+        alignas(64) std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+
+        alignas(64) mutable std::mutex mutex;
+        std::list<Node*> lru; // Most recently inserted or referenced first.
+        size_t bytes = 0;
+    };
+
+    Shard& shardFor(size_t hash) { return shards[hash % shardCount]; }
+
+    // What a writer removed while holding a shard's mutex. Declared before
+    // the lock, it is destroyed after the lock is released and retires it
+    // then, so that no reclamation work is done with the shard locked.
+    struct Unlinked {
+        Node* nodes = nullptr;  // Chained through Node::nextUnlinked.
+        Table* table = nullptr; // An index replaced by rebuild().
+
+        Unlinked() = default;
+        Unlinked(const Unlinked&) = delete;
+        Unlinked& operator=(const Unlinked&) = delete;
+        ~Unlinked();
+    };
+
+    // Returns the fresh entry under `key` or, with `stale`, one that is
+    // expired but has a validator, marking it referenced. Sets `stored` if
+    // there is an entry under `key` at all. Lock-free.
+    Entry find(Shard& shard, std::string_view key, size_t hash, CacheClock::time_point now, bool stale,
+               bool& stored);
+
+    // The same from the disk tier, if any: the entry stored there under
+    // `key` is brought into memory if it is fresh or has a validator.
+    Entry findOnDisk(const HashedKey& key, CacheClock::time_point now, bool stale);
+
+    // Fills in the validators of `entry` and its 304 from its response.
+    static void setValidators(CachedResponse& entry);
+
+    // True if `entry` was stored for the values `request` has of the
+    // headers named by Vary.
+    template <class Request>
+    static bool varyMatches(const CachedResponse& entry, const Request& request);
+
+    // The node under `key`, or null; the shard must be locked.
+    Node* locate(Shard& shard, std::string_view key, size_t hash);
+
+    // Marks a slot whose node was removed.
+    static Node* tombstone();
+
+    // Adds `entry`, whose key hashes to `hash`, replacing any entry with the
+    // same key and evicting until the shard fits. Returns false if too large.
+    bool insert(Entry entry, size_t hash);
+
+    // Inserts `entry` and, if it fits, queues it for the disk tier, if any.
+    bool admit(Entry entry, size_t hash);
+
+    // Removes `node` from the index and the LRU list and adds it to
+    // `unlinked`; the shard must be locked.
+    void unlink(Shard& shard, Node* node, Unlinked& unlinked);
+
+    // Replaces the index of `shard` by one with room for more entries and
+    // no tombstones, adding the old one to `unlinked`; the shard must be
+    // locked.
+    Table* rebuild(Shard& shard, size_t entries, Unlinked& unlinked);
+
+    template <class Request>
+    static std::string_view headerValue(const Request& request, std::string_view name);
+
+    template <class Request>
+    static bool bypassesCache(const Request& request, bool for_store);
+
+    std::unique_ptr<Shard[]> shards;
+    size_t shardCount;
+    size_t shardCapacity;
+    DiskCache* disk = nullptr; // Not owned.
+};
+
+/*
+ * ResponseCache templates
+ */
+
+template <class Request>
+std::string_view ResponseCache::headerValue(const Request& request, std::string_view name) {
+    HeaderId id = classifyHeader(name);
+    const auto* header = id != HeaderId::Unknown ? request.getHeader(id) : request.getHeader(name);
+    return header != nullptr ? std::string_view(header->value) : std::string_view();
+}
+
+template <class Request>
+bool ResponseCache::bypassesCache(const Request& request, bool for_store) {
+    if (std::string_view(request.method) != "GET") return true;
+    if (request.getHeader(HeaderId::Authorization) != nullptr) return true;
+    return requestBypassesCache(headerValue(request, "Cache-Control"), headerValue(request, "Pragma"), for_store);
+}
+
+template <class Request>
+bool ResponseCache::mayServe(const Request& request) {
+    return !bypassesCache(request, false);
+}
+
+template <class Request>
+bool ResponseCache::mayStore(const Request& request) {
+    return !bypassesCache(request, true);
+}
+
+template <class Request>
+bool ResponseCache::mayRevalidate(const Request& request) {
+    return request.getHeader(HeaderId::Range) == nullptr && request.getHeader(HeaderId::IfMatch) == nullptr &&
+           request.getHeader(HeaderId::IfUnmodifiedSince) == nullptr;
+}
+
+template <class Request>
+bool ResponseCache::varyMatches(const CachedResponse& entry, const Request& request) {
+    for (const auto& [name, value] : entry.vary) {
+        if (headerValue(request, name) != value) return false;
+    }
+    return true;
+}
+
+template <class Request>
+std::shared_ptr<const CachedResponse> ResponseCache::lookup(const HashedKey& key, const Request& request,
+                                                            CacheClock::time_point now) {
+    Shard& shard = shardFor(key.hash);
+    bool stored = false;
+    Entry entry = find(shard, key.text, key.hash, now, false, stored);
+    if (!stored && disk != nullptr) entry = findOnDisk(key, now, false);
+    if (entry != nullptr && !varyMatches(*entry, request)) entry = nullptr;
+    (entry != nullptr ? shard.hits : shard.misses).fetch_add(1, std::memory_order_relaxed);
+    return entry;
+}
+
+template <class Request>
+std::shared_ptr<const CachedResponse> ResponseCache::lookupStale(const HashedKey& key, const Request& request) {
+    CacheClock::time_point now = CacheClock::now();
+    bool stored = false;
+    Entry entry = find(shardFor(key.hash), key.text, key.hash, now, true, stored);
+    if (!stored && disk != nullptr) entry = findOnDisk(key, now, true);
+    if (entry != nullptr && !varyMatches(*entry, request)) entry = nullptr;
+    return entry;
+}
+
+template <class Request>
+bool ResponseCache::store(HashedKey key, const Request& request, std::string response,
+                          CacheClock::time_point now) {
+    ResponsePolicy policy = parseResponsePolicy(response, now);
+    if (!policy.storable) return false;
+
+    auto entry = std::make_shared<CachedResponse>();
+    entry->key = std::move(key.text);
+    entry->response = std::move(response);
+    entry->expires = policy.expires;
+    for (std::string& name : policy.varyHeaders) {
+        std::string value(headerValue(request, name));
+        entry->vary.emplace_back(std::move(name), std::move(value));
+    }
+    setValidators(*entry);
+    return admit(std::move(entry), key.hash);
+}
@@ -0,0 +1,396 @@
+/*
+ * proxy_disk.cpp -- persistent on-disk tier of the response cache.
+ */
+
+#include "proxy_disk.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "proxy_trace.hpp"
+#include "proxy_uri.hpp"
+
+namespace {
+
+constexpr uint64_t kIndexMagic = 0x31584449444f5250ull;   // "PRODIDX1"
+constexpr uint64_t kSegmentMagic = 0x31474553444f5250ull; // "PRODSEG1"
+constexpr uint32_t kRecordMagic = 0x31434552;             // "REC1"
+
+// Slots a lookup probes before it gives up, and a store before it takes
+// the first one over whatever it holds.
+constexpr size_t kMaxProbes = 16;
+
+// Marks a slot whose record was erased; never a segment's generation.
+constexpr uint64_t kTombstone = UINT64_MAX;
+
+// Size of a typical record, to size the index for: it gets two slots per
+// record of that size the segments can hold.
+constexpr size_t kTypicalRecordBytes = 8 * 1024;
+constexpr size_t kMinSlots = 1024;
+
+// Bytes of records save() lets wait for the writer; more are dropped.
+constexpr size_t kMaxQueuedBytes = 64 << 20;
+
+constexpr size_t kMinSegmentBytes = 64 * 1024;
+constexpr size_t kMaxSegmentBytes = UINT32_MAX;
+
+size_t roundUp8(size_t n) {
+    return (n + 7) & ~size_t(7);
+}
+
+// Bytes the Vary values of `entry` take in its record.
+size_t varyBytes(const CachedResponse& entry) {
+    size_t total = 0;
+    for (const auto& [name, value] : entry.vary) total += 2 * sizeof(uint32_t) + name.size() + value.size();
+    return total;
+}
+
+size_t slotsFor(size_t capacity) {
+    size_t wanted = std::max(kMinSlots, capacity / kTypicalRecordBytes * 2);
+    size_t slots = kMinSlots;
+    while (slots < wanted) slots <<= 1;
+    return slots;
+}
+
+int64_t toNs(CacheClock::time_point when) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+}
+
+CacheClock::time_point fromNs(int64_t ns) {
+    return CacheClock::time_point(std::chrono::duration_cast<CacheClock::duration>(std::chrono::nanoseconds(ns)));
+}
+
+} // namespace
+
+// The file formats; native byte order, as the files never leave the host.
+struct DiskCache::IndexHeader {
+    uint64_t magic;
+    uint64_t slots;
+    uint64_t segments;
+    uint64_t segmentBytes;
+    uint64_t generation; // The highest generation any segment has had.
+    uint64_t reserved[3];
+};
+
+struct DiskCache::Slot {
+    uint64_t hash;
+    uint64_t generation; // 0 if the slot was never used.
+    uint32_t segment;
+    uint32_t offset;
+};
+
+struct DiskCache::SegmentHeader {
+    uint64_t magic;
+    uint64_t generation; // 0 if the segment was never used.
+    uint64_t used;       // Bytes of the segment taken, this header included.
+    uint64_t reserved[5];
+};
+
+// Followed by the key, the Vary values (each a name length, a value length
+// and their bytes) and the response, padded to a multiple of 8 bytes.
+struct DiskCache::RecordHeader {
+    uint64_t hash;
+    int64_t expires; // Nanoseconds since the epoch of CacheClock.
+    uint32_t magic;
+    uint32_t checksum; // Of everything after the header, within the lengths.
+    uint32_t keyLen;
+    uint32_t varyLen;
+    uint64_t responseLen;
+};
+
+DiskCache::DiskCache(std::string d, size_t capacity, size_t segment_bytes)
+    : dir(std::move(d)),
+      segmentBytes(roundUp8(std::clamp(segment_bytes, kMinSegmentBytes, kMaxSegmentBytes - 7))),
+      segmentCount(std::max<size_t>(2, capacity / segmentBytes)),
+      slotCount(slotsFor(segmentCount * segmentBytes)) {
+    static_assert(sizeof(IndexHeader) == 64 && sizeof(Slot) == 24 && sizeof(SegmentHeader) == 64 &&
+                      sizeof(RecordHeader) == 40,
+                  "the file formats have a fixed layout");
+}
+
+DiskCache::~DiskCache() {
+    if (writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        // What is queued is written first.
+        writer.join();
+    }
+    if (index != nullptr) munmap(index, sizeof(IndexHeader) + slotCount * sizeof(Slot));
+    if (segments) {
+        for (size_t i = 0; i < segmentCount; ++i) {
+            if (segments[i].header != nullptr) munmap(segments[i].base, segmentBytes);
+        }
+    }
+    if (dirFd >= 0) ::close(dirFd);
+}
+
+int DiskCache::open() {
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) return -1;
+    dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) return -1;
+
+    bool fresh;
+    void* mem = mapFile("index", sizeof(IndexHeader) + slotCount * sizeof(Slot), fresh);
+    if (mem == nullptr) return -1;
+    index = static_cast<IndexHeader*>(mem);
+    slots = reinterpret_cast<Slot*>(index + 1);
+    if (fresh || index->magic != kIndexMagic || index->slots != slotCount || index->segments != segmentCount ||
+        index->segmentBytes != segmentBytes) {
+        if (!fresh) {
+            TRACE("disk: %s is from another configuration, starting over", dir);
+            memset(static_cast<void*>(slots), 0, slotCount * sizeof(Slot));
+        }
+        *index = IndexHeader{kIndexMagic, slotCount, segmentCount, segmentBytes, 0, {}};
+    }
+
+    segments.reset(new Segment[segmentCount]);
+    for (size_t i = 0; i < segmentCount; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "segment.%zu", i);
+        mem = mapFile(name, segmentBytes, fresh);
+        if (mem == nullptr) return -1;
+        Segment& segment = segments[i];
+        segment.base = static_cast<char*>(mem);
+        segment.header = static_cast<SegmentHeader*>(mem);
+        SegmentHeader& header = *segment.header;
+        if (fresh || header.magic != kSegmentMagic || header.used < sizeof(SegmentHeader) ||
+            header.used > segmentBytes) {
+            header = SegmentHeader{kSegmentMagic, 0, sizeof(SegmentHeader), {}};
+        }
+        index->generation = std::max(index->generation, header.generation);
+        if (header.generation > segments[active].header->generation) active = i;
+    }
+    if (segments[active].header->generation == 0) recycle(segments[active]);
+    writer = std::thread(&DiskCache::run, this);
+    return 0;
+}
+
+void* DiskCache::mapFile(const char* name, size_t size, bool& fresh) {
+    int fd = openat(dirFd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    fresh = fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) != size;
+    if (fresh) {
+        // Allocated up front: a store into a hole of a full file system
+        // would be a SIGBUS rather than an error.
+        int error = ftruncate(fd, 0) < 0 ? errno : posix_fallocate(fd, 0, static_cast<off_t>(size));
+        if (error != 0) {
+            ::close(fd);
+            errno = error;
+            return nullptr;
+        }
+    }
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int saved = errno;
+    ::close(fd);
+    if (mem == MAP_FAILED) {
+        errno = saved;
+        return nullptr;
+    }
+    return mem;
+}
+
+bool DiskCache::live(const Slot& slot) const {
+    return slot.segment < segmentCount && slot.generation == segments[slot.segment].header->generation;
+}
+
+bool DiskCache::readRecord(const Slot& slot, std::string_view key, CachedResponse* out) const {
+    const Segment& segment = segments[slot.segment];
+    size_t used = segment.header->used;
+    if (slot.offset < sizeof(SegmentHeader) || slot.offset % 8 != 0 || slot.offset > used ||
+        used - slot.offset < sizeof(RecordHeader)) {
+        return false;
+    }
+    const char* at = segment.base + slot.offset;
+    RecordHeader record;
+    memcpy(&record, at, sizeof(record));
+    size_t room = used - slot.offset - sizeof(RecordHeader);
+    if (record.magic != kRecordMagic || record.hash != slot.hash || record.keyLen != key.size()) return false;
+    if (record.keyLen > room || record.varyLen > room - record.keyLen ||
+        record.responseLen > room - record.keyLen - record.varyLen) {
+        return false;
+    }
+    const char* payload = at + sizeof(RecordHeader);
+    if (std::string_view(payload, record.keyLen) != key) return false;
+    if (out == nullptr) return true;
+
+    size_t payload_len = record.keyLen + record.varyLen + record.responseLen;
+    if (static_cast<uint32_t>(hashKey(std::string_view(payload, payload_len))) != record.checksum) {
+        TRACE("disk: damaged record in segment %u at %u", slot.segment, slot.offset);
+        return false;
+    }
+
+    std::string_view vary(payload + record.keyLen, record.varyLen);
+    out->vary.clear();
+    while (!vary.empty()) {
+        uint32_t lengths[2];
+        if (vary.size() < sizeof(lengths)) return false;
+        memcpy(lengths, vary.data(), sizeof(lengths));
+        vary.remove_prefix(sizeof(lengths));
+        if (lengths[0] > vary.size() || lengths[1] > vary.size() - lengths[0]) return false;
+        out->vary.emplace_back(std::string(vary.substr(0, lengths[0])),
+                               std::string(vary.substr(lengths[0], lengths[1])));
+        vary.remove_prefix(lengths[0] + lengths[1]);
+    }
+    out->key.assign(key);
+    out->response.assign(payload + record.keyLen + record.varyLen, record.responseLen);
+    out->expires = fromNs(record.expires);
+    return true;
+}
+
+std::shared_ptr<CachedResponse> DiskCache::load(std::string_view key, uint64_t hash) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    for (size_t i = 0; i < kMaxProbes; ++i) {
+        const Slot& slot = slots[(hash + i) & (slotCount - 1)];
+        if (slot.generation == 0) break;
+        if (slot.hash != hash || !live(slot)) continue;
+        // Another key with the same hash is skipped before anything is
+        // allocated, and so is a damaged record.
+        if (!readRecord(slot, key, nullptr)) continue;
+        auto entry = std::make_shared<CachedResponse>();
+        if (readRecord(slot, key, entry.get())) return entry;
+    }
+    return nullptr;
+}
+
+bool DiskCache::save(std::shared_ptr<const CachedResponse> entry, uint64_t hash) {
+    size_t size = roundUp8(sizeof(RecordHeader) + entry->key.size() + varyBytes(*entry) + entry->response.size());
+    if (size > segmentBytes - sizeof(SegmentHeader)) return false;
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (queuedBytes + size > kMaxQueuedBytes) return false;
+        queuedBytes += size;
+        queued.push_back({std::move(entry), hash, size});
+    }
+    wakeup.notify_one();
+    return true;
+}
+
+void DiskCache::run() {
+    std::unique_lock<std::mutex> queue_lock(queueMutex);
+    for (;;) {
+        wakeup.wait(queue_lock, [this] { return stopping || !queued.empty(); });
+        if (queued.empty()) return; // Stopping, with everything written.
+
+        // Taken before the write leaves the queue, so that erase() finds it
+        // either still queued or written.
+        queue_lock.unlock();
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        queue_lock.lock();
+        if (queued.empty()) continue; // Dropped by erase() meanwhile.
+        Write write = std::move(queued.front());
+        queued.pop_front();
+        queuedBytes -= write.size;
+        queue_lock.unlock();
+
+        append(*write.entry, write.hash, write.size);
+        lock.unlock();
+        write.entry.reset();
+        queue_lock.lock();
+    }
+}
+
+void DiskCache::append(const CachedResponse& entry, uint64_t hash, size_t size) {
+    size_t vary_len = varyBytes(entry);
+    size_t payload_len = entry.key.size() + vary_len + entry.response.size();
+    if (segmentBytes - segments[active].header->used < size) {
+        active = (active + 1) % segmentCount;
+        recycle(segments[active]);
+    }
+    Segment& segment = segments[active];
+    uint64_t offset = segment.header->used;
+    char* at = segment.base + offset;
+
+    char* p = at + sizeof(RecordHeader);
+    memcpy(p, entry.key.data(), entry.key.size());
+    p += entry.key.size();
+    for (const auto& [name, value] : entry.vary) {
+        uint32_t lengths[2] = {static_cast<uint32_t>(name.size()), static_cast<uint32_t>(value.size())};
+        memcpy(p, lengths, sizeof(lengths));
+        p += sizeof(lengths);
+        memcpy(p, name.data(), name.size());
+        p += name.size();
+        memcpy(p, value.data(), value.size());
+        p += value.size();
+    }
+    memcpy(p, entry.response.data(), entry.response.size());
+
+    RecordHeader record{};
+    record.hash = hash;
+    record.expires = toNs(entry.expires);
+    record.magic = kRecordMagic;
+    record.checksum = static_cast<uint32_t>(hashKey(std::string_view(at + sizeof(RecordHeader), payload_len)));
+    record.keyLen = static_cast<uint32_t>(entry.key.size());
+    record.varyLen = static_cast<uint32_t>(vary_len);
+    record.responseLen = entry.response.size();
+    memcpy(at, &record, sizeof(record));
+    segment.header->used = offset + size;
+
+    // The slot of the key's previous record is reused, or else the first
+    // free one; a later duplicate of the key is dropped.
+    Slot* target = nullptr;
+    for (size_t i = 0; i < kMaxProbes; ++i) {
+        Slot& slot = slots[(hash + i) & (slotCount - 1)];
+        if (slot.generation == 0) {
+            if (target == nullptr) target = &slot;
+            break;
+        }
+        if (!live(slot)) {
+            if (target == nullptr) target = &slot;
+            continue;
+        }
+        if (slot.hash == hash && readRecord(slot, entry.key, nullptr)) {
+            if (target == nullptr) {
+                target = &slot;
+            } else {
+                slot.generation = kTombstone;
+            }
+            break;
+        }
+    }
+    // Every slot probed holds a live record: the first one loses it.
+    if (target == nullptr) target = &slots[hash & (slotCount - 1)];
+    *target = Slot{hash, segment.header->generation, static_cast<uint32_t>(active), static_cast<uint32_t>(offset)};
+}
+
+void DiskCache::erase(std::string_view key, uint64_t hash) {
+    std::vector<Write> dropped; // Released once the locks are.
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    {
+        // A save still queued would bring the record back.
+        std::lock_guard<std::mutex> queue_lock(queueMutex);
+        for (auto it = queued.begin(); it != queued.end();) {
+            if (it->hash != hash || it->entry->key != key) {
+                ++it;
+                continue;
+            }
+            queuedBytes -= it->size;
+            dropped.push_back(std::move(*it));
+            it = queued.erase(it);
+        }
+    }
+    for (size_t i = 0; i < kMaxProbes; ++i) {
+        Slot& slot = slots[(hash + i) & (slotCount - 1)];
+        if (slot.generation == 0) break;
+        if (slot.hash == hash && live(slot) && readRecord(slot, key, nullptr)) slot.generation = kTombstone;
+    }
+}
+
+void DiskCache::recycle(Segment& segment) {
+    // Slots pointing into the old contents no longer match the generation.
+    segment.header->generation = ++index->generation;
+    segment.header->used = sizeof(SegmentHeader);
+}
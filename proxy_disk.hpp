@@ -0,0 +1,171 @@
+/*
+ * proxy_disk.hpp -- persistent on-disk tier of the response cache.
+ *
+ * The ResponseCache lives in memory, so a restarted proxy would send every
+ * request to the origins again. With a cache directory configured, every
+ * response the ResponseCache stores is also written to a DiskCache, which
+ * the ResponseCache falls back to when it misses and which outlives the
+ * process:
+ *
+ *   - Responses are appended to segments: a fixed number of files of a
+ *     fixed size, written one after the other. A record is never changed
+ *     once written; a newer response for the same key is appended anew.
+ *   - The index is a file mapped into memory, an open-addressed table from
+ *     the hashKey() of the resource key to the segment and offset of the
+ *     latest record under it. A lookup probes a few slots and copies the
+ *     record out of the segment's mapping: no read() and no scan.
+ *   - When the segment being written is full, the oldest one is recycled as
+ *     a whole. Its generation number is bumped, and since every index slot
+ *     carries the generation of the segment it points into, slots into the
+ *     old contents are from then on seen as free; nothing is rewritten or
+ *     compacted, so each byte stored is written once. Replacement is FIFO by
+ *     segment, which a tier behind an LRU cache can afford.
+ *   - Writes are queued to a thread of the DiskCache's own, so the worker
+ *     that stores a response neither copies it into a segment nor waits for
+ *     the lookups of the other workers to let go of the index. A response
+ *     still queued is not found on disk yet, which only matters once memory
+ *     has evicted it too; when more is queued than the thread keeps up
+ *     with, further responses are not written at all.
+ *   - Opening maps the files and reads the segment headers, and nothing
+ *     else: the pages of the index and of the segments are faulted in by the
+ *     lookups that need them, so the proxy answers hits from its previous
+ *     run as soon as it listens.
+ *   - The mappings are shared, so what was written survives the process (the
+ *     kernel writes it back) but not necessarily a crash of the machine. A
+ *     record is complete before a slot points to it and is checked against
+ *     its checksum when read, so one that was torn is a miss rather than a
+ *     corrupt response.
+ *
+ * The directory holds "index" and "segment.0" up to "segment.<N-1>"; files
+ * left by a run with a different size or segment count are started afresh.
+ * Space for all of them is allocated when they are created.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "proxy_cache.hpp"
+
+/*
+ * DiskCache class
+ *
+ * The files of the disk tier, mapped. Thread-safe: lookups share a lock,
+ * which the writer thread takes exclusively.
+ */
+class DiskCache {
+public:
+    /*
+     * Constructor: Keeps `capacity` bytes of responses under `dir`, in
+     * segments of `segment_bytes` (at most 4 GiB, and at least two of them).
+     */
+    DiskCache(std::string dir, size_t capacity, size_t segment_bytes);
+
+    // Writes what is still queued before it returns.
+    ~DiskCache();
+
+    DiskCache(const DiskCache&) = delete;
+    DiskCache& operator=(const DiskCache&) = delete;
+
+    /*
+     * open() method: Creates the directory and the files if need be, maps
+     * them and starts the writer thread.
+     * Returns 0 on success, -1 on failure (with errno set).
+     */
+    int open();
+
+    /*
+     * load() method: An entry with the key, response, expiry and Vary values
+     * of the latest record stored under `key`, which hashes to `hash`. May
+     * block on page faults; allocates nothing unless the index has a record
+     * under `key`.
+     * Returns null if there is none, or if it is damaged.
+     */
+    std::shared_ptr<CachedResponse> load(std::string_view key, uint64_t hash) const;
+
+    /*
+     * save() method: Queues `entry`, whose key hashes to `hash`, for the
+     * writer thread, which appends it and points the index at it, recycling
+     * the oldest segment if the current one is full.
+     * Returns false if the entry does not fit in a segment, or if the queue
+     * is full.
+     */
+    bool save(std::shared_ptr<const CachedResponse> entry, uint64_t hash);
+
+    /*
+     * erase() method: Drops the record stored under `key`, which hashes to
+     * `hash`, if any, and any save of it still queued.
+     */
+    void erase(std::string_view key, uint64_t hash);
+
+private:
+    struct IndexHeader;
+    struct Slot;
+    struct SegmentHeader;
+    struct RecordHeader;
+
+    // One segment file, mapped.
+    struct Segment {
+        SegmentHeader* header = nullptr; // At the start of the mapping.
+        char* base = nullptr;
+    };
+
+    // A save() waiting for the writer thread.
+    struct Write {
+        std::shared_ptr<const CachedResponse> entry;
+        uint64_t hash;
+        size_t size; // Of its record.
+    };
+
+    // Body of the writer thread.
+    void run();
+
+    // Appends the record of `size` bytes for `entry` and points the index at
+    // it; the lock must be held exclusively.
+    void append(const CachedResponse& entry, uint64_t hash, size_t size);
+
+    // True if `slot` points into the current contents of its segment.
+    bool live(const Slot& slot) const;
+
+    // The record `slot` points to, parsed into `out` if it is intact and
+    // stored under `key`; compares the key only if `out` is null.
+    bool readRecord(const Slot& slot, std::string_view key, CachedResponse* out) const;
+
+    // Starts `segment` over under a new generation; the lock must be held
+    // exclusively.
+    void recycle(Segment& segment);
+
+    // Creates or maps the file `name` of `size` bytes; `fresh` is set if it
+    // did not have that size and was started over.
+    void* mapFile(const char* name, size_t size, bool& fresh);
+
+    const std::string dir;
+    const size_t segmentBytes;
+    const size_t segmentCount;
+    const size_t slotCount; // A power of two.
+
+    int dirFd = -1;
+    IndexHeader* index = nullptr; // The index mapping, followed by its slots.
+    Slot* slots = nullptr;
+    std::unique_ptr<Segment[]> segments;
+    size_t active = 0; // The segment being appended to.
+
+    mutable std::shared_mutex mutex;
+
+    // Taken after `mutex` when both are.
+    std::mutex queueMutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    std::deque<Write> queued; // Oldest first.
+    size_t queuedBytes = 0;
+    std::thread writer; // Running once open() succeeds.
+};
@@ -0,0 +1,161 @@
+/*
+ * proxy_dispatch.cpp -- work stealing between worker threads.
+ */
+
+#include "proxy_dispatch.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "proxy_trace.hpp"
+
+namespace {
+
+// Tasks waiting in a deque before its owner wakes an idle worker to help.
+constexpr size_t kWakeBacklog = 2;
+
+void signal(int fd) {
+    uint64_t one = 1;
+    if (fd >= 0 && write(fd, &one, sizeof(one)) < 0) TRACE("dispatcher: failed to signal: %s", strerror(errno));
+}
+
+} // namespace
+
+/*
+ * StealDeque
+ */
+
+bool StealDeque::push(Task* task) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    if (b - t >= static_cast<int64_t>(kCapacity)) return false;
+    slots[static_cast<size_t>(b) & kMask].store(task, std::memory_order_relaxed);
+    // Publishes the task, and everything written to it, to thieves.
+    bottom.store(b + 1, std::memory_order_release);
+    return true;
+}
+
+Task* StealDeque::pop() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    Task* task = slots[static_cast<size_t>(b) & kMask].load(std::memory_order_relaxed);
+    if (t == b) {
+        // The last task: thieves may be after it too.
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            task = nullptr;
+        }
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+}
+
+Task* StealDeque::steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) return nullptr;
+    Task* task = slots[static_cast<size_t>(t) & kMask].load(std::memory_order_relaxed);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    return task;
+}
+
+size_t StealDeque::size() const {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_relaxed);
+    return b > t ? static_cast<size_t>(b - t) : 0;
+}
+
+/*
+ * Dispatcher
+ */
+
+Dispatcher::Dispatcher(size_t workers) : count(workers), slots(new Slot[workers > 0 ? workers : 1]) {
+    for (size_t i = 0; i < count; ++i) {
+        slots[i].stealFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        slots[i].doneFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+}
+
+Dispatcher::~Dispatcher() {
+    for (size_t i = 0; i < count; ++i) {
+        if (slots[i].stealFd >= 0) ::close(slots[i].stealFd);
+        if (slots[i].doneFd >= 0) ::close(slots[i].doneFd);
+    }
+}
+
+bool Dispatcher::valid() const {
+    for (size_t i = 0; i < count; ++i) {
+        if (slots[i].stealFd < 0 || slots[i].doneFd < 0) return false;
+    }
+    return true;
+}
+
+bool Dispatcher::push(size_t index, Task* task) {
+    task->owner = index;
+    StealDeque& deque = slots[index].deque;
+    if (!deque.push(task)) return false;
+    if (deque.size() >= kWakeBacklog) wakeIdle(index);
+    return true;
+}
+
+Task* Dispatcher::pop(size_t index) {
+    return slots[index].deque.pop();
+}
+
+Task* Dispatcher::steal(size_t index) {
+    // Start after `index` so that thieves spread over their victims.
+    for (size_t i = 1; i < count; ++i) {
+        if (Task* task = slots[(index + i) % count].deque.steal()) return task;
+    }
+    return nullptr;
+}
+
+void Dispatcher::complete(Task* task) {
+    Slot& slot = slots[task->owner];
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lock(slot.mutex);
+        was_empty = slot.done.empty();
+        slot.done.push_back(task);
+    }
+    // The owner takes everything at once; one signal per batch is enough.
+    if (was_empty) signal(slot.doneFd);
+}
+
+std::vector<Task*> Dispatcher::finished(size_t index) {
+    std::vector<Task*> done;
+    std::lock_guard<std::mutex> lock(slots[index].mutex);
+    done.swap(slots[index].done);
+    return done;
+}
+
+void Dispatcher::setIdle(size_t index, bool idle) {
+    // Only written when it changes: the flag is read by every busy worker.
+    if (slots[index].idle.load(std::memory_order_relaxed) != idle) {
+        slots[index].idle.store(idle, std::memory_order_relaxed);
+    }
+}
+
+void Dispatcher::wakeIdle(size_t index) {
+    for (size_t i = 1; i < count; ++i) {
+        Slot& slot = slots[(index + i) % count];
+        bool idle = true;
+        // Whoever clears the flag sends the one wakeup.
+        if (slot.idle.load(std::memory_order_relaxed) &&
+            slot.idle.compare_exchange_strong(idle, false, std::memory_order_acq_rel)) {
+            signal(slot.stealFd);
+            return;
+        }
+    }
+}
@@ -0,0 +1,177 @@
+/*
+ * proxy_dispatch.hpp -- work stealing between worker threads.
+ *
+ * Every connection belongs to one worker, and so does the work its requests
+ * cause. Connections are spread over the workers by the kernel, one at a
+ * time, with no idea of what their requests will cost; a burst of expensive
+ * requests on one worker keeps its other connections waiting while the
+ * rest of the machine idles.
+ *
+ * Socket I/O has to stay on the owning event loop, but what a worker does
+ * with a request between parsing it and touching a socket again (rewriting
+ * it for the origin, looking it up in the cache) does not. Workers queue
+ * that work as Tasks, and a worker with nothing to do takes them over:
+ *
+ *   - Each worker has a StealDeque. The owner pushes and pops at the bottom
+ *     without contention; other workers steal from the top.
+ *   - A worker about to block in its event loop marks itself idle. A worker
+ *     whose deque backs up wakes one idle worker through its eventfd.
+ *   - A Task run by a thief is handed back to its owner through the owner's
+ *     completion queue, whose eventfd wakes the owner's event loop. The
+ *     owner finishes it there, with its sockets.
+ *
+ * A worker runs the tasks left in its own deque once it has handled a batch
+ * of events, so when no one steals, a task costs two atomic operations and
+ * a short detour.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Task class
+ *
+ * A piece of work that may run on any worker thread. It must not touch the
+ * sockets or other per-worker state of its owner; the owner does not touch
+ * what the task works on until it is handed back.
+ */
+class Task {
+public:
+    size_t owner = 0; // Index of the worker that queued it.
+
+    virtual void run() = 0;
+
+protected:
+    ~Task() = default;
+};
+
+/*
+ * StealDeque class
+ *
+ * Fixed-capacity Chase-Lev work-stealing deque (in the formulation of Lê et
+ * al., "Correct and Efficient Work-Stealing for Weak Memory Models", 2013).
+ * push() and pop() are for the owning thread only; steal() may be called by
+ * any thread. Neither side takes a lock.
+ */
+class StealDeque {
+public:
+    static constexpr size_t kCapacity = 1024;
+
+    /*
+     * push() method: Adds `task` at the bottom. Returns false if the deque
+     * is full, in which case the owner runs the task itself.
+     */
+    bool push(Task* task);
+
+    /*
+     * pop() method: Removes the task at the bottom, the newest one.
+     * Returns nullptr if the deque is empty or a thief took the last task.
+     */
+    Task* pop();
+
+    /*
+     * steal() method: Removes the task at the top, the oldest one.
+     * Returns nullptr if the deque is empty or another thread got there
+     * first.
+     */
+    Task* steal();
+
+    // Tasks in the deque; only a hint while other threads use it.
+    size_t size() const;
+
+private:
+    static constexpr size_t kMask = kCapacity - 1;
+    static_assert((kCapacity & kMask) == 0, "kCapacity must be a power of two");
+
+    alignas(64) std::atomic<int64_t> top{0}; // Next task to steal.
+    alignas(64) std::atomic<int64_t> bottom{0}; // Next free slot.
+    std::array<std::atomic<Task*>, kCapacity> slots{};
+};
+
+/*
+ * Dispatcher class
+ *
+ * The deques, completion queues and wakeup eventfds of all workers. Shared
+ * by the workers; thread-safe, with the exceptions noted.
+ */
+class Dispatcher {
+public:
+    /*
+     * Constructor: Sets up `workers` workers. Returns with some eventfds
+     * missing if they could not be created; such a worker is never woken,
+     * and valid() is false.
+     */
+    explicit Dispatcher(size_t workers);
+    ~Dispatcher();
+
+    Dispatcher(const Dispatcher&) = delete;
+    Dispatcher& operator=(const Dispatcher&) = delete;
+
+    bool valid() const;
+
+    /*
+     * push() method: Queues `task` on worker `index`, which must be the
+     * calling thread, and wakes an idle worker if the queue is backing up.
+     * Returns false if the deque is full.
+     */
+    bool push(size_t index, Task* task);
+
+    /*
+     * pop() method: Takes the newest task queued by worker `index`, which
+     * must be the calling thread. Returns nullptr if there is none.
+     */
+    Task* pop(size_t index);
+
+    /*
+     * steal() method: Takes the oldest task of some other worker than
+     * `index`. Returns nullptr if none was found.
+     */
+    Task* steal(size_t index);
+
+    /*
+     * complete() method: Hands a stolen task, run to completion, back to its
+     * owner.
+     */
+    void complete(Task* task);
+
+    /*
+     * finished() method: Removes and returns the tasks of worker `index`
+     * that others completed.
+     */
+    std::vector<Task*> finished(size_t index);
+
+    /*
+     * setIdle() method: Whether worker `index` is about to wait for events
+     * with nothing to do, and may be woken to steal.
+     */
+    void setIdle(size_t index, bool idle);
+
+    // Readable once worker `index` has been asked to steal.
+    int stealFd(size_t index) const { return slots[index].stealFd; }
+
+    // Readable once tasks of worker `index` have been completed by others.
+    int doneFd(size_t index) const { return slots[index].doneFd; }
+
+private:
+    struct alignas(64) Slot {
+        StealDeque deque;
+        std::atomic<bool> idle{false};
+        int stealFd = -1;
+        int doneFd = -1;
+        std::mutex mutex; // Guards `done`.
+        std::vector<Task*> done;
+    };
+
+    // Asks one idle worker other than `index` to steal.
+    void wakeIdle(size_t index);
+
+    size_t count;
+    std::unique_ptr<Slot[]> slots;
+};
@@ -0,0 +1,174 @@
+/*
+ * proxy_epoch.cpp -- epoch-based reclamation for lock-free readers.
+ */
+
+#include "proxy_epoch.hpp"
+
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// Objects a thread retires between two collections. Collecting advances the
+// global epoch, which every entering reader loads, and reads the records of
+// all threads, so it is done this rarely rather than on every retire().
+constexpr size_t kCollectInterval = 64;
+
+// The read-side state of one thread. Records are never freed; a thread that
+// exits gives its record back for the next thread to reuse.
+struct alignas(64) Record {
+    std::atomic<uint64_t> epoch{0}; // Epoch recorded on entry; 0 outside guards.
+    std::atomic<bool> inUse{false};
+    std::atomic<size_t> retired{0}; // Objects its thread retired, not yet destroyed.
+    Record* next = nullptr;
+};
+
+struct Retired {
+    uint64_t epoch;
+    void* object;
+    void (*deleter)(void*);
+};
+
+// Namespace-scope atomics and mutexes are constant-initialized, so guards
+// work from any static initializer.
+std::atomic<uint64_t> globalEpoch{1};
+std::atomic<Record*> records{nullptr};
+std::mutex orphansMutex;
+
+// Objects left behind by threads that exited; guarded by orphansMutex.
+std::vector<Retired>& orphans() {
+    static std::vector<Retired> list;
+    return list;
+}
+
+Record* acquireRecord() {
+    for (Record* r = records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        bool expected = false;
+        if (!r->inUse.load(std::memory_order_relaxed) &&
+            r->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return r;
+        }
+    }
+    Record* r = new Record;
+    r->inUse.store(true, std::memory_order_relaxed);
+    r->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    return r;
+}
+
+// Moves the objects of `list` that no reader can hold any more to `done`.
+void takeReclaimable(std::vector<Retired>& list, std::vector<Retired>& done) {
+    if (list.empty()) return;
+
+    // Readers entering from here on record a later epoch than any object
+    // retired so far. The fence pairs with the one in Guard(): either a
+    // reader's record is seen below, or the reader sees the structure
+    // without the retired objects.
+    globalEpoch.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t oldest = UINT64_MAX;
+    for (Record* r = records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        uint64_t e = r->epoch.load(std::memory_order_acquire);
+        if (e != 0 && e < oldest) oldest = e;
+    }
+
+    size_t kept = 0;
+    for (Retired& item : list) {
+        if (item.epoch < oldest) {
+            done.push_back(item);
+        } else {
+            list[kept++] = item;
+        }
+    }
+    list.resize(kept);
+}
+
+void destroy(const std::vector<Retired>& done) {
+    for (const Retired& item : done) item.deleter(item.object);
+}
+
+struct ThreadState {
+    Record* record = nullptr;
+    unsigned depth = 0;
+    std::vector<Retired> retired; // Not destroyed yet, oldest first.
+    size_t sinceCollect = 0;      // Retired since the last collection.
+
+    Record& ownRecord() {
+        if (record == nullptr) record = acquireRecord();
+        return *record;
+    }
+
+    // Destroys what the thread retired that no reader can hold.
+    void collect() {
+        sinceCollect = 0;
+        std::vector<Retired> done;
+        takeReclaimable(retired, done);
+        if (done.empty()) return;
+        record->retired.fetch_sub(done.size(), std::memory_order_relaxed);
+        // Deleters may retire in turn, which only appends to `retired`.
+        destroy(done);
+    }
+
+    ~ThreadState() {
+        if (!retired.empty()) {
+            collect();
+            if (!retired.empty()) {
+                std::lock_guard<std::mutex> lock(orphansMutex);
+                orphans().insert(orphans().end(), retired.begin(), retired.end());
+            }
+            record->retired.store(0, std::memory_order_relaxed);
+        }
+        if (record != nullptr) record->inUse.store(false, std::memory_order_release);
+    }
+};
+
+thread_local ThreadState threadState;
+
+} // namespace
+
+Epoch::Guard::Guard() {
+    ThreadState& t = threadState;
+    if (t.depth++ > 0) return;
+    t.ownRecord().epoch.store(globalEpoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+Epoch::Guard::~Guard() {
+    ThreadState& t = threadState;
+    if (--t.depth > 0) return;
+    t.record->epoch.store(0, std::memory_order_release);
+}
+
+void Epoch::retire(void* object, void (*deleter)(void*)) {
+    // Readers that entered before this point may hold `object` and recorded
+    // at most the epoch read here; the epoch only advances when collecting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t epoch = globalEpoch.load(std::memory_order_seq_cst);
+
+    ThreadState& t = threadState;
+    t.retired.push_back({epoch, object, deleter});
+    t.ownRecord().retired.fetch_add(1, std::memory_order_relaxed);
+    if (++t.sinceCollect >= kCollectInterval) t.collect();
+}
+
+void Epoch::collect() {
+    threadState.collect();
+
+    std::vector<Retired> done;
+    {
+        std::unique_lock<std::mutex> lock(orphansMutex, std::try_to_lock);
+        if (!lock.owns_lock()) return;
+        takeReclaimable(orphans(), done);
+    }
+    destroy(done);
+}
+
+size_t Epoch::pending() {
+    size_t total = 0;
+    for (Record* r = records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        total += r->retired.load(std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> lock(orphansMutex);
+    return total + orphans().size();
+}
@@ -0,0 +1,76 @@
+/*
+ * proxy_epoch.hpp -- epoch-based reclamation for lock-free readers.
+ *
+ * Shared structures whose readers take no lock (see ResponseCache) still
+ * have writers that unlink objects from them. An unlinked object may be in
+ * use by a reader that found it just before, so it cannot be freed right
+ * away. Instead the writer retires it, and it is freed once every reader
+ * that might have seen it has left its read-side section.
+ *
+ *   - A reader brackets its accesses with an Epoch::Guard. Entering records
+ *     the current global epoch in the thread's record; leaving clears it.
+ *     Neither takes a lock or touches memory shared with other readers.
+ *   - retire() stamps the object with the current epoch and appends it to
+ *     a list of the calling thread. It takes no lock and writes nothing
+ *     another thread reads on its hot path, so writers may call it while
+ *     holding their own locks and still do not serialize on it.
+ *   - Every so many retires, and on collect(), a thread advances the epoch,
+ *     so that readers entering afterwards cannot reach what it retired, and
+ *     frees the objects whose stamp is older than the epoch of every thread
+ *     still inside a guard.
+ *
+ * Retired objects are freed by the thread that retired them, i.e. on the
+ * writers' side; readers never free anything. What a thread leaves behind
+ * when it exits is freed by later calls to collect() on other threads.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Epoch class
+ *
+ * The process-wide reclamation domain.
+ */
+class Epoch {
+public:
+    /*
+     * Guard class: Read-side section of the calling thread. Pointers loaded
+     * from a lock-free structure stay valid until the guard is destroyed.
+     * Guards nest; only the outermost one has an effect.
+     */
+    class Guard {
+    public:
+        Guard();
+        ~Guard();
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    /*
+     * retire() method: Hands over `object`, already unlinked from every
+     * shared structure, to be destroyed with `deleter` once no reader can
+     * hold it. May call deleters of objects the thread retired earlier.
+     */
+    static void retire(void* object, void (*deleter)(void*));
+
+    template <class T>
+    static void retire(T* object) {
+        retire(object, [](void* p) { delete static_cast<T*>(p); });
+    }
+
+    /*
+     * collect() method: Destroys the objects retired by the calling thread,
+     * and by threads that exited, that no reader can hold. Called
+     * periodically by threads that retire, so that what they retired last
+     * is not kept until they retire more.
+     */
+    static void collect();
+
+    // Retired objects not yet destroyed.
+    static size_t pending();
+};
@@ -0,0 +1,104 @@
+/*
+ * proxy_flight.cpp -- one origin fetch for concurrent misses on a resource.
+ */
+
+#include "proxy_flight.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "proxy_trace.hpp"
+
+/*
+ * FlightQueue
+ */
+
+FlightQueue::FlightQueue() : eventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+FlightQueue::~FlightQueue() {
+    if (eventFd >= 0) ::close(eventFd);
+}
+
+void FlightQueue::push(uint64_t token) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tokens.push_back(token);
+    }
+    uint64_t one = 1;
+    if (write(eventFd, &one, sizeof(one)) < 0) TRACE("flight: failed to signal: %s", strerror(errno));
+}
+
+std::vector<uint64_t> FlightQueue::take() {
+    std::vector<uint64_t> taken;
+    std::lock_guard<std::mutex> lock(mutex);
+    taken.swap(tokens);
+    return taken;
+}
+
+/*
+ * Flight
+ */
+
+Flight::Read Flight::read(size_t offset, std::string& out, const std::shared_ptr<FlightQueue>& queue,
+                          uint64_t token) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (abandoned) return Read::Abandoned;
+    if (offset < data.size()) {
+        out.append(data, offset, std::string::npos);
+        return Read::Data;
+    }
+    if (done) return Read::Done;
+    waiters.push_back({queue, token});
+    return Read::Wait;
+}
+
+template <class F>
+void Flight::update(F&& f) {
+    std::vector<Waiter> woken;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        f();
+        woken.swap(waiters);
+    }
+    // Each follower is told once per wait; one that is still sending what it
+    // read last time registers again when it asks for more.
+    for (const Waiter& waiter : woken) waiter.queue->push(waiter.token);
+}
+
+/*
+ * FlightTable
+ */
+
+std::shared_ptr<Flight> FlightTable::join(const HashedKey& key, bool& leader) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto [it, inserted] = flights.try_emplace(key);
+    if (inserted) it->second = std::make_shared<Flight>(key);
+    leader = inserted;
+    return it->second;
+}
+
+void FlightTable::append(Flight& flight, const char* data, size_t len) {
+    flight.update([&] { flight.data.append(data, len); });
+}
+
+void FlightTable::finish(Flight& flight) {
+    remove(flight);
+    flight.update([&] { flight.done = true; });
+}
+
+void FlightTable::abandon(Flight& flight) {
+    remove(flight);
+    flight.update([&] {
+        flight.abandoned = true;
+        flight.data = std::string();
+    });
+}
+
+void FlightTable::remove(Flight& flight) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = flights.find(flight.key);
+    if (it != flights.end() && it->second.get() == &flight) flights.erase(it);
+}
@@ -0,0 +1,183 @@
+/*
+ * proxy_flight.hpp -- one origin fetch for concurrent misses on a resource.
+ *
+ * When a popular cache entry expires, every request for it misses at once,
+ * and each would go to the origin for the same response. Misses are
+ * collapsed instead:
+ *
+ *   - The first request to miss on a resource becomes the leader of a
+ *     Flight, registered in the FlightTable under the resource key, and
+ *     fetches the response as before. Requests that miss on the same key
+ *     while it is in flight become followers and send nothing upstream.
+ *   - The leader copies what it receives into the Flight, and each follower
+ *     streams it to its client from there, at its own pace, from its own
+ *     worker. Followers that have read all there is leave a token on their
+ *     worker's FlightQueue, whose eventfd wakes the worker when the leader
+ *     has added more.
+ *   - The response is shared only once its head shows that it may be handed
+ *     to other clients (see responseSharable()). Until then followers have
+ *     sent nothing, so when the leader gives up, on such a response or any
+ *     failure, they fetch the response themselves as if they had never
+ *     waited. Should the leader fail later, followers close their clients
+ *     as the leader does.
+ *   - The flight ends when the leader has the whole response, after storing
+ *     it in the cache, so requests from then on are hits.
+ *
+ * Only requests that every client could have sent alike take part: GETs the
+ * cache may answer, without ranges or conditions. A response that exceeds
+ * the cache's object size ends the flight like a failure.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "proxy_cache.hpp"
+#include "proxy_uri.hpp"
+
+/*
+ * FlightQueue class
+ *
+ * Followers of one worker that flights have more for. Leaders of any
+ * worker push; the worker takes once fd() has become readable and it has
+ * read the eventfd counter.
+ */
+class FlightQueue {
+public:
+    FlightQueue();
+    ~FlightQueue();
+
+    FlightQueue(const FlightQueue&) = delete;
+    FlightQueue& operator=(const FlightQueue&) = delete;
+
+    // Non-blocking eventfd signalled by push(); -1 if it could not be created.
+    int fd() const { return eventFd; }
+
+    /*
+     * push() method: Adds the token of a follower and signals fd(). Any
+     * thread.
+     */
+    void push(uint64_t token);
+
+    /*
+     * take() method: Removes and returns the tokens pushed so far.
+     */
+    std::vector<uint64_t> take();
+
+private:
+    int eventFd;
+    std::mutex mutex;
+    std::vector<uint64_t> tokens;
+};
+
+/*
+ * Flight class
+ *
+ * The response to one fetch in progress and its followers. The leader
+ * writes through its FlightTable; followers read. Thread-safe.
+ */
+class Flight {
+public:
+    enum class Read {
+        Data,      // Bytes were appended to `out`.
+        Wait,      // Nothing new yet; the follower's queue will be told.
+        Done,      // The response is complete and all of it was read.
+        Abandoned, // The leader gave up; read no further.
+    };
+
+    explicit Flight(HashedKey key) : key(std::move(key)) {}
+
+    const HashedKey key;
+
+    /*
+     * mayShare() method: True if `request` may lead or follow a flight: a
+     * GET the cache may answer, without Range or any conditional header,
+     * so that a response to it would be a response to any such request.
+     */
+    template <class Request>
+    static bool mayShare(const Request& request);
+
+    /*
+     * read() method: Appends the bytes of the response from `offset` on to
+     * `out`. If there are none yet, registers `token` with `queue` to be
+     * pushed when there are.
+     */
+    Read read(size_t offset, std::string& out, const std::shared_ptr<FlightQueue>& queue, uint64_t token);
+
+private:
+    friend class FlightTable;
+
+    struct Waiter {
+        std::shared_ptr<FlightQueue> queue;
+        uint64_t token;
+    };
+
+    // Updates the state under the mutex, then tells the waiters.
+    template <class F>
+    void update(F&& f);
+
+    std::mutex mutex;
+    std::string data;
+    bool done = false;
+    bool abandoned = false;
+    std::vector<Waiter> waiters;
+};
+
+/*
+ * FlightTable class
+ *
+ * The flights in progress, by resource key. Shared by all workers;
+ * thread-safe. A miss takes its mutex once, to join or start a flight.
+ */
+class FlightTable {
+public:
+    /*
+     * join() method: The flight in progress under `key`, with `leader`
+     * false, or a new one for the caller to lead, with `leader` true.
+     */
+    std::shared_ptr<Flight> join(const HashedKey& key, bool& leader);
+
+    /*
+     * append() method: Adds response bytes received by the leader of
+     * `flight`.
+     */
+    void append(Flight& flight, const char* data, size_t len);
+
+    /*
+     * finish() method: Ends `flight`, whose response is complete.
+     */
+    void finish(Flight& flight);
+
+    /*
+     * abandon() method: Ends `flight`, whose leader gave up.
+     */
+    void abandon(Flight& flight);
+
+private:
+    // Removes `flight` from the table, unless a newer one replaced it.
+    void remove(Flight& flight);
+
+    std::mutex mutex;
+    std::unordered_map<HashedKey, std::shared_ptr<Flight>, HashedKeyHash> flights;
+};
+
+/*
+ * Flight templates
+ */
+
+template <class Request>
+bool Flight::mayShare(const Request& request) {
+    if (!ResponseCache::mayServe(request)) return false;
+    for (HeaderId id : {HeaderId::Range, HeaderId::IfMatch, HeaderId::IfNoneMatch, HeaderId::IfModifiedSince,
+                        HeaderId::IfUnmodifiedSince, HeaderId::IfRange}) {
+        if (request.getHeader(id) != nullptr) return false;
+    }
+    return true;
+}
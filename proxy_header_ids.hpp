@@ -0,0 +1,177 @@
+/*
+ * proxy_header_ids.hpp -- compile-time table of well-known HTTP headers.
+ *
+ * Every header is classified once, when it is parsed or added, into a
+ * HeaderId. Code on the request path then asks for `HeaderId::Host` instead
+ * of building a std::string from "Host" and comparing it against every
+ * header name.
+ *
+ * Classification hashes the length and three characters of the lowercased
+ * name into a 256-entry table. The hash has been chosen to be perfect for
+ * the names below, which is checked by a static_assert, so classifying a
+ * name costs one table lookup plus a single confirming comparison.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "proxy_headers.hpp"
+
+/*
+ * HeaderId enum
+ *
+ * The hot headers the proxy consults on every request come first so that
+ * ParsedRequest can cache their positions in a small array indexed by id.
+ */
+enum class HeaderId : uint8_t {
+    Unknown = 0,
+
+    // Hot headers (see kHotHeaderCount).
+    Host,
+    Connection,
+    ProxyConnection,
+    ContentLength,
+    TransferEncoding,
+
+    Accept,
+    AcceptCharset,
+    AcceptEncoding,
+    AcceptLanguage,
+    AcceptRanges,
+    Age,
+    Allow,
+    Authorization,
+    CacheControl,
+    ContentEncoding,
+    ContentLanguage,
+    ContentLocation,
+    ContentRange,
+    ContentType,
+    Cookie,
+    Date,
+    ETag,
+    Expect,
+    Expires,
+    Forwarded,
+    From,
+    IfMatch,
+    IfModifiedSince,
+    IfNoneMatch,
+    IfRange,
+    IfUnmodifiedSince,
+    KeepAlive,
+    LastModified,
+    Location,
+    MaxForwards,
+    Origin,
+    Pragma,
+    ProxyAuthenticate,
+    ProxyAuthorization,
+    Range,
+    Referer,
+    RetryAfter,
+    Server,
+    SetCookie,
+    TE,
+    Trailer,
+    Upgrade,
+    UserAgent,
+    Vary,
+    Via,
+    Warning,
+    WWWAuthenticate,
+    XForwardedFor,
+    XForwardedProto,
+    XRealIP,
+
+    Count
+};
+
+// Number of hot headers, i.e. ids Host .. TransferEncoding.
+constexpr size_t kHotHeaderCount = 5;
+
+// Canonical spelling of every header, indexed by HeaderId.
+constexpr std::array<std::string_view, static_cast<size_t>(HeaderId::Count)> kHeaderNames = {
+    "",
+    "Host", "Connection", "Proxy-Connection", "Content-Length", "Transfer-Encoding",
+    "Accept", "Accept-Charset", "Accept-Encoding", "Accept-Language", "Accept-Ranges",
+    "Age", "Allow", "Authorization", "Cache-Control", "Content-Encoding",
+    "Content-Language", "Content-Location", "Content-Range", "Content-Type", "Cookie",
+    "Date", "ETag", "Expect", "Expires", "Forwarded",
+    "From", "If-Match", "If-Modified-Since", "If-None-Match", "If-Range",
+    "If-Unmodified-Since", "Keep-Alive", "Last-Modified", "Location", "Max-Forwards",
+    "Origin", "Pragma", "Proxy-Authenticate", "Proxy-Authorization", "Range",
+    "Referer", "Retry-After", "Server", "Set-Cookie", "TE",
+    "Trailer", "Upgrade", "User-Agent", "Vary", "Via",
+    "Warning", "WWW-Authenticate", "X-Forwarded-For", "X-Forwarded-Proto", "X-Real-IP",
+};
+
+namespace header_ids_detail {
+
+constexpr unsigned lower(char c) {
+    return static_cast<unsigned char>(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+}
+
+// Perfect hash of the names in kHeaderNames; `name` must not be empty.
+constexpr unsigned hashName(std::string_view name) {
+    return (static_cast<unsigned>(name.size()) + 24 * lower(name.front()) + lower(name.back()) +
+            3 * lower(name[name.size() / 2])) & 0xFF;
+}
+
+constexpr std::array<HeaderId, 256> makeSlots() {
+    std::array<HeaderId, 256> slots{};
+    for (size_t i = 1; i < kHeaderNames.size(); ++i) {
+        slots[hashName(kHeaderNames[i])] = static_cast<HeaderId>(i);
+    }
+    return slots;
+}
+
+// True if no two names in kHeaderNames share a slot.
+constexpr bool isPerfect() {
+    std::array<bool, 256> used{};
+    for (size_t i = 1; i < kHeaderNames.size(); ++i) {
+        unsigned slot = hashName(kHeaderNames[i]);
+        if (used[slot]) return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+static_assert(isPerfect(), "header name hash has collisions; pick new constants");
+
+constexpr std::array<HeaderId, 256> kSlots = makeSlots();
+
+} // namespace header_ids_detail
+
+/*
+ * classifyHeader() function: Maps a header name, in any letter case, to its
+ * HeaderId, or HeaderId::Unknown if it is not one of the well-known headers.
+ */
+constexpr HeaderId classifyHeader(std::string_view name) {
+    if (name.empty()) return HeaderId::Unknown;
+    HeaderId id = header_ids_detail::kSlots[header_ids_detail::hashName(name)];
+    if (id != HeaderId::Unknown && equalsIgnoreCase(kHeaderNames[static_cast<size_t>(id)], name)) {
+        return id;
+    }
+    return HeaderId::Unknown;
+}
+
+/*
+ * headerName() function: Canonical spelling of a well-known header
+ * ("" for HeaderId::Unknown).
+ */
+constexpr std::string_view headerName(HeaderId id) {
+    return kHeaderNames[static_cast<size_t>(id)];
+}
+
+/*
+ * isHotHeader() function: True for the headers whose positions ParsedRequest
+ * caches.
+ */
+constexpr bool isHotHeader(HeaderId id) {
+    return id != HeaderId::Unknown && static_cast<size_t>(id) <= kHotHeaderCount;
+}
@@ -0,0 +1,236 @@
+/*
+ * proxy_headers.hpp -- flat, order-preserving header storage.
+ *
+ * A request carries around ten headers. Keeping them in a contiguous array
+ * with room for the common case inline is both smaller and faster than a
+ * hash table: there is no node allocation per header, the key is stored
+ * once, lookups are a short linear walk over adjacent memory, wire order is
+ * preserved for unparsing, and repeated headers (Via, Cookie, ...) can be
+ * represented.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace headers_detail {
+
+constexpr uint64_t kEveryByte = 0x0101010101010101ull;
+
+// `word` with its ASCII capitals turned into small letters, eight bytes at
+// a time: a byte gets 0x20 or'ed in if it is at least 'A', at most 'Z' and
+// has its top bit clear. The sums cannot carry into the next byte.
+inline uint64_t foldCase(uint64_t word) {
+    uint64_t low = word & (0x7f * kEveryByte);
+    uint64_t from_a = low + (0x80 - 'A') * kEveryByte;
+    uint64_t past_z = low + (0x80 - 'Z' - 1) * kEveryByte;
+    uint64_t capitals = from_a & ~past_z & ~word & (0x80 * kEveryByte);
+    return word | (capitals >> 2);
+}
+
+inline uint64_t loadWord(const char* p) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+// True if the words at `a` and `b` are equal but for the case of letters.
+inline bool sameWordIgnoringCase(const char* a, const char* b) {
+    uint64_t x = loadWord(a);
+    uint64_t y = loadWord(b);
+    return x == y || foldCase(x) == foldCase(y);
+}
+
+// The case-insensitive comparison of `n` >= 8 bytes at `a` and `b`, a word
+// at a time; the last word overlaps the one before it. Kept out of line so
+// that equalsIgnoreCase(), mostly a length check, stays small enough to
+// inline.
+__attribute__((noinline)) inline bool equalWordsIgnoringCase(const char* a, const char* b, size_t n) {
+    size_t last = n - 8;
+    for (size_t i = 0; i < last; i += 8) {
+        if (!sameWordIgnoringCase(a + i, b + i)) return false;
+    }
+    return sameWordIgnoringCase(a + last, b + last);
+}
+
+} // namespace headers_detail
+
+/*
+ * equalsIgnoreCase() function: ASCII case-insensitive comparison, as used for
+ * HTTP header names. Names of eight bytes or more are compared a word at a
+ * time, folding the case of a word only if it differs; shorter names, and
+ * constant evaluation, go a byte at a time.
+ */
+constexpr bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    if (!__builtin_is_constant_evaluated() && a.size() >= 8) {
+        return headers_detail::equalWordsIgnoringCase(a.data(), b.data(), a.size());
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        char x = a[i];
+        char y = b[i];
+        if (x == y) continue;
+        if (x >= 'A' && x <= 'Z') x = static_cast<char>(x - 'A' + 'a');
+        if (y >= 'A' && y <= 'Z') y = static_cast<char>(y - 'A' + 'a');
+        if (x != y) return false;
+    }
+    return true;
+}
+
+/*
+ * SmallVector class template
+ *
+ * A vector that stores up to `N` elements inside the object itself and only
+ * moves to the heap once it grows past that. Elements stay contiguous and in
+ * insertion order; erase() shifts the following elements down to keep it.
+ * Only the operations the parser needs are provided.
+ */
+template <class T, size_t N>
+class SmallVector {
+public:
+    using value_type = T;
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    SmallVector() : ptr(inlineData()), len(0), cap(N) {}
+
+    SmallVector(const SmallVector& other) : SmallVector() {
+        reserve(other.len);
+        for (const T& item : other) push_back(item);
+    }
+
+    SmallVector(SmallVector&& other) noexcept(std::is_nothrow_move_constructible<T>::value)
+        : SmallVector() {
+        takeFrom(other);
+    }
+
+    SmallVector& operator=(const SmallVector& other) {
+        if (this != &other) {
+            clear();
+            reserve(other.len);
+            for (const T& item : other) push_back(item);
+        }
+        return *this;
+    }
+
+    SmallVector& operator=(SmallVector&& other) noexcept(std::is_nothrow_move_constructible<T>::value) {
+        if (this != &other) {
+            clear();
+            releaseHeap();
+            takeFrom(other);
+        }
+        return *this;
+    }
+
+    ~SmallVector() {
+        clear();
+        releaseHeap();
+    }
+
+    size_t size() const { return len; }
+    size_t capacity() const { return cap; }
+    bool empty() const { return len == 0; }
+
+    // True while the elements still live in the inline buffer.
+    bool isInline() const { return ptr == inlineData(); }
+
+    T* data() { return ptr; }
+    const T* data() const { return ptr; }
+    iterator begin() { return ptr; }
+    iterator end() { return ptr + len; }
+    const_iterator begin() const { return ptr; }
+    const_iterator end() const { return ptr + len; }
+
+    T& operator[](size_t i) { return ptr[i]; }
+    const T& operator[](size_t i) const { return ptr[i]; }
+    T& front() { return ptr[0]; }
+    const T& front() const { return ptr[0]; }
+    T& back() { return ptr[len - 1]; }
+    const T& back() const { return ptr[len - 1]; }
+
+    void push_back(const T& item) { emplace_back(item); }
+    void push_back(T&& item) { emplace_back(std::move(item)); }
+
+    template <class... Args>
+    T& emplace_back(Args&&... args) {
+        if (len == cap) {
+            // Construct first: `args` may refer to an element that grow()
+            // is about to move.
+            T item(std::forward<Args>(args)...);
+            grow(cap * 2);
+            return *new (ptr + len++) T(std::move(item));
+        }
+        return *new (ptr + len++) T(std::forward<Args>(args)...);
+    }
+
+    void pop_back() {
+        ptr[--len].~T();
+    }
+
+    // Removes the element at `pos`, keeping the order of the others. Returns
+    // an iterator to the element that followed it.
+    iterator erase(iterator pos) {
+        for (iterator it = pos; it + 1 != end(); ++it) *it = std::move(*(it + 1));
+        pop_back();
+        return pos;
+    }
+
+    // Destroys all elements. The capacity, inline or heap, is kept.
+    void clear() {
+        while (len > 0) pop_back();
+    }
+
+    void reserve(size_t n) {
+        if (n > cap) grow(n);
+    }
+
+private:
+    T* inlineData() { return reinterpret_cast<T*>(inlineBuf); }
+    const T* inlineData() const { return reinterpret_cast<const T*>(inlineBuf); }
+
+    void grow(size_t n) {
+        T* bigger = std::allocator<T>().allocate(n);
+        for (size_t i = 0; i < len; ++i) {
+            new (bigger + i) T(std::move(ptr[i]));
+            ptr[i].~T();
+        }
+        releaseHeap();
+        ptr = bigger;
+        cap = n;
+    }
+
+    void releaseHeap() {
+        if (!isInline()) {
+            std::allocator<T>().deallocate(ptr, cap);
+            ptr = inlineData();
+            cap = N;
+        }
+    }
+
+    // Moves the contents of `other` into this empty, inline vector.
+    void takeFrom(SmallVector& other) {
+        if (other.isInline()) {
+            for (T& item : other) new (ptr + len++) T(std::move(item));
+            other.clear();
+        } else {
+            ptr = other.ptr;
+            len = other.len;
+            cap = other.cap;
+            other.ptr = other.inlineData();
+            other.len = 0;
+            other.cap = N;
+        }
+    }
+
+    T* ptr;
+    size_t len;
+    size_t cap;
+    alignas(T) unsigned char inlineBuf[N * sizeof(T)];
+};
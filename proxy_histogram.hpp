@@ -0,0 +1,109 @@
+/*
+ * proxy_histogram.hpp -- high dynamic range latency histograms.
+ *
+ * Latencies span several orders of magnitude, from microseconds for a cache
+ * hit to seconds for a stalled origin, and the tail is what matters. A
+ * histogram with fixed-width buckets is either too coarse at the low end or
+ * too large; keeping every sample costs memory proportional to the run.
+ *
+ * LatencyHistogram uses the layout of HdrHistogram (Gil Tene): values below
+ * 2048 get a bucket each, and every further power of two is split into 1024
+ * equal buckets. Every recorded value is thus known to within 1/1024 of
+ * itself, three significant decimal digits, across the whole range, and
+ * recording is a count-leading-zeros and an increment. Per-thread histograms
+ * are merged with add() once a run is over.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * LatencyHistogram class
+ *
+ * Counts values, typically nanoseconds, from 0 to kMaxValue; larger values
+ * are recorded as kMaxValue. Not thread-safe.
+ */
+class LatencyHistogram {
+public:
+    // Largest value told apart from larger ones: about 18 minutes in ns.
+    static constexpr uint64_t kMaxValue = (uint64_t{1} << 40) - 1;
+
+    LatencyHistogram() : counts(indexOf(kMaxValue) + 1, 0) {}
+
+    void record(uint64_t value) {
+        value = std::min(value, kMaxValue);
+        ++counts[indexOf(value)];
+        ++total;
+        sum += value;
+        minValue = std::min(minValue, value);
+        maxValue = std::max(maxValue, value);
+    }
+
+    // Adds the counts of `other`, e.g. of another thread.
+    void add(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); ++i) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        minValue = std::min(minValue, other.minValue);
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    void clear() {
+        std::fill(counts.begin(), counts.end(), 0);
+        total = sum = maxValue = 0;
+        minValue = UINT64_MAX;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total > 0 ? minValue : 0; }
+    uint64_t max() const { return maxValue; }
+    double mean() const { return total > 0 ? static_cast<double>(sum) / static_cast<double>(total) : 0.0; }
+
+    /*
+     * percentile() method: The value at or below which `percent` of the
+     * recorded values lie, e.g. 99.9 for the p99.9; the highest value of its
+     * bucket, but never more than max(). 0 if nothing was recorded.
+     */
+    uint64_t percentile(double percent) const {
+        if (total == 0) return 0;
+        double wanted = std::clamp(percent, 0.0, 100.0) / 100.0 * static_cast<double>(total);
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(wanted + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank) return std::min(highestIn(i), maxValue);
+        }
+        return maxValue;
+    }
+
+private:
+    // Values below kLinear map to themselves; above, each power of two has
+    // kSubBuckets buckets.
+    static constexpr unsigned kSubBucketBits = 10;
+    static constexpr uint64_t kSubBuckets = uint64_t{1} << kSubBucketBits;
+    static constexpr uint64_t kLinear = 2 * kSubBuckets;
+
+    static size_t indexOf(uint64_t value) {
+        if (value < kLinear) return static_cast<size_t>(value);
+        // The shift keeps the top kSubBucketBits + 1 bits of the value.
+        unsigned shift = 63 - static_cast<unsigned>(__builtin_clzll(value)) - kSubBucketBits;
+        return static_cast<size_t>(shift * kSubBuckets + (value >> shift));
+    }
+
+    static uint64_t highestIn(size_t index) {
+        if (index < kLinear) return index;
+        uint64_t shift = index / kSubBuckets - 1;
+        uint64_t sub = index - shift * kSubBuckets;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t minValue = UINT64_MAX;
+    uint64_t maxValue = 0;
+};
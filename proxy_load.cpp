@@ -0,0 +1,584 @@
+/*
+ * proxy_load.cpp -- load generator and latency harness for the proxy.
+ *
+ * Usage: proxy_load [-b address] [-p port] [-u url] [-c connections] [-t threads]
+ *                   [-d seconds] [-w seconds] [-k ratio] [-P depth] [-r rate]
+ *                   [-C cores] [-o] [-s]
+ *
+ *   -b address      IPv4 address of the proxy (default 127.0.0.1)
+ *   -p port         port of the proxy (default 8080)
+ *   -u url          what to request through it (default http://127.0.0.1:9000/,
+ *                   where proxy_origin listens by default)
+ *   -c connections  concurrent client connections (default 64)
+ *   -t threads      threads driving them (default 1)
+ *   -d seconds      length of the measurement (default 10)
+ *   -w seconds      warm-up before it, not measured (default 1)
+ *   -k ratio        share of requests sent keep-alive, 0 to 1; the others
+ *                   ask for the connection to close, and the connection is
+ *                   opened again for the next one (default 1)
+ *   -P depth        requests in flight per connection, pipelined (default 1)
+ *   -r rate         open loop: send this many requests per second in total,
+ *                   on schedule, whether or not responses keep up; by default
+ *                   the load is a closed loop, each connection sending its
+ *                   next request once a response is in
+ *   -C cores        CPU cores the proxy runs on, to report throughput per core
+ *   -o              send origin-form requests, straight to a server at -b/-p
+ *                   (e.g. proxy_origin, for a baseline without the proxy)
+ *   -s              print one tab-separated summary line instead of a report
+ *
+ * Latencies go into per-thread HDR histograms (proxy_histogram.hpp), merged
+ * at the end. In the closed loop a request's latency runs from the moment
+ * its connection was ready to issue it, so reconnecting after a
+ * non-keep-alive request counts against the next one. In the open loop it
+ * runs from the moment the schedule said the request was due: a server that
+ * falls behind delays the requests queued behind, and that time is counted
+ * instead of being omitted.
+ *
+ * A sweep over the proxy's thread count, e.g.
+ *
+ *     for n in 1 2 4 8 16 32 64; do
+ *         ./proxy -p 8080 -t $n -c 0 & sleep 1
+ *         ./proxy_load -c 256 -t 8 -C $n -s
+ *         kill -INT %1; wait
+ *     done
+ *
+ * shows how it scales with cores, one line per core count.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "proxy_histogram.hpp"
+#include "proxy_upstream.hpp"
+
+namespace {
+
+constexpr size_t kReadChunk = 64 * 1024;
+constexpr int kMaxEvents = 256;
+
+// Wait after a failed connect before trying again.
+constexpr uint64_t kRetryDelayNs = 10 * 1000 * 1000;
+
+struct LoadConfig {
+    std::string address = "127.0.0.1";
+    uint16_t port = 8080;
+    std::string url = "http://127.0.0.1:9000/";
+    size_t connections = 64;
+    size_t threads = 1;
+    double seconds = 10;
+    double warmupSeconds = 1;
+    double keepAliveRatio = 1;
+    size_t depth = 1;
+    double rate = 0; // Requests per second over all connections; 0 for a closed loop.
+    size_t cores = 0;
+    bool originForm = false;
+    bool summary = false;
+};
+
+uint64_t nowNs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
+
+// Splits "http://host[:port][/path]" into the Host header value and path.
+bool splitUrl(const std::string& url, std::string& host, std::string& path) {
+    const std::string scheme = "http://";
+    if (url.compare(0, scheme.size(), scheme) != 0) return false;
+    size_t slash = url.find('/', scheme.size());
+    host = url.substr(scheme.size(), slash - scheme.size());
+    path = slash == std::string::npos ? "/" : url.substr(slash);
+    return !host.empty();
+}
+
+// What one thread counted.
+struct LoadStats {
+    LatencyHistogram latency; // Nanoseconds.
+    uint64_t completed = 0;
+    uint64_t bytes = 0;       // Response bytes received.
+    uint64_t connects = 0;
+    uint64_t connectErrors = 0;
+    uint64_t ioErrors = 0;    // Requests lost to a connection failing or closing early.
+    uint64_t errorStatus = 0; // Responses with a status of 400 and above.
+
+    void add(const LoadStats& other) {
+        latency.add(other.latency);
+        completed += other.completed;
+        bytes += other.bytes;
+        connects += other.connects;
+        connectErrors += other.connectErrors;
+        ioErrors += other.ioErrors;
+        errorStatus += other.errorStatus;
+    }
+};
+
+// One client connection and the requests it carries.
+struct LoadConnection {
+    int fd = -1;
+    bool connecting = false;
+    bool closing = false;         // A request asking to close is in flight.
+    std::string out;              // Request bytes not sent yet.
+    size_t outSent = 0;
+    std::deque<uint64_t> queued;  // Issue times of the requests not sent yet.
+    std::deque<uint64_t> started; // Issue times of the requests in flight.
+    ResponseFramer framer;
+    uint64_t nextDue = 0;         // Open loop: when the next request is due.
+    uint64_t retryAt = 0;         // Without a socket: when to connect again.
+};
+
+class LoadThread {
+public:
+    LoadThread(const LoadConfig& c, const sockaddr_in& a, size_t connections, uint64_t seed,
+               const std::string& keep_alive_request, const std::string& close_request)
+        : config(c), addr(a), conns(connections), random(seed | 1), keepAliveRequest(keep_alive_request),
+          closeRequest(close_request), buffer(kReadChunk) {}
+
+    ~LoadThread() {
+        for (LoadConnection& conn : conns) {
+            if (conn.fd >= 0) ::close(conn.fd);
+        }
+        if (timerFd >= 0) ::close(timerFd);
+        if (epollFd >= 0) ::close(epollFd);
+    }
+
+    // Runs from `start`, counting what completes from `measure_from` until
+    // `end`.
+    void run(uint64_t start, uint64_t measure_from, uint64_t end) {
+        measureFrom = measure_from;
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (epollFd < 0 || timerFd < 0) {
+            perror("epoll/timerfd");
+            return;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev);
+
+        uint64_t interval = config.rate > 0 ? static_cast<uint64_t>(1e9 * config.connections / config.rate) : 0;
+        for (LoadConnection& conn : conns) {
+            if (interval > 0) {
+                // Spread the connections over the interval.
+                conn.nextDue = start + next() % interval;
+            } else {
+                conn.queued.assign(config.depth, start);
+            }
+            connect(conn);
+        }
+
+        epoll_event events[kMaxEvents];
+        uint64_t armed = 0;
+        for (;;) {
+            uint64_t now = nowNs();
+            if (now >= end) break;
+            uint64_t wake = end;
+            if (interval > 0 || disconnected > 0) {
+                for (LoadConnection& conn : conns) {
+                    if (conn.fd < 0) {
+                        if (conn.retryAt <= now) {
+                            --disconnected;
+                            connect(conn);
+                        } else {
+                            wake = std::min(wake, conn.retryAt);
+                        }
+                    }
+                    if (interval == 0) continue;
+                    while (conn.nextDue <= now) {
+                        conn.queued.push_back(conn.nextDue);
+                        conn.nextDue += interval;
+                    }
+                    pump(conn);
+                    wake = std::min(wake, conn.nextDue);
+                }
+            }
+            if (wake != armed) {
+                arm(wake);
+                armed = wake;
+            }
+
+            int n = epoll_wait(epollFd, events, kMaxEvents, -1);
+            for (int i = 0; i < n; ++i) {
+                auto* conn = static_cast<LoadConnection*>(events[i].data.ptr);
+                if (conn == nullptr) {
+                    uint64_t expirations;
+                    if (read(timerFd, &expirations, sizeof(expirations)) < 0) {
+                        // Not expired after all; the loop re-arms it.
+                    }
+                    continue;
+                }
+                handle(*conn, events[i].events);
+            }
+        }
+    }
+
+    LoadStats stats;
+
+private:
+    uint64_t next() {
+        // xorshift64: cheap, and reproducible for a given seed.
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        return random;
+    }
+
+    void arm(uint64_t when) {
+        itimerspec spec{};
+        spec.it_value.tv_sec = static_cast<time_t>(when / 1000000000);
+        spec.it_value.tv_nsec = static_cast<long>(when % 1000000000);
+        timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+
+    void connect(LoadConnection& conn) {
+        conn.connecting = true;
+        conn.closing = false;
+        conn.out.clear();
+        conn.outSent = 0;
+        conn.framer.reset(false);
+        ++stats.connects;
+        conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (conn.fd < 0 ||
+            (::connect(conn.fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0 &&
+             errno != EINPROGRESS)) {
+            connectFailed(conn);
+            return;
+        }
+        int one = 1;
+        setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.ptr = &conn;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, conn.fd, &ev);
+    }
+
+    // Leaves the connection closed for a while; the run loop opens it again.
+    void connectFailed(LoadConnection& conn) {
+        ++stats.connectErrors;
+        if (conn.fd >= 0) ::close(conn.fd);
+        conn.fd = -1;
+        conn.retryAt = nowNs() + kRetryDelayNs;
+        ++disconnected;
+    }
+
+    // Drops a connection that failed and opens it again. The requests in
+    // flight are lost; in the closed loop they are issued again right away.
+    void fail(LoadConnection& conn) {
+        stats.ioErrors += conn.started.size();
+        reconnect(conn);
+    }
+
+    // Opens the connection again, e.g. after a response that closed it.
+    void reconnect(LoadConnection& conn) {
+        ::close(conn.fd);
+        conn.fd = -1;
+        conn.started.clear();
+        if (config.rate <= 0) {
+            uint64_t now = nowNs();
+            while (conn.queued.size() < config.depth) conn.queued.push_back(now);
+        }
+        connect(conn);
+    }
+
+    void handle(LoadConnection& conn, uint32_t events) {
+        if (conn.connecting) {
+            if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error != 0) {
+                connectFailed(conn);
+                return;
+            }
+            conn.connecting = false;
+            watch(conn, EPOLLIN);
+            pump(conn);
+            return;
+        }
+        if ((events & EPOLLOUT) && !flush(conn)) return;
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) receive(conn);
+    }
+
+    void watch(LoadConnection& conn, uint32_t events) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.ptr = &conn;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &ev);
+    }
+
+    // Sends queued requests while the pipeline has room. Returns false if
+    // the connection failed.
+    bool pump(LoadConnection& conn) {
+        if (conn.fd < 0 || conn.connecting) return true;
+        bool sent = false;
+        while (!conn.closing && !conn.queued.empty() && conn.started.size() < config.depth) {
+            bool keep_alive = config.keepAliveRatio >= 1 ||
+                              static_cast<double>(next() % 1000000) < config.keepAliveRatio * 1000000;
+            conn.out += keep_alive ? keepAliveRequest : closeRequest;
+            conn.closing = !keep_alive;
+            conn.started.push_back(conn.queued.front());
+            conn.queued.pop_front();
+            sent = true;
+        }
+        return !sent || flush(conn);
+    }
+
+    // Writes what is pending. Returns false if the connection failed.
+    bool flush(LoadConnection& conn) {
+        while (conn.outSent < conn.out.size()) {
+            ssize_t n = send(conn.fd, conn.out.data() + conn.outSent, conn.out.size() - conn.outSent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    watch(conn, EPOLLIN | EPOLLOUT);
+                    return true;
+                }
+                fail(conn);
+                return false;
+            }
+            conn.outSent += static_cast<size_t>(n);
+        }
+        conn.out.clear();
+        conn.outSent = 0;
+        watch(conn, EPOLLIN);
+        return true;
+    }
+
+    void receive(LoadConnection& conn) {
+        for (;;) {
+            ssize_t n = recv(conn.fd, buffer.data(), buffer.size(), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (n <= 0) {
+                // Closed with requests in flight, or failed.
+                if (conn.started.empty()) {
+                    reconnect(conn);
+                } else {
+                    fail(conn);
+                }
+                return;
+            }
+            uint64_t now = nowNs();
+            if (now >= measureFrom) stats.bytes += static_cast<uint64_t>(n);
+
+            size_t offset = 0;
+            while (offset < static_cast<size_t>(n)) {
+                if (conn.started.empty()) {
+                    // Bytes nobody asked for.
+                    fail(conn);
+                    return;
+                }
+                size_t used;
+                bool done = conn.framer.feed(buffer.data() + offset, static_cast<size_t>(n) - offset, used);
+                offset += used;
+                if (!done) break;
+                if (!complete(conn, now)) return;
+            }
+        }
+    }
+
+    // Accounts for the response to the oldest request in flight. Returns
+    // false if the connection was opened again.
+    bool complete(LoadConnection& conn, uint64_t now) {
+        if (now >= measureFrom) {
+            stats.latency.record(now - conn.started.front());
+            ++stats.completed;
+            if (conn.framer.status() >= 400) ++stats.errorStatus;
+        }
+        conn.started.pop_front();
+        bool reusable = conn.framer.reusable() && !(conn.closing && conn.started.empty());
+        conn.framer.reset(false);
+        if (config.rate <= 0) conn.queued.push_back(now);
+        if (!reusable) {
+            fail(conn);
+            return false;
+        }
+        return pump(conn);
+    }
+
+    const LoadConfig& config;
+    const sockaddr_in addr;
+    std::vector<LoadConnection> conns;
+    uint64_t random;
+    const std::string& keepAliveRequest;
+    const std::string& closeRequest;
+    std::vector<char> buffer;
+    uint64_t measureFrom = 0;
+    size_t disconnected = 0; // Connections waiting for retryAt.
+    int epollFd = -1;
+    int timerFd = -1;
+};
+
+std::string formatNs(uint64_t ns) {
+    char text[32];
+    if (ns < 10000) {
+        snprintf(text, sizeof(text), "%lluns", static_cast<unsigned long long>(ns));
+    } else if (ns < 10000000) {
+        snprintf(text, sizeof(text), "%.1fus", static_cast<double>(ns) / 1e3);
+    } else if (ns < 10000000000ull) {
+        snprintf(text, sizeof(text), "%.1fms", static_cast<double>(ns) / 1e6);
+    } else {
+        snprintf(text, sizeof(text), "%.2fs", static_cast<double>(ns) / 1e9);
+    }
+    return text;
+}
+
+void report(const LoadConfig& config, const LoadStats& stats) {
+    const LatencyHistogram& h = stats.latency;
+    double rate = static_cast<double>(stats.completed) / config.seconds;
+    if (config.summary) {
+        // cores connections threads depth keep-alive offered req/s p50 p99 p99.9 max (us) errors
+        printf("%zu\t%zu\t%zu\t%zu\t%.2f\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%llu\n", config.cores,
+               config.connections, config.threads, config.depth, config.keepAliveRatio, config.rate, rate,
+               h.percentile(50) / 1e3, h.percentile(99) / 1e3, h.percentile(99.9) / 1e3, h.max() / 1e3,
+               static_cast<unsigned long long>(stats.ioErrors + stats.connectErrors + stats.errorStatus));
+        return;
+    }
+
+    printf("%s via %s:%u\n", config.url.c_str(), config.address.c_str(), static_cast<unsigned>(config.port));
+    printf("%zu connections on %zu threads, pipeline depth %zu, %.0f%% keep-alive, ", config.connections,
+           config.threads, config.depth, config.keepAliveRatio * 100);
+    if (config.rate > 0) {
+        printf("open loop at %.0f req/s\n", config.rate);
+    } else {
+        printf("closed loop\n");
+    }
+    printf("%.2f s measured after %.2f s of warm-up\n\n", config.seconds, config.warmupSeconds);
+
+    printf("requests   %llu, %.1f/s", static_cast<unsigned long long>(stats.completed), rate);
+    if (config.cores > 0) printf(", %.1f/s per core over %zu cores", rate / config.cores, config.cores);
+    printf("\nreceived   %.1f MB, %.1f MB/s\n", stats.bytes / 1e6, stats.bytes / 1e6 / config.seconds);
+    printf("connects   %llu, %llu failed\n", static_cast<unsigned long long>(stats.connects),
+           static_cast<unsigned long long>(stats.connectErrors));
+    printf("errors     %llu lost in flight, %llu with status >= 400\n",
+           static_cast<unsigned long long>(stats.ioErrors), static_cast<unsigned long long>(stats.errorStatus));
+    printf("latency    min %s  mean %s  max %s\n", formatNs(h.min()).c_str(),
+           formatNs(static_cast<uint64_t>(h.mean())).c_str(), formatNs(h.max()).c_str());
+    printf("           p50 %s  p90 %s  p99 %s  p99.9 %s  p99.99 %s\n", formatNs(h.percentile(50)).c_str(),
+           formatNs(h.percentile(90)).c_str(), formatNs(h.percentile(99)).c_str(),
+           formatNs(h.percentile(99.9)).c_str(), formatNs(h.percentile(99.99)).c_str());
+}
+
+void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-b address] [-p port] [-u url] [-c connections] [-t threads] [-d seconds]\n"
+            "       [-w seconds] [-k ratio] [-P depth] [-r rate] [-C cores] [-o] [-s]\n",
+            argv0);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    LoadConfig config;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:u:c:t:d:w:k:P:r:C:os")) != -1) {
+        switch (opt) {
+        case 'b':
+            config.address = optarg;
+            break;
+        case 'p': {
+            long port = strtol(optarg, nullptr, 10);
+            if (port <= 0 || port > 65535) {
+                usage(argv[0]);
+                return 1;
+            }
+            config.port = static_cast<uint16_t>(port);
+            break;
+        }
+        case 'u':
+            config.url = optarg;
+            break;
+        case 'c':
+            config.connections = std::max<size_t>(1, strtoul(optarg, nullptr, 10));
+            break;
+        case 't':
+            config.threads = std::max<size_t>(1, strtoul(optarg, nullptr, 10));
+            break;
+        case 'd':
+            config.seconds = strtod(optarg, nullptr);
+            break;
+        case 'w':
+            config.warmupSeconds = std::max(0.0, strtod(optarg, nullptr));
+            break;
+        case 'k':
+            config.keepAliveRatio = std::clamp(strtod(optarg, nullptr), 0.0, 1.0);
+            break;
+        case 'P':
+            config.depth = std::max<size_t>(1, strtoul(optarg, nullptr, 10));
+            break;
+        case 'r':
+            config.rate = std::max(0.0, strtod(optarg, nullptr));
+            break;
+        case 'C':
+            config.cores = strtoul(optarg, nullptr, 10);
+            break;
+        case 'o':
+            config.originForm = true;
+            break;
+        case 's':
+            config.summary = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::string host, path;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (config.seconds <= 0 || !splitUrl(config.url, host, path) ||
+        inet_pton(AF_INET, config.address.c_str(), &addr.sin_addr) != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    config.threads = std::min(config.threads, config.connections);
+
+    std::string request_line = "GET " + (config.originForm ? path : config.url) + " HTTP/1.1\r\n";
+    std::string headers = "Host: " + host + "\r\nUser-Agent: proxy_load\r\nAccept: */*\r\n";
+    std::string keep_alive_request = request_line + headers + "\r\n";
+    std::string close_request = request_line + headers + "Connection: close\r\n\r\n";
+
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::unique_ptr<LoadThread>> workers;
+    for (size_t i = 0; i < config.threads; ++i) {
+        size_t share = config.connections / config.threads + (i < config.connections % config.threads ? 1 : 0);
+        workers.push_back(std::make_unique<LoadThread>(config, addr, share, 0x9E3779B97F4A7C15ull * (i + 1),
+                                                       keep_alive_request, close_request));
+    }
+
+    uint64_t start = nowNs();
+    uint64_t measure_from = start + static_cast<uint64_t>(config.warmupSeconds * 1e9);
+    uint64_t end = measure_from + static_cast<uint64_t>(config.seconds * 1e9);
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back([&worker, start, measure_from, end] { worker->run(start, measure_from, end); });
+    }
+    for (std::thread& thread : threads) thread.join();
+
+    LoadStats total;
+    for (auto& worker : workers) total.add(worker->stats);
+    report(config, total);
+    return 0;
+}
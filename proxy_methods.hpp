@@ -0,0 +1,147 @@
+/*
+ * proxy_methods.hpp -- compile-time table of HTTP request methods.
+ *
+ * The method of every request is classified once, when it is parsed, into
+ * an HttpMethod. The proxy then branches on the id ("is this HEAD?", "may
+ * it be retried?") instead of comparing strings, and a parser's limits
+ * policy names the methods it accepts as a MethodSet.
+ *
+ * Classification is a switch on the first four bytes of the method, packed
+ * into an integer, followed by a length check or a comparison of the rest
+ * for the methods longer than four characters. The compiler turns the
+ * switch into a jump table or a few integer comparisons.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string_view>
+
+/*
+ * HttpMethod enum
+ *
+ * The methods defined by RFC 9110 plus PATCH (RFC 5789). Methods are case
+ * sensitive, so "get" is HttpMethod::Other.
+ */
+enum class HttpMethod : uint8_t {
+    Other = 0, // An extension method, or not a method at all.
+
+    Get,
+    Head,
+    Post,
+    Put,
+    Delete,
+    Connect,
+    Options,
+    Trace,
+    Patch,
+
+    Count
+};
+
+// Canonical spelling of every method, indexed by HttpMethod.
+constexpr std::array<std::string_view, static_cast<size_t>(HttpMethod::Count)> kMethodNames = {
+    "", "GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE", "PATCH",
+};
+
+namespace methods_detail {
+
+// The first four bytes of `s`, zero-padded, packed so that the case labels
+// below can be written as the method names themselves.
+constexpr uint32_t prefix(std::string_view s) {
+    uint32_t key = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        key = key << 8 | (i < s.size() ? static_cast<unsigned char>(s[i]) : 0u);
+    }
+    return key;
+}
+
+} // namespace methods_detail
+
+/*
+ * classifyMethod() function: Maps a request method to its HttpMethod, or
+ * HttpMethod::Other if it is not one of the methods above.
+ */
+constexpr HttpMethod classifyMethod(std::string_view method) {
+    using methods_detail::prefix;
+    switch (prefix(method)) {
+    case prefix("GET"): return method.size() == 3 ? HttpMethod::Get : HttpMethod::Other;
+    case prefix("HEAD"): return method.size() == 4 ? HttpMethod::Head : HttpMethod::Other;
+    case prefix("POST"): return method.size() == 4 ? HttpMethod::Post : HttpMethod::Other;
+    case prefix("PUT"): return method.size() == 3 ? HttpMethod::Put : HttpMethod::Other;
+    case prefix("DELE"): return method == "DELETE" ? HttpMethod::Delete : HttpMethod::Other;
+    case prefix("CONN"): return method == "CONNECT" ? HttpMethod::Connect : HttpMethod::Other;
+    case prefix("OPTI"): return method == "OPTIONS" ? HttpMethod::Options : HttpMethod::Other;
+    case prefix("TRAC"): return method == "TRACE" ? HttpMethod::Trace : HttpMethod::Other;
+    case prefix("PATC"): return method == "PATCH" ? HttpMethod::Patch : HttpMethod::Other;
+    default: return HttpMethod::Other;
+    }
+}
+
+static_assert(classifyMethod("GET") == HttpMethod::Get && classifyMethod("GETS") == HttpMethod::Other &&
+              classifyMethod("OPTIONS") == HttpMethod::Options && classifyMethod("OPTI") == HttpMethod::Other &&
+              classifyMethod("") == HttpMethod::Other, "classifyMethod() is broken");
+
+/*
+ * methodName() function: Canonical spelling of a method ("" for
+ * HttpMethod::Other).
+ */
+constexpr std::string_view methodName(HttpMethod method) {
+    return kMethodNames[static_cast<size_t>(method)];
+}
+
+/*
+ * isIdempotentMethod() function: True for the methods a request may be
+ * retried with automatically, e.g. after a reused origin connection turned
+ * out to be closed (RFC 9110, section 9.2.2).
+ */
+constexpr bool isIdempotentMethod(HttpMethod method) {
+    switch (method) {
+    case HttpMethod::Get:
+    case HttpMethod::Head:
+    case HttpMethod::Put:
+    case HttpMethod::Delete:
+    case HttpMethod::Options:
+    case HttpMethod::Trace:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * MethodSet class
+ *
+ * A set of HttpMethods as a bit mask, usable in constant expressions. Sets
+ * containing HttpMethod::Other admit extension methods.
+ */
+class MethodSet {
+public:
+    constexpr MethodSet() = default;
+    constexpr MethodSet(std::initializer_list<HttpMethod> methods) {
+        for (HttpMethod method : methods) bits |= bit(method);
+    }
+
+    constexpr bool contains(HttpMethod method) const { return (bits & bit(method)) != 0; }
+
+    // Every method, extension methods included.
+    static constexpr MethodSet all() {
+        MethodSet set;
+        set.bits = (1u << static_cast<unsigned>(HttpMethod::Count)) - 1;
+        return set;
+    }
+
+private:
+    static constexpr uint32_t bit(HttpMethod method) { return 1u << static_cast<unsigned>(method); }
+
+    uint32_t bits = 0;
+};
+
+// Every method in HttpMethod, but no extension methods.
+constexpr MethodSet kStandardMethods = {
+    HttpMethod::Get, HttpMethod::Head, HttpMethod::Post, HttpMethod::Put, HttpMethod::Delete,
+    HttpMethod::Connect, HttpMethod::Options, HttpMethod::Trace, HttpMethod::Patch,
+};
@@ -0,0 +1,279 @@
+/*
+ * proxy_metrics.cpp -- per-thread request metrics and their export.
+ */
+
+#include "proxy_metrics.hpp"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+#include "proxy_parse.hpp"
+#include "proxy_trace.hpp"
+
+namespace {
+
+using metrics_detail::ThreadMetrics;
+
+// How long a scraper may take to send its request.
+constexpr int kRequestTimeoutMs = 2000;
+
+// Largest scrape request read.
+constexpr size_t kMaxRequestBytes = 8192;
+
+std::atomic<ThreadMetrics*> blocks{nullptr};
+
+struct BlockOwner {
+    ThreadMetrics* block = nullptr;
+
+    ~BlockOwner() {
+        if (block == nullptr) return;
+        metrics_detail::threadMetrics = nullptr;
+        block->inUse.store(false, std::memory_order_release);
+    }
+};
+
+thread_local BlockOwner blockOwner;
+
+struct CounterInfo {
+    const char* name;
+    const char* help;
+};
+
+// Indexed by Counter.
+constexpr CounterInfo kCounters[] = {
+    {"proxy_connections_accepted_total", "Client connections accepted."},
+    {"proxy_connections_closed_total", "Client connections closed."},
+    {"proxy_requests_total", "Requests parsed completely."},
+    {"proxy_error_responses_total", "Requests answered with an error response by the proxy."},
+    {"proxy_cache_hits_total", "Requests answered from the response cache."},
+    {"proxy_upstream_connects_total", "Connections opened to origin servers."},
+    {"proxy_upstream_reuses_total", "Requests sent on a pooled origin connection."},
+    {"proxy_upstream_retries_total", "Requests sent again after a pooled origin connection failed."},
+    {"proxy_static_responses_total", "Requests answered with a file from the document root."},
+    {"proxy_not_modified_total", "Conditional requests answered with 304 by the proxy itself."},
+    {"proxy_cache_revalidations_total", "Stale cache entries the origin confirmed as unchanged."},
+    {"proxy_coalesced_requests_total", "Cache misses answered from the response another request was fetching."},
+    {"proxy_disk_cache_loads_total", "Cache entries read back from the disk tier after missing in memory."},
+};
+static_assert(sizeof(kCounters) / sizeof(kCounters[0]) == static_cast<size_t>(Counter::Count),
+              "every Counter needs a name");
+
+// Indexed by Stage.
+constexpr const char* kStageNames[] = {
+    "parse", "handle", "resolve", "connect", "first_byte", "transfer", "total",
+};
+static_assert(sizeof(kStageNames) / sizeof(kStageNames[0]) == static_cast<size_t>(Stage::Count),
+              "every Stage needs a name");
+
+// The metrics of every thread, added up.
+struct Totals {
+    uint64_t counters[static_cast<size_t>(Counter::Count)] = {};
+    uint64_t buckets[static_cast<size_t>(Stage::Count)][metrics_detail::kBuckets] = {};
+    uint64_t sumNs[static_cast<size_t>(Stage::Count)] = {};
+};
+
+Totals collect() {
+    Totals totals;
+    for (const ThreadMetrics* m = blocks.load(std::memory_order_acquire); m != nullptr; m = m->next) {
+        for (size_t c = 0; c < static_cast<size_t>(Counter::Count); ++c) {
+            totals.counters[c] += m->counters[c].load(std::memory_order_relaxed);
+        }
+        for (size_t s = 0; s < static_cast<size_t>(Stage::Count); ++s) {
+            const metrics_detail::StageBuckets& stage = m->stages[s];
+            for (size_t b = 0; b < metrics_detail::kBuckets; ++b) {
+                totals.buckets[s][b] += stage.counts[b].load(std::memory_order_relaxed);
+            }
+            totals.sumNs[s] += stage.sumNs.load(std::memory_order_relaxed);
+        }
+    }
+    return totals;
+}
+
+void appendf(std::string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void appendf(std::string& out, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (n > 0) out.append(line, std::min(static_cast<size_t>(n), sizeof(line) - 1));
+}
+
+// Sends all of `data`; false if the scraper went away.
+bool sendAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+std::string response(const char* status, std::string_view type, std::string_view body) {
+    std::string out = "HTTP/1.1 ";
+    out += status;
+    out += "\r\nContent-Type: ";
+    out += type;
+    out += "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+    out += body;
+    return out;
+}
+
+} // namespace
+
+ThreadMetrics* metrics_detail::attachThread() {
+    for (ThreadMetrics* m = blocks.load(std::memory_order_acquire); m != nullptr; m = m->next) {
+        bool expected = false;
+        if (!m->inUse.load(std::memory_order_relaxed) &&
+            m->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            blockOwner.block = threadMetrics = m;
+            return m;
+        }
+    }
+    ThreadMetrics* m = new ThreadMetrics;
+    m->inUse.store(true, std::memory_order_relaxed);
+    m->next = blocks.load(std::memory_order_relaxed);
+    while (!blocks.compare_exchange_weak(m->next, m, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    blockOwner.block = threadMetrics = m;
+    return m;
+}
+
+std::string renderMetrics() {
+    Totals totals = collect();
+    std::string out;
+    for (size_t c = 0; c < static_cast<size_t>(Counter::Count); ++c) {
+        appendf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", kCounters[c].name, kCounters[c].help,
+                kCounters[c].name, kCounters[c].name, static_cast<unsigned long long>(totals.counters[c]));
+    }
+
+    uint64_t accepted = totals.counters[static_cast<size_t>(Counter::ConnectionsAccepted)];
+    uint64_t closed = totals.counters[static_cast<size_t>(Counter::ConnectionsClosed)];
+    appendf(out, "# HELP proxy_connections_open Client connections currently open.\n"
+                 "# TYPE proxy_connections_open gauge\nproxy_connections_open %llu\n",
+            static_cast<unsigned long long>(accepted > closed ? accepted - closed : 0));
+
+    out += "# HELP proxy_stage_duration_seconds Time requests spent in each stage of their handling.\n"
+           "# TYPE proxy_stage_duration_seconds histogram\n";
+    for (size_t s = 0; s < static_cast<size_t>(Stage::Count); ++s) {
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < metrics_detail::kBuckets; ++b) {
+            cumulative += totals.buckets[s][b];
+            if (b + 1 < metrics_detail::kBuckets) {
+                appendf(out, "proxy_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", kStageNames[s],
+                        static_cast<double>(metrics_detail::kBucketBounds[b]) / 1e9,
+                        static_cast<unsigned long long>(cumulative));
+            } else {
+                appendf(out, "proxy_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                        kStageNames[s], static_cast<unsigned long long>(cumulative));
+            }
+        }
+        appendf(out, "proxy_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", kStageNames[s],
+                static_cast<double>(totals.sumNs[s]) / 1e9);
+        appendf(out, "proxy_stage_duration_seconds_count{stage=\"%s\"} %llu\n", kStageNames[s],
+                static_cast<unsigned long long>(cumulative));
+    }
+    return out;
+}
+
+/*
+ * MetricsServer
+ */
+
+MetricsServer::MetricsServer(const std::string& a, uint16_t p) : address(a), port(p) {}
+
+MetricsServer::~MetricsServer() {
+    stop();
+    if (listenFd >= 0) ::close(listenFd);
+    if (stopFd >= 0) ::close(stopFd);
+}
+
+int MetricsServer::start() {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) return -1;
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listenFd, 16) < 0) return -1;
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    if (stopFd < 0) return -1;
+    thread = std::thread(&MetricsServer::run, this);
+    return 0;
+}
+
+void MetricsServer::stop() {
+    if (!thread.joinable()) return;
+    uint64_t one = 1;
+    if (write(stopFd, &one, sizeof(one)) < 0) TRACE("metrics: failed to stop: %s", strerror(errno));
+    thread.join();
+}
+
+void MetricsServer::run() {
+    for (;;) {
+        pollfd fds[2] = {{listenFd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            TRACE("metrics: poll: %s", strerror(errno));
+            return;
+        }
+        if (fds[1].revents != 0) return;
+        if (fds[0].revents == 0) continue;
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) TRACE("metrics: accept: %s", strerror(errno));
+            continue;
+        }
+        serve(fd);
+    }
+}
+
+void MetricsServer::serve(int fd) {
+    std::string in;
+    RequestParser parser;
+    ParsedRequestView request;
+    ParseStatus status = ParseStatus::NeedMore;
+    while (status == ParseStatus::NeedMore && in.size() < kMaxRequestBytes) {
+        pollfd readable{fd, POLLIN, 0};
+        if (poll(&readable, 1, kRequestTimeoutMs) <= 0) break;
+        char buf[1024];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        in.append(buf, static_cast<size_t>(n));
+        status = parser.feed(in, request);
+    }
+
+    if (status == ParseStatus::Done) {
+        bool get = request.methodId == HttpMethod::Get || request.methodId == HttpMethod::Head;
+        std::string_view path = request.path.substr(0, request.path.find('?'));
+        if (!get) {
+            sendAll(fd, response("405 Method Not Allowed", "text/plain", "GET or HEAD only\n"));
+        } else if (path != "/metrics") {
+            sendAll(fd, response("404 Not Found", "text/plain", "see /metrics\n"));
+        } else {
+            std::string full = response("200 OK", "text/plain; version=0.0.4", renderMetrics());
+            if (request.methodId == HttpMethod::Head) full.erase(full.find("\r\n\r\n") + 4);
+            sendAll(fd, full);
+        }
+    } else if (status == ParseStatus::Error) {
+        sendAll(fd, response("400 Bad Request", "text/plain", "bad request\n"));
+    }
+    ::close(fd);
+}
@@ -0,0 +1,212 @@
+/*
+ * proxy_metrics.hpp -- per-thread request metrics and their export.
+ *
+ * Every thread that handles requests counts events (connections accepted,
+ * cache hits, ...) and the time requests spend in each Stage into a block
+ * of its own, padded to whole cache lines. Each block has a single writer,
+ * the thread that owns it, so recording is a plain load and store of a
+ * relaxed atomic: no read-modify-write, no lock, no cache line bouncing
+ * between workers. The blocks are only summed when the metrics are read,
+ * by renderMetrics(), which a MetricsServer serves in the Prometheus text
+ * format on an admin port.
+ *
+ * Stage durations go into buckets with fixed bounds, 1 us to 10 s in a
+ * 1-2.5-5 series, which is what the exported histograms report; sums are
+ * kept in nanoseconds.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <thread>
+
+/*
+ * Stage enum
+ *
+ * The stages of handling a request, in order. Requests answered from the
+ * cache, from the document root or with an error skip the upstream stages.
+ */
+enum class Stage : uint8_t {
+    Parse,     // From the first bytes of the request to its complete head.
+    Handle,    // Rewriting the request and looking it up in the cache, or finding its file.
+    Resolve,   // Finding the address of the origin, from the cache or by a lookup.
+    Connect,   // Connecting to the origin.
+    FirstByte, // From the request being sent to the first bytes of the response.
+    Transfer,  // From there to the response being delivered to the client.
+    Total,     // From the first bytes of the request to the end of the response.
+
+    Count
+};
+
+/*
+ * Counter enum
+ *
+ * Events counted by every thread.
+ */
+enum class Counter : uint8_t {
+    ConnectionsAccepted,
+    ConnectionsClosed,
+    Requests,           // Requests parsed completely.
+    ErrorResponses,     // Requests answered with a canned error.
+    CacheHits,          // Requests answered from the response cache.
+    UpstreamConnects,   // New connections to origins.
+    UpstreamReuses,     // Requests sent on a pooled origin connection.
+    UpstreamRetries,    // Requests sent again after a pooled connection failed.
+    StaticResponses,    // Requests answered with a file from the document root.
+    NotModified,        // Requests answered with 304 from the cache or a file's metadata.
+    CacheRevalidations, // Stale cache entries the origin confirmed with 304.
+    CoalescedRequests,  // Cache misses answered from another request's fetch.
+    DiskCacheLoads,     // Cache entries brought back into memory from the disk tier.
+
+    Count
+};
+
+namespace metrics_detail {
+
+// Upper bounds of the stage buckets, in ns; a last bucket takes the rest.
+constexpr uint64_t kBucketBounds[] = {
+    1000,      2500,      5000,      10000,      25000,      50000,      100000,     250000,
+    500000,    1000000,   2500000,   5000000,    10000000,   25000000,   50000000,   100000000,
+    250000000, 500000000, 1000000000, 2500000000, 5000000000, 10000000000,
+};
+constexpr size_t kBuckets = sizeof(kBucketBounds) / sizeof(kBucketBounds[0]) + 1;
+
+struct StageBuckets {
+    std::atomic<uint64_t> counts[kBuckets] = {};
+    std::atomic<uint64_t> sumNs{0};
+};
+
+// The metrics of one thread. Blocks are never freed; a thread that exits
+// gives its block, with its counts, to the next thread to reuse.
+struct alignas(64) ThreadMetrics {
+    std::atomic<uint64_t> counters[static_cast<size_t>(Counter::Count)] = {};
+    StageBuckets stages[static_cast<size_t>(Stage::Count)];
+    std::atomic<bool> inUse{false};
+    ThreadMetrics* next = nullptr;
+};
+
+inline thread_local ThreadMetrics* threadMetrics = nullptr;
+
+ThreadMetrics* attachThread();
+
+inline ThreadMetrics& local() {
+    ThreadMetrics* metrics = threadMetrics;
+    return metrics != nullptr ? *metrics : *attachThread();
+}
+
+// Adds to a value only the calling thread writes.
+inline void add(std::atomic<uint64_t>& value, uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+} // namespace metrics_detail
+
+/*
+ * monotonicNs() function: The clock stage durations are measured with.
+ */
+inline uint64_t monotonicNs() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+}
+
+/*
+ * countEvent() function: Adds `n` to `counter` for the calling thread.
+ */
+inline void countEvent(Counter counter, uint64_t n = 1) {
+    metrics_detail::add(metrics_detail::local().counters[static_cast<size_t>(counter)], n);
+}
+
+/*
+ * recordStage() function: Records that a request spent `ns` in `stage`.
+ */
+inline void recordStage(Stage stage, uint64_t ns) {
+    using namespace metrics_detail;
+    StageBuckets& buckets = local().stages[static_cast<size_t>(stage)];
+    size_t bucket = static_cast<size_t>(std::lower_bound(std::begin(kBucketBounds), std::end(kBucketBounds), ns) -
+                                        std::begin(kBucketBounds));
+    add(buckets.counts[bucket], 1);
+    add(buckets.sumNs, ns);
+}
+
+/*
+ * StageTimer struct
+ *
+ * Times one request through its stages. Each lap() ends the current stage
+ * and starts the next; finish() also records the Total.
+ */
+struct StageTimer {
+    uint64_t start = 0; // When the request began; 0 before begin().
+    uint64_t mark = 0;  // When the current stage began.
+
+    bool running() const { return start != 0; }
+
+    void begin() { start = mark = monotonicNs(); }
+
+    void lap(Stage stage) {
+        uint64_t now = monotonicNs();
+        recordStage(stage, now - mark);
+        mark = now;
+    }
+
+    // Starts the next stage without recording the time since the last lap.
+    void skip() { mark = monotonicNs(); }
+
+    void finish(Stage last) {
+        if (!running()) return;
+        lap(last);
+        recordStage(Stage::Total, mark - start);
+        start = 0;
+    }
+};
+
+/*
+ * renderMetrics() function: The sum of every thread's metrics, in the
+ * Prometheus text exposition format (version 0.0.4).
+ */
+std::string renderMetrics();
+
+/*
+ * MetricsServer class
+ *
+ * Serves renderMetrics() at GET /metrics from a thread of its own, one
+ * connection at a time. Meant for an admin address that only the scraper
+ * can reach.
+ */
+class MetricsServer {
+public:
+    MetricsServer(const std::string& address, uint16_t port);
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    /*
+     * start() method: Listens on the address and port and starts serving.
+     * Returns 0 on success, -1 on failure (with errno set).
+     */
+    int start();
+
+    /*
+     * stop() method: Stops serving and waits for the thread to exit.
+     */
+    void stop();
+
+private:
+    void run();
+
+    // Answers one scrape on `fd` and closes it.
+    void serve(int fd);
+
+    const std::string address;
+    const uint16_t port;
+    int listenFd = -1;
+    int stopFd = -1;
+    std::thread thread;
+};
@@ -0,0 +1,361 @@
+/*
+ * proxy_origin.cpp -- mock origin server for load tests.
+ *
+ * Usage: proxy_origin [-b address] [-p port] [-t threads] [-s bytes] [-a seconds]
+ *
+ *   -b address  IPv4 address to listen on (default 127.0.0.1)
+ *   -p port     port to listen on (default 9000)
+ *   -t threads  threads, each with its own listening socket (default 1)
+ *   -s bytes    size of every response body (default 1024)
+ *   -a seconds  max-age of the responses; by default they must not be
+ *               cached, so that every request reaches the origin
+ *
+ * Answers every request, whatever its method and target, with the same
+ * 200 response, from memory and without any per-request work beyond parsing
+ * the request. Persistent connections and pipelining are supported, so a
+ * load test measures the proxy and not the origin. Request bodies framed by
+ * Content-Length or the chunked coding are read and discarded.
+ *
+ * The server runs until it receives SIGINT or SIGTERM.
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "proxy_parse.hpp"
+#include "proxy_upstream.hpp"
+
+namespace {
+
+constexpr size_t kReadChunk = 16 * 1024;
+constexpr int kMaxEvents = 256;
+
+struct OriginConfig {
+    std::string bindAddress = "127.0.0.1";
+    uint16_t port = 9000;
+    size_t threads = 1;
+    size_t bodyBytes = 1024;
+    long maxAge = -1; // Not cacheable.
+};
+
+std::atomic<bool> stopping{false};
+
+// One client connection: what it sent that has not been answered yet, and
+// what is still to be written back.
+struct Client {
+    int fd;
+    std::string in;
+    std::string out;
+    size_t outSent = 0;
+    RequestParser parser;
+    BodyFramer body;
+    bool inBody = false;
+    bool closeAfter = false; // The last request asked for the connection to close.
+};
+
+int listenSocket(const OriginConfig& config) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.bindAddress.c_str(), &addr.sin_addr) != 1 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        int saved = errno;
+        ::close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+// Whether the client wants the connection closed after this request.
+bool wantsClose(const ParsedRequestView& request) {
+    bool close = request.version == "HTTP/1.0";
+    for (const ParsedHeaderView& header : request.headers) {
+        if (header.id != HeaderId::Connection) continue;
+        if (equalsIgnoreCase(header.value, "close")) close = true;
+        if (equalsIgnoreCase(header.value, "keep-alive")) close = false;
+    }
+    return close;
+}
+
+// Frames the body of `request` as the proxy does; false if it cannot be
+// told where it ends.
+bool frameBody(const ParsedRequestView& request, BodyFramer& body) {
+    body.reset();
+    if (const ParsedHeaderView* coding = request.getHeader(HeaderId::TransferEncoding)) {
+        if (!equalsIgnoreCase(coding->value, "chunked")) return false;
+        body.expectChunked();
+    } else if (const ParsedHeaderView* length = request.getHeader(HeaderId::ContentLength)) {
+        uint64_t n = 0;
+        for (char c : length->value) {
+            if (c < '0' || c > '9') return false;
+            n = n * 10 + static_cast<uint64_t>(c - '0');
+        }
+        body.expectLength(n);
+    }
+    return true;
+}
+
+class OriginThread {
+public:
+    OriginThread(const OriginConfig& c, const std::string& r, const std::string& rc)
+        : config(c), response(r), closingResponse(rc) {}
+
+    ~OriginThread() {
+        for (auto& entry : clients) ::close(entry.first);
+        if (listenFd >= 0) ::close(listenFd);
+        if (epollFd >= 0) ::close(epollFd);
+    }
+
+    int start() {
+        listenFd = listenSocket(config);
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (listenFd < 0 || epollFd < 0) return -1;
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = listenFd;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+    }
+
+    void run() {
+        epoll_event events[kMaxEvents];
+        while (!stopping.load(std::memory_order_relaxed)) {
+            int n = epoll_wait(epollFd, events, kMaxEvents, 100);
+            for (int i = 0; i < n; ++i) {
+                if (events[i].data.fd == listenFd) {
+                    acceptClients();
+                    continue;
+                }
+                auto it = clients.find(events[i].data.fd);
+                if (it == clients.end()) continue;
+                Client& client = *it->second;
+                if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+                    close(client);
+                    continue;
+                }
+                if ((events[i].events & EPOLLOUT) && !flush(client)) continue;
+                if (events[i].events & EPOLLIN) readRequests(client);
+            }
+        }
+    }
+
+private:
+    void acceptClients() {
+        for (;;) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.fd = fd;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                ::close(fd);
+                continue;
+            }
+            auto client = std::make_unique<Client>();
+            client->fd = fd;
+            clients.emplace(fd, std::move(client));
+        }
+    }
+
+    void readRequests(Client& client) {
+        bool eof = false;
+        for (;;) {
+            size_t old_size = client.in.size();
+            client.in.resize(old_size + kReadChunk);
+            ssize_t n = recv(client.fd, &client.in[old_size], kReadChunk, 0);
+            client.in.resize(old_size + (n > 0 ? static_cast<size_t>(n) : 0));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                close(client);
+                return;
+            }
+            if (n <= 0) {
+                eof = n == 0;
+                break;
+            }
+        }
+        if (!answer(client)) return;
+        // A client that stopped sending still gets the answers to what it sent.
+        if (eof) client.closeAfter = true;
+        flush(client);
+    }
+
+    // Answers every complete request in `in`. Returns false if the client
+    // was closed.
+    bool answer(Client& client) {
+        size_t offset = 0;
+        while (offset < client.in.size() && !client.closeAfter) {
+            std::string_view rest = std::string_view(client.in).substr(offset);
+            if (client.inBody) {
+                size_t used;
+                bool done = client.body.feed(rest.data(), rest.size(), used);
+                offset += used;
+                if (!done) break;
+                client.inBody = false;
+                continue;
+            }
+
+            ParsedRequestView request;
+            ParseStatus status = client.parser.feed(rest, request);
+            if (status == ParseStatus::NeedMore) break;
+            if (status == ParseStatus::Error || !frameBody(request, client.body)) {
+                close(client);
+                return false;
+            }
+            offset += client.parser.consumed();
+            client.parser.reset();
+            client.closeAfter = wantsClose(request);
+            client.out += client.closeAfter ? closingResponse : response;
+            client.inBody = !client.body.done();
+        }
+        // The parser only remembers offsets into what is left.
+        if (offset > 0) client.in.erase(0, offset);
+        return true;
+    }
+
+    // Writes what is pending. Returns false if the client was closed.
+    bool flush(Client& client) {
+        while (client.outSent < client.out.size()) {
+            ssize_t n = send(client.fd, client.out.data() + client.outSent, client.out.size() - client.outSent,
+                             MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    watch(client, EPOLLIN | EPOLLOUT);
+                    return true;
+                }
+                close(client);
+                return false;
+            }
+            client.outSent += static_cast<size_t>(n);
+        }
+        client.out.clear();
+        client.outSent = 0;
+        if (client.closeAfter) {
+            close(client);
+            return false;
+        }
+        watch(client, EPOLLIN);
+        return true;
+    }
+
+    void watch(Client& client, uint32_t events) {
+        epoll_event ev{};
+        ev.events = events | EPOLLRDHUP;
+        ev.data.fd = client.fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, client.fd, &ev);
+    }
+
+    void close(Client& client) {
+        int fd = client.fd;
+        ::close(fd);
+        clients.erase(fd);
+    }
+
+    const OriginConfig& config;
+    const std::string& response;
+    const std::string& closingResponse;
+    int listenFd = -1;
+    int epollFd = -1;
+    std::unordered_map<int, std::unique_ptr<Client>> clients;
+};
+
+void stop(int) {
+    stopping.store(true);
+}
+
+void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-b address] [-p port] [-t threads] [-s bytes] [-a seconds]\n", argv0);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    OriginConfig config;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:t:s:a:")) != -1) {
+        switch (opt) {
+        case 'b':
+            config.bindAddress = optarg;
+            break;
+        case 'p': {
+            long port = strtol(optarg, nullptr, 10);
+            if (port <= 0 || port > 65535) {
+                usage(argv[0]);
+                return 1;
+            }
+            config.port = static_cast<uint16_t>(port);
+            break;
+        }
+        case 't':
+            config.threads = std::max<size_t>(1, strtoul(optarg, nullptr, 10));
+            break;
+        case 's':
+            config.bodyBytes = strtoul(optarg, nullptr, 10);
+            break;
+        case 'a':
+            config.maxAge = strtol(optarg, nullptr, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::string head = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: " +
+                       std::to_string(config.bodyBytes) + "\r\nCache-Control: " +
+                       (config.maxAge >= 0 ? "max-age=" + std::to_string(config.maxAge) : std::string("no-store")) +
+                       "\r\n";
+    std::string body(config.bodyBytes, 'x');
+    std::string response = head + "\r\n" + body;
+    std::string closing_response = head + "Connection: close\r\n\r\n" + body;
+
+    struct sigaction action{};
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::unique_ptr<OriginThread>> origins;
+    for (size_t i = 0; i < config.threads; ++i) {
+        origins.push_back(std::make_unique<OriginThread>(config, response, closing_response));
+        if (origins.back()->start() < 0) {
+            fprintf(stderr, "failed to listen on %s:%u: %s\n", config.bindAddress.c_str(),
+                    static_cast<unsigned>(config.port), strerror(errno));
+            return 1;
+        }
+    }
+    fprintf(stderr, "origin listening on %s:%u with %zu threads, %zu-byte bodies\n", config.bindAddress.c_str(),
+            static_cast<unsigned>(config.port), config.threads, config.bodyBytes);
+
+    std::vector<std::thread> threads;
+    for (auto& origin : origins) threads.emplace_back([&origin] { origin->run(); });
+    for (std::thread& thread : threads) thread.join();
+    return 0;
+}
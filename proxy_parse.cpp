@@ -0,0 +1,879 @@
+/*
+ * proxy_parse.cpp -- a HTTP Request Parsing Library.
+ *
+ * Implementation of the classes declared in proxy_parse.hpp.
+ *
+ * Parsing is done by HeadParser, an incremental state machine that skips
+ * to the next delimiter with the kernels from proxy_scan.hpp. RequestParser
+ * and ResponseParser run it and fill a ParsedRequestView or a
+ * ParsedResponseView with std::string_view slices of the caller's buffer.
+ * ParsedRequestView::parse() feeds it a complete buffer in one go, and
+ * ParsedRequest::parse() runs the view parser and then materializes the
+ * result into owning std::strings, so there is a single parsing code path for
+ * all three entry points.
+ *
+ * The request classes are templates over their limits policy. Their members
+ * are defined here and instantiated at the end of the file for the policies
+ * in use.
+ */
+
+#include "proxy_parse.hpp"
+#include "proxy_scan.hpp"
+#include "proxy_trace.hpp"
+#include "proxy_uri.hpp"
+
+namespace {
+
+// Characters that may surround a header value and are not part of it.
+bool isBlank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Removes leading and trailing blanks from `s`.
+std::string_view trimBlanks(std::string_view s) {
+    while (!s.empty() && isBlank(s.front())) s.remove_prefix(1);
+    while (!s.empty() && isBlank(s.back())) s.remove_suffix(1);
+    return s;
+}
+
+// Bytes one header contributes to the header block: its original line if it
+// is unmodified, "<key>: <value>\r\n" otherwise.
+size_t headerLineLen(const ParsedHeader& header) {
+    if (!header.isDirty()) return header.rawLen;
+    return header.key.size() + 2 + header.value.size() + 2;
+}
+
+// True if the line recorded for `header` in `buf` still holds its key and
+// value, i.e. it can be forwarded verbatim.
+bool rawLineMatches(const ParsedHeader& header, std::string_view buf) {
+    if (header.rawOffset > buf.size() || header.rawLen > buf.size() - header.rawOffset ||
+        header.rawLen < header.key.size() + 3) {
+        return false;
+    }
+    std::string_view line = buf.substr(header.rawOffset, header.rawLen - 2);
+    return line.substr(0, header.key.size()) == header.key && line[header.key.size()] == ':' &&
+           trimBlanks(line.substr(header.key.size() + 1)) == header.value;
+}
+
+// Separators referenced by ParsedRequest::unparseTo().
+const char kSpace[] = " ";
+const char kSchemeSeparator[] = "://";
+const char kColon[] = ":";
+const char kHeaderSeparator[] = ": ";
+const char kCrlf[] = "\r\n";
+
+// Points `iov` at `s`.
+void setIovec(struct iovec& iov, std::string_view s) {
+    iov.iov_base = const_cast<char*>(s.data());
+    iov.iov_len = s.size();
+}
+
+// The request line and unparseTo() logic below is shared by ParsedRequest
+// and ParsedRequestView, which have the same field names. They differ only in
+// where an unmodified header's original line lives.
+std::string_view rawLine(const ParsedRequest& request, const ParsedHeader& header) {
+    return std::string_view(request.buf).substr(header.rawOffset, header.rawLen);
+}
+
+template <class Limits>
+std::string_view rawLine(const BasicParsedRequestView<Limits>&, const ParsedHeaderView& header) {
+    return header.line;
+}
+
+// Length of "<method> <target> <version>\r\n".
+template <class Request>
+size_t requestLineLength(const Request& r) {
+    size_t len = r.method.size() + 1 + r.path.size() + 1 + r.version.size() + 2;
+    if (!r.host.empty() && !r.originForm) {
+        len += r.protocol.size() + 3 + r.host.size();
+        if (!r.port.empty()) len += 1 + r.port.size();
+    }
+    return len;
+}
+
+template <class Request>
+size_t countIovecs(const Request& r) {
+    // method SP [protocol "://" host [":" port]] path SP version CRLF, one
+    // entry per unmodified header and four per regenerated one, and the
+    // final CRLF.
+    size_t count = 6;
+    if (!r.host.empty() && !r.originForm) count += r.port.empty() ? 3 : 5;
+    for (const auto& header : r.headers) count += header.isDirty() ? 4 : 1;
+    return count + 1;
+}
+
+template <class Request>
+int fillIovecs(const Request& r, struct iovec* iov, size_t iovcnt) {
+    if (iovcnt < countIovecs(r)) return -1;
+
+    size_t n = 0;
+    setIovec(iov[n++], r.method);
+    setIovec(iov[n++], kSpace);
+    if (!r.host.empty() && !r.originForm) {
+        setIovec(iov[n++], r.protocol);
+        setIovec(iov[n++], kSchemeSeparator);
+        setIovec(iov[n++], r.host);
+        if (!r.port.empty()) {
+            setIovec(iov[n++], kColon);
+            setIovec(iov[n++], r.port);
+        }
+    }
+    setIovec(iov[n++], r.path);
+    setIovec(iov[n++], kSpace);
+    setIovec(iov[n++], r.version);
+    setIovec(iov[n++], kCrlf);
+
+    // End of the last entry holding original header lines, so that
+    // unmodified headers which follow each other in the original buffer
+    // share one entry.
+    const char* raw_end = nullptr;
+    for (const auto& header : r.headers) {
+        if (header.isDirty()) {
+            setIovec(iov[n++], header.key);
+            setIovec(iov[n++], kHeaderSeparator);
+            setIovec(iov[n++], header.value);
+            setIovec(iov[n++], kCrlf);
+            raw_end = nullptr;
+            continue;
+        }
+        std::string_view raw = rawLine(r, header);
+        if (raw.data() == raw_end) {
+            iov[n - 1].iov_len += raw.size();
+        } else {
+            setIovec(iov[n++], raw);
+        }
+        raw_end = raw.data() + raw.size();
+    }
+    setIovec(iov[n++], kCrlf);
+    return static_cast<int>(n);
+}
+
+// True if `header` is named `key`, whose classification is `id`. Well-known
+// names are matched by id alone; other names by case-insensitive comparison.
+template <class Header>
+bool sameName(const Header& header, HeaderId id, std::string_view key) {
+    if (id != HeaderId::Unknown) return header.id == id;
+    return header.id == HeaderId::Unknown && equalsIgnoreCase(header.key, key);
+}
+
+// Adds views of the first `count` header lines recorded in `spans` to
+// `headers`.
+template <class Headers, class Spans>
+void addHeaderViews(Headers& headers, std::string_view received, const Spans& spans, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        const auto& span = spans[i];
+        headers.emplace_back(
+            received.substr(span.start, span.colon - span.start),
+            trimBlanks(received.substr(span.colon + 1, span.end - span.colon - 1)),
+            received.substr(span.start, span.end + 2 - span.start));
+    }
+}
+
+} // namespace
+
+/*
+ * ParsedRequestView
+ */
+
+template <class Limits>
+void BasicParsedRequestView<Limits>::clear() {
+    method = protocol = host = port = path = version = buf = std::string_view();
+    methodId = HttpMethod::Other;
+    headers.clear();
+    originForm = false;
+}
+
+template <class Limits>
+int BasicParsedRequestView<Limits>::parse(std::string_view buffer) {
+    clear();
+
+    if (buffer.size() < 4) {
+        TRACE("invalid buffer length %zu", buffer.size());
+        return -1;
+    }
+
+    // A complete buffer is just the case of an incremental parse that is
+    // fed everything at once.
+    BasicRequestParser<Limits> parser;
+    ParseStatus status = parser.feed(buffer, *this);
+    if (status == ParseStatus::NeedMore) {
+        TRACE("failed to find the end of the header block");
+    }
+    return status == ParseStatus::Done ? 0 : -1;
+}
+
+template <class Limits>
+int BasicParsedRequestView<Limits>::parseTarget(std::string_view target) {
+    if (method.empty() || target.empty()) {
+        TRACE("empty method or request target");
+        return -1;
+    }
+    if (version.substr(0, 5) != "HTTP/") {
+        TRACE("invalid HTTP version: %s", version);
+        return -1;
+    }
+
+    // The asterisk form names the server rather than a resource on it, and
+    // only OPTIONS may use it.
+    if (target == "*" && methodId == HttpMethod::Options) {
+        path = target;
+        return 0;
+    }
+
+    UriParts parts;
+    if (parseUri(target, parts) != 0) {
+        TRACE("invalid request target: %s", target);
+        return -1;
+    }
+    protocol = parts.scheme.in(target);
+    host = parts.host.in(target);
+    port = parts.port.in(target);
+    // An absolute-form target without a path is for the root document.
+    path = parts.path.empty() ? std::string_view("/") : parts.path.in(target);
+    return 0;
+}
+
+template <class Limits>
+const ParsedHeaderView* BasicParsedRequestView<Limits>::getHeader(std::string_view key) const {
+    for (const ParsedHeaderView& header : headers) {
+        if (equalsIgnoreCase(header.key, key)) return &header;
+    }
+    return nullptr;
+}
+
+template <class Limits>
+const ParsedHeaderView* BasicParsedRequestView<Limits>::getHeader(HeaderId id) const {
+    if (id == HeaderId::Unknown) return nullptr;
+    for (const ParsedHeaderView& header : headers) {
+        if (header.id == id) return &header;
+    }
+    return nullptr;
+}
+
+template <class Limits>
+int BasicParsedRequestView<Limits>::setHeader(std::string_view key, std::string_view value) {
+    if (key.empty()) return -1;
+
+    HeaderId id = classifyHeader(key);
+    auto it = headers.begin();
+    while (it != headers.end() && !sameName(*it, id, key)) ++it;
+    if (it == headers.end()) {
+        headers.emplace_back(key, value);
+        return 0;
+    }
+
+    it->value = value;
+    it->line = std::string_view();
+    for (auto dup = it + 1; dup != headers.end();) {
+        if (sameName(*dup, id, key)) {
+            dup = headers.erase(dup);
+        } else {
+            ++dup;
+        }
+    }
+    return 0;
+}
+
+template <class Limits>
+int BasicParsedRequestView<Limits>::addHeader(std::string_view key, std::string_view value) {
+    if (key.empty()) return -1;
+    headers.emplace_back(key, value);
+    return 0;
+}
+
+template <class Limits>
+int BasicParsedRequestView<Limits>::removeHeader(std::string_view key) {
+    HeaderId id = classifyHeader(key);
+    size_t before = headers.size();
+    for (auto it = headers.begin(); it != headers.end();) {
+        if (sameName(*it, id, key)) {
+            it = headers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return headers.size() < before ? 0 : -1;
+}
+
+template <class Limits>
+int BasicParsedRequestView<Limits>::unparseTo(struct iovec* iov, size_t iovcnt) const {
+    return fillIovecs(*this, iov, iovcnt);
+}
+
+template <class Limits>
+size_t BasicParsedRequestView<Limits>::iovecCount() const {
+    return countIovecs(*this);
+}
+
+template <class Limits>
+size_t BasicParsedRequestView<Limits>::totalLen() const {
+    size_t len = requestLineLength(*this) + 2;
+    for (const ParsedHeaderView& header : headers) {
+        len += header.isDirty() ? header.key.size() + 2 + header.value.size() + 2
+                                : header.line.size();
+    }
+    return len;
+}
+
+template <class Limits>
+void BasicParsedRequestView<Limits>::rebase(const char* base) {
+    const char* old_begin = buf.data();
+    const char* old_end = old_begin + buf.size();
+    auto move = [&](std::string_view& field) {
+        if (field.data() >= old_begin && field.data() < old_end) {
+            field = std::string_view(base + (field.data() - old_begin), field.size());
+        }
+    };
+    move(method);
+    move(protocol);
+    move(host);
+    move(port);
+    move(path);
+    move(version);
+    for (ParsedHeaderView& header : headers) {
+        move(header.key);
+        move(header.value);
+        move(header.line);
+    }
+    buf = std::string_view(base, buf.size());
+}
+
+template <class Limits>
+int BasicParsedRequestView<Limits>::materialize(ParsedRequest& out) const {
+    out.reset();
+    out.method.assign(method);
+    out.protocol.assign(protocol);
+    out.host.assign(host);
+    out.port.assign(port);
+    out.path.assign(path);
+    out.version.assign(version);
+    out.buf.assign(buf);
+    out.originForm = originForm;
+
+    out.headers.reserve(headers.size());
+    for (const ParsedHeaderView& header : headers) {
+        ParsedHeader& copy = out.appendHeader(header.key, header.value, header.id);
+        if (!header.isDirty()) {
+            copy.rawOffset = static_cast<size_t>(header.line.data() - buf.data());
+            copy.rawLen = header.line.size();
+        }
+    }
+    out.reindexHeaders();
+    return 0;
+}
+
+/*
+ * HeadParser
+ */
+
+template <class Limits>
+HeadParser<Limits>::HeadParser(StartLine k) : kind(k) {
+    reset();
+}
+
+template <class Limits>
+void HeadParser<Limits>::reset() {
+    state = kind == StartLine::Request ? State::Method : State::StatusVersion;
+    // Every error that does not name another reason is a syntax error.
+    reason = ParseError::Malformed;
+    pos = sp1 = sp2 = lineEnd = 0;
+    spanCount = 0;
+}
+
+template <class Limits>
+ParseStatus HeadParser<Limits>::scan(std::string_view received) {
+    if (received.size() <= Limits::kMaxHeadBytes) return advance(received);
+
+    // A head still incomplete within the limit is too large, however it
+    // would have continued.
+    ParseStatus status = advance(received.substr(0, Limits::kMaxHeadBytes));
+    if (status == ParseStatus::NeedMore) {
+        TRACE("head larger than %zu bytes", Limits::kMaxHeadBytes);
+        fail(ParseError::HeadTooLarge);
+        return ParseStatus::Error;
+    }
+    return status;
+}
+
+template <class Limits>
+ParseStatus HeadParser<Limits>::advance(std::string_view received) {
+    const char* data = received.data();
+    const size_t len = received.size();
+
+    // States that wait for a delimiter skip ahead with the vectorized
+    // scanners and then look at the byte they stopped on; every other state
+    // consumes exactly one byte. Either way `pos` ends up on the next byte
+    // that has not been examined yet.
+    while (pos < len) {
+        switch (state) {
+        case State::Method:
+            pos += scanTokenChars(data + pos, len - pos);
+            if (pos == len) return ParseStatus::NeedMore;
+            if (data[pos] != ' ') {
+                TRACE("invalid character in method");
+                state = State::Error;
+                break;
+            }
+            sp1 = pos;
+            state = State::Target;
+            break;
+
+        case State::Target:
+            pos += scanForAny(data + pos, len - pos, ' ', '\r', '\n');
+            if (pos == len) return ParseStatus::NeedMore;
+            if (data[pos] != ' ') {
+                TRACE("request line has no version");
+                state = State::Error;
+                break;
+            }
+            sp2 = pos;
+            state = State::Version;
+            break;
+
+        case State::Version:
+            pos += scanForAny(data + pos, len - pos, '\r', ' ', '\n');
+            if (pos == len) return ParseStatus::NeedMore;
+            if (data[pos] != '\r') {
+                TRACE("malformed request line");
+                state = State::Error;
+                break;
+            }
+            lineEnd = pos;
+            state = State::StartLineLF;
+            break;
+
+        case State::StatusVersion:
+            pos += scanForAny(data + pos, len - pos, ' ', '\r', '\n');
+            if (pos == len) return ParseStatus::NeedMore;
+            if (data[pos] != ' ') {
+                TRACE("status line has no status code");
+                state = State::Error;
+                break;
+            }
+            sp1 = pos;
+            state = State::StatusCode;
+            break;
+
+        case State::StatusCode:
+            pos += scanForAny(data + pos, len - pos, ' ', '\r', '\n');
+            if (pos == len) return ParseStatus::NeedMore;
+            if (data[pos] == ' ') {
+                sp2 = pos;
+                state = State::Reason;
+            } else if (data[pos] == '\r') {
+                // No reason phrase, and not even the SP before it.
+                sp2 = lineEnd = pos;
+                state = State::StartLineLF;
+            } else {
+                TRACE("malformed status line");
+                state = State::Error;
+            }
+            break;
+
+        case State::Reason:
+            pos += scanForAny(data + pos, len - pos, '\r', '\n');
+            if (pos == len) return ParseStatus::NeedMore;
+            if (data[pos] != '\r') {
+                TRACE("malformed status line");
+                state = State::Error;
+                break;
+            }
+            lineEnd = pos;
+            state = State::StartLineLF;
+            break;
+
+        case State::StartLineLF:
+        case State::HeaderLF:
+            if (data[pos] != '\n') {
+                TRACE("CR not followed by LF");
+                state = State::Error;
+                break;
+            }
+            if (state == State::HeaderLF) ++spanCount;
+            state = State::HeaderStart;
+            break;
+
+        case State::HeaderStart:
+            if (data[pos] == '\r') {
+                state = State::FinalLF;
+            } else if (!isTokenChar(data[pos])) {
+                TRACE("malformed header line");
+                state = State::Error;
+            } else if (spanCount == spans.size()) {
+                TRACE("too many headers (limit %zu)", spans.size());
+                fail(ParseError::TooManyHeaders);
+            } else {
+                spans[spanCount].start = pos;
+                state = State::HeaderName;
+            }
+            break;
+
+        case State::HeaderName:
+            pos += scanTokenChars(data + pos, len - pos);
+            if (pos == len) return ParseStatus::NeedMore;
+            if (data[pos] != ':') {
+                TRACE("invalid character in header name");
+                state = State::Error;
+                break;
+            }
+            spans[spanCount].colon = pos;
+            state = State::HeaderValue;
+            break;
+
+        case State::HeaderValue:
+            pos += scanForAny(data + pos, len - pos, '\r', '\n');
+            if (pos == len) return ParseStatus::NeedMore;
+            if (data[pos] != '\r') {
+                TRACE("LF not preceded by CR");
+                state = State::Error;
+                break;
+            }
+            spans[spanCount].end = pos;
+            state = State::HeaderLF;
+            break;
+
+        case State::FinalLF:
+            if (data[pos] != '\n') {
+                TRACE("CR not followed by LF");
+                state = State::Error;
+                break;
+            }
+            ++pos;
+            state = State::Done;
+            return ParseStatus::Done;
+
+        case State::Done:
+            return ParseStatus::Done;
+
+        case State::Error:
+            return ParseStatus::Error;
+        }
+
+        if (state == State::Error) return ParseStatus::Error;
+        ++pos;
+    }
+
+    if (state == State::Done) return ParseStatus::Done;
+    if (state == State::Error) return ParseStatus::Error;
+    return ParseStatus::NeedMore;
+}
+
+/*
+ * RequestParser
+ */
+
+template <class Limits>
+BasicRequestParser<Limits>::BasicRequestParser() : head(HeadParser<Limits>::StartLine::Request) {}
+
+template <class Limits>
+ParseStatus BasicRequestParser<Limits>::feed(std::string_view received, BasicParsedRequestView<Limits>& out) {
+    // The view is built once, when the head is first found to be complete.
+    if (head.state == HeadParser<Limits>::State::Done) return ParseStatus::Done;
+    ParseStatus status = head.scan(received);
+    return status == ParseStatus::Done ? finish(received, out) : status;
+}
+
+template <class Limits>
+ParseStatus BasicRequestParser<Limits>::finish(std::string_view received, BasicParsedRequestView<Limits>& out) {
+    out.clear();
+    std::string_view method = received.substr(0, head.sp1);
+    std::string_view target = received.substr(head.sp1 + 1, head.sp2 - head.sp1 - 1);
+    HttpMethod method_id = classifyMethod(method);
+    if (!Limits::kMethods.contains(method_id)) {
+        TRACE("method not accepted: %s", method);
+        head.fail(ParseError::MethodNotAllowed);
+        return ParseStatus::Error;
+    }
+    if (target.size() > Limits::kMaxTargetLength) {
+        TRACE("request target longer than %zu bytes", Limits::kMaxTargetLength);
+        head.fail(ParseError::TargetTooLong);
+        return ParseStatus::Error;
+    }
+
+    out.buf = received.substr(0, head.pos);
+    out.method = method;
+    out.methodId = method_id;
+    out.version = received.substr(head.sp2 + 1, head.lineEnd - head.sp2 - 1);
+    if (out.parseTarget(target) < 0) {
+        out.clear();
+        head.fail(ParseError::Malformed);
+        return ParseStatus::Error;
+    }
+    addHeaderViews(out.headers, received, head.spans, head.spanCount);
+    return ParseStatus::Done;
+}
+
+/*
+ * ParsedResponseView
+ */
+
+void ParsedResponseView::clear() {
+    version = reason = buf = std::string_view();
+    status = 0;
+    headers.clear();
+}
+
+int ParsedResponseView::parse(std::string_view buffer) {
+    clear();
+    ResponseParser parser;
+    ParseStatus status = parser.feed(buffer, *this);
+    if (status == ParseStatus::NeedMore) {
+        TRACE("failed to find the end of the header block");
+    }
+    return status == ParseStatus::Done ? 0 : -1;
+}
+
+const ParsedHeaderView* ParsedResponseView::getHeader(std::string_view key) const {
+    for (const ParsedHeaderView& header : headers) {
+        if (equalsIgnoreCase(header.key, key)) return &header;
+    }
+    return nullptr;
+}
+
+const ParsedHeaderView* ParsedResponseView::getHeader(HeaderId id) const {
+    if (id == HeaderId::Unknown) return nullptr;
+    for (const ParsedHeaderView& header : headers) {
+        if (header.id == id) return &header;
+    }
+    return nullptr;
+}
+
+/*
+ * ResponseParser
+ */
+
+ResponseParser::ResponseParser() : head(HeadParser<DefaultResponseLimits>::StartLine::Response) {}
+
+ParseStatus ResponseParser::feed(std::string_view received, ParsedResponseView& out) {
+    if (head.state == HeadParser<DefaultResponseLimits>::State::Done) return ParseStatus::Done;
+    ParseStatus status = head.scan(received);
+    return status == ParseStatus::Done ? finish(received, out) : status;
+}
+
+ParseStatus ResponseParser::finish(std::string_view received, ParsedResponseView& out) {
+    out.clear();
+    std::string_view version = received.substr(0, head.sp1);
+    std::string_view code = received.substr(head.sp1 + 1, head.sp2 - head.sp1 - 1);
+    bool valid = version.substr(0, 5) == "HTTP/" && code.size() == 3 && code[0] >= '1' && code[0] <= '9';
+    int status = 0;
+    for (char c : code) {
+        if (c < '0' || c > '9') valid = false;
+        status = status * 10 + (c - '0');
+    }
+    if (!valid) {
+        TRACE("invalid status line: %s", received.substr(0, head.lineEnd));
+        head.fail(ParseError::Malformed);
+        return ParseStatus::Error;
+    }
+
+    out.buf = received.substr(0, head.pos);
+    out.version = version;
+    out.status = status;
+    if (head.sp2 < head.lineEnd) out.reason = received.substr(head.sp2 + 1, head.lineEnd - head.sp2 - 1);
+    addHeaderViews(out.headers, received, head.spans, head.spanCount);
+    return ParseStatus::Done;
+}
+
+/*
+ * ParsedRequest
+ */
+
+ParsedRequest::ParsedRequest() : headersLength(2) {
+    hotHeaders.fill(kNoHeader);
+}
+
+ParsedRequest::~ParsedRequest() = default;
+
+int ParsedRequest::parse(const std::string& buffer) {
+    ParsedRequestView view;
+    if (view.parse(buffer) < 0) return -1;
+    return view.materialize(*this);
+}
+
+size_t ParsedRequest::requestLineLen() const {
+    return requestLineLength(*this);
+}
+
+void ParsedRequest::appendRequestLine(std::string& out) const {
+    out.append(method).append(" ");
+    if (!host.empty() && !originForm) {
+        out.append(protocol).append("://").append(host);
+        if (!port.empty()) out.append(":").append(port);
+    }
+    out.append(path).append(" ").append(version).append("\r\n");
+}
+
+std::string ParsedRequest::unparse() const {
+    std::string out;
+    out.reserve(totalLen());
+    appendRequestLine(out);
+    appendHeaders(out);
+    return out;
+}
+
+std::string ParsedRequest::unparseHeaders() const {
+    std::string out;
+    out.reserve(headersLen());
+    appendHeaders(out);
+    return out;
+}
+
+void ParsedRequest::appendHeaders(std::string& out) const {
+    for (const ParsedHeader& header : headers) {
+        if (header.isDirty()) {
+            out.append(header.key).append(": ").append(header.value).append("\r\n");
+        } else {
+            out.append(buf, header.rawOffset, header.rawLen);
+        }
+    }
+    out.append("\r\n");
+}
+
+int ParsedRequest::unparseTo(struct iovec* iov, size_t iovcnt) const {
+    return fillIovecs(*this, iov, iovcnt);
+}
+
+size_t ParsedRequest::iovecCount() const {
+    return countIovecs(*this);
+}
+
+size_t ParsedRequest::totalLen() const {
+    return requestLineLen() + headersLength;
+}
+
+int ParsedRequest::setHeader(std::string_view key, std::string_view value) {
+    if (key.empty()) return -1;
+
+    HeaderId id = classifyHeader(key);
+    auto it = headers.begin();
+    while (it != headers.end() && !sameName(*it, id, key)) ++it;
+    if (it == headers.end()) {
+        appendHeader(key, value, id);
+        reindexHeaders();
+        return 0;
+    }
+
+    headersLength -= headerLineLen(*it);
+    it->value = value;
+    it->rawLen = 0;
+    headersLength += headerLineLen(*it);
+    bool removed = false;
+    for (auto dup = it + 1; dup != headers.end();) {
+        if (sameName(*dup, id, key)) {
+            dup = headers.erase(dup);
+            removed = true;
+        } else {
+            ++dup;
+        }
+    }
+    if (removed) reindexHeaders();
+    return 0;
+}
+
+int ParsedRequest::addHeader(std::string_view key, std::string_view value) {
+    if (key.empty()) return -1;
+    appendHeader(key, value, classifyHeader(key));
+    if (isHotHeader(headers.back().id)) {
+        reindexHeaders();
+    } else {
+        headersLength += headerLineLen(headers.back());
+    }
+    return 0;
+}
+
+ParsedHeader* ParsedRequest::getHeader(std::string_view key) {
+    HeaderId id = classifyHeader(key);
+    if (id != HeaderId::Unknown) return getHeader(id);
+    for (ParsedHeader& header : headers) {
+        if (sameName(header, id, key)) return &header;
+    }
+    return nullptr;
+}
+
+const ParsedHeader* ParsedRequest::getHeader(std::string_view key) const {
+    return const_cast<ParsedRequest*>(this)->getHeader(key);
+}
+
+ParsedHeader* ParsedRequest::getHeader(HeaderId id) {
+    if (id == HeaderId::Unknown) return nullptr;
+    if (isHotHeader(id)) {
+        size_t index = hotHeaders[static_cast<size_t>(id) - 1];
+        return index == kNoHeader ? nullptr : &headers[index];
+    }
+    for (ParsedHeader& header : headers) {
+        if (header.id == id) return &header;
+    }
+    return nullptr;
+}
+
+const ParsedHeader* ParsedRequest::getHeader(HeaderId id) const {
+    return const_cast<ParsedRequest*>(this)->getHeader(id);
+}
+
+int ParsedRequest::removeHeader(std::string_view key) {
+    HeaderId id = classifyHeader(key);
+    size_t before = headers.size();
+    for (auto it = headers.begin(); it != headers.end();) {
+        if (sameName(*it, id, key)) {
+            it = headers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (headers.size() == before) return -1;
+    reindexHeaders();
+    return 0;
+}
+
+void ParsedRequest::reindexHeaders() {
+    hotHeaders.fill(kNoHeader);
+    // The header block ends with "\r\n".
+    headersLength = 2;
+    // Walk backwards so that the first occurrence of a repeated header wins.
+    for (size_t i = headers.size(); i-- > 0;) {
+        ParsedHeader& header = headers[i];
+        if (!header.isDirty() && !rawLineMatches(header, buf)) header.rawLen = 0;
+        if (isHotHeader(header.id)) hotHeaders[static_cast<size_t>(header.id) - 1] = i;
+        headersLength += headerLineLen(header);
+    }
+}
+
+void ParsedRequest::reset() {
+    method.clear();
+    protocol.clear();
+    host.clear();
+    port.clear();
+    path.clear();
+    version.clear();
+    buf.clear();
+    originForm = false;
+
+    recycled.reserve(recycled.size() + headers.size());
+    for (ParsedHeader& header : headers) recycled.push_back(std::move(header));
+    headers.clear();
+    hotHeaders.fill(kNoHeader);
+    headersLength = 2;
+}
+
+ParsedHeader& ParsedRequest::appendHeader(std::string_view key, std::string_view value, HeaderId id) {
+    if (recycled.empty()) {
+        return headers.emplace_back(std::string(key), std::string(value), id);
+    }
+    ParsedHeader& header = headers.emplace_back(std::move(recycled.back()));
+    recycled.pop_back();
+    header.key.assign(key);
+    header.value.assign(value);
+    header.id = id;
+    header.rawOffset = 0;
+    header.rawLen = 0;
+    return header;
+}
+
+/*
+ * Instantiations for the limits policies in use
+ */
+
+template class HeadParser<DefaultRequestLimits>;
+template class HeadParser<DefaultResponseLimits>;
+template class BasicParsedRequestView<DefaultRequestLimits>;
+template class BasicRequestParser<DefaultRequestLimits>;
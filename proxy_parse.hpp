@@ -31,11 +31,21 @@
 #include <vector>
 
 // Line 5: #include <unordered_map>
-// Provides the `std::unordered_map` template class, a hash table implementation.
-// This is an excellent choice for storing HTTP headers (key-value pairs)
-// as it allows for very efficient (average O(1) time complexity) lookup, insertion,
-// and deletion of elements by key. This replaces the C-style linked list for headers.
-#include <unordered_map>
+// Headers used to live in a `std::unordered_map`. They are now stored in the
+// flat, order-preserving SmallVector from proxy_headers.hpp, which keeps the
+// ~10 headers of a typical request in one contiguous inline block, preserves
+// wire order and allows repeated headers.
+#include "proxy_headers.hpp"
+
+// Provides HeaderId and classifyHeader(): every header is tagged with the id
+// of its well-known name once, so hot-path lookups compare one byte instead
+// of a string.
+#include "proxy_header_ids.hpp"
+
+// Provides HttpMethod, classifyMethod() and MethodSet: the method of a request
+// is classified as it is parsed, and the parser limits name the methods they
+// accept.
+#include "proxy_methods.hpp"
 
 // Line 6: #include <stdexcept>
 // Provides standard exception classes like `std::runtime_error`, `std::logic_error`, etc.
@@ -60,41 +70,23 @@
 // for parsing text-based protocols like HTTP.
 #include <cctype>
 
-// Line 10: // #include <cstdarg>
-// This line is commented out. It would provide C-style variable argument handling
-// (like `va_list`, `va_start`). While still usable in C++, modern C++ often prefers
-// templates or function overloads for type-safe variadic functions.
-// Only uncomment if your `debug` function's implementation specifically requires it.
-
-// Line 11: #ifndef NDEBUG
-// This preprocessor directive checks if the macro `NDEBUG` is *not* defined.
-// `NDEBUG` (No DEBUG) is a standard macro often defined by build systems
-// in "release" configurations to disable debugging features (like `assert`).
-#ifndef NDEBUG
-
-// Line 12: #define DEBUG_ENABLED 1
-// If `NDEBUG` is not defined (meaning it's likely a "debug" build), then
-// `DEBUG_ENABLED` is defined as `1`, indicating that debugging code should be active.
-#define DEBUG_ENABLED 1
-
-// Line 13: #else
-// If `NDEBUG` *is* defined (meaning it's likely a "release" build),
-// the code block below `#else` will be processed.
-#else
-
-// Line 14: #define DEBUG_ENABLED 0
-// `DEBUG_ENABLED` is defined as `0`, indicating that debugging code should be inactive
-// and optimized out by the compiler.
-#define DEBUG_ENABLED 0
-
-// Line 15: #endif
-// Ends the `#ifndef NDEBUG` preprocessor block.
-#endif
+// Provides `std::string_view`, a non-owning (pointer, length) reference into
+// someone else's character buffer. Used by the zero-copy ParsedRequestView so
+// that parsing a request does not copy any bytes out of the receive buffer.
+#include <string_view>
+
+// Provides `std::array`, a fixed-size array with no heap allocation. Holds the
+// header offsets recorded by RequestParser.
+#include <array>
+
+// Provides `struct iovec`, the (pointer, length) pair taken by writev(). Used
+// by ParsedRequest::unparseTo() to serialize a request without copying it.
+#include <sys/uio.h>
 
 // Line 16: // Forward declaration of ParsedHeader class.
 // This tells the compiler that `ParsedHeader` is a class, allowing `ParsedRequest`
 // to declare pointers or references to it before `ParsedHeader`'s full definition.
-// However, for `std::unordered_map<std::string, ParsedHeader>`, the full
+// However, for `SmallVector<ParsedHeader, N>`, which stores headers inline, the full
 // definition of ParsedHeader is required BEFORE ParsedRequest is defined.
 // So, the order of class definitions below is crucial.
 // class ParsedHeader; // Not strictly needed here if ParsedHeader is defined first.
@@ -118,24 +110,47 @@ public:
     // Stores the header's value (e.g., "text/html"). `std::string` handles memory.
     std::string value;
 
+    // Well-known name of `key` (HeaderId::Unknown for any other name). Set by
+    // the constructors; assign it again if `key` is changed in place.
+    HeaderId id = HeaderId::Unknown;
+
+    // Byte range of this header's line, CRLF included, within the `buf` of
+    // the ParsedRequest it was parsed into. Unmodified parsed headers are
+    // forwarded verbatim from that range; rawLen is 0 for headers that were
+    // added or modified since parsing, which are regenerated from key and value.
+    size_t rawOffset = 0;
+    size_t rawLen = 0;
+
+    // True if the header has to be regenerated rather than copied from `buf`.
+    bool isDirty() const { return rawLen == 0; }
+
     // Line 27: // Constructors for convenience
     // Line 28: ParsedHeader() = default; // Default constructor: initializes key and value to empty strings.
     ParsedHeader() = default;
 
     // Line 29: ParsedHeader(const std::string& k, const std::string& v) : key(k), value(v) {}
     // Parameterized constructor: allows initializing key and value directly upon creation.
-    ParsedHeader(const std::string& k, const std::string& v) : key(k), value(v) {}
+    ParsedHeader(const std::string& k, const std::string& v)
+        : key(k), value(v), id(classifyHeader(key)) {}
+
+    // Used when the name has already been classified, e.g. by the parser.
+    ParsedHeader(std::string k, std::string v, HeaderId i)
+        : key(std::move(k)), value(std::move(v)), id(i) {}
 
     // Line 30: // No need for keylen/valuelen, std::string handles their lengths automatically.
 };
 
+// Header storage of ParsedRequest: room for 16 headers inline, spilling to
+// the heap only for unusually large requests.
+using HeaderList = SmallVector<ParsedHeader, 16>;
+
 // Line 31: /*
 // Line 32:  * ParsedRequest class
 // Line 33:  *
 // Line 34:  * This class represents a parsed HTTP request.
 // Line 35:  * It's converted from a C struct to a C++ class to encapsulate data and behavior.
 // Line 36:  * All char* pointers are replaced with std::string for automatic memory management.
-// Line 37:  * The headers linked list is replaced with a std::unordered_map for efficient management.
+// Line 37:  * The headers linked list is replaced with a flat HeaderList that keeps wire order.
 // Line 38:  */
 // Line 39: class ParsedRequest {
 // Class definition for the entire parsed HTTP request.
@@ -152,21 +167,28 @@ public:
     std::string version;  // Line 48: HTTP version (e.g., "HTTP/1.1").
     std::string buf;      // Line 49: Internal buffer to store the original request line/full request if needed.
                           //          No 'buflen' needed as std::string::length() provides this.
+                          //          Unmodified headers are unparsed straight from this buffer.
 
-    // Line 50: // Using std::unordered_map<std::string, ParsedHeader> to store headers.
+    // When true, unparse() and unparseTo() write the request target in
+    // origin-form (the path only) even though `host` is set, as needed when
+    // forwarding a proxy request to the origin server.
+    bool originForm = false;
+
+    // Line 50: // Headers in the order they were received (or added), duplicates included.
     // Line 51: // This replaces the C-style linked list (struct ParsedHeader *)
-    // Line 52: // and automatically manages memory for the headers, offering fast lookups.
-    std::unordered_map<std::string, ParsedHeader> headers;
+    // Line 52: // and automatically manages memory for the headers. Lookups by name are
+    //          case-insensitive linear scans, which beat hashing at typical header counts.
+    HeaderList headers;
 
     // Line 53: // No direct equivalent for headersused/headerslen needed;
-    // Line 54: // std::unordered_map::size() provides the count of headers.
+    // Line 54: // HeaderList::size() provides the count of headers.
 
     // Line 55: // Constructor: Replaces ParsedRequest_create().
     // Line 56: // Initializes member strings to empty.
     ParsedRequest();
 
     // Line 57: // Destructor: Replaces ParsedRequest_destroy().
-    // Line 58: // std::string and std::unordered_map automatically handle memory cleanup (RAII).
+    // Line 58: // std::string and HeaderList automatically handle memory cleanup (RAII).
     ~ParsedRequest();
 
     /* Line 59:
@@ -191,10 +213,32 @@ public:
      */
     std::string unparseHeaders() const;
 
+    /*
+     * unparseTo() method: Scatter-gather form of unparse(). Fills `iov` with
+     * pointers to the request line pieces and header keys/values stored in
+     * this object (plus static separators), ready for a single writev() to
+     * the upstream with no intermediate copy. Unmodified headers are not
+     * regenerated: each run of them that is contiguous in `buf` is emitted as
+     * one entry pointing into `buf`. The entries stay valid until the request
+     * is next modified or destroyed.
+     * Returns the number of entries used, or -1 if `iovcnt` is smaller than
+     * iovecCount().
+     */
+    int unparseTo(struct iovec* iov, size_t iovcnt) const;
+
+    /*
+     * iovecCount() method: Number of iovec entries unparseTo() may need;
+     * the actual count is lower when unmodified headers are merged.
+     * Note that writev() accepts at most IOV_MAX entries per call.
+     */
+    size_t iovecCount() const;
+
     /* Line 72:
      * Line 73: totalLen() method: Calculates the total length of the request.
      * Line 74: Replaces ParsedRequest_totalLen().
      * Line 75: Returns size_t.
+     * O(1): the request line is sized from its fields and the headers from
+     * the cached headersLen().
      */
     size_t totalLen() const;
 
@@ -202,45 +246,538 @@ public:
      * Line 77: headersLen() method: Calculates the total length of the headers.
      * Line 78: Replaces ParsedHeader_headersLen().
      * Line 79: Returns size_t.
+     * O(1): the length is cached and kept up to date by the header setters.
      */
-    size_t headersLen() const;
+    size_t headersLen() const { return headersLength; }
 
     /* Line 80:
      * Line 81: setHeader() method: Sets or adds a header key-value pair.
      * Line 82: Replaces ParsedHeader_set().
      * Line 83: Returns 0 on success, -1 on failure.
+     * If headers named `key` already exist, the first one takes the new value
+     * (keeping its position) and the others are removed.
+     */
+    int setHeader(std::string_view key, std::string_view value);
+
+    /*
+     * addHeader() method: Appends a header even if one with the same name is
+     * already present, as needed for repeated headers such as Via.
+     * Returns 0 on success, -1 on failure.
      */
-    int setHeader(const std::string& key, const std::string& value);
+    int addHeader(std::string_view key, std::string_view value);
 
     /* Line 84:
      * Line 85: getHeader() method: Retrieves a pointer to a ParsedHeader object by key.
      * Line 86: Replaces ParsedHeader_get().
      * Line 87: Returns a pointer to the ParsedHeader if found, nullptr otherwise.
      * Line 88: Note: Returning a non-const pointer means the header can be modified.
+     * Names are compared case-insensitively, without copying `key`; with
+     * repeated headers the first one is returned.
      */
-    ParsedHeader* getHeader(const std::string& key);
+    ParsedHeader* getHeader(std::string_view key);
 
     // Line 89: const ParsedHeader* getHeader(const std::string& key) const; // Overload for const objects
     // Provides a const-correct version for when the ParsedRequest object is const.
-    const ParsedHeader* getHeader(const std::string& key) const;
+    const ParsedHeader* getHeader(std::string_view key) const;
+
+    /*
+     * getHeader() overloads taking a HeaderId: Retrieve the first header with
+     * a well-known name without any string comparison. The hot headers
+     * (Host, Connection, Proxy-Connection, Content-Length, Transfer-Encoding)
+     * are answered from a cached position.
+     * Returns a pointer to the ParsedHeader if found, nullptr otherwise.
+     */
+    ParsedHeader* getHeader(HeaderId id);
+    const ParsedHeader* getHeader(HeaderId id) const;
 
     /* Line 90:
      * Line 91: removeHeader() method: Removes a header by key.
      * Line 92: Replaces ParsedHeader_remove().
      * Line 93: Returns 0 on success, -1 on failure.
+     * Every header named `key` (case-insensitively) is removed; -1 means
+     * there was none.
+     */
+    int removeHeader(std::string_view key);
+
+    /*
+     * reindexHeaders() method: Rebuilds the cached positions of the hot
+     * headers and the cached headersLen(), and marks headers that no longer
+     * match their line in `buf` as modified. setHeader(), addHeader(),
+     * removeHeader() and parse() keep all of this up to date; call this after
+     * editing `headers` directly or through a pointer from getHeader().
      */
-    int removeHeader(const std::string& key);
+    void reindexHeaders();
+
+    /*
+     * reset() method: Clears every field so the object can hold the next
+     * request, as if newly constructed, but keeps the capacity of its
+     * strings and header storage. Header objects are retained for reuse by
+     * later parse()/setHeader()/addHeader() calls, so a request reused across
+     * a keep-alive connection stops allocating once it has warmed up.
+     */
+    void reset();
 
 private:
+    // ParsedRequestView::materialize() fills the headers through
+    // appendHeader() to benefit from recycled header storage.
+    template <class> friend class BasicParsedRequestView;
+
     // Line 94: // Private helper for parsing the initial request line buffer.
     // Line 95: // You might add private helper methods here as you implement the parsing logic.
     // Line 96: // Example: int parseRequestLine(const std::string& request_line);
+
+    // Length of the request line produced by unparse(), including its CRLF.
+    size_t requestLineLen() const;
+
+    // Appends the request line produced by unparse(), including its CRLF.
+    void appendRequestLine(std::string& out) const;
+
+    // Appends the header block produced by unparseHeaders().
+    void appendHeaders(std::string& out) const;
+
+    // Marks a hot header as absent in `hotHeaders`.
+    static constexpr size_t kNoHeader = static_cast<size_t>(-1);
+
+    // Index into `headers` of the first occurrence of each hot header,
+    // indexed by HeaderId - 1, or kNoHeader.
+    std::array<size_t, kHotHeaderCount> hotHeaders;
+
+    // Cached value of headersLen().
+    size_t headersLength;
+
+    // Header objects kept by reset(): their strings keep their capacity and
+    // are reused by appendHeader().
+    std::vector<ParsedHeader> recycled;
+
+    // Appends a header, reusing a recycled header object if there is one.
+    // Does not update the hot header cache or headersLength.
+    ParsedHeader& appendHeader(std::string_view key, std::string_view value, HeaderId id);
+};
+
+/*
+ * ParsedHeaderView class
+ *
+ * Non-owning counterpart of ParsedHeader. Both members point into the buffer
+ * that was handed to ParsedRequestView::parse(), so a ParsedHeaderView is only
+ * valid for as long as that buffer is alive and unmodified.
+ */
+class ParsedHeaderView {
+public:
+    std::string_view key;   // Header name exactly as received (e.g. "Host").
+    std::string_view value; // Header value with surrounding blanks trimmed.
+    HeaderId id = HeaderId::Unknown; // Well-known name of `key`, if any.
+    std::string_view line;  // The whole header line as received, CRLF included;
+                            // empty for headers added or modified after parsing.
+
+    // True if the header has to be regenerated rather than forwarded from `line`.
+    bool isDirty() const { return line.empty(); }
+
+    ParsedHeaderView() = default;
+    ParsedHeaderView(std::string_view k, std::string_view v)
+        : key(k), value(v), id(classifyHeader(k)) {}
+    ParsedHeaderView(std::string_view k, std::string_view v, std::string_view l)
+        : key(k), value(v), id(classifyHeader(k)), line(l) {}
+};
+
+/*
+ * ParseStatus enum
+ *
+ * Result of feeding bytes to a RequestParser.
+ */
+enum class ParseStatus {
+    NeedMore, // The header block is not complete yet; feed more bytes.
+    Done,     // The header block is complete and the view has been filled.
+    Error     // The bytes received so far can never form a valid request.
+};
+
+/*
+ * ParseError enum
+ *
+ * Why a parser returned ParseStatus::Error, so that the caller can answer
+ * with the matching status code.
+ */
+enum class ParseError {
+    None,
+    Malformed,        // Not HTTP/1.x syntax.
+    HeadTooLarge,     // The head is longer than the limits allow.
+    TooManyHeaders,   // More header lines than the limits allow.
+    TargetTooLong,    // The request target is longer than the limits allow.
+    MethodNotAllowed  // The method is not in the limits' method set.
+};
+
+/*
+ * Limits policies
+ *
+ * The parsers are templates over a policy class that fixes their limits at
+ * compile time, so that the inline header storage of a view is sized to
+ * hold every header a request may carry, and checking a limit is a
+ * comparison against a constant. A request policy has these members; a
+ * response policy only needs kMaxHeaders and kMaxHeadBytes:
+ *
+ *     kMaxHeaders      - header lines in a head.
+ *     kMaxHeadBytes    - start line plus header block, final CRLFCRLF included.
+ *     kMaxTargetLength - the request target.
+ *     kMethods         - the request methods accepted, a MethodSet.
+ *
+ * The member functions of the parser templates are defined in
+ * proxy_parse.cpp and instantiated there for the policies below; a new
+ * policy needs its own explicit instantiations at the end of that file.
+ */
+struct DefaultRequestLimits {
+    static constexpr size_t kMaxHeaders = 64;
+    static constexpr size_t kMaxHeadBytes = 64 * 1024;
+    static constexpr size_t kMaxTargetLength = 8 * 1024;
+    static constexpr MethodSet kMethods = kStandardMethods;
 };
 
-// Line 97: // Global debug function.
-// Line 98: // Using a function in a namespace or a static member function of a utility class
-// Line 99: // is more C++ idiomatic than a global C-style function.
-// Line 100: // For simplicity, keeping it as a free function but using std::cerr for output.
-// Line 101: // The implementation for this function will be in the .cpp file.
-void debug(const char * format, ...);
+struct DefaultResponseLimits {
+    static constexpr size_t kMaxHeaders = 64;
+    static constexpr size_t kMaxHeadBytes = 64 * 1024;
+};
+
+template <class Limits>
+class BasicRequestParser;
+
+/*
+ * BasicParsedRequestView class template
+ *
+ * Zero-copy sibling of ParsedRequest. parse() slices the caller's buffer into
+ * std::string_view fields instead of copying them into std::strings, so
+ * parsing a request performs no heap allocation at all. Requests beyond the
+ * limits set by `Limits` are rejected. Use it as ParsedRequestView, with the
+ * default limits.
+ *
+ * The view does not own anything: every field refers to the buffer passed to
+ * parse(). If the request has to outlive that buffer (e.g. the socket buffer
+ * is about to be reused), call materialize() to copy it into an owning
+ * ParsedRequest.
+ */
+template <class Limits>
+class BasicParsedRequestView {
+public:
+    // Upper bound on the number of headers a view can hold. Headers are stored
+    // inline so that parsing never touches the heap; requests carrying more
+    // headers than this are rejected by parse().
+    static constexpr size_t kMaxHeaders = Limits::kMaxHeaders;
+
+    std::string_view method;   // HTTP method (e.g. "GET").
+    HttpMethod methodId = HttpMethod::Other; // `method` classified.
+    std::string_view protocol; // Protocol of an absolute-form target (e.g. "http"), empty otherwise.
+    std::string_view host;     // Hostname of an absolute-form target, empty otherwise.
+    std::string_view port;     // Port of an absolute-form target, empty if absent.
+    std::string_view path;     // Request path (e.g. "/index.html").
+    std::string_view version;  // HTTP version (e.g. "HTTP/1.1").
+    std::string_view buf;      // The request line and header block, including the final CRLFCRLF.
+
+    // Headers in the order they were received, duplicates included. Sized so
+    // that a request within kMaxHeaders never leaves the inline storage.
+    SmallVector<ParsedHeaderView, kMaxHeaders> headers;
+
+    // Same meaning as ParsedRequest::originForm.
+    bool originForm = false;
+
+    /*
+     * parse() method: Parses the request line and headers found at the start
+     * of `buffer`. The buffer must contain the complete header block
+     * (terminated by CRLFCRLF); any bytes after it (e.g. a body) are ignored.
+     * On success the fields point into `buffer`.
+     * Returns 0 on success, -1 on failure.
+     */
+    int parse(std::string_view buffer);
+
+    /*
+     * materialize() method: Copies the viewed request into an owning
+     * ParsedRequest so it no longer depends on the parsed buffer.
+     * Returns 0 on success, -1 on failure.
+     */
+    int materialize(ParsedRequest& out) const;
+
+    /*
+     * getHeader() method: Retrieves the first header named `key`, compared
+     * case-insensitively.
+     * Returns a pointer to the ParsedHeaderView if found, nullptr otherwise.
+     */
+    const ParsedHeaderView* getHeader(std::string_view key) const;
+
+    /*
+     * getHeader() overload taking a HeaderId: Retrieves the first header
+     * with a well-known name by comparing ids only.
+     * Returns a pointer to the ParsedHeaderView if found, nullptr otherwise.
+     */
+    const ParsedHeaderView* getHeader(HeaderId id) const;
+
+    /*
+     * setHeader(), addHeader() and removeHeader() methods: Same semantics as
+     * their ParsedRequest counterparts. The view only stores references, so
+     * `key` and `value` must stay alive as long as the view uses them.
+     * Return 0 on success, -1 on failure.
+     */
+    int setHeader(std::string_view key, std::string_view value);
+    int addHeader(std::string_view key, std::string_view value);
+    int removeHeader(std::string_view key);
+
+    /*
+     * unparseTo() and iovecCount() methods: Same as their ParsedRequest
+     * counterparts; unmodified header lines are referenced where they were
+     * parsed.
+     */
+    int unparseTo(struct iovec* iov, size_t iovcnt) const;
+    size_t iovecCount() const;
+
+    /*
+     * totalLen() method: Length of the request written by unparseTo(). Unlike
+     * ParsedRequest::totalLen() this walks the headers.
+     */
+    size_t totalLen() const;
 
+    /*
+     * rebase() method: Re-points every field that refers into `buf` at the
+     * same offset within `base`, which must hold a copy of `buf`. Used after
+     * moving the parsed bytes, e.g. to the front of a grown or compacted
+     * receive buffer. Fields that refer to other memory (headers set with
+     * setHeader(), the default "/" path) are left alone.
+     */
+    void rebase(const char* base);
+
+    /*
+     * clear() method: Resets every field so the view can be reused.
+     */
+    void clear();
+
+private:
+    // The request parser fills the fields of a view directly once it has
+    // located them in the buffer.
+    friend class BasicRequestParser<Limits>;
+
+    // Validates `version` and splits the request target into protocol, host,
+    // port and path with parseUri(). The "*" of "OPTIONS * HTTP/1.1" becomes
+    // the path. `methodId` must already be set.
+    int parseTarget(std::string_view target);
+};
+
+using ParsedRequestView = BasicParsedRequestView<DefaultRequestLimits>;
+
+/*
+ * HeadParser class template
+ *
+ * The incremental state machine under the request and response parsers. It
+ * scans a message head, start line and header block, that may arrive over
+ * several recv() calls, and records where the three fields of the start line
+ * and every header line are; the parsers build their views from those
+ * offsets once the head is complete. The same vectorized scanners do the
+ * work for both kinds of message. `Limits` caps the header count and the
+ * head size.
+ */
+template <class Limits>
+class HeadParser {
+public:
+    // The two shapes of start line.
+    enum class StartLine {
+        Request, // method SP request-target SP HTTP-version
+        Response // HTTP-version SP status-code [SP reason-phrase]
+    };
+
+    explicit HeadParser(StartLine kind);
+
+    /*
+     * scan() method: Same contract as RequestParser::feed(), but only
+     * records offsets. No byte past Limits::kMaxHeadBytes is examined.
+     */
+    ParseStatus scan(std::string_view received);
+
+    // Length of the head once scan() has returned ParseStatus::Done.
+    size_t consumed() const { return pos; }
+
+    // Why the head was rejected, once scan() has returned ParseStatus::Error.
+    ParseError error() const { return state == State::Error ? reason : ParseError::None; }
+
+    // Forgets all progress, for the next message.
+    void reset();
+
+private:
+    // The parsers read the recorded offsets and may reject a head whose
+    // fields turn out to be invalid.
+    template <class> friend class BasicRequestParser;
+    friend class ResponseParser;
+
+    // Where the scanner is within the head.
+    enum class State {
+        Method,        // Inside the method, waiting for the first SP.
+        Target,        // Inside the request target, waiting for the second SP.
+        Version,       // Inside the version, waiting for CR.
+        StatusVersion, // Inside the version of a status line, waiting for SP.
+        StatusCode,    // Inside the status code, waiting for SP or CR.
+        Reason,        // Inside the reason phrase, waiting for CR.
+        StartLineLF,   // Saw the CR ending the start line, expecting LF.
+        HeaderStart,   // At the start of a header line or of the final CRLF.
+        HeaderName,    // Inside a header name, waiting for ':'.
+        HeaderValue,   // Inside a header value, waiting for CR.
+        HeaderLF,      // Saw the CR ending a header line, expecting LF.
+        FinalLF,       // Saw the CR of the empty line, expecting LF.
+        Done,
+        Error
+    };
+
+    // Offsets of one header line within the received buffer.
+    struct HeaderSpan {
+        size_t start; // First byte of the header name.
+        size_t colon; // The ':' separating name and value.
+        size_t end;   // The CR ending the line.
+    };
+
+    // scan() without the size limit.
+    ParseStatus advance(std::string_view received);
+
+    // Moves to State::Error for `why`.
+    void fail(ParseError why) {
+        state = State::Error;
+        reason = why;
+    }
+
+    StartLine kind;
+    State state;
+    ParseError reason; // Why the head was rejected, in State::Error.
+    size_t pos;     // Offset of the next byte to examine.
+    size_t sp1;     // Offset of the SP after the first field of the start line.
+    size_t sp2;     // Offset of the SP after the second field, or of the CR
+                    // ending a status line without a reason phrase.
+    size_t lineEnd; // Offset of the CR ending the start line.
+    std::array<HeaderSpan, Limits::kMaxHeaders> spans;
+    size_t spanCount;
+};
+
+/*
+ * BasicRequestParser class template
+ *
+ * Incremental, resumable request parser for requests that arrive over
+ * several recv() calls. The parser remembers where it stopped in the request
+ * line and header section, so every received byte is examined once no matter
+ * how many pieces the request arrives in; rescanning the accumulated buffer
+ * from the start on every recv() would be quadratic in the header size.
+ * Use it as RequestParser, with the default limits.
+ *
+ * The caller owns the receive buffer and keeps appending to it. Every call
+ * to feed() passes the whole buffer received so far; only the bytes past the
+ * previous call are looked at. Positions are remembered as offsets rather
+ * than pointers, so the buffer may be reallocated between calls as long as
+ * the bytes already fed are left unchanged.
+ *
+ * Typical use:
+ *
+ *     RequestParser parser;
+ *     ParsedRequestView request;
+ *     std::string in;
+ *     while (parser.feed(in, request) == ParseStatus::NeedMore) {
+ *         ...append the next recv() to `in`...
+ *     }
+ */
+template <class Limits>
+class BasicRequestParser {
+public:
+    BasicRequestParser();
+
+    /*
+     * feed() method: Scans the bytes of `received` that were not seen by
+     * previous calls. On ParseStatus::Done, `out` is filled with views into
+     * `received` and consumed() gives the length of the header block; `out`
+     * is left untouched otherwise. Once Done or Error has been returned,
+     * further calls return the same status until reset().
+     */
+    ParseStatus feed(std::string_view received, BasicParsedRequestView<Limits>& out);
+
+    /*
+     * consumed() method: Number of bytes making up the request line and the
+     * header block, valid once feed() has returned ParseStatus::Done. Any
+     * bytes past this offset belong to the body or to the next request.
+     */
+    size_t consumed() const { return head.consumed(); }
+
+    /*
+     * error() method: Why the request was rejected, once feed() has
+     * returned ParseStatus::Error.
+     */
+    ParseError error() const { return head.error(); }
+
+    /*
+     * reset() method: Forgets all progress so the parser can be used for the
+     * next request.
+     */
+    void reset() { head.reset(); }
+
+private:
+    // Builds the view from the recorded offsets once the block is complete.
+    ParseStatus finish(std::string_view received, BasicParsedRequestView<Limits>& out);
+
+    HeadParser<Limits> head;
+};
+
+using RequestParser = BasicRequestParser<DefaultRequestLimits>;
+
+/*
+ * ParsedResponseView class
+ *
+ * Zero-copy view of the status line and headers of an HTTP/1.x response, the
+ * counterpart of ParsedRequestView for what comes back from an origin. Every
+ * field refers to the buffer that was parsed.
+ */
+class ParsedResponseView {
+public:
+    static constexpr size_t kMaxHeaders = DefaultResponseLimits::kMaxHeaders;
+
+    std::string_view version; // HTTP version (e.g. "HTTP/1.1").
+    int status = 0;           // Status code, 100 to 999.
+    std::string_view reason;  // Reason phrase, possibly empty.
+    std::string_view buf;     // The status line and header block, including the final CRLFCRLF.
+
+    // Headers in the order they were received, duplicates included.
+    SmallVector<ParsedHeaderView, kMaxHeaders> headers;
+
+    /*
+     * parse() method: Parses the status line and headers found at the start
+     * of `buffer`, which must contain the complete header block; the body
+     * after it is ignored.
+     * Returns 0 on success, -1 on failure.
+     */
+    int parse(std::string_view buffer);
+
+    /*
+     * getHeader() methods: Same as their ParsedRequestView counterparts.
+     */
+    const ParsedHeaderView* getHeader(std::string_view key) const;
+    const ParsedHeaderView* getHeader(HeaderId id) const;
+
+    // True for HTTP/1.1 and later, whose connections persist by default.
+    bool persistentByDefault() const { return version != "HTTP/1.0"; }
+
+    /*
+     * clear() method: Resets every field so the view can be reused.
+     */
+    void clear();
+};
+
+/*
+ * ResponseParser class
+ *
+ * Incremental parser for response heads, used exactly like RequestParser.
+ */
+class ResponseParser {
+public:
+    ResponseParser();
+
+    /*
+     * feed() method: Same as RequestParser::feed(), filling a
+     * ParsedResponseView.
+     */
+    ParseStatus feed(std::string_view received, ParsedResponseView& out);
+
+    // Length of the status line and header block; see RequestParser.
+    size_t consumed() const { return head.consumed(); }
+
+    void reset() { head.reset(); }
+
+private:
+    // Builds the view from the recorded offsets once the block is complete.
+    ParseStatus finish(std::string_view received, ParsedResponseView& out);
+
+    HeadParser<DefaultResponseLimits> head;
+};
@@ -0,0 +1,203 @@
+/*
+ * proxy_resolver.cpp -- name resolution off the event loop threads.
+ */
+
+#include "proxy_resolver.hpp"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "proxy_parse.hpp"
+#include "proxy_trace.hpp"
+
+namespace {
+
+// Fills `out` if `host` is an IPv4 or IPv6 literal and `port` a number.
+bool numericAddress(const std::string& host, const std::string& port, ResolvedAddress& out) {
+    if (port.empty() || port.size() > 5 || port.find_first_not_of("0123456789") != std::string::npos) return false;
+    unsigned long number = strtoul(port.c_str(), nullptr, 10);
+    if (number > 65535) return false;
+    uint16_t net_port = htons(static_cast<uint16_t>(number));
+
+    std::string literal = host;
+    if (literal.size() >= 2 && literal.front() == '[' && literal.back() == ']') {
+        literal = literal.substr(1, literal.size() - 2);
+    }
+
+    out = ResolvedAddress{};
+    ResolvedAddress::Address& only = out.addrs[0];
+    auto* v4 = reinterpret_cast<sockaddr_in*>(&only.addr);
+    if (inet_pton(AF_INET, literal.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = net_port;
+        only.len = sizeof(sockaddr_in);
+        out.count = 1;
+        return true;
+    }
+    auto* v6 = reinterpret_cast<sockaddr_in6*>(&only.addr);
+    if (inet_pton(AF_INET6, literal.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = net_port;
+        only.len = sizeof(sockaddr_in6);
+        out.count = 1;
+        return true;
+    }
+    return false;
+}
+
+} // namespace
+
+int resolveUpstream(const std::string& host, const std::string& port, ResolvedAddress& out) {
+    out = ResolvedAddress{};
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addrs = nullptr;
+    int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+    if (rc != 0) {
+        TRACE("cannot resolve %s: %s", host.c_str(), gai_strerror(rc));
+        out.error = rc;
+        return rc;
+    }
+    for (addrinfo* ai = addrs; ai != nullptr && out.count < ResolvedAddress::kMaxAddresses; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(sockaddr_storage)) continue;
+        ResolvedAddress::Address& address = out.addrs[out.count++];
+        std::memcpy(&address.addr, ai->ai_addr, ai->ai_addrlen);
+        address.len = ai->ai_addrlen;
+    }
+    freeaddrinfo(addrs);
+    if (out.count == 0) {
+        out.error = EAI_FAMILY;
+        return out.error;
+    }
+    return 0;
+}
+
+/*
+ * ResolveQueue
+ */
+
+ResolveQueue::ResolveQueue() : eventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+ResolveQueue::~ResolveQueue() {
+    if (eventFd >= 0) ::close(eventFd);
+}
+
+void ResolveQueue::push(Completion completion) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        completions.push_back(completion);
+    }
+    uint64_t one = 1;
+    if (write(eventFd, &one, sizeof(one)) < 0) TRACE("resolver: failed to signal: %s", strerror(errno));
+}
+
+std::vector<ResolveQueue::Completion> ResolveQueue::take() {
+    std::vector<Completion> done;
+    std::lock_guard<std::mutex> lock(mutex);
+    done.swap(completions);
+    return done;
+}
+
+/*
+ * Resolver
+ */
+
+Resolver::Resolver(size_t thread_count, int positive_ttl_ms, int negative_ttl_ms, size_t max_entries)
+    : positiveTtl(std::chrono::milliseconds(positive_ttl_ms)),
+      negativeTtl(std::chrono::milliseconds(negative_ttl_ms)),
+      maxEntries(max_entries) {
+    if (thread_count == 0) thread_count = 1;
+    for (size_t i = 0; i < thread_count; ++i) threads.emplace_back(&Resolver::run, this);
+}
+
+Resolver::~Resolver() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    // A thread inside getaddrinfo() finishes that lookup first.
+    for (std::thread& thread : threads) thread.join();
+}
+
+bool Resolver::lookup(const NormalizedTarget& target, ResolvedAddress& out) {
+    if (numericAddress(target.host, target.port, out)) return true;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = cache.find(target.origin);
+    if (found == cache.end()) return false;
+    if (found->second.expires <= Clock::now()) {
+        cache.erase(found);
+        return false;
+    }
+    out = found->second.result;
+    return true;
+}
+
+void Resolver::resolve(const NormalizedTarget& target, uint64_t token, std::shared_ptr<ResolveQueue> queue) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto [it, inserted] = pending.try_emplace(target.origin);
+        it->second.waiters.push_back({token, std::move(queue)});
+        if (!inserted) return; // Joins the lookup already under way.
+        it->second.host = target.host;
+        it->second.port = target.port;
+        queued.push_back(target.origin);
+    }
+    wakeup.notify_one();
+}
+
+void Resolver::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wakeup.wait(lock, [this] { return stopping || !queued.empty(); });
+        if (stopping) return;
+
+        HashedKey key = std::move(queued.front());
+        queued.pop_front();
+        std::string host = pending[key].host;
+        std::string port = pending[key].port;
+
+        lock.unlock();
+        ResolvedAddress result;
+        resolveUpstream(host, port, result);
+        lock.lock();
+
+        remember(key, result);
+        auto found = pending.find(key);
+        std::vector<Waiter> waiters = std::move(found->second.waiters);
+        pending.erase(found);
+
+        lock.unlock();
+        for (Waiter& waiter : waiters) waiter.queue->push({waiter.token, result});
+        lock.lock();
+    }
+}
+
+void Resolver::remember(const HashedKey& key, const ResolvedAddress& result) {
+    Clock::duration ttl = result.error == 0 ? positiveTtl : negativeTtl;
+    if (ttl <= Clock::duration::zero()) return;
+
+    Clock::time_point now = Clock::now();
+    if (cache.size() >= maxEntries) {
+        // Make room: drop what has expired, or else everything. Names are
+        // looked up again on their next use.
+        for (auto it = cache.begin(); it != cache.end();) {
+            it = it->second.expires <= now ? cache.erase(it) : std::next(it);
+        }
+        if (cache.size() >= maxEntries) cache.clear();
+    }
+    cache[key] = {result, now + ttl};
+}
+
+size_t Resolver::entries() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return cache.size();
+}
@@ -0,0 +1,183 @@
+/*
+ * proxy_resolver.hpp -- name resolution off the event loop threads.
+ *
+ * getaddrinfo() blocks for as long as the DNS server takes to answer, and
+ * while it does, every other connection of the worker that called it waits.
+ * Workers therefore hand lookups to a Resolver:
+ *
+ *   - A small pool of resolver threads, shared by all workers, runs the
+ *     blocking lookups. Requests for a name already being looked up wait
+ *     for that lookup instead of starting another one.
+ *   - Each worker has a ResolveQueue. Finished lookups are pushed onto it
+ *     and its eventfd becomes readable, so completions arrive through the
+ *     worker's event loop like any other socket event.
+ *   - Results are cached, successes and failures alike, each for its own
+ *     time to live, so most requests find their origin's address without
+ *     leaving the worker thread at all. getaddrinfo() does not report the
+ *     TTLs of the records it found, so these are configured.
+ */
+
+#pragma once
+
+#include <sys/socket.h>
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "proxy_uri.hpp"
+
+/*
+ * ResolvedAddress struct
+ *
+ * The outcome of resolving one host and port: its first few addresses, in
+ * the order getaddrinfo() returned them, to be tried one after the other.
+ * A name often has an IPv6 address first, which an origin listening on
+ * IPv4 only refuses.
+ */
+struct ResolvedAddress {
+    static constexpr size_t kMaxAddresses = 4;
+
+    struct Address {
+        sockaddr_storage addr{};
+        socklen_t len = 0;
+    };
+
+    int error = 0;    // 0, or the getaddrinfo() error code.
+    size_t count = 0; // Entries of `addrs` in use; at least one without an error.
+    std::array<Address, kMaxAddresses> addrs{};
+};
+
+/*
+ * resolveUpstream() function: Resolves an origin server to its addresses.
+ * Blocks the calling thread while the name is looked up.
+ * Returns 0 on success, or the getaddrinfo() error code.
+ */
+int resolveUpstream(const std::string& host, const std::string& port, ResolvedAddress& out);
+
+/*
+ * ResolveQueue class
+ *
+ * Lookups finished for one worker. Resolver threads push; the worker takes
+ * them once fd() has become readable and it has read the eventfd counter.
+ */
+class ResolveQueue {
+public:
+    struct Completion {
+        uint64_t token; // As passed to Resolver::resolve().
+        ResolvedAddress result;
+    };
+
+    ResolveQueue();
+    ~ResolveQueue();
+
+    ResolveQueue(const ResolveQueue&) = delete;
+    ResolveQueue& operator=(const ResolveQueue&) = delete;
+
+    // Non-blocking eventfd signalled by push(); -1 if it could not be created.
+    int fd() const { return eventFd; }
+
+    /*
+     * push() method: Adds a completion and signals fd(). Any thread.
+     */
+    void push(Completion completion);
+
+    /*
+     * take() method: Removes and returns the completions pushed so far.
+     */
+    std::vector<Completion> take();
+
+private:
+    int eventFd;
+    std::mutex mutex;
+    std::vector<Completion> completions;
+};
+
+/*
+ * Resolver class
+ *
+ * Thread pool plus shared cache of lookups. Thread-safe.
+ */
+class Resolver {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /*
+     * Constructor: Starts `threads` resolver threads (at least one). Cached
+     * results expire after `positive_ttl_ms` or, for failed lookups,
+     * `negative_ttl_ms`; at most `max_entries` are kept.
+     */
+    Resolver(size_t threads, int positive_ttl_ms, int negative_ttl_ms, size_t max_entries = 4096);
+
+    /*
+     * Destructor: Stops the threads. Lookups not started yet are dropped,
+     * and their queues are never told.
+     */
+    ~Resolver();
+
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+
+    /*
+     * lookup() method: Answers without blocking if it can: from the cache,
+     * or directly for a numeric address. Returns true with `out` set, or
+     * false if the origin of `target` has to be resolved.
+     */
+    bool lookup(const NormalizedTarget& target, ResolvedAddress& out);
+
+    /*
+     * resolve() method: Looks the host and port of `target` up on a
+     * resolver thread and pushes the result, tagged with `token`, onto
+     * `queue`.
+     */
+    void resolve(const NormalizedTarget& target, uint64_t token, std::shared_ptr<ResolveQueue> queue);
+
+    // Cached results, fresh or not.
+    size_t entries() const;
+
+private:
+    struct Waiter {
+        uint64_t token;
+        std::shared_ptr<ResolveQueue> queue;
+    };
+
+    // A lookup queued or in progress, and everyone waiting for it.
+    struct Pending {
+        std::string host;
+        std::string port;
+        std::vector<Waiter> waiters;
+    };
+
+    struct CacheEntry {
+        ResolvedAddress result;
+        Clock::time_point expires;
+    };
+
+    // Body of the resolver threads.
+    void run();
+
+    // Stores `result` for `key`; the mutex must be held.
+    void remember(const HashedKey& key, const ResolvedAddress& result);
+
+    Clock::duration positiveTtl;
+    Clock::duration negativeTtl;
+    size_t maxEntries;
+
+    mutable std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    // Lookups are keyed on the NormalizedTarget::origin they are for.
+    std::deque<HashedKey> queued; // Keys of `pending` not started yet, oldest first.
+    std::unordered_map<HashedKey, Pending, HashedKeyHash> pending;
+    std::unordered_map<HashedKey, CacheEntry, HashedKeyHash> cache;
+    std::vector<std::thread> threads;
+};
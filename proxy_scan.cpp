@@ -0,0 +1,226 @@
+/*
+ * proxy_scan.cpp -- vectorized byte scanning kernels for the HTTP parser.
+ *
+ * Every public function follows the same shape: a vector loop over whole
+ * 32- or 16-byte blocks that turns the comparison result into a bit mask and
+ * stops at its lowest set bit, then a scalar loop over the remaining tail.
+ *
+ * Token validation uses the nibble-table technique: for a byte with low
+ * nibble `lo` and high nibble `hi`, kTokenNibbles[lo] holds one bit per high
+ * nibble 0..7 for which the byte is a token character, and kHighBits[hi]
+ * selects that bit (high nibbles 8..15, i.e. non-ASCII bytes, select
+ * nothing). Both tables fit a single 16-byte shuffle, so a whole vector is
+ * classified with two shuffles and an AND.
+ */
+
+#include "proxy_scan.hpp"
+
+#include <array>
+#include <cstdint>
+
+#if defined(PROXY_SCAN_SCALAR)
+#define PROXY_SCAN_KERNEL "scalar"
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define PROXY_SCAN_X86 1
+#define PROXY_SCAN_KERNEL "avx2"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#define PROXY_SCAN_X86 1
+#define PROXY_SCAN_KERNEL "sse2"
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PROXY_SCAN_NEON 1
+#define PROXY_SCAN_KERNEL "neon"
+#else
+#define PROXY_SCAN_KERNEL "scalar"
+#endif
+
+namespace {
+
+constexpr bool tokenChar(unsigned c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           c == '!' || c == '#' || c == '$' || c == '%' || c == '&' || c == '\'' ||
+           c == '*' || c == '+' || c == '-' || c == '.' || c == '^' || c == '_' ||
+           c == '`' || c == '|' || c == '~';
+}
+
+constexpr std::array<bool, 256> makeTokenTable() {
+    std::array<bool, 256> table{};
+    for (unsigned c = 0; c < 256; ++c) table[c] = tokenChar(c);
+    return table;
+}
+
+constexpr std::array<uint8_t, 16> makeTokenNibbles() {
+    std::array<uint8_t, 16> table{};
+    for (unsigned lo = 0; lo < 16; ++lo) {
+        for (unsigned hi = 0; hi < 8; ++hi) {
+            if (tokenChar(hi << 4 | lo)) table[lo] |= static_cast<uint8_t>(1u << hi);
+        }
+    }
+    return table;
+}
+
+constexpr std::array<bool, 256> kTokenTable = makeTokenTable();
+
+alignas(16) constexpr std::array<uint8_t, 16> kTokenNibbles = makeTokenNibbles();
+
+alignas(16) constexpr std::array<uint8_t, 16> kHighBits = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0, 0, 0, 0, 0, 0, 0, 0};
+
+#if defined(PROXY_SCAN_NEON)
+// Compresses a 16-byte 0x00/0xFF comparison result into a 64-bit mask with
+// four bits per byte; the first matching byte is at ctz(mask) / 4.
+inline uint64_t neonMask(uint8x16_t eq) {
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+#endif
+
+#if defined(PROXY_SCAN_X86) && (defined(__AVX2__) || defined(__SSSE3__))
+// Returns a movemask with one bit set for every byte of `v` that is not a
+// token character.
+inline uint32_t invalidTokenMask16(__m128i v) {
+    const __m128i nibbles = _mm_load_si128(reinterpret_cast<const __m128i*>(kTokenNibbles.data()));
+    const __m128i high_bits = _mm_load_si128(reinterpret_cast<const __m128i*>(kHighBits.data()));
+    const __m128i low_mask = _mm_set1_epi8(0x0F);
+    __m128i lo = _mm_and_si128(v, low_mask);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low_mask);
+    __m128i ok = _mm_and_si128(_mm_shuffle_epi8(nibbles, lo), _mm_shuffle_epi8(high_bits, hi));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ok, _mm_setzero_si128())));
+}
+#endif
+
+} // namespace
+
+size_t scanForAny(const char* data, size_t len, char a, char b) {
+    size_t i = 0;
+#if defined(PROXY_SCAN_X86)
+#if defined(__AVX2__)
+    const __m256i a32 = _mm256_set1_epi8(a);
+    const __m256i b32 = _mm256_set1_epi8(b);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, a32), _mm256_cmpeq_epi8(v, b32))));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    const __m128i a16 = _mm_set1_epi8(a);
+    const __m128i b16 = _mm_set1_epi8(b);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, a16), _mm_cmpeq_epi8(v, b16))));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#elif defined(PROXY_SCAN_NEON)
+    const uint8x16_t a16 = vdupq_n_u8(static_cast<uint8_t>(a));
+    const uint8x16_t b16 = vdupq_n_u8(static_cast<uint8_t>(b));
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+        uint64_t mask = neonMask(vorrq_u8(vceqq_u8(v, a16), vceqq_u8(v, b16)));
+        if (mask) return i + (__builtin_ctzll(mask) >> 2);
+    }
+#endif
+    for (; i < len; ++i) {
+        if (data[i] == a || data[i] == b) return i;
+    }
+    return len;
+}
+
+size_t scanForAny(const char* data, size_t len, char a, char b, char c) {
+    size_t i = 0;
+#if defined(PROXY_SCAN_X86)
+#if defined(__AVX2__)
+    const __m256i a32 = _mm256_set1_epi8(a);
+    const __m256i b32 = _mm256_set1_epi8(b);
+    const __m256i c32 = _mm256_set1_epi8(c);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(v, a32), _mm256_cmpeq_epi8(v, b32));
+        eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(v, c32));
+        uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(eq));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    const __m128i a16 = _mm_set1_epi8(a);
+    const __m128i b16 = _mm_set1_epi8(b);
+    const __m128i c16 = _mm_set1_epi8(c);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(v, a16), _mm_cmpeq_epi8(v, b16));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi8(v, c16));
+        uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(eq));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#elif defined(PROXY_SCAN_NEON)
+    const uint8x16_t a16 = vdupq_n_u8(static_cast<uint8_t>(a));
+    const uint8x16_t b16 = vdupq_n_u8(static_cast<uint8_t>(b));
+    const uint8x16_t c16 = vdupq_n_u8(static_cast<uint8_t>(c));
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+        uint8x16_t eq = vorrq_u8(vorrq_u8(vceqq_u8(v, a16), vceqq_u8(v, b16)), vceqq_u8(v, c16));
+        uint64_t mask = neonMask(eq);
+        if (mask) return i + (__builtin_ctzll(mask) >> 2);
+    }
+#endif
+    for (; i < len; ++i) {
+        if (data[i] == a || data[i] == b || data[i] == c) return i;
+    }
+    return len;
+}
+
+size_t scanTokenChars(const char* data, size_t len) {
+    size_t i = 0;
+#if defined(PROXY_SCAN_X86) && defined(__AVX2__)
+    const __m256i nibbles = _mm256_broadcastsi128_si256(
+        _mm_load_si128(reinterpret_cast<const __m128i*>(kTokenNibbles.data())));
+    const __m256i high_bits = _mm256_broadcastsi128_si256(
+        _mm_load_si128(reinterpret_cast<const __m128i*>(kHighBits.data())));
+    const __m256i low_mask = _mm256_set1_epi8(0x0F);
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i lo = _mm256_and_si256(v, low_mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+        __m256i ok = _mm256_and_si256(_mm256_shuffle_epi8(nibbles, lo),
+                                      _mm256_shuffle_epi8(high_bits, hi));
+        uint32_t mask = static_cast<uint32_t>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(ok, _mm256_setzero_si256())));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+#if defined(PROXY_SCAN_X86) && (defined(__AVX2__) || defined(__SSSE3__))
+    for (; i + 16 <= len; i += 16) {
+        uint32_t mask = invalidTokenMask16(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#elif defined(PROXY_SCAN_NEON) && defined(__aarch64__)
+    const uint8x16_t nibbles = vld1q_u8(kTokenNibbles.data());
+    const uint8x16_t high_bits = vld1q_u8(kHighBits.data());
+    const uint8x16_t low_mask = vdupq_n_u8(0x0F);
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+        uint8x16_t ok = vandq_u8(vqtbl1q_u8(nibbles, vandq_u8(v, low_mask)),
+                                 vqtbl1q_u8(high_bits, vshrq_n_u8(v, 4)));
+        uint64_t mask = neonMask(vceqq_u8(ok, vdupq_n_u8(0)));
+        if (mask) return i + (__builtin_ctzll(mask) >> 2);
+    }
+#endif
+    for (; i < len; ++i) {
+        if (!kTokenTable[static_cast<unsigned char>(data[i])]) return i;
+    }
+    return len;
+}
+
+bool isTokenChar(char c) {
+    return kTokenTable[static_cast<unsigned char>(c)];
+}
+
+const char* scanKernelName() {
+    return PROXY_SCAN_KERNEL;
+}
@@ -0,0 +1,50 @@
+/*
+ * proxy_scan.hpp -- vectorized byte scanning kernels for the HTTP parser.
+ *
+ * The request parser spends most of its time looking for the next delimiter
+ * (SP, ':', CR, LF) and checking that header names and methods consist of
+ * token characters. These functions do that work 16 or 32 bytes at a time.
+ *
+ * The kernel is chosen at compile time from the target the compiler is
+ * building for:
+ *
+ *   - AVX2 (32 bytes per step) when __AVX2__ is defined,
+ *   - SSE2 (16 bytes per step) when __SSE2__ is defined; token validation
+ *     additionally needs SSSE3 for its table lookup and falls back to the
+ *     scalar table otherwise,
+ *   - NEON (16 bytes per step) when __ARM_NEON is defined,
+ *   - a portable scalar loop otherwise, or when PROXY_SCAN_SCALAR is defined.
+ *
+ * All kernels only ever read inside [data, data + len); the tail that does
+ * not fill a whole vector is handled by the scalar loop.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+/*
+ * scanForAny() functions: Return the offset of the first byte in
+ * [data, data + len) equal to one of the given characters, or `len` if there
+ * is none.
+ */
+size_t scanForAny(const char* data, size_t len, char a, char b);
+size_t scanForAny(const char* data, size_t len, char a, char b, char c);
+
+/*
+ * scanTokenChars() function: Returns the offset of the first byte in
+ * [data, data + len) that is not an RFC 7230 token character
+ * ("!#$%&'*+-.^_`|~", digits and letters), or `len` if all of them are.
+ */
+size_t scanTokenChars(const char* data, size_t len);
+
+/*
+ * isTokenChar() function: Scalar form of the check done by scanTokenChars().
+ */
+bool isTokenChar(char c);
+
+/*
+ * scanKernelName() function: Name of the kernel compiled in ("avx2", "sse2",
+ * "neon" or "scalar"), for logging and benchmarks.
+ */
+const char* scanKernelName();
@@ -0,0 +1,1788 @@
+/*
+ * proxy_server.cpp -- the multi-threaded proxy server.
+ *
+ * Life of a connection on a worker:
+ *
+ *   ReadingRequest  Client bytes are appended to `in` and fed to the
+ *                   connection's RequestParser, which only examines the new
+ *                   bytes. The parsed ParsedRequestView points into `in`.
+ *   Handling        The request is complete. A RequestTask rewrites it for
+ *                   the origin server in place (origin-form target,
+ *                   hop-by-hop headers dropped) and looks it up in the
+ *                   cache, or finds its file under the document root, on
+ *                   this worker or on an idle one that stole it.
+ *                   Nothing else touches the connection meanwhile; if the
+ *                   client fails, that is acted upon once the task is back.
+ *   Resolving       The origin's address was not cached, so a resolver
+ *                   thread is looking it up.
+ *   Connecting      A non-blocking connect() to the origin is in progress.
+ *                   The client is not read in this state or the previous
+ *                   ones, so `in` and the view over it stay valid.
+ *   Following       Another request for the same resource is fetching it
+ *                   (see proxy_flight.hpp); its response is copied to the
+ *                   client as it arrives, and nothing goes upstream.
+ *   Relaying        The request has been sent with one sendmsg() straight
+ *                   from the view's iovecs. From now on bytes are copied in
+ *                   both directions until the response is complete or the
+ *                   origin closes its side.
+ *   Closing         An error response, a cached response or a file is being
+ *                   sent to the client; the connection is closed once it is
+ *                   written, unless a cache hit or a file leaves it open for
+ *                   the next request.
+ *
+ * Persistent clients: once the response to a client that keeps its
+ * connection open has been delivered, complete and delimited, the upstream
+ * goes back to the pool, the request's bytes are dropped from `in` and the
+ * connection starts over with the next request. A pipelining client may
+ * send several requests before the first response; whatever follows a
+ * complete request in `in` is parsed in one go by parsePipelinedRequests(),
+ * and the requests are then served one at a time, so that the responses go
+ * out in order. The client is not read while a request it sent completely
+ * is being served; later requests wait in `in` or in the socket buffer.
+ *
+ * Caching: a GET whose response may be served from the ResponseCache is
+ * answered from it without contacting the origin. Otherwise, if the response
+ * may be stored, a copy of it is kept while it is relayed and handed to the
+ * cache once it is complete. Misses on a resource that is being fetched
+ * already follow that fetch instead of starting their own (see
+ * proxy_flight.hpp).
+ *
+ * Upstream reuse: a complete request without a streamed body asks the origin
+ * to keep the connection open. A ResponseFramer follows the response, and
+ * once it is complete the upstream goes back to the worker's UpstreamPool
+ * for the next request to the same host:port, which skips the connect. A
+ * pooled connection the origin closed before answering is replaced by a new
+ * one and the request sent again, if it is idempotent.
+ *
+ * Static files: with a document root configured, origin-form requests are
+ * answered from StaticFiles (see proxy_static.hpp) instead of being proxied.
+ * The head comes precomputed with the file; a small body is sent from the
+ * file's mapping in the same sendmsg(), a larger one with sendfile().
+ *
+ * Body streaming: the request body is framed by its Content-Length or
+ * chunked coding, and the response body by the ResponseFramer. Body content
+ * the proxy has no use for, which is all of it unless the response is being
+ * captured for the cache, is splice()d from one socket to the other through
+ * a pipe and never copied to user space; only the chunk framing is read.
+ * The worker keeps a few empty pipes around for the next connection.
+ *
+ * Flow control: each direction has one pending buffer and one pipe, of
+ * which at most one holds bytes. While it does the destination is watched
+ * for EPOLLOUT and the source is not read.
+ */
+
+#include "proxy_server.hpp"
+#include "proxy_epoch.hpp"
+#include "proxy_metrics.hpp"
+#include "proxy_trace.hpp"
+#include "proxy_uring.hpp"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Events fetched per epoll_wait() call.
+constexpr int kMaxEvents = 256;
+
+// Bytes read per recv() call.
+constexpr size_t kReadChunk = 16 * 1024;
+
+// How often idle connections are looked for, in milliseconds.
+constexpr int kSweepIntervalMs = 1000;
+
+// Body content is spliced once at least this much of it is expected; less is
+// read and sent.
+constexpr uint64_t kSpliceMinBytes = kReadChunk;
+
+// Bytes moved per splice() call: what a pipe holds by default.
+constexpr size_t kPipeBytes = 64 * 1024;
+
+// Empty pipes a worker keeps for reuse.
+constexpr size_t kMaxSparePipes = 64;
+
+// Requests of a pipelining client parsed ahead of the one being served.
+constexpr size_t kMaxPipelinedRequests = 16;
+
+// Tasks of other workers run per wakeup to steal.
+constexpr size_t kMaxStolenTasks = 64;
+
+// Files up to this size are sent from their mapping along with the head;
+// larger ones with sendfile().
+constexpr uint64_t kInlineFileBytes = 64 * 1024;
+
+const char* statusText(int status) {
+    switch (status) {
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 414: return "URI Too Long";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    default: return "Error";
+    }
+}
+
+// Calls `fn` with each token of the request's Connection headers, blanks
+// around it trimmed.
+template <class Fn>
+void forEachConnectionToken(const ParsedRequestView& request, Fn fn) {
+    for (const ParsedHeaderView& header : request.headers) {
+        if (header.id != HeaderId::Connection) continue;
+        std::string_view list = header.value;
+        while (!list.empty()) {
+            size_t comma = list.find(',');
+            std::string_view token = list.substr(0, comma);
+            while (!token.empty() && (token.front() == ' ' || token.front() == '\t')) token.remove_prefix(1);
+            while (!token.empty() && (token.back() == ' ' || token.back() == '\t')) token.remove_suffix(1);
+            if (!token.empty()) fn(token);
+            if (comma == std::string_view::npos) break;
+            list.remove_prefix(comma + 1);
+        }
+    }
+}
+
+// Whether the client expects the connection to stay open after the
+// response: for HTTP/1.1 unless it says otherwise, for HTTP/1.0 only if it
+// asks.
+bool clientKeepsAlive(const ParsedRequestView& request) {
+    bool close = false, keep_alive = false;
+    forEachConnectionToken(request, [&](std::string_view token) {
+        if (equalsIgnoreCase(token, "close")) close = true;
+        if (equalsIgnoreCase(token, "keep-alive")) keep_alive = true;
+    });
+    return request.version == "HTTP/1.0" ? keep_alive && !close : !close;
+}
+
+// Reads the Content-Length of `request` into `length`.
+// Returns 1 if it has one, 0 if it has none, or -1 if it is malformed
+// (not 1 to 18 digits) or given more than once, even with the same value.
+int requestContentLength(const ParsedRequestView& request, uint64_t& length) {
+    const ParsedHeaderView* found = nullptr;
+    for (const ParsedHeaderView& header : request.headers) {
+        if (header.id != HeaderId::ContentLength) continue;
+        if (found != nullptr) return -1;
+        found = &header;
+    }
+    if (found == nullptr) return 0;
+
+    std::string_view value = found->value;
+    if (value.empty() || value.size() > 18) return -1;
+    length = 0;
+    for (char c : value) {
+        if (c < '0' || c > '9') return -1;
+        length = length * 10 + static_cast<uint64_t>(c - '0');
+    }
+    return 1;
+}
+
+// Whether `header` only concerns the client's hop to the proxy: one of the
+// standard hop-by-hop fields or one the client lists in Connection. The
+// Connection headers themselves are replaced rather than dropped, and the
+// fields that frame the request are needed by the origin whatever the client
+// lists.
+bool hopByHop(const ParsedRequestView& request, const ParsedHeaderView& header) {
+    switch (header.id) {
+    case HeaderId::ProxyConnection:
+    case HeaderId::KeepAlive:
+    case HeaderId::TE:
+    case HeaderId::Trailer:
+    case HeaderId::Upgrade:
+    case HeaderId::ProxyAuthorization: return true;
+    case HeaderId::Connection:
+    case HeaderId::Host:
+    case HeaderId::ContentLength:
+    case HeaderId::TransferEncoding: return false;
+    default: break;
+    }
+    bool listed = false;
+    forEachConnectionToken(request, [&](std::string_view token) {
+        if (equalsIgnoreCase(token, header.key)) listed = true;
+    });
+    return listed;
+}
+
+} // namespace
+
+/*
+ * Request handling shared by the workers
+ */
+
+int openListenSocket(const ServerConfig& config) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.bindAddress.c_str(), &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(fd, config.backlog) < 0) {
+        int saved = errno;
+        ::close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+void pinWorkerThread(size_t index) {
+    // Pin to the index-th CPU this process may run on.
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) return;
+
+    size_t target = index % static_cast<size_t>(CPU_COUNT(&allowed));
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (target-- == 0) {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+            return;
+        }
+    }
+}
+
+int prepareUpstreamRequest(ParsedRequestView& request, std::string& host_storage, NormalizedTarget& target,
+                           bool keep_alive) {
+    if (request.methodId == HttpMethod::Connect || (!request.protocol.empty() && request.protocol != "http")) {
+        return 501;
+    }
+
+    // The origin server is named by an absolute-form target or, for
+    // origin-form requests, by the Host header.
+    std::string_view target_host = request.host;
+    std::string_view target_port = request.port;
+    if (target_host.empty()) {
+        const ParsedHeaderView* host_header = request.getHeader(HeaderId::Host);
+        UriParts parts;
+        if (host_header == nullptr || parseAuthority(host_header->value, parts) != 0) return 400;
+        target_host = parts.host.in(host_header->value);
+        target_port = parts.port.in(host_header->value);
+    }
+    if (target.assign(target_host, target_port, request.path) != 0) return 400;
+
+    // The origin must frame the body as the proxy did: by Transfer-Encoding
+    // over Content-Length (RFC 9112 section 6.3), and by a single valid
+    // length or not at all.
+    uint64_t length;
+    if (request.getHeader(HeaderId::TransferEncoding) != nullptr) {
+        request.removeHeader("Content-Length");
+    } else if (requestContentLength(request, length) < 0) {
+        return 400;
+    }
+
+    // The origin gets a plain origin-form request. Hop-by-hop headers are
+    // meant for the proxy, whose own hop to the origin is kept open only if
+    // the worker can reuse it.
+    request.originForm = true;
+    for (size_t i = 0; i < request.headers.size();) {
+        if (hopByHop(request, request.headers[i])) {
+            request.removeHeader(request.headers[i].key);
+        } else {
+            ++i;
+        }
+    }
+    request.setHeader("Connection", keep_alive ? "keep-alive" : "close");
+    // An absolute-form target overrides whatever Host the client sent; the
+    // origin, and the cache, must not see a Host naming another server.
+    if (!request.host.empty() || request.getHeader(HeaderId::Host) == nullptr) {
+        host_storage.assign(target.host);
+        if (!target.defaultPort()) host_storage.append(":").append(target.port);
+        request.setHeader("Host", host_storage);
+    }
+    return 0;
+}
+
+bool frameRequestBody(const ParsedRequestView& request, BodyFramer& body) {
+    body.expectUntilClose();
+    if (const ParsedHeaderView* coding = request.getHeader(HeaderId::TransferEncoding)) {
+        // Only a final "chunked" coding frames the body.
+        std::string_view value = coding->value;
+        size_t comma = value.rfind(',');
+        std::string_view last = comma == std::string_view::npos ? value : value.substr(comma + 1);
+        while (!last.empty() && (last.front() == ' ' || last.front() == '\t')) last.remove_prefix(1);
+        if (!equalsIgnoreCase(last, "chunked")) return false;
+        body.expectChunked();
+        return true;
+    }
+    uint64_t n = 0;
+    int found = requestContentLength(request, n);
+    if (found < 0) return false;
+    if (found == 0) {
+        body.reset();
+    } else {
+        body.expectLength(n);
+    }
+    return true;
+}
+
+bool requestComplete(const ParsedRequestView& request, size_t body_received) {
+    BodyFramer body;
+    if (!frameRequestBody(request, body)) return false;
+    if (body_received == 0) return body.done();
+    // Only the framing matters here, not the bytes.
+    return body.opaqueBytes() == body_received && body.skip(body_received);
+}
+
+size_t parsePipelinedRequests(std::string_view buffer, size_t offset, std::deque<ParsedRequestView>& out,
+                              size_t max_requests) {
+    RequestParser parser;
+    BodyFramer body;
+    while (offset < buffer.size() && out.size() < max_requests) {
+        std::string_view rest = buffer.substr(offset);
+        ParsedRequestView request;
+        parser.reset();
+        if (parser.feed(rest, request) != ParseStatus::Done) break;
+
+        size_t head_len = parser.consumed(), body_used;
+        if (!frameRequestBody(request, body) ||
+            !body.feed(rest.data() + head_len, rest.size() - head_len, body_used)) {
+            break;
+        }
+        out.push_back(std::move(request));
+        offset += head_len + body_used;
+    }
+    return offset;
+}
+
+int rejectionStatus(ParseError error) {
+    switch (error) {
+    case ParseError::HeadTooLarge:
+    case ParseError::TooManyHeaders: return 431;
+    case ParseError::TargetTooLong: return 414;
+    case ParseError::MethodNotAllowed: return 501;
+    default: return 400;
+    }
+}
+
+std::string errorResponse(int status) {
+    return "HTTP/1.1 " + std::to_string(status) + " " + statusText(status) +
+           "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+}
+
+/*
+ * Endpoint struct
+ *
+ * One socket of a connection, as registered with epoll. The epoll event data
+ * points at the Endpoint so that an event leads straight to its connection.
+ */
+struct Endpoint {
+    enum class Kind { Client, Upstream };
+
+    Kind kind;
+    Connection* conn;
+    int fd = -1;
+    uint32_t events = 0;     // Current epoll interest set.
+    bool registered = false; // Whether `fd` has been added to epoll.
+
+    Endpoint(Kind k, Connection* c) : kind(k), conn(c) {}
+};
+
+/*
+ * RequestTask struct
+ *
+ * The part of handling a request that involves no socket and no state of
+ * the worker, so that any worker can run it.
+ */
+struct RequestTask final : Task {
+    Connection* conn = nullptr;
+    ResponseCache* cache = nullptr; // Null if disabled.
+    FlightTable* flights = nullptr; // Null if the cache is disabled.
+    StaticFiles* files = nullptr;   // Null without a document root.
+
+    void run() override;
+};
+
+/*
+ * Connection struct
+ *
+ * A client connection and, once the request is known, its upstream.
+ */
+struct Connection {
+    enum class State { ReadingRequest, Handling, Following, Resolving, Connecting, Relaying, Closing };
+
+    Endpoint client{Endpoint::Kind::Client, this};
+    Endpoint upstream{Endpoint::Kind::Upstream, this};
+    State state = State::ReadingRequest;
+
+    size_t slot = 0;     // Position in EpollWorker::connections.
+    bool closed = false; // Set by EpollWorker::close(); the object is freed later.
+
+    std::string in;            // Request bytes received from the client.
+    RequestParser parser;      // Incremental parser over `in`.
+    ParsedRequestView request; // The parsed request, pointing into the start of `in`.
+    size_t requestLength = 0;  // Bytes at the start of `in` that go upstream with it.
+    bool persistent = false;   // The client keeps the connection open after the response.
+
+    // Complete requests received after the current one, oldest first,
+    // pointing into `in`.
+    std::deque<ParsedRequestView> pipelined;
+    bool serving = false;  // nextRequest() is running.
+    bool nextDue = false;  // A request finished while it was.
+
+    RequestTask task;     // Queued while Handling.
+    int handled = 0;      // Result of the task: 0, or the status to answer with.
+    bool hungUp = false;  // The client failed while Handling.
+    std::string hostHeader;    // Storage for a Host header the proxy adds.
+    NormalizedTarget target;   // The origin and resource of the request.
+    uint64_t lookup = 0;       // Token of the lookup while Resolving.
+    ResolvedAddress addresses; // The origin's addresses while Connecting.
+    size_t nextAddress = 0;    // The first of `addresses` not tried yet.
+
+    BodyFramer requestBody; // Finds the end of the request body.
+    ResponseFramer framer;  // Finds the end of the response.
+    bool reusable = false;  // Nothing but the complete request went upstream.
+    bool pooled = false;    // The upstream came from the pool; it may turn out to be closed.
+    bool retryable = false; // The request may be sent again on a new connection.
+
+    std::string toUpstream; // Bytes waiting to be written to the upstream.
+    std::string toClient;   // Bytes waiting to be written to the client.
+    SplicePipe toUpstreamPipe; // Body bytes on their way to the upstream.
+    SplicePipe toClientPipe;   // Body bytes on their way to the client.
+    bool clientDone = false;   // The client shut down its sending side.
+    bool upstreamDone = false; // The upstream shut down its sending side.
+
+    HashedKey captureKey;   // Cache key of the response being captured, if any.
+    std::string captured;   // The response so far.
+
+    // The stale entry the request was made conditional on, and the start of
+    // the response, held back until its status shows whether the entry is
+    // still good.
+    std::shared_ptr<const CachedResponse> stale;
+    std::string held;
+
+    // The client's own conditions are met by the cached response or file
+    // that answers it; it gets a 304 instead.
+    bool notModified = false;
+
+    // The flight the request leads or follows, if any. A leader copies
+    // `captured` into it, up to `flightSent` so far; a follower has read it
+    // up to `flightOffset` and waits for more under `flightToken`.
+    std::shared_ptr<Flight> flight;
+    bool leader = false;
+    size_t flightSent = 0;
+    size_t flightOffset = 0;
+    uint64_t flightToken = 0;
+
+    // The response sent in the Closing state: an error, a cache hit or a
+    // file, whose body follows `finalResponse` from its mapping
+    // (`finalBody`) or its descriptor (up to `fileEnd`).
+    std::shared_ptr<const CachedResponse> cached;
+    std::shared_ptr<const StaticFile> file;
+    std::string_view finalResponse;
+    std::string_view finalBody;
+    size_t finalSent = 0; // Of `finalResponse` and `finalBody`.
+    off_t fileOffset = 0;
+    off_t fileEnd = 0;
+
+    StageTimer timer; // Times the request being served.
+    Clock::time_point lastActive = Clock::now();
+
+    // The client should not be read: the request is complete and whatever
+    // it sends next is another request.
+    bool holdsClient() const { return persistent && requestBody.done(); }
+
+    // The upstream can carry another request: the request went out complete
+    // and alone, and the response is complete on a connection the origin
+    // keeps open.
+    bool upstreamReusable() const {
+        return reusable && requestBody.done() && toUpstream.empty() && toUpstreamPipe.bytes == 0 &&
+               framer.reusable();
+    }
+};
+
+void RequestTask::run() {
+    if (files != nullptr && StaticFiles::serves(conn->request)) {
+        conn->handled = files->lookup(conn->request, conn->file);
+        if (conn->file) {
+            conn->notModified = requestNotModified(conn->request, conn->file->etag, conn->file->lastModified);
+        }
+        return;
+    }
+    conn->handled = prepareUpstreamRequest(conn->request, conn->hostHeader, conn->target, conn->reusable);
+    if (conn->handled != 0 || cache == nullptr) return;
+
+    if (ResponseCache::mayServe(conn->request)) {
+        conn->cached = cache->lookup(conn->target.resource, conn->request);
+        if (conn->cached) {
+            conn->notModified = requestNotModified(conn->request, conn->cached->etag, conn->cached->lastModified);
+            return;
+        }
+    }
+    if (!ResponseCache::mayStore(conn->request)) return;
+    conn->captureKey = conn->target.resource;
+
+    // Concurrent misses wait for the first one's response.
+    if (flights != nullptr && Flight::mayShare(conn->request)) {
+        conn->flight = flights->join(conn->target.resource, conn->leader);
+        if (!conn->leader) return;
+    }
+
+    // A stale entry is revalidated rather than fetched again. The client's
+    // conditions are answered here, from the entry, if the origin confirms
+    // it.
+    if (!ResponseCache::mayRevalidate(conn->request)) return;
+    conn->stale = cache->lookupStale(conn->target.resource, conn->request);
+    if (conn->stale) {
+        conn->notModified = requestNotModified(conn->request, conn->stale->etag, conn->stale->lastModified);
+        ResponseCache::makeConditional(conn->request, *conn->stale);
+    }
+}
+
+/*
+ * EpollWorker
+ */
+
+EpollWorker::EpollWorker(const ServerConfig& c, size_t i, ResponseCache* rc, FlightTable* ft, StaticFiles* f,
+                         Resolver* r, Dispatcher* d)
+    : config(c),
+      index(i),
+      cache(rc),
+      flights(ft),
+      files(f),
+      resolver(r),
+      dispatcher(d),
+      pool(c.upstreamMaxIdlePerHost, c.upstreamMaxIdle, c.upstreamIdleTimeoutMs) {}
+
+EpollWorker::~EpollWorker() {
+    if (thread.joinable()) {
+        stop();
+        join();
+    }
+    for (SplicePipe& pipe : sparePipes) {
+        ::close(pipe.readFd);
+        ::close(pipe.writeFd);
+    }
+    if (listenFd >= 0) ::close(listenFd);
+    if (epollFd >= 0) ::close(epollFd);
+    if (wakeFd >= 0) ::close(wakeFd);
+}
+
+int EpollWorker::start() {
+    listenFd = openListenSocket(config);
+    if (listenFd < 0) return -1;
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) return -1;
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    stealFd = dispatcher->stealFd(index);
+    doneFd = dispatcher->doneFd(index);
+    if (wakeFd < 0 || lookups->fd() < 0 || flightQueue->fd() < 0 || stealFd < 0 || doneFd < 0) return -1;
+
+    // The listening, wake-up, lookup, flight and dispatcher descriptors are told
+    // apart from connection endpoints by the address of the member holding
+    // them.
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listenFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev) < 0) return -1;
+    ev.data.ptr = &wakeFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev) < 0) return -1;
+    ev.data.ptr = &lookups;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, lookups->fd(), &ev) < 0) return -1;
+    ev.data.ptr = &flightQueue;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, flightQueue->fd(), &ev) < 0) return -1;
+    ev.data.ptr = &stealFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, stealFd, &ev) < 0) return -1;
+    ev.data.ptr = &doneFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, doneFd, &ev) < 0) return -1;
+
+    thread = std::thread(&EpollWorker::run, this);
+    return 0;
+}
+
+void EpollWorker::stop() {
+    uint64_t one = 1;
+    if (wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0) {
+        TRACE("worker %zu: failed to wake: %s", index, strerror(errno));
+    }
+}
+
+void EpollWorker::join() {
+    if (thread.joinable()) thread.join();
+}
+
+void EpollWorker::run() {
+    if (config.pinThreads) pinWorkerThread(index);
+
+    epoll_event events[kMaxEvents];
+    Clock::time_point last_sweep = Clock::now();
+    bool running = true;
+
+    while (running) {
+        dispatcher->setIdle(index, true);
+        int n = epoll_wait(epollFd, events, kMaxEvents, kSweepIntervalMs);
+        dispatcher->setIdle(index, false);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            TRACE("worker %zu: epoll_wait: %s", index, strerror(errno));
+            break;
+        }
+
+        bool steal = false;
+        for (int i = 0; i < n; ++i) {
+            void* tag = events[i].data.ptr;
+            if (tag == &wakeFd) {
+                running = false;
+            } else if (tag == &listenFd) {
+                acceptConnections();
+            } else if (tag == &lookups) {
+                finishLookups();
+            } else if (tag == &flightQueue) {
+                finishFlights();
+            } else if (tag == &stealFd) {
+                uint64_t count;
+                if (read(stealFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    TRACE("worker %zu: steal wakeup: %s", index, strerror(errno));
+                }
+                steal = true;
+            } else if (tag == &doneFd) {
+                finishTasks();
+            } else {
+                Endpoint* endpoint = static_cast<Endpoint*>(tag);
+                // An earlier event of this batch may have closed it.
+                if (!endpoint->conn->closed) handleEvent(*endpoint, events[i].events);
+            }
+        }
+        runTasks(steal);
+        closed.clear();
+
+        Clock::time_point now = Clock::now();
+        if (now - last_sweep >= std::chrono::milliseconds(kSweepIntervalMs)) {
+            closeIdleConnections();
+            closed.clear();
+            // Frees cache entries this worker evicted last, if it has not
+            // evicted enough since to do so by itself.
+            Epoch::collect();
+            last_sweep = now;
+        }
+    }
+
+    // Tasks still out refer to connections, and other workers may be
+    // running them.
+    while (tasksInFlight > 0) {
+        runTasks(false);
+        if (tasksInFlight == 0) break;
+        pollfd done{doneFd, POLLIN, 0};
+        poll(&done, 1, kSweepIntervalMs);
+        finishTasks();
+    }
+    closed.clear();
+    while (!connections.empty()) close(*connections.back());
+    closed.clear();
+}
+
+void EpollWorker::runTasks(bool steal) {
+    while (Task* task = dispatcher->pop(index)) {
+        task->run();
+        --tasksInFlight;
+        finishHandling(*static_cast<RequestTask*>(task)->conn);
+    }
+    if (!steal) return;
+
+    // Woken to help: take over requests of busy workers for a while, then
+    // get back to this worker's own sockets.
+    for (size_t i = 0; i < kMaxStolenTasks; ++i) {
+        Task* task = dispatcher->steal(index);
+        if (task == nullptr) break;
+        task->run();
+        dispatcher->complete(task);
+    }
+}
+
+void EpollWorker::finishTasks() {
+    uint64_t count;
+    if (read(doneFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        TRACE("worker %zu: task completions: %s", index, strerror(errno));
+    }
+    for (Task* task : dispatcher->finished(index)) {
+        --tasksInFlight;
+        finishHandling(*static_cast<RequestTask*>(task)->conn);
+    }
+}
+
+void EpollWorker::acceptConnections() {
+    for (;;) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                TRACE("worker %zu: accept: %s", index, strerror(errno));
+            }
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        auto conn = std::make_unique<Connection>();
+        conn->client.fd = fd;
+        conn->slot = connections.size();
+        Connection& ref = *conn;
+        connections.push_back(std::move(conn));
+        countEvent(Counter::ConnectionsAccepted);
+        watch(ref.client, EPOLLIN);
+    }
+}
+
+void EpollWorker::handleEvent(Endpoint& endpoint, uint32_t events) {
+    Connection& conn = *endpoint.conn;
+    conn.lastActive = Clock::now();
+
+    if (conn.state == Connection::State::Handling) {
+        // The client is not watched, so it failed or hung up. Its task may
+        // be running on another worker; stop hearing about it until then.
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, endpoint.fd, nullptr);
+        endpoint.registered = false;
+        endpoint.events = 0;
+        conn.hungUp = true;
+        return;
+    }
+
+    if (events & EPOLLERR) {
+        if (endpoint.kind == Endpoint::Kind::Upstream && conn.state == Connection::State::Connecting) {
+            finishConnect(conn); // Tries the next address, if any.
+        } else if (endpoint.kind != Endpoint::Kind::Upstream || !retryUpstream(conn)) {
+            close(conn);
+        }
+        return;
+    }
+    // A hang-up on a socket we are not reading would be reported forever.
+    if ((events & EPOLLHUP) && !(endpoint.events & EPOLLIN) &&
+        conn.state != Connection::State::Connecting) {
+        close(conn);
+        return;
+    }
+
+    if (endpoint.kind == Endpoint::Kind::Client) {
+        if (conn.state == Connection::State::Following) {
+            if (events & EPOLLOUT) pullFlight(conn);
+            return;
+        }
+        if (conn.state == Connection::State::Closing) {
+            if (events & EPOLLOUT) sendFinal(conn);
+            return;
+        }
+        if ((events & EPOLLOUT) && !flush(conn, conn.client, conn.toClient, conn.toClientPipe)) return;
+        if (events & (EPOLLIN | EPOLLHUP)) {
+            if (conn.state == Connection::State::ReadingRequest) {
+                readRequest(conn);
+            } else if (conn.state == Connection::State::Relaying && (conn.client.events & EPOLLIN)) {
+                relay(conn, conn.client, conn.upstream, conn.toUpstream, conn.toUpstreamPipe);
+            } else if ((conn.state == Connection::State::Resolving ||
+                        conn.state == Connection::State::Connecting) && (events & EPOLLHUP)) {
+                close(conn);
+            }
+        }
+        return;
+    }
+
+    if (conn.state == Connection::State::Connecting) {
+        if (events & (EPOLLOUT | EPOLLHUP)) finishConnect(conn);
+        return;
+    }
+    if ((events & EPOLLOUT) && !flush(conn, conn.upstream, conn.toUpstream, conn.toUpstreamPipe)) return;
+    if ((events & (EPOLLIN | EPOLLHUP)) && (conn.upstream.events & EPOLLIN)) {
+        relay(conn, conn.upstream, conn.client, conn.toClient, conn.toClientPipe);
+    }
+}
+
+void EpollWorker::readRequest(Connection& conn) {
+    // The parser fails with HeadTooLarge, answered with 431, once too much
+    // has arrived without the end of the head.
+    for (;;) {
+        size_t old_size = conn.in.size();
+        conn.in.resize(old_size + kReadChunk);
+        ssize_t n = recv(conn.client.fd, &conn.in[old_size], kReadChunk, 0);
+        conn.in.resize(old_size + (n > 0 ? static_cast<size_t>(n) : 0));
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) close(conn);
+            return;
+        }
+        if (n == 0) {
+            // The client went away before sending a complete request.
+            close(conn);
+            return;
+        }
+        if (!conn.timer.running()) conn.timer.begin();
+
+        switch (conn.parser.feed(conn.in, conn.request)) {
+        case ParseStatus::NeedMore:
+            break;
+        case ParseStatus::Error:
+            sendError(conn, rejectionStatus(conn.parser.error()));
+            return;
+        case ParseStatus::Done:
+            dispatchRequest(conn);
+            return;
+        }
+    }
+}
+
+void EpollWorker::dispatchRequest(Connection& conn) {
+    // Pipelined requests were parsed as soon as the one before them was.
+    if (!conn.timer.running()) conn.timer.begin();
+    conn.timer.lap(Stage::Parse);
+    countEvent(Counter::Requests);
+
+    // The upstream may be reused after a request whose body has a known end
+    // and was not followed by anything, however much of it is still to come.
+    // What follows the body of a persistent client's request is its next
+    // request; for other clients it goes upstream too.
+    size_t head_len = conn.request.buf.size();
+    size_t body_received = conn.in.size() - head_len, body_used;
+    bool framed = frameRequestBody(conn.request, conn.requestBody);
+    bool body_done = conn.requestBody.feed(conn.in.data() + head_len, body_received, body_used);
+    conn.persistent = framed && clientKeepsAlive(conn.request);
+    conn.requestLength = conn.persistent ? head_len + body_used : conn.in.size();
+    conn.reusable = pool.enabled() && framed && conn.requestLength == head_len + body_used;
+    if (body_done && conn.persistent && conn.pipelined.empty() && conn.requestLength < conn.in.size()) {
+        parsePipelinedRequests(conn.in, conn.requestLength, conn.pipelined, kMaxPipelinedRequests);
+    }
+    // Only what arrived with the head could be sent again.
+    conn.retryable = isIdempotentMethod(conn.request.methodId) && conn.requestBody.done();
+    conn.framer.reset(conn.request.methodId == HttpMethod::Head);
+
+    conn.state = Connection::State::Handling;
+    conn.task.conn = &conn;
+    conn.task.cache = cache;
+    conn.task.flights = flights;
+    conn.task.files = files;
+    watch(conn.client, 0);
+    if (dispatcher->push(index, &conn.task)) {
+        ++tasksInFlight;
+        return;
+    }
+    // The deque is full; this worker is far behind anyway.
+    conn.task.run();
+    finishHandling(conn);
+}
+
+void EpollWorker::finishHandling(Connection& conn) {
+    if (conn.hungUp) {
+        close(conn);
+        return;
+    }
+    conn.timer.lap(Stage::Handle);
+    if (conn.handled != 0) {
+        sendError(conn, conn.handled);
+        return;
+    }
+    if (conn.cached) {
+        sendCached(conn, std::move(conn.cached));
+        return;
+    }
+    if (conn.file) {
+        sendFile(conn, std::move(conn.file));
+        return;
+    }
+    if (conn.flight && !conn.leader) {
+        follow(conn);
+        return;
+    }
+    startUpstream(conn);
+}
+
+void EpollWorker::startUpstream(Connection& conn) {
+    if (conn.reusable) {
+        int fd = pool.acquire(conn.target.origin);
+        if (fd >= 0) {
+            conn.upstream.fd = fd;
+            conn.pooled = true;
+            countEvent(Counter::UpstreamReuses);
+            forwardRequest(conn);
+            return;
+        }
+    }
+    connectUpstream(conn);
+}
+
+void EpollWorker::connectUpstream(Connection& conn) {
+    ResolvedAddress address;
+    if (resolver->lookup(conn.target, address)) {
+        connectTo(conn, address);
+        return;
+    }
+
+    // Not cached: wait for a resolver thread, without reading the client.
+    conn.lookup = ++nextLookup;
+    resolving.emplace(conn.lookup, &conn);
+    conn.state = Connection::State::Resolving;
+    watch(conn.client, 0);
+    resolver->resolve(conn.target, conn.lookup, lookups);
+}
+
+void EpollWorker::connectTo(Connection& conn, const ResolvedAddress& address) {
+    conn.timer.lap(Stage::Resolve);
+    if (address.error != 0) {
+        sendError(conn, 502);
+        return;
+    }
+    conn.addresses = address;
+    conn.nextAddress = 0;
+    connectNext(conn);
+}
+
+void EpollWorker::connectNext(Connection& conn) {
+    const std::string& host = conn.target.host;
+    const std::string& port = conn.target.port;
+    while (conn.nextAddress < conn.addresses.count) {
+        const ResolvedAddress::Address& address = conn.addresses.addrs[conn.nextAddress++];
+        int fd = socket(address.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || (connect(fd, reinterpret_cast<const sockaddr*>(&address.addr), address.len) < 0 &&
+                       errno != EINPROGRESS)) {
+            TRACE("worker %zu: cannot connect to %s:%s: %s", index, host.c_str(), port.c_str(), strerror(errno));
+            if (fd >= 0) ::close(fd);
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        countEvent(Counter::UpstreamConnects);
+
+        conn.upstream.fd = fd;
+        conn.state = Connection::State::Connecting;
+        watch(conn.client, 0);
+        watch(conn.upstream, EPOLLOUT);
+        return;
+    }
+    sendError(conn, 502);
+}
+
+void EpollWorker::finishLookups() {
+    uint64_t count;
+    if (read(lookups->fd(), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        TRACE("worker %zu: lookup queue: %s", index, strerror(errno));
+    }
+    for (ResolveQueue::Completion& done : lookups->take()) {
+        // The connection may have been closed while it waited.
+        auto found = resolving.find(done.token);
+        if (found == resolving.end()) continue;
+        Connection& conn = *found->second;
+        resolving.erase(found);
+        conn.lastActive = Clock::now();
+        connectTo(conn, done.result);
+    }
+}
+
+void EpollWorker::finishConnect(Connection& conn) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn.upstream.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    if (err != 0) {
+        TRACE("worker %zu: connect: %s", index, strerror(err));
+        // Closing the descriptor also removes it from epoll.
+        ::close(conn.upstream.fd);
+        conn.upstream.fd = -1;
+        conn.upstream.events = 0;
+        conn.upstream.registered = false;
+        connectNext(conn);
+        return;
+    }
+    conn.timer.lap(Stage::Connect);
+    forwardRequest(conn);
+}
+
+void EpollWorker::forwardRequest(Connection& conn) {
+    iovec iov[kMaxRequestIovecs];
+    int count = conn.request.unparseTo(iov, kMaxRequestIovecs - 1);
+    if (count < 0) {
+        sendError(conn, 431);
+        return;
+    }
+
+    // Body bytes that arrived together with the header block.
+    size_t head_len = conn.request.buf.size();
+    if (conn.requestLength > head_len) {
+        iov[count].iov_base = &conn.in[head_len];
+        iov[count].iov_len = conn.requestLength - head_len;
+        ++count;
+    }
+
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = static_cast<size_t>(count);
+    ssize_t sent = sendmsg(conn.upstream.fd, &msg, MSG_NOSIGNAL);
+    if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            if (!retryUpstream(conn)) sendError(conn, 502);
+            return;
+        }
+        sent = 0;
+    }
+    conn.timer.skip();
+
+    // Whatever did not fit in the socket buffer is copied out before the
+    // request buffer is recycled.
+    size_t skip = static_cast<size_t>(sent);
+    for (int i = 0; i < count; ++i) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        conn.toUpstream.append(static_cast<const char*>(iov[i].iov_base) + skip, iov[i].iov_len - skip);
+        skip = 0;
+    }
+
+    // While the response is captured the request stays around: the cache
+    // reads the headers named by Vary from it. It may also have to be sent
+    // again if a pooled upstream turns out to be closed. Requests pipelined
+    // behind it point into the same buffer.
+    if (conn.captureKey.empty() && !conn.pooled && conn.requestLength == conn.in.size()) {
+        conn.request.clear();
+        conn.parser.reset();
+        conn.in.clear();
+        conn.requestLength = 0;
+    }
+    conn.state = Connection::State::Relaying;
+
+    uint32_t readable = EPOLLIN, writable = EPOLLOUT;
+    bool pending = !conn.toUpstream.empty();
+    watch(conn.upstream, pending ? readable | writable : readable);
+    watch(conn.client, pending || conn.holdsClient() ? 0 : readable);
+}
+
+void EpollWorker::relay(Connection& conn, Endpoint& from, Endpoint& to, std::string& pending, SplicePipe& pipe) {
+    bool from_upstream = from.kind == Endpoint::Kind::Upstream;
+
+    // Body content that nothing here looks at bypasses user space.
+    uint64_t opaque = from_upstream ? conn.framer.opaqueBytes() : conn.requestBody.opaqueBytes();
+    if (from_upstream && !conn.captureKey.empty()) opaque = 0;
+    bool spliced = opaque >= kSpliceMinBytes && openPipe(pipe);
+
+    char buf[kReadChunk];
+    ssize_t n = spliced ? splice(from.fd, nullptr, pipe.writeFd, nullptr, std::min<uint64_t>(opaque, kPipeBytes),
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+                        : recv(from.fd, buf, sizeof(buf), 0);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            if (!from_upstream || !retryUpstream(conn)) close(conn);
+        }
+        return;
+    }
+
+    if (n == 0) {
+        if (from_upstream && retryUpstream(conn)) return;
+        if (from_upstream && !conn.held.empty()) {
+            // The head of the response never came complete.
+            close(conn);
+            return;
+        }
+        watch(from, from.events & ~EPOLLIN);
+        if (from_upstream) {
+            // The origin finished its response; close once it is delivered.
+            finishResponse(conn);
+            if (pending.empty() && pipe.bytes == 0) finishExchange(conn);
+        } else {
+            // The client is done sending. Pass the half-close on, unless the
+            // request is complete anyway and the upstream may be reused.
+            conn.clientDone = true;
+            if (!conn.requestBody.done()) conn.reusable = false;
+            if (pending.empty() && pipe.bytes == 0 && !conn.reusable) shutdown(to.fd, SHUT_WR);
+        }
+        return;
+    }
+
+    if (from_upstream && !conn.framer.started()) conn.timer.lap(Stage::FirstByte);
+    bool complete = false;
+    if (spliced) {
+        pipe.bytes += static_cast<size_t>(n);
+        if (from_upstream) {
+            complete = conn.framer.skip(static_cast<uint64_t>(n));
+        } else {
+            conn.requestBody.skip(static_cast<uint64_t>(n));
+        }
+        if (!drainPipe(conn, to, pipe)) return;
+        if (pipe.bytes > 0) {
+            watch(to, to.events | EPOLLOUT);
+            watch(from, from.events & ~EPOLLIN);
+        }
+    } else {
+        std::string_view out;
+        size_t used;
+        if (from_upstream) {
+            bool holding = conn.stale && !conn.framer.headDone();
+            complete = conn.framer.feed(buf, static_cast<size_t>(n), used);
+            if (complete && used != static_cast<size_t>(n)) {
+                // Bytes after the response, which the client would take for
+                // the next one.
+                conn.reusable = false;
+                conn.persistent = false;
+            }
+            if (!conn.captureKey.empty()) capture(conn, buf, static_cast<size_t>(n));
+            out = std::string_view(buf, static_cast<size_t>(n));
+            if (holding) {
+                conn.held.append(buf, static_cast<size_t>(n));
+                if (!conn.framer.headDone()) return;
+                if (conn.framer.status() == 304 && complete) {
+                    finishRevalidation(conn);
+                    return;
+                }
+                // The entry is out of date; the client gets the new response.
+                out = conn.held;
+            }
+            if (conn.flight) publish(conn);
+        } else {
+            if (conn.requestBody.done()) {
+                used = 0;
+            } else {
+                conn.requestBody.feed(buf, static_cast<size_t>(n), used);
+            }
+            if (used != static_cast<size_t>(n) && conn.persistent) {
+                // The start of the next request; it waits until this one
+                // has been answered.
+                const char* old_base = conn.in.data();
+                conn.in.append(buf + used, static_cast<size_t>(n) - used);
+                if (conn.in.data() != old_base && !conn.request.buf.empty()) conn.request.rebase(conn.in.data());
+                n = static_cast<ssize_t>(used);
+            } else if (used != static_cast<size_t>(n)) {
+                // More than the request went upstream.
+                conn.reusable = false;
+            }
+            out = std::string_view(buf, static_cast<size_t>(n));
+        }
+
+        ssize_t sent = send(to.fd, out.data(), out.size(), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close(conn);
+                return;
+            }
+            sent = 0;
+        }
+        if (static_cast<size_t>(sent) < out.size()) {
+            pending.assign(out.substr(static_cast<size_t>(sent)));
+            watch(to, to.events | EPOLLOUT);
+            watch(from, from.events & ~EPOLLIN);
+        }
+        conn.held.clear();
+    }
+
+    if (!from_upstream && conn.holdsClient()) watch(from, from.events & ~EPOLLIN);
+    if (complete) {
+        // The origin may keep the connection open; nothing more is read
+        // from it, and the client moves on once it has the response.
+        watch(from, from.events & ~EPOLLIN);
+        finishResponse(conn);
+        if (pending.empty() && pipe.bytes == 0) finishExchange(conn);
+    }
+}
+
+void EpollWorker::finishResponse(Connection& conn) {
+    conn.upstreamDone = true;
+    if (!conn.captureKey.empty()) {
+        cache->store(std::move(conn.captureKey), conn.request, std::move(conn.captured));
+        conn.captureKey.clear();
+    }
+    // Stored first, so that requests from now on hit the cache.
+    if (conn.flight && conn.flightSent > 0) {
+        flights->finish(*conn.flight);
+        conn.flight.reset();
+    }
+    leaveFlight(conn);
+}
+
+void EpollWorker::finishRevalidation(Connection& conn) {
+    countEvent(Counter::CacheRevalidations);
+    std::shared_ptr<const CachedResponse> entry = cache->revalidate(conn.stale, conn.held);
+    conn.held.clear();
+    conn.captureKey.clear();
+    conn.captured.clear();
+    if (conn.flight) {
+        // Followers get the whole entry.
+        flights->append(*conn.flight, entry->response.data(), entry->response.size());
+        flights->finish(*conn.flight);
+        conn.flight.reset();
+    }
+
+    // The 304 is complete, so the upstream can go back to the pool now.
+    conn.upstreamDone = true;
+    releaseUpstream(conn);
+    conn.upstream.events = 0;
+    conn.upstream.registered = false;
+    conn.framer.reset(false);
+    sendCached(conn, std::move(entry));
+}
+
+bool EpollWorker::retryUpstream(Connection& conn) {
+    if (!conn.pooled || !conn.retryable || !conn.reusable || conn.framer.started()) return false;
+    TRACE("worker %zu: pooled connection to %s was closed, retrying", index, conn.target.origin.text);
+    countEvent(Counter::UpstreamRetries);
+    conn.timer.skip();
+
+    // Closing the descriptor also removes it from epoll.
+    ::close(conn.upstream.fd);
+    conn.upstream.fd = -1;
+    conn.upstream.events = 0;
+    conn.upstream.registered = false;
+    conn.pooled = false;
+    conn.toUpstream.clear();
+    connectUpstream(conn);
+    return true;
+}
+
+void EpollWorker::finishExchange(Connection& conn) {
+    conn.timer.finish(Stage::Transfer);
+    // The client can only tell where the response ended if it was complete
+    // and delimited, and the origin did not announce that it closes.
+    if (!conn.persistent || conn.clientDone || !conn.requestBody.done() || !conn.framer.reusable()) {
+        close(conn);
+        return;
+    }
+    nextRequest(conn);
+}
+
+void EpollWorker::nextRequest(Connection& conn) {
+    releaseUpstream(conn);
+    conn.upstream.events = 0;
+    conn.upstream.registered = false;
+    closePipe(conn.toUpstreamPipe);
+    closePipe(conn.toClientPipe);
+
+    // Drop the request just served; the ones after it move to the front.
+    size_t served = std::min(conn.requestLength, conn.in.size());
+    conn.in.erase(0, served);
+    for (ParsedRequestView& request : conn.pipelined) request.rebase(request.buf.data() - served);
+
+    conn.state = Connection::State::ReadingRequest;
+    conn.request.clear();
+    conn.parser.reset();
+    conn.requestLength = 0;
+    conn.handled = 0;
+    conn.reusable = conn.pooled = conn.retryable = false;
+    conn.upstreamDone = false;
+    conn.toUpstream.clear();
+    conn.toClient.clear();
+    conn.captureKey.clear();
+    conn.captured.clear();
+    conn.cached.reset();
+    conn.file.reset();
+    conn.stale.reset();
+    conn.held.clear();
+    conn.notModified = false;
+    leaveFlight(conn);
+    conn.flightSent = conn.flightOffset = 0;
+    conn.finalResponse = conn.finalBody = std::string_view();
+    conn.finalSent = 0;
+    conn.fileOffset = conn.fileEnd = 0;
+
+    // A cache hit is answered without waiting, from within the call below,
+    // and then the request after it is due. Unwind to the outermost call
+    // instead of recursing once per pipelined request.
+    if (conn.serving) {
+        conn.nextDue = true;
+        return;
+    }
+    conn.serving = true;
+    do {
+        conn.nextDue = false;
+        if (!conn.pipelined.empty()) {
+            conn.request = std::move(conn.pipelined.front());
+            conn.pipelined.pop_front();
+            dispatchRequest(conn);
+            continue;
+        }
+        switch (conn.parser.feed(conn.in, conn.request)) {
+        case ParseStatus::NeedMore:
+            watch(conn.client, EPOLLIN);
+            break;
+        case ParseStatus::Error:
+            sendError(conn, rejectionStatus(conn.parser.error()));
+            break;
+        case ParseStatus::Done:
+            dispatchRequest(conn);
+            break;
+        }
+    } while (conn.nextDue && !conn.closed);
+    conn.serving = false;
+}
+
+void EpollWorker::releaseUpstream(Connection& conn) {
+    if (conn.upstream.fd < 0) return;
+    if (conn.upstreamReusable()) {
+        if (conn.upstream.registered) epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.upstream.fd, nullptr);
+        pool.release(conn.target.origin, conn.upstream.fd);
+    } else {
+        ::close(conn.upstream.fd);
+    }
+    conn.upstream.fd = -1;
+}
+
+bool EpollWorker::flush(Connection& conn, Endpoint& to, std::string& pending, SplicePipe& pipe) {
+    if (!drainPipe(conn, to, pipe)) return false;
+    if (pipe.bytes > 0) return true;
+    while (!pending.empty()) {
+        ssize_t sent = send(to.fd, pending.data(), pending.size(), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            close(conn);
+            return false;
+        }
+        pending.erase(0, static_cast<size_t>(sent));
+    }
+    watch(to, to.events & ~EPOLLOUT);
+
+    // The destination caught up: resume reading its source, or pass on the
+    // end of the stream if the source already finished.
+    bool to_client = to.kind == Endpoint::Kind::Client;
+    Endpoint& from = to_client ? conn.upstream : conn.client;
+    bool from_done = to_client ? conn.upstreamDone : conn.clientDone;
+    if (from_done) {
+        if (to_client) {
+            finishExchange(conn);
+            return false;
+        }
+        if (!conn.reusable) shutdown(to.fd, SHUT_WR);
+    } else if (conn.state == Connection::State::Relaying && (to_client || !conn.holdsClient())) {
+        watch(from, from.events | EPOLLIN);
+    }
+    return true;
+}
+
+bool EpollWorker::drainPipe(Connection& conn, Endpoint& to, SplicePipe& pipe) {
+    while (pipe.bytes > 0) {
+        ssize_t sent = splice(pipe.readFd, nullptr, to.fd, nullptr, pipe.bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            close(conn);
+            return false;
+        }
+        pipe.bytes -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+bool EpollWorker::openPipe(SplicePipe& pipe) {
+    if (pipe.open()) return true;
+    if (!sparePipes.empty()) {
+        pipe = sparePipes.back();
+        sparePipes.pop_back();
+        return true;
+    }
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        TRACE("worker %zu: pipe2: %s", index, strerror(errno));
+        return false;
+    }
+    pipe.readFd = fds[0];
+    pipe.writeFd = fds[1];
+    return true;
+}
+
+void EpollWorker::closePipe(SplicePipe& pipe) {
+    if (!pipe.open()) return;
+    if (pipe.bytes == 0 && sparePipes.size() < kMaxSparePipes) {
+        sparePipes.push_back(pipe);
+    } else {
+        ::close(pipe.readFd);
+        ::close(pipe.writeFd);
+    }
+    pipe = SplicePipe{};
+}
+
+void EpollWorker::capture(Connection& conn, const char* data, size_t len) {
+    if (conn.captured.size() + len > config.cacheMaxObjectBytes) {
+        conn.captureKey.clear();
+        conn.captured = std::string();
+        leaveFlight(conn);
+        return;
+    }
+    conn.captured.append(data, len);
+}
+
+void EpollWorker::publish(Connection& conn) {
+    if (!conn.framer.headDone() || conn.captureKey.empty()) return;
+    if (conn.flightSent == 0 && !responseSharable(conn.captured)) {
+        leaveFlight(conn);
+        return;
+    }
+    flights->append(*conn.flight, conn.captured.data() + conn.flightSent, conn.captured.size() - conn.flightSent);
+    conn.flightSent = conn.captured.size();
+}
+
+void EpollWorker::follow(Connection& conn) {
+    conn.state = Connection::State::Following;
+    conn.flightToken = ++nextFlightToken;
+    following[conn.flightToken] = &conn;
+    watch(conn.client, 0);
+    pullFlight(conn);
+}
+
+void EpollWorker::pullFlight(Connection& conn) {
+    for (;;) {
+        while (!conn.toClient.empty()) {
+            ssize_t sent = send(conn.client.fd, conn.toClient.data(), conn.toClient.size(), MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    watch(conn.client, EPOLLOUT);
+                } else {
+                    close(conn);
+                }
+                return;
+            }
+            conn.toClient.erase(0, static_cast<size_t>(sent));
+        }
+        if (conn.upstreamDone) {
+            watch(conn.client, 0);
+            finishExchange(conn);
+            return;
+        }
+
+        switch (conn.flight->read(conn.flightOffset, conn.toClient, flightQueue, conn.flightToken)) {
+        case Flight::Read::Data: {
+            if (conn.flightOffset == 0) {
+                countEvent(Counter::CoalescedRequests);
+                conn.timer.lap(Stage::FirstByte);
+            }
+            conn.flightOffset += conn.toClient.size();
+            conn.lastActive = Clock::now();
+            // Framed like a relayed response, for finishExchange().
+            size_t used;
+            if (conn.framer.feed(conn.toClient.data(), conn.toClient.size(), used)) {
+                conn.upstreamDone = true;
+                if (used != conn.toClient.size()) conn.persistent = false;
+                conn.toClient.resize(used);
+            }
+            break;
+        }
+        case Flight::Read::Wait:
+            watch(conn.client, 0);
+            return;
+        case Flight::Read::Done:
+            conn.upstreamDone = true;
+            break;
+        case Flight::Read::Abandoned:
+            if (conn.flightOffset > 0) {
+                // Part of the response went out; the rest never comes.
+                close(conn);
+                return;
+            }
+            // Nothing went out: fetch it after all.
+            leaveFlight(conn);
+            conn.framer.reset(false);
+            startUpstream(conn);
+            return;
+        }
+    }
+}
+
+void EpollWorker::finishFlights() {
+    uint64_t count;
+    if (read(flightQueue->fd(), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        TRACE("worker %zu: flight queue: %s", index, strerror(errno));
+    }
+    for (uint64_t token : flightQueue->take()) {
+        // The connection may have been closed, or have given up, meanwhile.
+        auto found = following.find(token);
+        if (found != following.end()) pullFlight(*found->second);
+    }
+}
+
+void EpollWorker::leaveFlight(Connection& conn) {
+    if (!conn.flight) return;
+    if (conn.leader) {
+        flights->abandon(*conn.flight);
+    } else {
+        following.erase(conn.flightToken);
+    }
+    conn.flight.reset();
+    conn.leader = false;
+}
+
+void EpollWorker::sendError(Connection& conn, int status) {
+    countEvent(Counter::ErrorResponses);
+    conn.toClient = errorResponse(status);
+    conn.finalResponse = conn.toClient;
+    conn.finalSent = 0;
+    sendFinal(conn);
+}
+
+void EpollWorker::sendCached(Connection& conn, std::shared_ptr<const CachedResponse> response) {
+    // Framed like a relayed response, for finishExchange().
+    std::string_view out = conn.notModified ? response->notModified : response->response;
+    size_t used;
+    conn.framer.feed(out.data(), out.size(), used);
+    if (used != out.size()) conn.persistent = false;
+    countEvent(Counter::CacheHits);
+    if (conn.notModified) countEvent(Counter::NotModified);
+    conn.cached = std::move(response);
+    conn.finalResponse = out;
+    conn.finalSent = 0;
+    sendFinal(conn);
+}
+
+void EpollWorker::sendFile(Connection& conn, std::shared_ptr<const StaticFile> file) {
+    countEvent(Counter::StaticResponses);
+    if (conn.notModified) countEvent(Counter::NotModified);
+    conn.toClient.assign(conn.notModified ? file->notModified : file->head);
+    conn.toClient += conn.persistent ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    // Framed like a relayed response, for finishExchange().
+    size_t used;
+    bool with_body = conn.request.methodId != HttpMethod::Head && !conn.notModified && file->size > 0;
+    conn.framer.feed(conn.toClient.data(), conn.toClient.size(), used);
+    if (with_body) conn.framer.skip(file->size);
+    conn.finalResponse = conn.toClient;
+    conn.finalSent = 0;
+    if (with_body && file->size <= kInlineFileBytes) {
+        conn.finalBody = file->body;
+    } else if (with_body) {
+        conn.fileOffset = 0;
+        conn.fileEnd = static_cast<off_t>(file->size);
+    }
+    conn.file = std::move(file);
+    sendFinal(conn);
+}
+
+void EpollWorker::sendFinal(Connection& conn) {
+    if (conn.state != Connection::State::Closing) {
+        leaveFlight(conn);
+        if (conn.upstream.fd >= 0) {
+            ::close(conn.upstream.fd);
+            conn.upstream.fd = -1;
+        }
+        conn.state = Connection::State::Closing;
+        watch(conn.client, 0);
+    }
+
+    size_t head_len = conn.finalResponse.size();
+    while (conn.finalSent < head_len + conn.finalBody.size()) {
+        iovec iov[2];
+        size_t count = 0;
+        if (conn.finalSent < head_len) {
+            iov[count++] = {const_cast<char*>(conn.finalResponse.data()) + conn.finalSent, head_len - conn.finalSent};
+        }
+        size_t body_sent = conn.finalSent - std::min(conn.finalSent, head_len);
+        if (body_sent < conn.finalBody.size()) {
+            iov[count++] = {const_cast<char*>(conn.finalBody.data()) + body_sent, conn.finalBody.size() - body_sent};
+        }
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(conn.client.fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(conn.client, EPOLLOUT);
+            } else {
+                close(conn);
+            }
+            return;
+        }
+        conn.finalSent += static_cast<size_t>(sent);
+    }
+    // The body of a large file goes straight from the page cache.
+    while (conn.fileOffset < conn.fileEnd) {
+        ssize_t sent = sendfile(conn.client.fd, conn.file->fd, &conn.fileOffset,
+                                static_cast<size_t>(conn.fileEnd - conn.fileOffset));
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch(conn.client, EPOLLOUT);
+            } else {
+                close(conn);
+            }
+            return;
+        }
+        if (sent == 0) {
+            // The file shrank since it was opened.
+            close(conn);
+            return;
+        }
+    }
+    if (conn.cached || conn.file) {
+        finishExchange(conn);
+    } else {
+        close(conn);
+    }
+}
+
+void EpollWorker::watch(Endpoint& endpoint, uint32_t events) {
+    if (endpoint.fd < 0) return;
+    if (endpoint.registered && endpoint.events == events) return;
+
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.ptr = &endpoint;
+    int op = endpoint.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(epollFd, op, endpoint.fd, &ev) < 0) {
+        TRACE("worker %zu: epoll_ctl: %s", index, strerror(errno));
+        return;
+    }
+    endpoint.registered = true;
+    endpoint.events = events;
+}
+
+void EpollWorker::close(Connection& conn) {
+    if (conn.closed) return;
+    conn.closed = true;
+    countEvent(Counter::ConnectionsClosed);
+    if (conn.state == Connection::State::Resolving) resolving.erase(conn.lookup);
+    leaveFlight(conn);
+    if (conn.client.fd >= 0) ::close(conn.client.fd);
+    releaseUpstream(conn);
+    conn.client.fd = -1;
+    closePipe(conn.toUpstreamPipe);
+    closePipe(conn.toClientPipe);
+
+    // Swap-remove from `connections`, keeping the object alive until the
+    // current batch of events no longer refers to it.
+    size_t slot = conn.slot;
+    closed.push_back(std::move(connections[slot]));
+    if (slot + 1 != connections.size()) {
+        connections[slot] = std::move(connections.back());
+        connections[slot]->slot = slot;
+    }
+    connections.pop_back();
+}
+
+void EpollWorker::closeIdleConnections() {
+    pool.closeExpired();
+    Clock::time_point deadline = Clock::now() - std::chrono::milliseconds(config.idleTimeoutMs);
+    // Walk backwards: close() moves the last connection into the freed slot,
+    // and that one has already been looked at.
+    for (size_t i = connections.size(); i-- > 0;) {
+        Connection& conn = *connections[i];
+        // A connection whose task is out is not idle, and must be left alone.
+        if (conn.lastActive >= deadline || conn.state == Connection::State::Handling) continue;
+        if (conn.state == Connection::State::ReadingRequest && !conn.in.empty()) {
+            // A partial request that never completed, e.g. a slowloris client.
+            sendError(conn, 408);
+            if (!conn.closed) close(conn);
+        } else {
+            close(conn);
+        }
+    }
+}
+
+/*
+ * ProxyServer
+ */
+
+ProxyServer::ProxyServer(const ServerConfig& c) : config(c) {}
+
+ProxyServer::~ProxyServer() {
+    stop();
+}
+
+int ProxyServer::start() {
+    size_t count = config.threads;
+    if (count == 0) count = std::thread::hardware_concurrency();
+    if (count == 0) count = 1;
+
+    if (!config.docroot.empty() && !files) {
+        auto root = std::make_unique<StaticFiles>(config.docroot, config.staticMaxFiles);
+        if (root->open() < 0) {
+            int saved = errno;
+            TRACE("static: cannot open %s: %s", config.docroot, strerror(saved));
+            errno = saved;
+            return -1;
+        }
+        files = std::move(root);
+    }
+    if (config.cacheBytes > 0 && !config.diskCacheDir.empty() && !disk) {
+        auto tier = std::make_unique<DiskCache>(config.diskCacheDir, config.diskCacheBytes, config.diskSegmentBytes);
+        if (tier->open() < 0) {
+            int saved = errno;
+            TRACE("disk: cannot open %s: %s", config.diskCacheDir, strerror(saved));
+            errno = saved;
+            return -1;
+        }
+        disk = std::move(tier);
+    }
+    if (config.cacheBytes > 0 && !cache) {
+        cache = std::make_unique<ResponseCache>(config.cacheBytes);
+        cache->setDiskTier(disk.get());
+        flights = std::make_unique<FlightTable>();
+    }
+    if (!resolver) {
+        resolver = std::make_unique<Resolver>(config.resolverThreads, config.dnsPositiveTtlMs,
+                                              config.dnsNegativeTtlMs);
+    }
+    if (!dispatcher) dispatcher = std::make_unique<Dispatcher>(count);
+
+    for (size_t i = 0; i < count; ++i) {
+        if (startWorker(i) < 0) {
+            int saved = errno;
+            TRACE("worker %zu: failed to start: %s", i, strerror(saved));
+            stop();
+            errno = saved;
+            return -1;
+        }
+    }
+
+    if (config.metricsPort != 0) {
+        metrics = std::make_unique<MetricsServer>(config.metricsAddress, config.metricsPort);
+        if (metrics->start() < 0) {
+            int saved = errno;
+            TRACE("metrics: failed to start: %s", strerror(saved));
+            stop();
+            errno = saved;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int ProxyServer::startWorker(size_t index) {
+#if PROXY_HAVE_IO_URING
+    if (config.engine == ServerConfig::Engine::IoUring) {
+        auto worker = std::make_unique<UringWorker>(config, index, cache.get(), flights.get(), files.get(),
+                                                    resolver.get());
+        if (worker->start() == 0) {
+            workers.push_back(std::move(worker));
+            return 0;
+        }
+        // Anything but a kernel without (the needed parts of) io_uring, or
+        // one that forbids it, is a real error.
+        if (errno != ENOSYS && errno != EINVAL && errno != EPERM && errno != EOPNOTSUPP) return -1;
+        TRACE("worker %zu: io_uring unavailable (%s), using epoll", index, strerror(errno));
+        config.engine = ServerConfig::Engine::Epoll;
+    }
+#endif
+    auto worker = std::make_unique<EpollWorker>(config, index, cache.get(), flights.get(), files.get(),
+                                                resolver.get(), dispatcher.get());
+    if (worker->start() < 0) return -1;
+    workers.push_back(std::move(worker));
+    return 0;
+}
+
+void ProxyServer::stop() {
+    metrics.reset();
+    for (auto& worker : workers) worker->stop();
+    for (auto& worker : workers) worker->join();
+    workers.clear();
+}
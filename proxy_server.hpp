@@ -0,0 +1,458 @@
+/*
+ * proxy_server.hpp -- the multi-threaded proxy server.
+ *
+ * The server runs one event loop per worker thread. Every worker owns:
+ *
+ *   - its own listening socket, bound to the shared port with SO_REUSEPORT
+ *     so that the kernel spreads incoming connections across workers,
+ *   - its own epoll instance, watching that socket and every client and
+ *     upstream socket of the connections it accepted,
+ *   - its own connections, which never migrate to another worker.
+ *
+ * All sockets are non-blocking; no state is shared between workers, so the
+ * request path takes no locks. Each connection is driven by a RequestParser:
+ * bytes from the client are fed to it until the header block is complete,
+ * after which the request is rewritten for the origin server and forwarded
+ * with a single scatter-gather send, and the two sockets are relayed. The
+ * steps in between that need no socket may be taken over by an idle worker;
+ * see proxy_dispatch.hpp.
+ */
+
+#pragma once
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "proxy_cache.hpp"
+#include "proxy_dispatch.hpp"
+#include "proxy_disk.hpp"
+#include "proxy_flight.hpp"
+#include "proxy_metrics.hpp"
+#include "proxy_parse.hpp"
+#include "proxy_resolver.hpp"
+#include "proxy_static.hpp"
+#include "proxy_upstream.hpp"
+#include "proxy_uri.hpp"
+
+/*
+ * ServerConfig struct
+ *
+ * Everything the server can be configured with, filled in by proxy.cpp from
+ * the command line.
+ */
+struct ServerConfig {
+    // How workers wait for and perform socket I/O.
+    enum class Engine {
+        Epoll,  // Readiness notification plus one syscall per operation.
+        IoUring // Batched completion-based I/O; see proxy_uring.hpp.
+    };
+
+    std::string bindAddress = "0.0.0.0"; // IPv4 address to listen on.
+    uint16_t port = 8080;                // Port to listen on.
+    size_t threads = 0;                  // Worker threads; 0 means one per online CPU.
+    bool pinThreads = true;              // Pin worker i to CPU i (modulo the CPU count).
+    int backlog = 1024;                  // listen() backlog of every worker socket.
+    int idleTimeoutMs = 30000;           // Close connections idle for this long.
+    Engine engine = Engine::Epoll;       // Falls back to Epoll if io_uring is unavailable.
+    size_t cacheBytes = 64 << 20;        // Response cache capacity; 0 disables caching.
+    size_t cacheMaxObjectBytes = 1 << 20; // Largest response the cache stores.
+    std::string diskCacheDir;            // Keep a persistent cache tier under it; empty disables it.
+    size_t diskCacheBytes = size_t(1) << 30; // Capacity of the disk tier.
+    size_t diskSegmentBytes = 16 << 20;  // Size of each of its segment files.
+    size_t upstreamMaxIdlePerHost = 8;   // Idle origin connections kept per host:port and worker; 0 disables reuse.
+    size_t upstreamMaxIdle = 256;        // Idle origin connections kept per worker.
+    int upstreamIdleTimeoutMs = 15000;   // Close idle origin connections after this long.
+    size_t resolverThreads = 2;          // Threads running DNS lookups, shared by all workers.
+    int dnsPositiveTtlMs = 60000;        // Cache resolved origin addresses for this long.
+    int dnsNegativeTtlMs = 5000;         // Cache failed lookups for this long.
+    std::string metricsAddress = "127.0.0.1"; // IPv4 address of the /metrics endpoint.
+    uint16_t metricsPort = 0;            // Port of the /metrics endpoint; 0 disables it.
+    std::string docroot;                 // Serve origin-form requests from files under it; empty disables it.
+    size_t staticMaxFiles = 256;         // Files (and missing paths) the open-file cache keeps.
+};
+
+/*
+ * Worker class
+ *
+ * One event loop thread with its own listening socket. Implemented by
+ * EpollWorker below and by UringWorker in proxy_uring.hpp.
+ */
+class Worker {
+public:
+    virtual ~Worker() = default;
+
+    /*
+     * start() method: Creates the listening socket and the event loop's
+     * kernel objects and launches the event loop thread.
+     * Returns 0 on success, -1 on failure (with errno set).
+     */
+    virtual int start() = 0;
+
+    /*
+     * stop() method: Asks the event loop to exit. Safe to call from any
+     * thread; returns immediately.
+     */
+    virtual void stop() = 0;
+
+    /*
+     * join() method: Waits for the event loop thread to exit.
+     */
+    virtual void join() = 0;
+
+    // Number of connections currently open on this worker.
+    virtual size_t connectionCount() const = 0;
+};
+
+/*
+ * Request handling shared by the workers.
+ */
+
+// Enough iovecs to send a request with the maximum number of headers, all of
+// them modified, plus the body bytes received with the head.
+constexpr size_t kMaxRequestIovecs = 4 * ParsedRequestView::kMaxHeaders + 16;
+
+/*
+ * openListenSocket() function: Creates a non-blocking SO_REUSEPORT socket
+ * listening on the configured address and port.
+ * Returns the descriptor, or -1 on failure (with errno set).
+ */
+int openListenSocket(const ServerConfig& config);
+
+/*
+ * pinWorkerThread() function: Pins the calling thread to the index-th CPU
+ * the process may run on (modulo their number).
+ */
+void pinWorkerThread(size_t index);
+
+/*
+ * prepareUpstreamRequest() function: Picks the origin server of a complete
+ * client request and rewrites the request in place for it: origin-form
+ * target, hop-by-hop headers dropped (the standard ones and any the client
+ * lists in Connection), a Connection header asking the origin to keep the
+ * connection open (`keep_alive`) or to close it, and a Host header, which
+ * for an absolute-form target names that target whatever the client sent.
+ * A Content-Length next to a Transfer-Encoding is dropped, and a malformed
+ * or repeated one is rejected with 400.
+ * `host_storage` backs a Host header the proxy sets and must outlive
+ * `request`.
+ * Returns 0 with `target` set to the normalized origin and resource, or the
+ * HTTP status to answer the client with.
+ */
+int prepareUpstreamRequest(ParsedRequestView& request, std::string& host_storage, NormalizedTarget& target,
+                           bool keep_alive);
+
+/*
+ * frameRequestBody() function: Sets `body` up for the body of `request` as
+ * its Content-Length or Transfer-Encoding header describes it.
+ * Returns false if the end of the body cannot be told (a final transfer
+ * coding other than chunked, or a malformed or repeated Content-Length);
+ * `body` then runs until the client closes its side.
+ */
+bool frameRequestBody(const ParsedRequestView& request, BodyFramer& body);
+
+/*
+ * requestComplete() function: True if `request`, of which `body_received`
+ * body bytes arrived with the head, is complete: no Transfer-Encoding and
+ * exactly Content-Length (or no) body bytes. Only then can its origin
+ * connection carry another request afterwards.
+ */
+bool requestComplete(const ParsedRequestView& request, size_t body_received);
+
+/*
+ * parsePipelinedRequests() function: Parses the requests a pipelining client
+ * sent back to back in `buffer`, starting at `offset`, and appends views of
+ * them to `out`, in order, until it holds `max_requests`. One parser serves
+ * the whole batch. A request is only taken once it is complete, framed body
+ * included; parsing stops before the first one that is not, which is left
+ * to the connection's RequestParser.
+ * Returns the offset just past the last request taken.
+ */
+size_t parsePipelinedRequests(std::string_view buffer, size_t offset, std::deque<ParsedRequestView>& out,
+                              size_t max_requests);
+
+/*
+ * errorResponse() function: The canned response sent for an HTTP error
+ * status, after which the connection is closed.
+ */
+std::string errorResponse(int status);
+
+/*
+ * rejectionStatus() function: The status code answering a request the
+ * parser rejected for `error`.
+ */
+int rejectionStatus(ParseError error);
+
+// Per-connection state; defined in proxy_server.cpp.
+struct Connection;
+struct Endpoint;
+
+/*
+ * SplicePipe struct
+ *
+ * A pipe that splice() moves body bytes through on their way from one
+ * socket to another, without copying them to user space.
+ */
+struct SplicePipe {
+    int readFd = -1;
+    int writeFd = -1;
+    size_t bytes = 0; // Spliced in and not yet out.
+
+    bool open() const { return readFd >= 0; }
+};
+
+/*
+ * EpollWorker class
+ *
+ * Worker driving non-blocking sockets from an epoll instance.
+ */
+class EpollWorker : public Worker {
+public:
+    EpollWorker(const ServerConfig& config, size_t index, ResponseCache* cache, FlightTable* flights,
+                StaticFiles* files, Resolver* resolver, Dispatcher* dispatcher);
+    ~EpollWorker() override;
+
+    EpollWorker(const EpollWorker&) = delete;
+    EpollWorker& operator=(const EpollWorker&) = delete;
+
+    int start() override;
+    void stop() override;
+    void join() override;
+    size_t connectionCount() const override { return connections.size(); }
+
+private:
+    // Event loop body, run on the worker thread.
+    void run();
+
+    // Accepts every pending connection on the listening socket.
+    void acceptConnections();
+
+    // Dispatches one epoll event for a client or upstream socket.
+    void handleEvent(Endpoint& endpoint, uint32_t events);
+
+    // Reads request bytes from the client and feeds them to the parser.
+    void readRequest(Connection& conn);
+
+    // Acts on a complete request: frames its body and queues the rest of
+    // its handling as a task.
+    void dispatchRequest(Connection& conn);
+
+    // Goes on with a request whose task has run: answers it with an error,
+    // a file or from the cache, follows the flight it joined, or sends it
+    // upstream.
+    void finishHandling(Connection& conn);
+
+    // Sends the request on a pooled connection to the origin or starts
+    // connecting.
+    void startUpstream(Connection& conn);
+
+    // Runs the tasks this worker queued, and once asked to, some of the
+    // other workers' tasks.
+    void runTasks(bool steal);
+
+    // Finishes the tasks other workers ran.
+    void finishTasks();
+
+    // Finds the address of the origin of the request, from the resolver's
+    // cache or by waiting for a lookup, and connects to it.
+    void connectUpstream(Connection& conn);
+
+    // Starts a non-blocking connect to the resolved origin addresses.
+    void connectTo(Connection& conn, const ResolvedAddress& address);
+
+    // Starts a non-blocking connect to the first of the origin's addresses
+    // that takes one, or answers 502 once none is left.
+    void connectNext(Connection& conn);
+
+    // Connects the connections whose lookups have finished.
+    void finishLookups();
+
+    // Completes a non-blocking connect and sends the rewritten request, or
+    // tries the next address if connecting failed.
+    void finishConnect(Connection& conn);
+
+    // Called when a pooled upstream closed or failed before answering. If
+    // the request may be sent again, starts over on a new connection and
+    // returns true.
+    bool retryUpstream(Connection& conn);
+
+    // Called when the origin answered a revalidation with 304: refreshes
+    // the stale entry and answers the client from it.
+    void finishRevalidation(Connection& conn);
+
+    // Sends the rewritten request head and any body bytes already received.
+    void forwardRequest(Connection& conn);
+
+    // Appends response bytes to the copy being made for the cache, giving
+    // up once the response is too large to store.
+    void capture(Connection& conn, const char* data, size_t len);
+
+    // Copies what the leader of a flight has captured to the flight, once
+    // the head shows that the response may be shared, or ends the flight if
+    // it may not.
+    void publish(Connection& conn);
+
+    // Makes `conn` a follower of the flight it joined.
+    void follow(Connection& conn);
+
+    // Sends a follower what its flight has for it, and goes on as
+    // finishExchange() once it has all of it. A follower whose leader gave
+    // up before sending anything goes upstream itself.
+    void pullFlight(Connection& conn);
+
+    // Goes on with the followers whose flights have more for them.
+    void finishFlights();
+
+    // Drops the flight of `conn`, ending it if `conn` leads it.
+    void leaveFlight(Connection& conn);
+
+    // Copies bytes from `from` to `to` once the request has been forwarded.
+    // Body content is spliced through `pipe` rather than read, unless the
+    // response is being captured.
+    void relay(Connection& conn, Endpoint& from, Endpoint& to, std::string& pending, SplicePipe& pipe);
+
+    // The origin is done with the response, by completing it or by closing
+    // the connection: stores it in the cache if it was captured.
+    void finishResponse(Connection& conn);
+
+    // The response has been delivered to the client. Serves the next
+    // request of a client that keeps the connection open, or closes it.
+    void finishExchange(Connection& conn);
+
+    // Starts on the request after the one just served: the next one already
+    // parsed, or whatever the client has sent of it.
+    void nextRequest(Connection& conn);
+
+    // Hands a reusable upstream back to the pool, or closes it.
+    void releaseUpstream(Connection& conn);
+
+    // Writes pending bytes to `to`. Returns false if the connection was
+    // closed or has moved on to the next request.
+    bool flush(Connection& conn, Endpoint& to, std::string& pending, SplicePipe& pipe);
+
+    // Splices the bytes in `pipe` out to `to`, as many as it takes.
+    // Returns false if the connection was closed.
+    bool drainPipe(Connection& conn, Endpoint& to, SplicePipe& pipe);
+
+    // Gives `pipe` a spare pipe or a new one. Returns false if none could
+    // be created.
+    bool openPipe(SplicePipe& pipe);
+
+    // Keeps `pipe` as a spare if it is empty, closes it otherwise.
+    void closePipe(SplicePipe& pipe);
+
+    // Queues a canned error response and closes the connection once sent.
+    void sendError(Connection& conn, int status);
+
+    // Answers the client from the cache, then goes on as finishExchange().
+    void sendCached(Connection& conn, std::shared_ptr<const CachedResponse> response);
+
+    // Answers the client with a file from the document root, then goes on
+    // as finishExchange().
+    void sendFile(Connection& conn, std::shared_ptr<const StaticFile> file);
+
+    // Writes the rest of the final response of a Closing connection.
+    void sendFinal(Connection& conn);
+
+    // Registers or updates the epoll interest set of `endpoint`.
+    void watch(Endpoint& endpoint, uint32_t events);
+
+    // Closes both sockets of `conn`, or hands a reusable upstream back to
+    // the pool; the object is freed after the current batch of events has
+    // been processed.
+    void close(Connection& conn);
+
+    // Closes connections that have been idle for longer than the timeout.
+    void closeIdleConnections();
+
+    const ServerConfig& config;
+    const size_t index;
+    ResponseCache* const cache; // Shared by all workers; null if disabled.
+    FlightTable* const flights; // Shared by all workers; null if the cache is disabled.
+    StaticFiles* const files; // Shared by all workers; null without a document root.
+    Resolver* const resolver; // Shared by all workers.
+    Dispatcher* const dispatcher; // Shared by all workers.
+    UpstreamPool pool;
+    int listenFd = -1;
+    int epollFd = -1;
+    int wakeFd = -1;
+    std::thread thread;
+
+    // Lookups of this worker's connections; the resolver may outlive it.
+    std::shared_ptr<ResolveQueue> lookups = std::make_shared<ResolveQueue>();
+    uint64_t nextLookup = 0;
+    std::unordered_map<uint64_t, Connection*> resolving; // By lookup token.
+
+    // Followers of this worker waiting for flights, which other workers lead.
+    std::shared_ptr<FlightQueue> flightQueue = std::make_shared<FlightQueue>();
+    uint64_t nextFlightToken = 0;
+    std::unordered_map<uint64_t, Connection*> following; // By flight token.
+
+    // This worker's descriptors in the dispatcher, and its tasks not yet
+    // finished.
+    int stealFd = -1;
+    int doneFd = -1;
+    size_t tasksInFlight = 0;
+
+    // Open connections; each one stores its own position for O(1) removal.
+    std::vector<std::unique_ptr<Connection>> connections;
+
+    // Connections closed during the current batch of events.
+    std::vector<std::unique_ptr<Connection>> closed;
+
+    // Empty pipes kept for the next body to be spliced.
+    std::vector<SplicePipe> sparePipes;
+};
+
+/*
+ * ProxyServer class
+ *
+ * Owns the workers and their lifetime.
+ */
+class ProxyServer {
+public:
+    explicit ProxyServer(const ServerConfig& config);
+    ~ProxyServer();
+
+    /*
+     * start() method: Opens the document root if one is configured, then
+     * starts every worker, on the configured engine if this kernel supports
+     * it and on epoll otherwise, and the /metrics endpoint if it is
+     * configured.
+     * Returns 0 on success, -1 on failure (workers already started are
+     * stopped again).
+     */
+    int start();
+
+    /*
+     * stop() method: Asks every worker and the /metrics endpoint to exit and
+     * waits for them.
+     */
+    void stop();
+
+    // Number of workers that were started.
+    size_t workerCount() const { return workers.size(); }
+
+private:
+    // Creates and starts worker `index` on the configured engine.
+    // Returns 0 on success, -1 on failure (with errno set).
+    int startWorker(size_t index);
+
+    ServerConfig config;
+    std::unique_ptr<DiskCache> disk; // Null unless configured; outlives the cache it backs.
+    std::unique_ptr<ResponseCache> cache;
+    std::unique_ptr<FlightTable> flights; // Null if the cache is disabled.
+    std::unique_ptr<StaticFiles> files; // Null unless configured.
+    std::unique_ptr<Resolver> resolver;
+    std::unique_ptr<Dispatcher> dispatcher;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::unique_ptr<MetricsServer> metrics; // Null unless configured.
+};
@@ -0,0 +1,273 @@
+/*
+ * proxy_static.cpp -- files served from a document root.
+ */
+
+#include "proxy_static.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "proxy_trace.hpp"
+
+namespace {
+
+// How long a cached entry is trusted before its path is stat()ed again.
+constexpr auto kRevalidateInterval = std::chrono::seconds(1);
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+struct ContentType {
+    const char* extension;
+    const char* type;
+};
+
+constexpr ContentType kContentTypes[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm", "text/html; charset=utf-8"},
+    {"css", "text/css; charset=utf-8"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"ico", "image/vnd.microsoft.icon"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+};
+
+const char* contentType(std::string_view path) {
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if (dot == std::string_view::npos || (slash != std::string_view::npos && dot < slash)) {
+        return "application/octet-stream";
+    }
+    std::string_view extension = path.substr(dot + 1);
+    for (const ContentType& entry : kContentTypes) {
+        if (equalsIgnoreCase(extension, entry.extension)) return entry.type;
+    }
+    return "application/octet-stream";
+}
+
+// An IMF-fixdate, as Last-Modified has it.
+std::string httpDate(time_t when) {
+    tm utc;
+    char text[64];
+    if (gmtime_r(&when, &utc) == nullptr) return std::string();
+    size_t n = strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S GMT", &utc);
+    return std::string(text, n);
+}
+
+int64_t mtimeNs(const struct stat& st) {
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// The status answering a request for a path open() failed on.
+int openStatus(int error) {
+    return error == EACCES || error == EPERM ? 403 : 404;
+}
+
+} // namespace
+
+StaticFile::~StaticFile() {
+    if (!body.empty()) munmap(const_cast<char*>(body.data()), body.size());
+    if (fd >= 0) ::close(fd);
+}
+
+bool mapStaticPath(std::string_view target, std::string& out) {
+    out.clear();
+    if (target.empty() || target.front() != '/') return false;
+    target = target.substr(0, target.find_first_of("?#"));
+
+    // Decoded first, so that an escaped '/' or '.' is checked like any other.
+    std::string decoded;
+    decoded.reserve(target.size());
+    for (size_t i = 0; i < target.size(); ++i) {
+        char c = target[i];
+        if (c == '%') {
+            if (i + 2 >= target.size()) return false;
+            int high = hexValue(target[i + 1]);
+            int low = hexValue(target[i + 2]);
+            if (high < 0 || low < 0) return false;
+            c = static_cast<char>(high * 16 + low);
+            i += 2;
+        }
+        if (c == '\0') return false;
+        decoded += c;
+    }
+
+    size_t begin = 0;
+    while (begin < decoded.size()) {
+        size_t end = std::min(decoded.find('/', begin), decoded.size());
+        std::string_view segment(decoded.data() + begin, end - begin);
+        if (segment == "." || segment == "..") return false;
+        if (!segment.empty()) {
+            if (!out.empty()) out += '/';
+            out.append(segment);
+        }
+        begin = end + 1;
+    }
+    if (decoded.back() == '/') {
+        if (!out.empty()) out += '/';
+        out += "index.html";
+    }
+    return true;
+}
+
+/*
+ * StaticFiles
+ */
+
+StaticFiles::StaticFiles(std::string r, size_t max_entries)
+    : root(std::move(r)), maxPerShard(std::max<size_t>(1, max_entries / kShards)) {}
+
+StaticFiles::~StaticFiles() {
+    if (rootFd >= 0) ::close(rootFd);
+}
+
+int StaticFiles::open() {
+    rootFd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return rootFd < 0 ? -1 : 0;
+}
+
+int StaticFiles::lookup(const ParsedRequestView& request, std::shared_ptr<const StaticFile>& out) {
+    out.reset();
+    if (request.methodId != HttpMethod::Get && request.methodId != HttpMethod::Head) return 405;
+    HashedKey key;
+    if (!mapStaticPath(request.path, key.text)) return 400;
+    key.hash = hashKey(key.text);
+
+    Shard& shard = shards[key.hash % kShards];
+    Clock::time_point now = Clock::now();
+    Entry entry;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            const Entry& cached = *it->second;
+            if (now - cached.checked < kRevalidateInterval) {
+                out = cached.file;
+                return cached.status;
+            }
+            entry = cached;
+        }
+    }
+
+    // Opened or stat()ed without the lock; two requests for the same stale
+    // path may both do it, and the second one to finish wins.
+    if (entry.path.empty() || !unchanged(entry)) {
+        entry = Entry();
+        entry.path = std::move(key);
+        load(entry);
+    }
+    entry.checked = now;
+    out = entry.file;
+    int status = entry.status;
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    store(shard, std::move(entry));
+    return status;
+}
+
+size_t StaticFiles::entries() const {
+    size_t total = 0;
+    for (Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        total += shard.lru.size();
+    }
+    return total;
+}
+
+void StaticFiles::load(Entry& entry) const {
+    const std::string& path = entry.path.text;
+    int fd = openat(rootFd, path.c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if (fd < 0) {
+        entry.status = openStatus(errno);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        // Directories are only served through their index.html.
+        ::close(fd);
+        entry.status = 404;
+        return;
+    }
+
+    auto file = std::make_shared<StaticFile>();
+    file->fd = fd;
+    file->size = static_cast<uint64_t>(st.st_size);
+    file->mtime = st.st_mtim.tv_sec;
+    if (st.st_size > 0) {
+        void* mem = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+            TRACE("static: mmap %s: %s", path, strerror(errno));
+            entry.status = 500;
+            return;
+        }
+        file->body = std::string_view(static_cast<const char*>(mem), static_cast<size_t>(st.st_size));
+    }
+
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%llx-%llx\"", static_cast<unsigned long long>(st.st_mtim.tv_sec),
+             static_cast<unsigned long long>(st.st_size));
+    file->etag = etag;
+    file->lastModified = httpDate(file->mtime);
+    file->head = "HTTP/1.1 200 OK\r\nContent-Type: ";
+    file->head += contentType(path);
+    file->head += "\r\nContent-Length: " + std::to_string(file->size);
+    file->head += "\r\nLast-Modified: " + file->lastModified;
+    file->head += "\r\nETag: " + file->etag + "\r\n";
+    file->notModified = "HTTP/1.1 304 Not Modified\r\nLast-Modified: " + file->lastModified;
+    file->notModified += "\r\nETag: " + file->etag + "\r\n";
+
+    entry.file = std::move(file);
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.size = st.st_size;
+    entry.mtimeNs = mtimeNs(st);
+}
+
+bool StaticFiles::unchanged(const Entry& entry) const {
+    struct stat st;
+    if (fstatat(rootFd, entry.path.text.c_str(), &st, 0) < 0) return !entry.file && openStatus(errno) == entry.status;
+    return entry.file && st.st_dev == entry.dev && st.st_ino == entry.ino && st.st_size == entry.size &&
+           mtimeNs(st) == entry.mtimeNs;
+}
+
+void StaticFiles::store(Shard& shard, Entry entry) {
+    auto it = shard.index.find(entry.path);
+    if (it != shard.index.end()) {
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    shard.lru.push_front(std::move(entry));
+    shard.index.emplace(shard.lru.front().path, shard.lru.begin());
+    while (shard.lru.size() > maxPerShard) {
+        shard.index.erase(shard.lru.back().path);
+        shard.lru.pop_back();
+    }
+}
@@ -0,0 +1,169 @@
+/*
+ * proxy_static.hpp -- files served from a document root.
+ *
+ * With a document root configured, the proxy also serves as a plain web
+ * server: requests in origin form ("GET /index.html") are answered with the
+ * file their path names under the root, while absolute-form requests are
+ * proxied as before. Serving a file takes no read() and no copy through the
+ * proxy's own buffers:
+ *
+ *   - StaticFiles keeps an LRU cache of the files it has opened, shared by
+ *     all workers and split into shards by the hash of the path. An entry
+ *     holds the open descriptor, the result of its fstat(), a read-only
+ *     mapping of the whole file and the head of its 200 response, with
+ *     Content-Type, Content-Length, Last-Modified and ETag worked out once.
+ *     Lookups of a hot file are one hash probe under the shard's mutex.
+ *   - Paths that name no file are cached too, so a missing favicon costs no
+ *     open() per request either.
+ *   - An entry is trusted for a second; the lookup after that stat()s the
+ *     path again and opens the file anew if its inode, size or modification
+ *     time changed. Files should be replaced by rename() rather than
+ *     rewritten in place, which clients reading the old mapping could see.
+ *   - A conditional request (If-None-Match, If-Modified-Since) that the
+ *     file's validators meet is answered with a 304 head, also worked out
+ *     once, and no body.
+ *   - Small bodies go out from the mapping with the head, in one send;
+ *     EpollWorker sends larger ones with sendfile() from the descriptor and
+ *     UringWorker, as io_uring has no sendfile, from the mapping.
+ *
+ * Only GET and HEAD are served. Paths are percent-decoded and may not
+ * contain "." or ".." segments; a path ending in '/' names the index.html
+ * of that directory. Symbolic links under the root are followed.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "proxy_parse.hpp"
+#include "proxy_uri.hpp"
+
+/*
+ * StaticFile struct
+ *
+ * One open file and its response head. Immutable once cached and handed out
+ * as a shared pointer, so a worker can keep sending it after it has been
+ * evicted or replaced; the descriptor and the mapping go with the last
+ * reference.
+ */
+struct StaticFile {
+    int fd = -1;
+    uint64_t size = 0;
+    time_t mtime = 0;
+    std::string etag;         // Quoted, as in the ETag header.
+    std::string lastModified; // As in the Last-Modified header.
+
+    // Status line and headers up to, but not including, the Connection
+    // header and the blank line that the worker adds: of the 200, and of
+    // the 304 answering a request whose conditions the file meets.
+    std::string head;
+    std::string notModified;
+
+    // The whole file, mapped; empty for an empty file.
+    std::string_view body;
+
+    StaticFile() = default;
+    ~StaticFile();
+
+    StaticFile(const StaticFile&) = delete;
+    StaticFile& operator=(const StaticFile&) = delete;
+};
+
+/*
+ * mapStaticPath() function: Turns the path of an origin-form request target
+ * into a path relative to the document root: the query is dropped, escapes
+ * are decoded and "index.html" is appended to a directory.
+ * Returns false if the path is malformed, contains a NUL byte or a "." or
+ * ".." segment.
+ */
+bool mapStaticPath(std::string_view target, std::string& out);
+
+/*
+ * StaticFiles class
+ *
+ * The document root and the cache of files opened under it. Thread-safe.
+ */
+class StaticFiles {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /*
+     * Constructor: Serves the files under `root`, keeping at most
+     * `max_entries` of them (and of the paths found missing) cached.
+     */
+    StaticFiles(std::string root, size_t max_entries);
+    ~StaticFiles();
+
+    StaticFiles(const StaticFiles&) = delete;
+    StaticFiles& operator=(const StaticFiles&) = delete;
+
+    /*
+     * open() method: Opens the document root.
+     * Returns 0 on success, -1 on failure (with errno set).
+     */
+    int open();
+
+    /*
+     * serves() method: True if `request` is answered from the document root
+     * rather than proxied: it is in origin form.
+     */
+    static bool serves(const ParsedRequestView& request) { return request.host.empty(); }
+
+    /*
+     * lookup() method: Finds the file that answers `request`, from the cache
+     * or by opening it. May block on the file system.
+     * Returns 0 with `out` set, or the HTTP status to answer with instead.
+     */
+    int lookup(const ParsedRequestView& request, std::shared_ptr<const StaticFile>& out);
+
+    // Cached entries, files and missing paths.
+    size_t entries() const;
+
+private:
+    // A cached path, with the file it names or null if it names none.
+    struct Entry {
+        HashedKey path;
+        std::shared_ptr<const StaticFile> file;
+        int status = 0; // The error status for a path that names no file.
+        // What fstat() said of the file, to tell whether the path still
+        // names it.
+        dev_t dev = 0;
+        ino_t ino = 0;
+        off_t size = 0;
+        int64_t mtimeNs = 0;
+        Clock::time_point checked; // When the path was last opened or stat()ed.
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru; // Most recently used first.
+        std::unordered_map<HashedKey, std::list<Entry>::iterator, HashedKeyHash> index;
+    };
+
+    static constexpr size_t kShards = 16;
+
+    // Opens `path` into `entry`, or records why it cannot be served.
+    void load(Entry& entry) const;
+
+    // True if the file of `entry` is still what `path` names.
+    bool unchanged(const Entry& entry) const;
+
+    // Puts `entry` in `shard` in front of the LRU list, replacing any entry
+    // for its path; the mutex must be held.
+    void store(Shard& shard, Entry entry);
+
+    const std::string root;
+    const size_t maxPerShard;
+    int rootFd = -1;
+    mutable Shard shards[kShards];
+};
@@ -0,0 +1,290 @@
+/*
+ * proxy_trace.cpp -- per-thread binary tracing.
+ *
+ * A dump is written in the byte order of the machine, for proxy_tracedump
+ * on the same machine:
+ *
+ *   "PXTRACE1"
+ *   u64 base ticks, i64 CLOCK_REALTIME ns at the base, f64 ticks per ns
+ *   u32 site count, then per site, in id order:
+ *       u32 line, then the file, format and signature, each as u32 length
+ *       and bytes
+ *   u32 ring count, then per ring: u64 event count and the TraceRecords,
+ *       oldest first
+ */
+
+#include "proxy_trace.hpp"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct Clocks {
+    uint64_t ticks;
+    int64_t monotonicNs;
+    int64_t realtimeNs;
+};
+
+int64_t nanoseconds(clockid_t clock) {
+    timespec now;
+    clock_gettime(clock, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+Clocks readClocks() {
+    return Clocks{traceTicks(), nanoseconds(CLOCK_MONOTONIC), nanoseconds(CLOCK_REALTIME)};
+}
+
+// Taken at startup; the rate of the ticks is measured from here to a dump.
+const Clocks baseClocks = readClocks();
+
+std::atomic<trace_detail::Ring*> rings{nullptr};
+
+std::mutex sitesMutex;
+
+// Enrolled sites, by id - 1. Guarded by sitesMutex.
+std::vector<const TraceSite*>& siteTable() {
+    static std::vector<const TraceSite*> table;
+    return table;
+}
+
+// Gives the ring back when its thread exits. Events already recorded stay
+// in it for dumps.
+struct RingOwner {
+    trace_detail::Ring* ring = nullptr;
+
+    ~RingOwner() {
+        if (ring == nullptr) return;
+        trace_detail::threadRing = nullptr;
+        ring->inUse.store(false, std::memory_order_release);
+    }
+};
+
+thread_local RingOwner ringOwner;
+
+// Appends `length` and `bytes` to `out`.
+void appendString(std::string& out, const char* bytes, size_t length) {
+    uint32_t n = static_cast<uint32_t>(length);
+    out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+    out.append(bytes, length);
+}
+
+template <class T>
+void appendValue(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Formats one conversion with `spec`, a printf conversion specification.
+template <class T>
+void appendFormatted(std::string& out, const std::string& spec, T value) {
+    char buffer[256];
+    int n = std::snprintf(buffer, sizeof(buffer), spec.c_str(), value);
+    if (n < 0) return;
+    if (static_cast<size_t>(n) < sizeof(buffer)) {
+        out.append(buffer, static_cast<size_t>(n));
+        return;
+    }
+    std::string big(static_cast<size_t>(n) + 1, '\0');
+    std::snprintf(&big[0], big.size(), spec.c_str(), value);
+    out.append(big, 0, static_cast<size_t>(n));
+}
+
+// Reads the stored arguments of an event in turn.
+class PayloadReader {
+public:
+    PayloadReader(const unsigned char* p, size_t n) : cursor(p), end(p + n) {}
+
+    bool integer(uint64_t& value) {
+        if (static_cast<size_t>(end - cursor) < sizeof(value)) return false;
+        std::memcpy(&value, cursor, sizeof(value));
+        cursor += sizeof(value);
+        return true;
+    }
+
+    bool string(std::string& value) {
+        if (cursor == end || static_cast<size_t>(end - cursor) < 1u + *cursor) return false;
+        size_t n = *cursor++;
+        value.assign(reinterpret_cast<const char*>(cursor), n);
+        cursor += n;
+        return true;
+    }
+
+private:
+    const unsigned char* cursor;
+    const unsigned char* end;
+};
+
+} // namespace
+
+trace_detail::Ring* trace_detail::attachThread() {
+    Ring* ring = nullptr;
+    for (Ring* r = rings.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        bool expected = false;
+        if (!r->inUse.load(std::memory_order_relaxed) &&
+            r->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            ring = r;
+            break;
+        }
+    }
+    if (ring == nullptr) {
+        ring = new Ring;
+        ring->inUse.store(true, std::memory_order_relaxed);
+        ring->next = rings.load(std::memory_order_relaxed);
+        while (!rings.compare_exchange_weak(ring->next, ring, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+    ring->thread = static_cast<uint32_t>(syscall(SYS_gettid));
+    ringOwner.ring = ring;
+    threadRing = ring;
+    return ring;
+}
+
+uint32_t TraceSite::enroll(const char* tags) {
+    std::lock_guard<std::mutex> lock(sitesMutex);
+    uint32_t current = id.load(std::memory_order_relaxed);
+    if (current != 0) return current;
+    std::vector<const TraceSite*>& table = siteTable();
+    table.push_back(this);
+    signature = tags;
+    current = static_cast<uint32_t>(table.size());
+    id.store(current, std::memory_order_release);
+    return current;
+}
+
+void TraceSite::echo(const TraceRecord& record) const {
+    std::string line = traceFormat(format, signature, record.payload, record.length);
+    line += '\n';
+    fwrite(line.data(), 1, line.size(), stderr);
+}
+
+std::string traceFormat(const char* format, const char* signature, const unsigned char* payload, size_t length) {
+    PayloadReader args(payload, length);
+    size_t next = 0;
+    std::string out;
+    // Takes the next argument as an integer, for a conversion or a '*'.
+    auto integer = [&](uint64_t& value) { return signature[next] != '\0' && args.integer(value) && ++next; };
+
+    for (const char* p = format; *p != '\0'; ++p) {
+        if (*p != '%') {
+            out += *p;
+            continue;
+        }
+        if (p[1] == '%') {
+            out += '%';
+            ++p;
+            continue;
+        }
+        // Rebuilds the specification with the '*' replaced by the stored
+        // values and the length modifiers by those of the stored types.
+        std::string spec = "%";
+        ++p;
+        while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') spec += *p++;
+        for (int part = 0; part < 2; ++part) {
+            if (*p == '*') {
+                uint64_t value;
+                if (!integer(value)) return out + "<bad trace arguments>";
+                spec += std::to_string(static_cast<int>(static_cast<int64_t>(value)));
+                ++p;
+            }
+            while (*p >= '0' && *p <= '9') spec += *p++;
+            if (part == 0 && *p == '.') spec += *p++;
+            else break;
+        }
+        while (*p == 'h' || *p == 'l' || *p == 'L' || *p == 'j' || *p == 'z' || *p == 't') ++p;
+        if (*p == '\0') break;
+
+        char conversion = *p;
+        char tag = signature[next];
+        uint64_t value = 0;
+        std::string text;
+        bool ok = tag == 's' ? args.string(text) : tag != '\0' && args.integer(value);
+        if (!ok) return out + "<bad trace arguments>";
+        ++next;
+        switch (tag) {
+        case 's':
+            appendFormatted(out, spec + 's', text.c_str());
+            break;
+        case 'p':
+            appendFormatted(out, spec + 'p', reinterpret_cast<void*>(static_cast<uintptr_t>(value)));
+            break;
+        case 'f': {
+            double d;
+            std::memcpy(&d, &value, sizeof(d));
+            appendFormatted(out, spec + conversion, d);
+            break;
+        }
+        default:
+            if (conversion == 'c') appendFormatted(out, spec + 'c', static_cast<int>(value));
+            else if (tag == 'i') appendFormatted(out, spec + "ll" + conversion, static_cast<long long>(value));
+            else appendFormatted(out, spec + "ll" + conversion, static_cast<unsigned long long>(value));
+            break;
+        }
+    }
+    return out;
+}
+
+int traceDump(const char* path) {
+    std::string out = "PXTRACE1";
+    Clocks now = readClocks();
+    int64_t elapsed = now.monotonicNs - baseClocks.monotonicNs;
+    double ticks_per_ns =
+        elapsed > 0 ? static_cast<double>(now.ticks - baseClocks.ticks) / static_cast<double>(elapsed) : 1.0;
+    appendValue(out, baseClocks.ticks);
+    appendValue(out, baseClocks.realtimeNs);
+    appendValue(out, ticks_per_ns);
+
+    {
+        std::lock_guard<std::mutex> lock(sitesMutex);
+        const std::vector<const TraceSite*>& table = siteTable();
+        appendValue(out, static_cast<uint32_t>(table.size()));
+        for (const TraceSite* site : table) {
+            appendValue(out, static_cast<uint32_t>(site->line));
+            appendString(out, site->file, strlen(site->file));
+            appendString(out, site->format, strlen(site->format));
+            appendString(out, site->signature, strlen(site->signature));
+        }
+    }
+
+    // A ring's owner keeps recording while it is copied. Events published
+    // before the copy started are in it, except those whose slot the owner
+    // reused, or was about to reuse, by the time it ended.
+    std::vector<const trace_detail::Ring*> all;
+    for (const trace_detail::Ring* r = rings.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        all.push_back(r);
+    }
+    appendValue(out, static_cast<uint32_t>(all.size()));
+    auto copy = std::make_unique<TraceRecord[]>(kTraceRingRecords);
+    for (const trace_detail::Ring* ring : all) {
+        uint64_t first_head = ring->head.load(std::memory_order_acquire);
+        std::memcpy(copy.get(), ring->records, sizeof(ring->records));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t last_head = ring->head.load(std::memory_order_relaxed);
+
+        uint64_t begin = first_head > kTraceRingRecords ? first_head - kTraceRingRecords : 0;
+        if (last_head + 1 > kTraceRingRecords) begin = std::max(begin, last_head + 1 - kTraceRingRecords);
+        uint64_t count = first_head > begin ? first_head - begin : 0;
+        appendValue(out, count);
+        for (uint64_t i = begin; i < first_head; ++i) {
+            const TraceRecord& record = copy[i & (kTraceRingRecords - 1)];
+            out.append(reinterpret_cast<const char*>(&record), sizeof(record));
+        }
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) return -1;
+    bool written = fwrite(out.data(), 1, out.size(), file) == out.size();
+    int saved = errno;
+    if (fclose(file) != 0 && written) return -1;
+    if (!written) {
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
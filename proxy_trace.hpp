@@ -0,0 +1,307 @@
+/*
+ * proxy_trace.hpp -- per-thread binary tracing.
+ *
+ * TRACE(format, args...) records an event with printf-style formatting, but
+ * nothing is formatted when it happens. Each call site owns a static
+ * TraceSite holding the format string, the file and line, and the types of
+ * its arguments; the event itself is a 128-byte TraceRecord with a
+ * timestamp, the site's id and the arguments in binary form, written to a
+ * ring buffer owned by the calling thread. Recording takes no lock, makes no
+ * system call and touches no memory shared with other threads, so tracing
+ * can stay enabled on the request path.
+ *
+ *   - Format strings are checked at compile time: the number of conversions
+ *     and the kind of each one (integer, floating point, string, pointer)
+ *     must match the arguments.
+ *   - Integers, floating point numbers and pointers are stored as 8 bytes.
+ *     Strings (const char*, std::string, std::string_view) are copied, and
+ *     truncated so that every argument fits in the record.
+ *   - Every ring keeps the last kTraceRingRecords events of its thread and
+ *     overwrites older ones. traceDump() writes all rings, oldest event
+ *     first, and the table of call sites to a file; proxy_tracedump formats
+ *     it offline. The proxy dumps its trace on SIGUSR1.
+ *   - With the events echoed (the default in builds without NDEBUG), each
+ *     one is also formatted and written to stderr as it is recorded.
+ *
+ * Format strings need no trailing newline. Building with
+ * -DPROXY_TRACE_ENABLED=0 compiles the call sites out; their arguments are
+ * then not evaluated.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#ifndef PROXY_TRACE_ENABLED
+#define PROXY_TRACE_ENABLED 1
+#endif
+
+constexpr size_t kTraceRecordBytes = 128;
+constexpr size_t kTracePayloadBytes = kTraceRecordBytes - 17;
+constexpr size_t kTraceRingRecords = 4096; // 512 KiB per thread; a power of two.
+
+/*
+ * TraceRecord struct
+ *
+ * One event as it is stored in a ring and in a dump.
+ */
+struct TraceRecord {
+    uint64_t ticks;  // traceTicks() when the event was recorded.
+    uint32_t site;   // Id of the TraceSite, from 1.
+    uint32_t thread; // Kernel thread id of the recording thread.
+    uint8_t length;  // Bytes of payload in use.
+    unsigned char payload[kTracePayloadBytes];
+};
+
+static_assert(sizeof(TraceRecord) == kTraceRecordBytes, "TraceRecord is not packed as expected");
+
+/*
+ * traceTicks() function: A timestamp that is cheap to take: the time stamp
+ * counter on x86, nanoseconds of CLOCK_MONOTONIC elsewhere. Dumps record
+ * the rate to convert it to time.
+ */
+inline uint64_t traceTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000u + static_cast<uint64_t>(now.tv_nsec);
+#endif
+}
+
+namespace trace_detail {
+
+// Kind of a stored argument: 'i' signed or 'u' unsigned integer, 'f' double,
+// 's' string, 'p' pointer.
+template <class T>
+constexpr char tagOf() {
+    if constexpr (std::is_same_v<T, const char*> || std::is_same_v<T, char*> || std::is_same_v<T, std::string> ||
+                  std::is_same_v<T, std::string_view>) {
+        return 's';
+    } else if constexpr (std::is_pointer_v<T> || std::is_null_pointer_v<T>) {
+        return 'p';
+    } else if constexpr (std::is_enum_v<T>) {
+        return tagOf<std::underlying_type_t<T>>();
+    } else if constexpr (std::is_same_v<T, bool>) {
+        return 'u';
+    } else if constexpr (std::is_integral_v<T>) {
+        return std::is_signed_v<T> ? 'i' : 'u';
+    } else if constexpr (std::is_floating_point_v<T>) {
+        return 'f';
+    } else {
+        static_assert(sizeof(T) == 0, "TRACE() cannot record arguments of this type");
+        return 0;
+    }
+}
+
+// The argument kinds of a call site, as a string.
+template <class... Args>
+struct Signature {
+    static constexpr char kTags[sizeof...(Args) + 1] = {tagOf<Args>()..., '\0'};
+    static constexpr size_t kStrings = ((tagOf<Args>() == 's' ? 1 : 0) + ... + 0);
+    static constexpr size_t kFixedBytes = 8 * (sizeof...(Args) - kStrings);
+    static_assert(kFixedBytes + kStrings <= kTracePayloadBytes, "TRACE() with too many arguments");
+    // Bytes each string may use, after its length byte.
+    static constexpr size_t kStringBytes =
+        kStrings == 0 ? 0 : std::min<size_t>(255, (kTracePayloadBytes - kFixedBytes - kStrings) / kStrings);
+};
+
+// How an argument of type T is stored; string literals become const char*.
+template <class T>
+using Stored = std::decay_t<const T>;
+
+// Never defined; names the Signature of a list of arguments in decltype().
+template <class... Args>
+Signature<Stored<Args>...> signatureOf(const Args&...);
+
+// The argument kind a printf conversion character takes, or 0 if it is not
+// one that TRACE() supports.
+constexpr char tagFor(char conversion) {
+    switch (conversion) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c': return 'i';
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': return 'f';
+    case 's': return 's';
+    case 'p': return 'p';
+    default: return 0;
+    }
+}
+
+constexpr bool isInteger(char tag) {
+    return tag == 'i' || tag == 'u';
+}
+
+/*
+ * matches() function: True if the conversions of `format` take exactly the
+ * arguments of `tags`, in order. A '*' width or precision takes an integer.
+ */
+constexpr bool matches(const char* format, const char* tags) {
+    size_t next = 0;
+    for (size_t i = 0; format[i] != '\0'; ++i) {
+        if (format[i] != '%') continue;
+        if (format[++i] == '%') continue;
+        while (format[i] == '-' || format[i] == '+' || format[i] == ' ' || format[i] == '#' || format[i] == '0') ++i;
+        for (int part = 0; part < 2; ++part) {
+            if (format[i] == '*') {
+                if (!isInteger(tags[next++])) return false;
+                ++i;
+            }
+            while (format[i] >= '0' && format[i] <= '9') ++i;
+            if (part == 0 && format[i] == '.') ++i;
+            else break;
+        }
+        while (format[i] == 'h' || format[i] == 'l' || format[i] == 'L' || format[i] == 'j' || format[i] == 'z' ||
+               format[i] == 't') {
+            ++i;
+        }
+        char wanted = tagFor(format[i]);
+        char given = tags[next];
+        if (wanted == 0 || given == 0) return false;
+        if (wanted == 'i' ? !isInteger(given) : wanted != given) return false;
+        ++next;
+    }
+    return tags[next] == '\0';
+}
+
+inline void put(unsigned char*& out, uint64_t bits) {
+    std::memcpy(out, &bits, sizeof(bits));
+    out += sizeof(bits);
+}
+
+inline void putString(unsigned char*& out, size_t limit, const char* s, size_t length) {
+    length = std::min(length, limit);
+    *out++ = static_cast<unsigned char>(length);
+    std::memcpy(out, s, length);
+    out += length;
+}
+
+template <class T>
+void store(unsigned char*& out, size_t limit, const T& value) {
+    if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>) {
+        putString(out, limit, value.data(), value.size());
+    } else if constexpr (std::is_same_v<T, const char*> || std::is_same_v<T, char*>) {
+        if (value == nullptr) putString(out, limit, "(null)", 6);
+        else putString(out, limit, value, strnlen(value, limit));
+    } else if constexpr (std::is_pointer_v<T> || std::is_null_pointer_v<T>) {
+        put(out, reinterpret_cast<uintptr_t>(static_cast<const void*>(value)));
+    } else if constexpr (std::is_floating_point_v<T>) {
+        double d = static_cast<double>(value);
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        put(out, bits);
+    } else if constexpr (std::is_enum_v<T>) {
+        store(out, limit, static_cast<std::underlying_type_t<T>>(value));
+    } else if constexpr (std::is_signed_v<T>) {
+        put(out, static_cast<uint64_t>(static_cast<int64_t>(value)));
+    } else {
+        put(out, static_cast<uint64_t>(value));
+    }
+}
+
+struct alignas(64) Ring {
+    std::atomic<uint64_t> head{0}; // Events ever recorded; written by the owner only.
+    std::atomic<bool> inUse{false};
+    uint32_t thread = 0;
+    Ring* next = nullptr;
+    TraceRecord records[kTraceRingRecords];
+};
+
+// The ring of the calling thread, attached on its first event.
+inline thread_local Ring* threadRing = nullptr;
+
+Ring* attachThread();
+
+} // namespace trace_detail
+
+// Whether events are also formatted to stderr when they are recorded.
+#ifdef NDEBUG
+inline std::atomic<bool> traceEchoing{false};
+#else
+inline std::atomic<bool> traceEchoing{true};
+#endif
+
+/*
+ * TraceSite class
+ *
+ * The static description of one TRACE() call site. Constant-initialized, so
+ * it costs no guard on the hot path; it is enrolled in the process-wide
+ * table of sites, and gets its id, on its first event.
+ */
+class TraceSite {
+public:
+    constexpr TraceSite(const char* f, const char* fl, unsigned l) : format(f), file(fl), line(l) {}
+
+    TraceSite(const TraceSite&) = delete;
+    TraceSite& operator=(const TraceSite&) = delete;
+
+    template <class... Args>
+    void emit(const Args&... args) {
+        using Sig = trace_detail::Signature<trace_detail::Stored<Args>...>;
+        uint32_t site = id.load(std::memory_order_acquire);
+        if (site == 0) site = enroll(Sig::kTags);
+
+        trace_detail::Ring* ring = trace_detail::threadRing;
+        if (ring == nullptr) ring = trace_detail::attachThread();
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        TraceRecord& record = ring->records[head & (kTraceRingRecords - 1)];
+        record.ticks = traceTicks();
+        record.site = site;
+        record.thread = ring->thread;
+        unsigned char* out = record.payload;
+        (trace_detail::store<trace_detail::Stored<Args>>(out, Sig::kStringBytes, args), ...);
+        record.length = static_cast<uint8_t>(out - record.payload);
+        ring->head.store(head + 1, std::memory_order_release);
+
+        if (traceEchoing.load(std::memory_order_relaxed)) echo(record);
+    }
+
+    const char* const format;
+    const char* const file;
+    const unsigned line;
+    const char* signature = nullptr; // Set when enrolled.
+
+private:
+    uint32_t enroll(const char* tags);
+    void echo(const TraceRecord& record) const;
+
+    std::atomic<uint32_t> id{0};
+};
+
+/*
+ * traceFormat() function: Formats an event of a site with `format` and
+ * argument kinds `signature` from its payload, as printf() would have.
+ */
+std::string traceFormat(const char* format, const char* signature, const unsigned char* payload, size_t length);
+
+/*
+ * traceDump() function: Writes the events in every thread's ring, and the
+ * sites they refer to, to the file at `path`. Safe to call while other
+ * threads record events; those overwritten while their ring is copied are
+ * left out. Returns 0, or -1 with errno set.
+ */
+int traceDump(const char* path);
+
+#if PROXY_TRACE_ENABLED
+#define TRACE(format, ...)                                                                                       \
+    do {                                                                                                         \
+        static_assert(::trace_detail::matches(format, decltype(::trace_detail::signatureOf(__VA_ARGS__))::kTags), \
+                      "TRACE() arguments do not match the format string");                                      \
+        static TraceSite trace_site_(format, __FILE__, __LINE__);                                                \
+        trace_site_.emit(__VA_ARGS__);                                                                           \
+    } while (0)
+#else
+#define TRACE(format, ...)                                                                                       \
+    do {                                                                                                         \
+        static_assert(::trace_detail::matches(format, decltype(::trace_detail::signatureOf(__VA_ARGS__))::kTags), \
+                      "TRACE() arguments do not match the format string");                                      \
+    } while (0)
+#endif
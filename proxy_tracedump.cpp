@@ -0,0 +1,178 @@
+/*
+ * proxy_tracedump.cpp -- prints a trace written by traceDump().
+ *
+ * Usage: proxy_tracedump [-t thread] [-l] file
+ *
+ *   -t thread  only the events of this kernel thread id
+ *   -l         prefix every event with the file and line of its call site
+ *
+ * The events of all threads are merged and printed in the order they were
+ * recorded, one per line, with their wall-clock time and thread id:
+ *
+ *   2026-10-14 09:12:03.123456789 51234 worker 3: accept: Too many open files
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "proxy_trace.hpp"
+
+namespace {
+
+struct Site {
+    uint32_t line;
+    std::string file;
+    std::string format;
+    std::string signature;
+};
+
+struct Trace {
+    uint64_t baseTicks = 0;
+    int64_t baseRealtimeNs = 0;
+    double ticksPerNs = 1.0;
+    std::vector<Site> sites;
+    std::vector<TraceRecord> records;
+};
+
+class Reader {
+public:
+    explicit Reader(const std::string& d) : data(d) {}
+
+    template <class T>
+    bool value(T& v) {
+        if (data.size() - offset < sizeof(v)) return false;
+        std::memcpy(&v, data.data() + offset, sizeof(v));
+        offset += sizeof(v);
+        return true;
+    }
+
+    bool string(std::string& s) {
+        uint32_t n;
+        if (!value(n) || data.size() - offset < n) return false;
+        s.assign(data, offset, n);
+        offset += n;
+        return true;
+    }
+
+    bool bytes(void* out, size_t n) {
+        if (data.size() - offset < n) return false;
+        std::memcpy(out, data.data() + offset, n);
+        offset += n;
+        return true;
+    }
+
+private:
+    const std::string& data;
+    size_t offset = 0;
+};
+
+bool load(const std::string& data, Trace& trace) {
+    if (data.compare(0, 8, "PXTRACE1") != 0) return false;
+    Reader in(data);
+    char magic[8];
+    uint32_t site_count, ring_count;
+    if (!in.bytes(magic, sizeof(magic)) || !in.value(trace.baseTicks) || !in.value(trace.baseRealtimeNs) ||
+        !in.value(trace.ticksPerNs) || !in.value(site_count)) {
+        return false;
+    }
+    trace.sites.resize(site_count);
+    for (Site& site : trace.sites) {
+        if (!in.value(site.line) || !in.string(site.file) || !in.string(site.format) || !in.string(site.signature)) {
+            return false;
+        }
+    }
+    if (!in.value(ring_count)) return false;
+    for (uint32_t r = 0; r < ring_count; ++r) {
+        uint64_t count;
+        if (!in.value(count)) return false;
+        for (uint64_t i = 0; i < count; ++i) {
+            TraceRecord record;
+            if (!in.bytes(&record, sizeof(record))) return false;
+            trace.records.push_back(record);
+        }
+    }
+    return true;
+}
+
+// "YYYY-MM-DD HH:MM:SS.nnnnnnnnn" in local time.
+std::string wallClock(int64_t ns) {
+    time_t seconds = static_cast<time_t>(ns / 1000000000);
+    tm local;
+    localtime_r(&seconds, &local);
+    char text[64];
+    size_t n = strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &local);
+    snprintf(text + n, sizeof(text) - n, ".%09lld", static_cast<long long>(ns % 1000000000));
+    return text;
+}
+
+void usage(const char* argv0) {
+    fprintf(stderr, "usage: %s [-t thread] [-l] file\n", argv0);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    long only_thread = -1;
+    bool locations = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:l")) != -1) {
+        switch (opt) {
+        case 't':
+            only_thread = strtol(optarg, nullptr, 10);
+            break;
+        case 'l':
+            locations = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::ifstream file(argv[optind], std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "cannot open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    Trace trace;
+    if (!load(data, trace)) {
+        fprintf(stderr, "%s is not a complete trace\n", argv[optind]);
+        return 1;
+    }
+
+    std::stable_sort(trace.records.begin(), trace.records.end(),
+                     [](const TraceRecord& a, const TraceRecord& b) { return a.ticks < b.ticks; });
+    for (const TraceRecord& record : trace.records) {
+        if (only_thread >= 0 && record.thread != static_cast<uint64_t>(only_thread)) continue;
+        int64_t ns = trace.baseRealtimeNs +
+                     static_cast<int64_t>(static_cast<double>(static_cast<int64_t>(record.ticks - trace.baseTicks)) /
+                                          trace.ticksPerNs);
+        std::string line = wallClock(ns) + ' ' + std::to_string(record.thread) + ' ';
+        if (record.site == 0 || record.site > trace.sites.size()) {
+            line += "<unknown trace site>";
+        } else {
+            const Site& site = trace.sites[record.site - 1];
+            if (locations) line += site.file + ':' + std::to_string(site.line) + ": ";
+            line += traceFormat(site.format.c_str(), site.signature.c_str(), record.payload,
+                                std::min<size_t>(record.length, kTracePayloadBytes));
+        }
+        puts(line.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,349 @@
+/*
+ * proxy_upstream.cpp -- persistent connections to origin servers.
+ */
+
+#include "proxy_upstream.hpp"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <iterator>
+
+#include "proxy_header_ids.hpp"
+#include "proxy_headers.hpp"
+
+namespace {
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+// Calls f(token) for every element of a comma-separated header value.
+template <class F>
+void forEachToken(std::string_view list, F&& f) {
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string_view token = trim(list.substr(0, comma));
+        if (!token.empty()) f(token);
+        if (comma == std::string_view::npos) break;
+        list.remove_prefix(comma + 1);
+    }
+}
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+} // namespace
+
+/*
+ * BodyFramer
+ */
+
+void BodyFramer::expectLength(uint64_t length) {
+    remaining = length;
+    state = remaining == 0 ? State::Done : State::Body;
+}
+
+void BodyFramer::expectChunked() {
+    state = State::ChunkSize;
+    chunkSize = 0;
+    sizeDigits = inExtension = sawCR = false;
+}
+
+bool BodyFramer::feed(const char* data, size_t len, size_t& used) {
+    size_t i = 0;
+    while (i < len && state != State::Done) {
+        switch (state) {
+        case State::Body:
+        case State::ChunkData: {
+            uint64_t n = std::min<uint64_t>(remaining, len - i);
+            i += static_cast<size_t>(n);
+            skip(n);
+            break;
+        }
+
+        case State::ChunkSize: {
+            char c = data[i++];
+            int digit = hexValue(c);
+            if (sawCR) {
+                if (c != '\n' || !sizeDigits) {
+                    state = State::UntilClose;
+                } else if (chunkSize == 0) {
+                    state = State::Trailer;
+                    sawCR = false;
+                    lineLength = 0;
+                } else {
+                    state = State::ChunkData;
+                    remaining = chunkSize;
+                }
+            } else if (c == '\r') {
+                sawCR = true;
+            } else if (inExtension) {
+                // Chunk extensions are ignored.
+            } else if (digit >= 0 && chunkSize < (uint64_t{1} << 56)) {
+                chunkSize = chunkSize * 16 + static_cast<uint64_t>(digit);
+                sizeDigits = true;
+            } else if ((c == ';' || c == ' ' || c == '\t') && sizeDigits) {
+                inExtension = true;
+            } else {
+                state = State::UntilClose;
+            }
+            break;
+        }
+
+        case State::ChunkDataEnd: {
+            char c = data[i++];
+            if (!sawCR && c == '\r') {
+                sawCR = true;
+            } else if (sawCR && c == '\n') {
+                expectChunked();
+            } else {
+                state = State::UntilClose;
+            }
+            break;
+        }
+
+        case State::Trailer: {
+            char c = data[i++];
+            if (sawCR) {
+                if (c != '\n') {
+                    state = State::UntilClose;
+                } else if (lineLength == 0) {
+                    state = State::Done;
+                } else {
+                    sawCR = false;
+                    lineLength = 0;
+                }
+            } else if (c == '\r') {
+                sawCR = true;
+            } else {
+                ++lineLength;
+            }
+            break;
+        }
+
+        case State::UntilClose:
+            i = len;
+            break;
+
+        case State::Done:
+            break;
+        }
+    }
+
+    used = i;
+    return state == State::Done;
+}
+
+uint64_t BodyFramer::opaqueBytes() const {
+    switch (state) {
+    case State::Body:
+    case State::ChunkData:
+        return remaining;
+    case State::UntilClose:
+        return kUntilClose;
+    default:
+        return 0;
+    }
+}
+
+bool BodyFramer::skip(uint64_t len) {
+    if (state != State::Body && state != State::ChunkData) return state == State::Done;
+    remaining -= std::min(len, remaining);
+    if (remaining == 0) {
+        if (state == State::Body) {
+            state = State::Done;
+        } else {
+            state = State::ChunkDataEnd;
+            sawCR = false;
+        }
+    }
+    return state == State::Done;
+}
+
+/*
+ * ResponseFramer
+ */
+
+void ResponseFramer::reset(bool head_request) {
+    inHead = true;
+    headRequest = head_request;
+    received = false;
+    keepAlive = false;
+    finalStatus = 0;
+    head.clear();
+    parser.reset();
+    body.reset();
+}
+
+bool ResponseFramer::feed(const char* data, size_t len, size_t& used) {
+    if (len > 0) received = true;
+
+    size_t i = 0;
+    while (i < len && inHead) {
+        size_t before = head.size();
+        head.append(data + i, std::min(len - i, kMaxHeadBytes + 4 - before));
+        ParsedResponseView response;
+        ParseStatus status = parser.feed(head, response);
+        if (status == ParseStatus::Done) {
+            i += parser.consumed() - before;
+            parseHead(response);
+            head.clear();
+            parser.reset();
+            continue;
+        }
+        i += head.size() - before;
+        if (status == ParseStatus::Error || head.size() > kMaxHeadBytes) {
+            // Nothing can be told about the rest.
+            inHead = false;
+            body.expectUntilClose();
+            head = std::string();
+        }
+    }
+
+    if (!inHead && i < len) {
+        size_t body_used;
+        body.feed(data + i, len - i, body_used);
+        i += body_used;
+    }
+    used = i;
+    return !inHead && body.done();
+}
+
+void ResponseFramer::parseHead(const ParsedResponseView& response) {
+    inHead = false;
+    body.expectUntilClose();
+    keepAlive = false;
+
+    bool close = false, keep_alive = false, chunked = false, has_te = false, bad_length = false;
+    int64_t content_length = -1;
+    for (const ParsedHeaderView& header : response.headers) {
+        std::string_view value = header.value;
+        switch (header.id) {
+        case HeaderId::Connection:
+            forEachToken(value, [&](std::string_view token) {
+                if (equalsIgnoreCase(token, "close")) close = true;
+                if (equalsIgnoreCase(token, "keep-alive")) keep_alive = true;
+            });
+            break;
+        case HeaderId::TransferEncoding:
+            // Only a final "chunked" coding frames the body.
+            has_te = true;
+            chunked = false;
+            forEachToken(value, [&](std::string_view token) { chunked = equalsIgnoreCase(token, "chunked"); });
+            break;
+        case HeaderId::ContentLength: {
+            int64_t n = 0;
+            if (value.empty() || value.size() > 18) bad_length = true;
+            for (char c : value) {
+                if (c < '0' || c > '9' || bad_length) {
+                    bad_length = true;
+                    break;
+                }
+                n = n * 10 + (c - '0');
+            }
+            if (content_length >= 0 && n != content_length) bad_length = true;
+            content_length = n;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    int status = response.status;
+    if (status >= 100 && status < 200) {
+        // A final response follows an interim one; 101 switches protocols.
+        if (status != 101) inHead = true;
+        return;
+    }
+    finalStatus = status;
+
+    keepAlive = response.persistentByDefault() ? !close : keep_alive;
+    if (headRequest || status == 204 || status == 304) {
+        body.reset();
+    } else if (has_te) {
+        if (chunked) body.expectChunked();
+    } else if (content_length >= 0 && !bad_length) {
+        body.expectLength(static_cast<uint64_t>(content_length));
+    }
+    if (!body.delimited()) keepAlive = false;
+}
+
+/*
+ * UpstreamPool
+ */
+
+UpstreamPool::UpstreamPool(size_t max_idle_per_host, size_t max_idle, int idle_timeout_ms)
+    : maxIdlePerHost(max_idle_per_host),
+      maxIdle(max_idle),
+      idleTimeout(std::chrono::milliseconds(idle_timeout_ms)) {}
+
+UpstreamPool::~UpstreamPool() {
+    for (auto& [key, list] : connections) {
+        for (const Idle& idle : list) ::close(idle.fd);
+    }
+}
+
+int UpstreamPool::acquire(const HashedKey& key) {
+    auto found = connections.find(key);
+    if (found == connections.end()) return -1;
+
+    std::vector<Idle>& list = found->second;
+    int fd = -1;
+    while (fd < 0 && !list.empty()) {
+        Idle idle = list.back();
+        list.pop_back();
+        --idleCount;
+
+        // An idle connection has nothing to read: readable means the origin
+        // closed it, or sent something it should not have.
+        char byte;
+        ssize_t n = recv(idle.fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            fd = idle.fd;
+        } else {
+            ::close(idle.fd);
+        }
+    }
+    if (list.empty()) connections.erase(found);
+    return fd;
+}
+
+void UpstreamPool::release(const HashedKey& key, int fd) {
+    if (!enabled() || idleCount >= maxIdle) {
+        ::close(fd);
+        return;
+    }
+    std::vector<Idle>& list = connections[key];
+    if (list.size() >= maxIdlePerHost) {
+        // Keep the warmest connections.
+        ::close(list.front().fd);
+        list.erase(list.begin());
+        --idleCount;
+    }
+    list.push_back({fd, Clock::now()});
+    ++idleCount;
+}
+
+void UpstreamPool::closeExpired(Clock::time_point now) {
+    for (auto it = connections.begin(); it != connections.end();) {
+        std::vector<Idle>& list = it->second;
+        size_t expired = 0;
+        while (expired < list.size() && now - list[expired].since >= idleTimeout) {
+            ::close(list[expired].fd);
+            ++expired;
+        }
+        list.erase(list.begin(), list.begin() + static_cast<ptrdiff_t>(expired));
+        idleCount -= expired;
+        it = list.empty() ? connections.erase(it) : std::next(it);
+    }
+}
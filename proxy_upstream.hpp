@@ -0,0 +1,222 @@
+/*
+ * proxy_upstream.hpp -- persistent connections to origin servers.
+ *
+ * Connecting to an origin costs a DNS lookup and a TCP handshake, several
+ * round trips over a WAN. Workers therefore keep the connection open once a
+ * response is complete and reuse it for the next request to the same
+ * host:port:
+ *
+ *   - ResponseFramer follows the bytes relayed from the origin far enough to
+ *     tell where the response ends (Content-Length, chunked coding, or a
+ *     status without a body) and whether the origin allows reuse. Its
+ *     BodyFramer also frames request bodies streamed to the origin.
+ *   - UpstreamPool keeps a worker's idle connections, keyed on the origin key
+ *     of a NormalizedTarget ("host:port", see proxy_uri.hpp), bounded in
+ *     number and in idle time, and checks that one is still open before
+ *     handing it out.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "proxy_parse.hpp"
+#include "proxy_uri.hpp"
+
+/*
+ * BodyFramer class
+ *
+ * Finds the end of an HTTP/1.x message body delimited by Content-Length, by
+ * the chunked transfer coding or by the connection closing. Body content
+ * need not pass through the framer: opaqueBytes() says how much of it comes
+ * next, and those bytes may be skip()ped unseen, e.g. when they are spliced
+ * from one socket to another.
+ */
+class BodyFramer {
+public:
+    // Returned by opaqueBytes() for a body that runs until the connection
+    // closes.
+    static constexpr uint64_t kUntilClose = UINT64_MAX;
+
+    // A message without a body; done() right away.
+    void reset() { state = State::Done; }
+
+    // A body of exactly `length` bytes.
+    void expectLength(uint64_t length);
+
+    // A chunked body, up to and including its trailer section.
+    void expectChunked();
+
+    // A body delimited by the connection closing; never done().
+    void expectUntilClose() { state = State::UntilClose; }
+
+    /*
+     * feed() method: Follows the next `len` bytes of the body. Returns true
+     * once it is complete, with `used` set to the bytes of `data` that
+     * belong to it.
+     */
+    bool feed(const char* data, size_t len, size_t& used);
+
+    /*
+     * opaqueBytes() method: How many of the bytes that come next are body
+     * content, as opposed to framing: the rest of the body or of the current
+     * chunk, or kUntilClose. 0 while chunk framing is expected.
+     */
+    uint64_t opaqueBytes() const;
+
+    /*
+     * skip() method: Accounts for `len` content bytes, at most opaqueBytes(),
+     * without looking at them. Returns true once the body is complete.
+     */
+    bool skip(uint64_t len);
+
+    bool done() const { return state == State::Done; }
+
+    // The end of the body can be told without the connection closing.
+    bool delimited() const { return state != State::UntilClose; }
+
+private:
+    enum class State {
+        Body,         // Content-Length body; `remaining` bytes to go.
+        ChunkSize,    // Hex chunk size and extensions up to CRLF.
+        ChunkData,    // Chunk data; `remaining` bytes to go.
+        ChunkDataEnd, // The CRLF after chunk data.
+        Trailer,      // Trailer fields up to an empty line.
+        UntilClose,   // Delimited by the connection closing.
+        Done
+    };
+
+    State state = State::Done;
+    uint64_t remaining = 0;   // Body or chunk bytes still to come.
+    uint64_t chunkSize = 0;   // Size being read in ChunkSize.
+    bool sizeDigits = false;  // At least one hex digit was read.
+    bool inExtension = false; // Past the digits, in a chunk extension.
+    bool sawCR = false;       // The previous byte was CR.
+    size_t lineLength = 0;    // Bytes on the current trailer line.
+};
+
+/*
+ * ResponseFramer class
+ *
+ * Finds the end of one HTTP/1.x response in the bytes received from an
+ * origin, without copying or changing them. Interim 1xx responses are
+ * skipped. A response whose end cannot be told (no Content-Length and not
+ * chunked, or malformed framing) ends when the origin closes the
+ * connection; feed() then never reports completion and reusable() is false.
+ */
+class ResponseFramer {
+public:
+    // Longest response head followed; longer ones make the response run
+    // until the connection closes.
+    static constexpr size_t kMaxHeadBytes = DefaultResponseLimits::kMaxHeadBytes;
+
+    /*
+     * reset() method: Prepares for the response to a new request.
+     * Responses to HEAD requests have no body whatever their headers say.
+     */
+    void reset(bool head_request);
+
+    /*
+     * feed() method: Follows the next `len` bytes of the response. Returns
+     * true once the response is complete, with `used` set to the bytes of
+     * `data` that belong to it; anything after that is a protocol error on
+     * the origin's part.
+     */
+    bool feed(const char* data, size_t len, size_t& used);
+
+    // Body content bytes that come next and may be skip()ped; see BodyFramer.
+    uint64_t opaqueBytes() const { return inHead ? 0 : body.opaqueBytes(); }
+
+    // Accounts for `len` bytes, at most opaqueBytes(), without seeing them.
+    // Returns true once the response is complete.
+    bool skip(uint64_t len) { return body.skip(len); }
+
+    // Some bytes of the response were received.
+    bool started() const { return received; }
+
+    // Status code of the final response once its head is through, 0 before.
+    int status() const { return finalStatus; }
+
+    // The head of the final response is through, or could not be parsed.
+    bool headDone() const { return !inHead; }
+
+    // The response is complete and the origin keeps the connection open.
+    bool reusable() const { return !inHead && body.done() && keepAlive; }
+
+private:
+    // Reads the framing headers of a complete head.
+    void parseHead(const ParsedResponseView& response);
+
+    bool inHead = true;
+    bool headRequest = false;
+    bool received = false;
+    bool keepAlive = false;
+    int finalStatus = 0;
+    std::string head;      // Head bytes so far.
+    ResponseParser parser; // Follows `head` as it grows.
+    BodyFramer body;
+};
+
+/*
+ * UpstreamPool class
+ *
+ * The idle origin connections of one worker. Not thread-safe: every worker
+ * owns its own pool.
+ */
+class UpstreamPool {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /*
+     * Constructor: Keeps at most `max_idle_per_host` connections for each
+     * host:port and `max_idle` in total, each for at most `idle_timeout_ms`.
+     * With `max_idle_per_host` 0 nothing is ever kept.
+     */
+    UpstreamPool(size_t max_idle_per_host, size_t max_idle, int idle_timeout_ms);
+    ~UpstreamPool();
+
+    UpstreamPool(const UpstreamPool&) = delete;
+    UpstreamPool& operator=(const UpstreamPool&) = delete;
+
+    bool enabled() const { return maxIdlePerHost > 0; }
+
+    /*
+     * acquire() method: Takes the most recently used idle connection to
+     * `key` that is still open and has nothing pending to read, closing the
+     * ones that are not. Returns its descriptor, or -1 if there is none.
+     */
+    int acquire(const HashedKey& key);
+
+    /*
+     * release() method: Keeps `fd`, connected to `key` with no request in
+     * progress, for reuse; closes it if the pool is full.
+     */
+    void release(const HashedKey& key, int fd);
+
+    /*
+     * closeExpired() method: Closes the connections idle for longer than
+     * the idle timeout.
+     */
+    void closeExpired(Clock::time_point now = Clock::now());
+
+    // Connections currently kept.
+    size_t idle() const { return idleCount; }
+
+private:
+    struct Idle {
+        int fd;
+        Clock::time_point since;
+    };
+
+    size_t maxIdlePerHost;
+    size_t maxIdle;
+    Clock::duration idleTimeout;
+    std::unordered_map<HashedKey, std::vector<Idle>, HashedKeyHash> connections; // Oldest first.
+    size_t idleCount = 0;
+};
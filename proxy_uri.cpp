@@ -0,0 +1,161 @@
+/*
+ * proxy_uri.cpp -- request targets: their components and normalized keys.
+ */
+
+#include "proxy_uri.hpp"
+
+#include <algorithm>
+
+namespace {
+
+bool isAlpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// ALPHA / DIGIT / "+" / "-" / "."
+bool isSchemeChar(char c) {
+    return isAlpha(c) || isDigit(c) || c == '+' || c == '-' || c == '.';
+}
+
+// unreserved / pct-encoded / sub-delims: what a reg-name may contain
+// before decoding.
+bool isHostChar(char c) {
+    if (isAlpha(c) || isDigit(c)) return true;
+    switch (c) {
+    case '-': case '.': case '_': case '~': case '%':
+    case '!': case '$': case '&': case '\'': case '(': case ')': case '*': case '+': case ',': case ';': case '=':
+        return true;
+    default:
+        return false;
+    }
+}
+
+// What may appear between the brackets of an IP literal.
+bool isLiteralChar(char c) {
+    return c == ':' || (c != '%' && isHostChar(c));
+}
+
+// What an escape in a host may decode to: unreserved characters, and the
+// bytes of UTF-8 sequences.
+bool isDecodedHostChar(unsigned char c) {
+    return isAlpha(static_cast<char>(c)) || isDigit(static_cast<char>(c)) || c == '-' || c == '.' || c == '_' ||
+           c == '~' || c >= 0x80;
+}
+
+int hexValue(char c) {
+    if (isDigit(c)) return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+UriSpan span(size_t offset, size_t length) {
+    return UriSpan{static_cast<uint32_t>(offset), static_cast<uint32_t>(length)};
+}
+
+// Splits the authority text[begin, end) into the host and port of `out`.
+int splitAuthority(std::string_view text, size_t begin, size_t end, UriParts& out) {
+    size_t i = begin;
+    if (i < end && text[i] == '[') {
+        while (++i < end && text[i] != ']') {
+            if (!isLiteralChar(text[i])) return -1;
+        }
+        if (i == end || i == begin + 1) return -1;
+        ++i;
+    } else {
+        for (; i < end && text[i] != ':'; ++i) {
+            if (!isHostChar(text[i])) return -1;
+        }
+    }
+    if (i == begin) return -1;
+    out.host = span(begin, i - begin);
+    if (i == end) return 0;
+    if (text[i] != ':') return -1;
+
+    // An empty port is allowed and means the default one.
+    uint32_t value = 0;
+    for (size_t j = ++i; j < end; ++j) {
+        if (!isDigit(text[j])) return -1;
+        value = value * 10 + static_cast<uint32_t>(text[j] - '0');
+        if (value > 65535) return -1;
+    }
+    if (i < end && value == 0) return -1;
+    out.port = span(i, end - i);
+    return 0;
+}
+
+} // namespace
+
+int parseUri(std::string_view target, UriParts& out) {
+    out = UriParts();
+    if (target.empty()) return -1;
+    // A fragment is never meant for the server.
+    size_t end = std::min(target.find('#'), target.size());
+
+    if (target.front() == '/') {
+        out.path = span(0, end);
+        return 0;
+    }
+
+    size_t i = 0;
+    if (!isAlpha(target[0])) return -1;
+    while (i < end && isSchemeChar(target[i])) ++i;
+    if (target.compare(i, 3, "://") != 0) return -1;
+    out.scheme = span(0, i);
+
+    size_t authority = i + 3;
+    size_t authority_end = authority;
+    while (authority_end < end && target[authority_end] != '/' && target[authority_end] != '?') ++authority_end;
+    // "http://host?query" would need a "/" the target does not have.
+    if (authority_end < end && target[authority_end] == '?') return -1;
+    if (splitAuthority(target, authority, authority_end, out) != 0) return -1;
+    if (authority_end < end) out.path = span(authority_end, end - authority_end);
+    return 0;
+}
+
+int parseAuthority(std::string_view authority, UriParts& out) {
+    out = UriParts();
+    return splitAuthority(authority, 0, authority.size(), out);
+}
+
+size_t normalizeHost(char* host, size_t length) {
+    size_t out = 0;
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = static_cast<unsigned char>(host[i]);
+        if (c == '%') {
+            int high = i + 2 < length ? hexValue(host[i + 1]) : -1;
+            int low = i + 2 < length ? hexValue(host[i + 2]) : -1;
+            if (high < 0 || low < 0) return std::string::npos;
+            c = static_cast<unsigned char>(high * 16 + low);
+            if (!isDecodedHostChar(c)) return std::string::npos;
+            i += 2;
+        }
+        if (c >= 'A' && c <= 'Z') c = static_cast<unsigned char>(c - 'A' + 'a');
+        host[out++] = static_cast<char>(c);
+    }
+    return out;
+}
+
+/*
+ * NormalizedTarget
+ */
+
+int NormalizedTarget::assign(std::string_view raw_host, std::string_view raw_port, std::string_view path) {
+    host.assign(raw_host);
+    size_t length = normalizeHost(&host[0], host.size());
+    if (length == std::string::npos || length == 0) return -1;
+    host.resize(length);
+
+    while (raw_port.size() > 1 && raw_port.front() == '0') raw_port.remove_prefix(1);
+    port.assign(raw_port.empty() ? std::string_view("80") : raw_port);
+
+    origin.text.assign(host).append(1, ':').append(port);
+    origin.hash = hashKey(origin.text);
+    resource.text.assign(origin.text).append(path.empty() ? std::string_view("/") : path);
+    resource.hash = hashKey(resource.text);
+    return 0;
+}
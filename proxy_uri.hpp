@@ -0,0 +1,151 @@
+/*
+ * proxy_uri.hpp -- request targets: their components and normalized keys.
+ *
+ * parseUri() splits the target of a request line into scheme, host, port
+ * and path as offsets into the target, without copying anything, and
+ * parseAuthority() does the same for the value of a Host header. A
+ * NormalizedTarget then holds the origin a request goes to, built once per
+ * request in storage it keeps from one request to the next:
+ *
+ *   - The host is percent-decoded and lowercased in place, in the copy the
+ *     proxy keeps anyway to resolve and connect to it.
+ *   - The port loses its leading zeros, and a target without one gets the
+ *     default port of http, so "http://Example.COM/", "http://example.com:80/"
+ *     and "http://example.com:0080/" name the same origin.
+ *   - The keys of the origin ("host:port") and of the resource
+ *     ("host:port/path") come with their 64-bit hashes. UpstreamPool,
+ *     Resolver and ResponseCache are indexed on these keys as they are, so
+ *     none of them builds or hashes a key of its own per request.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+/*
+ * UriSpan struct
+ *
+ * A component of a request target, by position in the target.
+ */
+struct UriSpan {
+    uint32_t offset = 0;
+    uint32_t length = 0;
+
+    bool empty() const { return length == 0; }
+    std::string_view in(std::string_view target) const { return target.substr(offset, length); }
+};
+
+/*
+ * UriParts struct
+ *
+ * The components of a request target as found by parseUri(), or of an
+ * authority as found by parseAuthority().
+ */
+struct UriParts {
+    UriSpan scheme; // "http" of an absolute-form target; empty for origin-form.
+    UriSpan host;   // Host of an absolute-form target, brackets of an IP literal included.
+    UriSpan port;   // Digits after the host; empty if absent.
+    UriSpan path;   // From the first '/' up to any fragment, query included; empty if there is none.
+};
+
+/*
+ * parseUri() function: Splits `target`, in origin form ("/index.html") or
+ * absolute form ("http://host[:port][/path]"), into `out`. Components are
+ * checked for characters they may not contain; nothing is decoded.
+ * Returns 0 on success, -1 if `target` is malformed.
+ */
+int parseUri(std::string_view target, UriParts& out);
+
+/*
+ * parseAuthority() function: Splits `authority` ("host[:port]", as in a Host
+ * header) into the host and port of `out`; the other spans are cleared.
+ * Returns 0 on success, -1 if `authority` is malformed.
+ */
+int parseAuthority(std::string_view authority, UriParts& out);
+
+/*
+ * normalizeHost() function: Percent-decodes and lowercases the `length`
+ * bytes at `host` in place. Returns the new length, which is never larger,
+ * or std::string::npos if an escape is malformed or decodes to a byte that
+ * cannot be part of a host name.
+ */
+size_t normalizeHost(char* host, size_t length);
+
+/*
+ * hashKey() function: 64-bit hash of a normalized key, read a word at a
+ * time. Every index over keys uses it, so that a hash computed once is good
+ * for all of them.
+ */
+inline uint64_t hashKey(std::string_view text) {
+    constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15ull;
+    auto mix = [](uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdull;
+        x ^= x >> 33;
+        return x;
+    };
+    const char* p = text.data();
+    size_t n = text.size();
+    uint64_t h = 0xcbf29ce484222325ull ^ (static_cast<uint64_t>(n) * kMultiplier);
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        h = (h ^ mix(word)) * kMultiplier;
+    }
+    if (n > 0) {
+        uint64_t word = 0;
+        std::memcpy(&word, p, n);
+        h = (h ^ mix(word)) * kMultiplier;
+    }
+    return mix(h);
+}
+
+/*
+ * HashedKey struct
+ *
+ * A key with its hashKey(), for the unordered containers keyed on it
+ * (through HashedKeyHash), which then never hash it again.
+ */
+struct HashedKey {
+    std::string text;
+    uint64_t hash = 0;
+
+    bool empty() const { return text.empty(); }
+    void clear() {
+        text.clear();
+        hash = 0;
+    }
+
+    bool operator==(const HashedKey& other) const { return hash == other.hash && text == other.text; }
+};
+
+struct HashedKeyHash {
+    size_t operator()(const HashedKey& key) const { return static_cast<size_t>(key.hash); }
+};
+
+/*
+ * NormalizedTarget struct
+ *
+ * The origin server and resource of a request, normalized, and their keys.
+ */
+struct NormalizedTarget {
+    std::string host;  // Percent-decoded and lowercased.
+    std::string port;  // Decimal without leading zeros; "80" if the request named none.
+    HashedKey origin;   // "host:port": the key of UpstreamPool and Resolver.
+    HashedKey resource; // "host:port/path": the key of ResponseCache.
+
+    // True if `port` is the default port, which a Host header may leave out.
+    bool defaultPort() const { return port == "80"; }
+
+    /*
+     * assign() method: Sets every field from the host, port and path of a
+     * request as received. The host must not be empty; an empty path is
+     * taken as "/".
+     * Returns 0 on success, -1 if the host does not normalize.
+     */
+    int assign(std::string_view raw_host, std::string_view raw_port, std::string_view path);
+};
@@ -0,0 +1,1383 @@
+/*
+ * proxy_uring.cpp -- io_uring I/O engine for the proxy server.
+ *
+ * A connection goes through the same states as on EpollWorker (see
+ * proxy_server.cpp), but nothing is ever waited for: every operation is
+ * queued on the ring and its completion drives the next step.
+ *
+ * Operations in flight: a completion names its connection and operation in
+ * its user_data. A connection counts the operations that will still complete
+ * for it; close() cancels them all and the connection is freed by release()
+ * once the last one has come back, so no completion can ever refer to freed
+ * memory or to a recycled file descriptor.
+ *
+ * Relaying: each socket has a single multishot recv, and the buffers it fills
+ * are queued on the pipe towards the other socket and sent from there, one
+ * send in flight per pipe so that bytes stay in order. A buffer goes back to
+ * the ring once its bytes have been sent. When a pipe backs up, the recv of
+ * its source is cancelled and re-armed once the pipe has drained.
+ *
+ * Static files are served as on EpollWorker, except that bodies of any size
+ * are sent from the file's mapping: io_uring has no sendfile.
+ *
+ * Flights (see proxy_flight.hpp) are led and followed as on EpollWorker. A
+ * follower copies what it reads from its flight into `unsent` and sends it
+ * from there; the flight queue's eventfd is polled like the lookup queue's.
+ *
+ * Upstream reuse works as on EpollWorker. A pooled upstream only goes back to
+ * the pool from release(), when no operation on it is in flight any more, and
+ * a stale one is only replaced when none is either: the request send has
+ * completed and the recv that reported the failure was the last of its
+ * multishot.
+ */
+
+#include "proxy_uring.hpp"
+
+#if PROXY_HAVE_IO_URING
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include "proxy_epoch.hpp"
+#include "proxy_metrics.hpp"
+#include "proxy_trace.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Submission queue entries per worker ring.
+constexpr unsigned kRingEntries = 1024;
+
+// Buffer group of the worker's provided buffers.
+constexpr uint16_t kBufferGroup = 0;
+
+// Chunks a pipe may hold before its source stops being read.
+constexpr size_t kMaxQueuedChunks = 8;
+
+// How often idle connections are looked for, in milliseconds.
+constexpr int kSweepIntervalMs = 1000;
+
+int ioUringSetup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int ioUringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int ioUringRegister(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+// What a completion is for. The low four bits of its user_data hold the
+// operation; the others hold the UringConnection, or zero for the
+// worker-wide operations.
+enum class WorkerOp : uint64_t { Accept, Wake, Timer, Lookups, Flights, Cancel };
+enum class ConnOp : uint64_t {
+    ClientRecv,
+    UpstreamRecv,
+    ClientSend,
+    UpstreamSend,
+    Connect,
+    SendRequest,
+    SendFinal,
+    FlightSend,
+    Cancel
+};
+constexpr uint64_t kOpMask = 15;
+
+uint64_t tag(WorkerOp op) {
+    return static_cast<uint64_t>(op);
+}
+
+} // namespace
+
+/*
+ * UringConnection struct
+ *
+ * A client connection and, once the request is known, its upstream.
+ */
+struct alignas(kOpMask + 1) UringConnection {
+    enum class State { ReadingRequest, Following, Resolving, Connecting, Relaying, Closing };
+
+    // Received bytes waiting in a provided buffer.
+    struct Chunk {
+        uint16_t buffer;
+        uint32_t offset;
+        uint32_t len;
+    };
+
+    // Bytes received from one socket on their way to the other.
+    struct Pipe {
+        std::vector<Chunk> chunks; // Oldest first.
+        size_t next = 0;           // First chunk not completely sent.
+        bool sending = false;      // A send of chunks[next] is in flight.
+        bool sourceDone = false;   // The source shut down its sending side.
+
+        size_t queued() const { return chunks.size() - next; }
+    };
+
+    // One of the two sockets.
+    struct Side {
+        int fd = -1;
+        bool recvArmed = false; // Its multishot recv is in flight.
+        bool paused = false;    // Its recv was cancelled because `out` of the other side backed up.
+        bool starved = false;   // Its recv stopped because no buffer was free.
+        Pipe out;               // Bytes to be sent to this socket.
+    };
+
+    State state = State::ReadingRequest;
+    Side client;
+    Side upstream;
+
+    size_t slot = 0;       // Position in UringWorker::connections.
+    bool closed = false;   // Set by UringWorker::close().
+    unsigned inflight = 0; // Operations that will still complete.
+
+    std::string in;            // Request bytes, once they span several buffers.
+    RequestParser parser;      // Incremental parser over the received bytes.
+    ParsedRequestView request; // The parsed request.
+    std::string hostHeader;    // Storage for a Host header the proxy adds.
+    int heldBuffer = -1;       // Provided buffer `request` was parsed from in place.
+    size_t heldLen = 0;        // Bytes received into `heldBuffer`.
+    NormalizedTarget target;   // The origin and resource of the request.
+    uint64_t lookup = 0;       // Token of the lookup while Resolving.
+
+    ResponseFramer framer;  // Finds the end of the response.
+    bool reusable = false;  // Nothing but the complete request went upstream.
+    bool pooled = false;    // The upstream came from the pool; it may turn out to be closed.
+    bool retryable = false; // The request may be sent again on a new connection.
+
+    // Operands of the linked connect and sendmsg; the kernel reads them
+    // while the operations are in flight. The connect is to the address of
+    // `addresses` before `nextAddress`; `connectFailed` is set until the
+    // cancelled send of a failed one completes and the next can be tried.
+    ResolvedAddress addresses;
+    size_t nextAddress = 0;
+    bool connectFailed = false;
+    iovec iov[kMaxRequestIovecs];
+    msghdr msg{};
+    bool requestCopied = false; // The unsent rest of the request is in `unsent`.
+    std::string unsent;         // Copied request bytes, or the error response.
+
+    HashedKey captureKey;   // Cache key of the response being captured, if any.
+    std::string captured;   // The response so far.
+
+    // The stale entry the request was made conditional on; see the
+    // Connection counterpart in proxy_server.cpp.
+    std::shared_ptr<const CachedResponse> stale;
+    bool notModified = false;
+
+    // The response, whose chunks are queued to the client without being
+    // sent, has yet to show whether it revalidates `stale`.
+    bool holdsResponse() const { return stale && !framer.headDone(); }
+
+    // The flight the request leads or follows, if any; see the Connection
+    // counterpart in proxy_server.cpp. A follower sends what it read last
+    // from `unsent`, up to `finalSent` so far, and has read all of the
+    // response once `client.out.sourceDone` is set.
+    std::shared_ptr<Flight> flight;
+    bool leader = false;
+    size_t flightSent = 0;
+    size_t flightOffset = 0;
+    uint64_t flightToken = 0;
+
+    // The response sent in the Closing state: an error, a cache hit or a
+    // file, whose body follows `finalResponse` from its mapping.
+    std::shared_ptr<const CachedResponse> cached;
+    std::shared_ptr<const StaticFile> file;
+    std::string_view finalResponse;
+    std::string_view finalBody;
+    size_t finalSent = 0; // Of `finalResponse` and `finalBody`.
+    iovec finalIov[2];    // Operands of the sendmsg of the rest.
+    msghdr finalMsg{};
+
+    StageTimer timer; // Times the request.
+    Clock::time_point lastActive = Clock::now();
+
+    Side& side(bool up) { return up ? upstream : client; }
+
+    // The upstream can carry another request: see the Connection
+    // counterpart in proxy_server.cpp.
+    bool upstreamReusable() const {
+        return reusable && upstream.out.queued() == 0 && client.out.sourceDone && framer.reusable();
+    }
+
+    uint64_t tag(ConnOp op) const {
+        return reinterpret_cast<uint64_t>(this) | static_cast<uint64_t>(op);
+    }
+};
+
+/*
+ * IoRing
+ */
+
+IoRing::~IoRing() {
+    if (sqes != nullptr) munmap(sqes, sqesSize);
+    if (rings != nullptr) munmap(rings, ringsSize);
+    if (ringFd >= 0) ::close(ringFd);
+}
+
+int IoRing::init(unsigned entries) {
+    // A single submitter lets the kernel skip locking, and deferring task
+    // work runs completions only when the loop asks for them.
+    io_uring_params params{};
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED;
+    ringFd = ioUringSetup(entries, &params);
+    if (ringFd < 0 && errno == EINVAL) {
+        // Kernels before 6.1.
+        params = io_uring_params{};
+        ringFd = ioUringSetup(entries, &params);
+    }
+    if (ringFd < 0) return -1;
+    disabled = (params.flags & IORING_SETUP_R_DISABLED) != 0;
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOSYS;
+        return -1;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ringsSize = std::max(sq_size, cq_size);
+    void* mem = mmap(nullptr, ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                     IORING_OFF_SQ_RING);
+    if (mem == MAP_FAILED) return -1;
+    rings = mem;
+
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    mem = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (mem == MAP_FAILED) return -1;
+    sqes = static_cast<io_uring_sqe*>(mem);
+
+    char* base = static_cast<char*>(rings);
+    sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    sqMask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    sqEntries = params.sq_entries;
+    sqeTail = *sqTail;
+
+    // Submission slot i always holds entry i.
+    unsigned* array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    for (unsigned i = 0; i < sqEntries; ++i) array[i] = i;
+
+    cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+    return 0;
+}
+
+int IoRing::enable() {
+    if (!disabled) return 0;
+    if (ioUringRegister(ringFd, IORING_REGISTER_ENABLE_RINGS, nullptr, 0) < 0) return -1;
+    disabled = false;
+    return 0;
+}
+
+io_uring_sqe* IoRing::getSqe() {
+    if (sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) submit(0);
+    io_uring_sqe* sqe = &sqes[sqeTail & sqMask];
+    ++sqeTail;
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int IoRing::submit(unsigned wait) {
+    unsigned pending = sqeTail - *sqTail;
+    __atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    return ioUringEnter(ringFd, pending, wait, flags) < 0 ? -1 : 0;
+}
+
+/*
+ * BufferRing
+ */
+
+BufferRing::~BufferRing() {
+    if (ring == nullptr) return;
+    if (ringFd >= 0) {
+        io_uring_buf_reg reg{};
+        reg.bgid = groupId;
+        ioUringRegister(ringFd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    munmap(ring, ringSize);
+}
+
+int BufferRing::init(IoRing& io_ring, uint16_t group, unsigned count, size_t buffer_size) {
+    ringSize = count * sizeof(io_uring_buf);
+    void* mem = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return -1;
+    ring = static_cast<io_uring_buf*>(mem);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (ioUringRegister(io_ring.fd(), IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+    ringFd = io_ring.fd();
+
+    groupId = group;
+    mask = count - 1;
+    size = buffer_size;
+    storage.reset(new char[count * buffer_size]);
+    for (unsigned i = 0; i < count; ++i) recycle(static_cast<uint16_t>(i));
+    return 0;
+}
+
+void BufferRing::recycle(uint16_t id) {
+    io_uring_buf& buf = ring[tail & mask];
+    buf.addr = reinterpret_cast<uint64_t>(buffer(id));
+    buf.len = static_cast<uint32_t>(size);
+    buf.bid = id;
+    ++tail;
+    // The tail overlays the reserved field of the first entry.
+    __atomic_store_n(&ring[0].resv, tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * UringWorker
+ */
+
+UringWorker::UringWorker(const ServerConfig& c, size_t i, ResponseCache* rc, FlightTable* ft, StaticFiles* f,
+                         Resolver* r)
+    : config(c),
+      index(i),
+      cache(rc),
+      flights(ft),
+      files(f),
+      resolver(r),
+      pool(c.upstreamMaxIdlePerHost, c.upstreamMaxIdle, c.upstreamIdleTimeoutMs) {}
+
+UringWorker::~UringWorker() {
+    if (thread.joinable()) {
+        stop();
+        join();
+    }
+    if (listenFd >= 0) ::close(listenFd);
+    if (wakeFd >= 0) ::close(wakeFd);
+}
+
+int UringWorker::start() {
+    listenFd = openListenSocket(config);
+    if (listenFd < 0) return -1;
+    // io_uring would fail a multishot accept on a non-blocking socket with
+    // EAGAIN instead of waiting for the next connection.
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) & ~O_NONBLOCK);
+
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (wakeFd < 0 || lookups->fd() < 0 || flightQueue->fd() < 0) return -1;
+
+    if (ring.init(kRingEntries) < 0) return -1;
+    if (buffers.init(ring, kBufferGroup, kBufferCount, kBufferSize) < 0) return -1;
+
+    sweepInterval.tv_sec = kSweepIntervalMs / 1000;
+    sweepInterval.tv_nsec = (kSweepIntervalMs % 1000) * 1000000L;
+
+    thread = std::thread(&UringWorker::run, this);
+    return 0;
+}
+
+void UringWorker::stop() {
+    uint64_t one = 1;
+    if (wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0) {
+        TRACE("worker %zu: failed to wake: %s", index, strerror(errno));
+    }
+}
+
+void UringWorker::join() {
+    if (thread.joinable()) thread.join();
+}
+
+void UringWorker::run() {
+    if (config.pinThreads) pinWorkerThread(index);
+    if (ring.enable() < 0) {
+        TRACE("worker %zu: cannot enable ring: %s", index, strerror(errno));
+        return;
+    }
+
+    running = true;
+    armAccept();
+    armWake();
+    armTimer();
+    armLookups();
+    armFlights();
+
+    auto handle = [this](const io_uring_cqe& cqe) { handleCompletion(cqe); };
+    while (running) {
+        if (ring.submit(1) < 0 && errno != EINTR && errno != EBUSY) {
+            TRACE("worker %zu: io_uring_enter: %s", index, strerror(errno));
+            break;
+        }
+        ring.forEachCompletion(handle);
+    }
+
+    // Cancel everything and wait for it, so that the kernel no longer uses
+    // any buffer or connection when they are freed.
+    io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = listenFd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = tag(WorkerOp::Cancel);
+    for (auto& conn : connections) close(*conn);
+    while (!connections.empty()) {
+        if (ring.submit(1) < 0 && errno != EINTR && errno != EBUSY) break;
+        ring.forEachCompletion(handle);
+    }
+}
+
+void UringWorker::handleCompletion(const io_uring_cqe& cqe) {
+    UringConnection* conn = reinterpret_cast<UringConnection*>(cqe.user_data & ~kOpMask);
+    uint64_t op = cqe.user_data & kOpMask;
+
+    if (conn == nullptr) {
+        switch (static_cast<WorkerOp>(op)) {
+        case WorkerOp::Accept:
+            onAccept(cqe);
+            break;
+        case WorkerOp::Wake:
+            running = false;
+            break;
+        case WorkerOp::Timer:
+            if (running) {
+                closeIdleConnections();
+                Epoch::collect(); // See EpollWorker::run().
+                armTimer();
+            }
+            break;
+        case WorkerOp::Lookups:
+            if (running) {
+                finishLookups();
+                armLookups();
+            }
+            break;
+        case WorkerOp::Flights:
+            if (running) {
+                finishFlights();
+                armFlights();
+            }
+            break;
+        case WorkerOp::Cancel:
+            break;
+        }
+        return;
+    }
+
+    // Multishot operations keep going as long as they report F_MORE.
+    if (!(cqe.flags & IORING_CQE_F_MORE)) --conn->inflight;
+    conn->lastActive = Clock::now();
+
+    switch (static_cast<ConnOp>(op)) {
+    case ConnOp::ClientRecv:
+        onRecv(*conn, false, cqe);
+        break;
+    case ConnOp::UpstreamRecv:
+        onRecv(*conn, true, cqe);
+        break;
+    case ConnOp::ClientSend:
+        onSend(*conn, false, cqe.res);
+        break;
+    case ConnOp::UpstreamSend:
+        onSend(*conn, true, cqe.res);
+        break;
+    case ConnOp::Connect:
+        onConnect(*conn, cqe.res);
+        break;
+    case ConnOp::SendRequest:
+        onRequestSent(*conn, cqe.res);
+        break;
+    case ConnOp::SendFinal:
+        if (cqe.res <= 0 || conn->closed) {
+            close(*conn);
+            break;
+        }
+        conn->finalSent += static_cast<size_t>(cqe.res);
+        if (conn->finalSent < conn->finalResponse.size() + conn->finalBody.size()) {
+            sendFinal(*conn);
+        } else {
+            if (conn->cached || conn->file) conn->timer.finish(Stage::Transfer);
+            close(*conn);
+        }
+        break;
+    case ConnOp::FlightSend:
+        if (cqe.res <= 0 || conn->closed) {
+            close(*conn);
+            break;
+        }
+        conn->finalSent += static_cast<size_t>(cqe.res);
+        if (conn->finalSent < conn->unsent.size()) {
+            sendFlight(*conn);
+        } else {
+            pullFlight(*conn);
+        }
+        break;
+    case ConnOp::Cancel:
+        break;
+    }
+    release(*conn);
+}
+
+void UringWorker::armAccept() {
+    io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenFd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = tag(WorkerOp::Accept);
+}
+
+void UringWorker::armWake() {
+    io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakeFd;
+    sqe->addr = reinterpret_cast<uint64_t>(&wakeValue);
+    sqe->len = sizeof(wakeValue);
+    sqe->user_data = tag(WorkerOp::Wake);
+}
+
+void UringWorker::armTimer() {
+    io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uint64_t>(&sweepInterval);
+    sqe->len = 1;
+    sqe->user_data = tag(WorkerOp::Timer);
+}
+
+void UringWorker::armLookups() {
+    // The queue's eventfd is non-blocking, so a read would fail with EAGAIN
+    // rather than wait: poll it and read it once it is readable.
+    io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = lookups->fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = tag(WorkerOp::Lookups);
+}
+
+void UringWorker::armFlights() {
+    io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = flightQueue->fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = tag(WorkerOp::Flights);
+}
+
+void UringWorker::armRecv(UringConnection& conn, bool upstream) {
+    UringConnection::Side& from = conn.side(upstream);
+    io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = from.fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers.group();
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = conn.tag(upstream ? ConnOp::UpstreamRecv : ConnOp::ClientRecv);
+    ++conn.inflight;
+    from.recvArmed = true;
+}
+
+void UringWorker::onAccept(const io_uring_cqe& cqe) {
+    if (!(cqe.flags & IORING_CQE_F_MORE) && running) armAccept();
+    if (cqe.res < 0) {
+        if (cqe.res != -ECANCELED) TRACE("worker %zu: accept: %s", index, strerror(-cqe.res));
+        return;
+    }
+    int fd = cqe.res;
+    if (!running) {
+        ::close(fd);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    auto conn = std::make_unique<UringConnection>();
+    conn->client.fd = fd;
+    conn->slot = connections.size();
+    UringConnection& ref = *conn;
+    connections.push_back(std::move(conn));
+    countEvent(Counter::ConnectionsAccepted);
+    armRecv(ref, false);
+}
+
+void UringWorker::onRecv(UringConnection& conn, bool upstream, const io_uring_cqe& cqe) {
+    UringConnection::Side& from = conn.side(upstream);
+    UringConnection::Side& to = conn.side(!upstream);
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    if (!more) from.recvArmed = false;
+
+    if (cqe.res > 0) {
+        uint16_t buffer = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        size_t len = static_cast<size_t>(cqe.res);
+        bool complete = false;
+        bool revalidated = false;
+        if (conn.closed || conn.state == UringConnection::State::Closing || (upstream && to.out.sourceDone)) {
+            // Bytes after the end of the response, if from the upstream.
+            if (upstream) conn.reusable = false;
+            recycle(buffer);
+        } else if (!upstream && conn.state == UringConnection::State::ReadingRequest) {
+            readRequest(conn, buffer, len);
+        } else {
+            if (upstream) {
+                if (!conn.framer.started()) conn.timer.lap(Stage::FirstByte);
+                bool holding = conn.holdsResponse();
+                size_t used;
+                complete = conn.framer.feed(buffers.buffer(buffer), len, used);
+                if (complete && used != len) conn.reusable = false;
+                if (!conn.captureKey.empty()) capture(conn, buffers.buffer(buffer), len);
+                revalidated = holding && conn.framer.status() == 304 && complete;
+                if (conn.flight && !revalidated) publish(conn);
+            } else {
+                // More than the request goes upstream.
+                conn.reusable = false;
+            }
+            // Queued while connecting, and sent once the request is out.
+            to.out.chunks.push_back({buffer, 0, static_cast<uint32_t>(len)});
+            if (revalidated) {
+                finishRevalidation(conn);
+            } else if (conn.state == UringConnection::State::Relaying) {
+                sendNext(conn, !upstream);
+            }
+            if (to.out.queued() >= kMaxQueuedChunks && from.recvArmed && !from.paused) {
+                io_uring_sqe* sqe = ring.getSqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = conn.tag(upstream ? ConnOp::UpstreamRecv : ConnOp::ClientRecv);
+                sqe->user_data = conn.tag(ConnOp::Cancel);
+                ++conn.inflight;
+                from.paused = true;
+            }
+        }
+        // Once the response is complete the connection is left alone; any
+        // recv still armed is cancelled when the client has it all.
+        if (complete && !revalidated) finishResponse(conn);
+        if (more || conn.closed || conn.state == UringConnection::State::Closing) return;
+        if (upstream && to.out.sourceDone) return;
+        // The recv stopped on its own; keep reading unless the pipe is
+        // backed up, in which case onSend() re-arms it.
+        from.paused = to.out.queued() > kMaxQueuedChunks / 2;
+        if (!from.paused) armRecv(conn, upstream);
+        return;
+    }
+
+    if (conn.closed || conn.state == UringConnection::State::Closing) return;
+
+    if (cqe.res == 0) {
+        if (!upstream && conn.state == UringConnection::State::ReadingRequest) {
+            // The client went away before sending a complete request.
+            close(conn);
+            return;
+        }
+        if (upstream) {
+            if (to.out.sourceDone) {
+                conn.reusable = false; // Closed after the response.
+                return;
+            }
+            if (retryUpstream(conn)) return;
+            if (conn.holdsResponse()) {
+                // The head of the response never came complete.
+                close(conn);
+                return;
+            }
+            finishResponse(conn);
+        } else {
+            to.out.sourceDone = true;
+            if (conn.state == UringConnection::State::Relaying && to.out.queued() == 0) {
+                pipeDrained(conn, true);
+            }
+        }
+    } else if (cqe.res == -ENOBUFS) {
+        from.starved = true;
+        starved.push_back(&conn);
+    } else if (cqe.res == -ECANCELED) {
+        // Paused; re-armed by onSend() once the pipe has drained. It may
+        // have drained already.
+        if (from.paused && to.out.queued() <= kMaxQueuedChunks / 2) {
+            from.paused = false;
+            armRecv(conn, upstream);
+        }
+    } else if (!upstream || !retryUpstream(conn)) {
+        close(conn);
+    }
+}
+
+void UringWorker::onSend(UringConnection& conn, bool upstream, int res) {
+    UringConnection::Side& to = conn.side(upstream);
+    UringConnection::Side& from = conn.side(!upstream);
+    UringConnection::Pipe& pipe = to.out;
+    pipe.sending = false;
+    if (conn.closed) return;
+    if (res < 0) {
+        close(conn);
+        return;
+    }
+
+    UringConnection::Chunk& chunk = pipe.chunks[pipe.next];
+    chunk.offset += static_cast<uint32_t>(res);
+    chunk.len -= static_cast<uint32_t>(res);
+    if (chunk.len == 0) {
+        recycle(chunk.buffer);
+        if (++pipe.next == pipe.chunks.size()) {
+            pipe.chunks.clear();
+            pipe.next = 0;
+        }
+    }
+
+    if (from.paused && !from.recvArmed && pipe.queued() <= kMaxQueuedChunks / 2) {
+        from.paused = false;
+        armRecv(conn, !upstream);
+    }
+    if (pipe.queued() > 0) {
+        sendNext(conn, upstream);
+    } else if (pipe.sourceDone) {
+        pipeDrained(conn, upstream);
+    }
+}
+
+void UringWorker::onConnect(UringConnection& conn, int res) {
+    if (conn.closed || conn.state != UringConnection::State::Connecting) return;
+    if (res >= 0) {
+        conn.timer.lap(Stage::Connect);
+        return;
+    }
+    TRACE("worker %zu: connect: %s", index, strerror(-res));
+    if (conn.nextAddress < conn.addresses.count) {
+        conn.connectFailed = true;
+        return;
+    }
+    sendError(conn, 502);
+}
+
+void UringWorker::onRequestSent(UringConnection& conn, int res) {
+    // After a failed connect the linked send completes with -ECANCELED.
+    if (conn.closed || conn.state != UringConnection::State::Connecting) return;
+    if (conn.connectFailed) {
+        // Nothing refers to the socket any longer.
+        conn.connectFailed = false;
+        ::close(conn.upstream.fd);
+        conn.upstream = UringConnection::Side{};
+        connectNext(conn);
+        return;
+    }
+    if (res < 0) {
+        if (!retryUpstream(conn)) sendError(conn, 502);
+        return;
+    }
+
+    size_t sent = static_cast<size_t>(res);
+    if (!conn.requestCopied) {
+        // Copy whatever did not fit in the socket buffer, so that the
+        // request's buffers need not be kept any longer.
+        for (size_t i = 0; i < conn.msg.msg_iovlen; ++i) {
+            const iovec& iov = conn.iov[i];
+            if (sent >= iov.iov_len) {
+                sent -= iov.iov_len;
+                continue;
+            }
+            conn.unsent.append(static_cast<const char*>(iov.iov_base) + sent, iov.iov_len - sent);
+            sent = 0;
+        }
+        conn.requestCopied = true;
+    } else {
+        conn.unsent.erase(0, sent);
+    }
+
+    if (!conn.unsent.empty()) {
+        io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn.upstream.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(conn.unsent.data());
+        sqe->len = static_cast<uint32_t>(conn.unsent.size());
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = conn.tag(ConnOp::SendRequest);
+        ++conn.inflight;
+        return;
+    }
+    conn.timer.skip();
+
+    // The request is out; from here on bytes are only relayed. While the
+    // response is captured the request stays around, since the cache reads
+    // the headers named by Vary from it, and so it does while it may have to
+    // be sent again, but it must not pin a buffer.
+    if (conn.captureKey.empty() && !conn.pooled) {
+        conn.request.clear();
+        conn.parser.reset();
+        conn.in.clear();
+    } else if (conn.heldBuffer >= 0) {
+        conn.in.assign(buffers.buffer(static_cast<uint16_t>(conn.heldBuffer)), conn.heldLen);
+        conn.request.rebase(conn.in.data());
+    }
+    if (conn.heldBuffer >= 0) {
+        recycle(static_cast<uint16_t>(conn.heldBuffer));
+        conn.heldBuffer = -1;
+    }
+    conn.state = UringConnection::State::Relaying;
+    armRecv(conn, true);
+    if (conn.upstream.out.queued() > 0) {
+        sendNext(conn, true);
+    } else if (conn.upstream.out.sourceDone) {
+        pipeDrained(conn, true);
+    }
+}
+
+void UringWorker::readRequest(UringConnection& conn, uint16_t buffer, size_t len) {
+    const char* data = buffers.buffer(buffer);
+    ParseStatus status;
+    if (!conn.timer.running()) conn.timer.begin();
+
+    if (conn.in.empty()) {
+        // Most requests fit in one buffer: parse them where they landed.
+        status = conn.parser.feed(std::string_view(data, len), conn.request);
+        if (status == ParseStatus::Done) {
+            conn.heldBuffer = buffer;
+            conn.heldLen = len;
+            dispatchRequest(conn);
+            return;
+        }
+        if (status == ParseStatus::NeedMore) conn.in.assign(data, len);
+        recycle(buffer);
+    } else {
+        conn.in.append(data, len);
+        recycle(buffer);
+        status = conn.parser.feed(conn.in, conn.request);
+        if (status == ParseStatus::Done) {
+            dispatchRequest(conn);
+            return;
+        }
+    }
+
+    // A head too large for DefaultRequestLimits is an error too.
+    if (status == ParseStatus::Error) sendError(conn, rejectionStatus(conn.parser.error()));
+}
+
+void UringWorker::dispatchRequest(UringConnection& conn) {
+    conn.timer.lap(Stage::Parse);
+    countEvent(Counter::Requests);
+    size_t received = conn.heldBuffer >= 0 ? conn.heldLen : conn.in.size();
+    conn.reusable = pool.enabled() && requestComplete(conn.request, received - conn.parser.consumed());
+    conn.retryable = isIdempotentMethod(conn.request.methodId);
+    conn.framer.reset(conn.request.methodId == HttpMethod::Head);
+
+    if (files != nullptr && StaticFiles::serves(conn.request)) {
+        std::shared_ptr<const StaticFile> file;
+        int status = files->lookup(conn.request, file);
+        conn.timer.lap(Stage::Handle);
+        if (status != 0) {
+            sendError(conn, status);
+        } else {
+            conn.notModified = requestNotModified(conn.request, file->etag, file->lastModified);
+            sendFile(conn, std::move(file));
+        }
+        return;
+    }
+
+    int status = prepareUpstreamRequest(conn.request, conn.hostHeader, conn.target, conn.reusable);
+    if (status != 0) {
+        sendError(conn, status);
+        return;
+    }
+
+    if (cache != nullptr) {
+        if (ResponseCache::mayServe(conn.request)) {
+            if (auto hit = cache->lookup(conn.target.resource, conn.request)) {
+                conn.timer.lap(Stage::Handle);
+                conn.notModified = requestNotModified(conn.request, hit->etag, hit->lastModified);
+                sendCached(conn, std::move(hit));
+                return;
+            }
+        }
+        if (ResponseCache::mayStore(conn.request)) {
+            conn.captureKey = conn.target.resource;
+            // Concurrent misses wait for the first one's response.
+            if (flights != nullptr && Flight::mayShare(conn.request)) {
+                conn.flight = flights->join(conn.target.resource, conn.leader);
+                if (!conn.leader) {
+                    conn.timer.lap(Stage::Handle);
+                    follow(conn);
+                    return;
+                }
+            }
+            if (ResponseCache::mayRevalidate(conn.request)) {
+                conn.stale = cache->lookupStale(conn.target.resource, conn.request);
+            }
+        }
+        if (conn.stale) {
+            conn.notModified = requestNotModified(conn.request, conn.stale->etag, conn.stale->lastModified);
+            ResponseCache::makeConditional(conn.request, *conn.stale);
+        }
+    }
+    conn.timer.lap(Stage::Handle);
+    startUpstream(conn);
+}
+
+void UringWorker::startUpstream(UringConnection& conn) {
+    if (conn.reusable) {
+        int fd = pool.acquire(conn.target.origin);
+        if (fd >= 0) {
+            conn.upstream.fd = fd;
+            conn.pooled = true;
+            countEvent(Counter::UpstreamReuses);
+            sendRequest(conn, false);
+            return;
+        }
+    }
+    connectUpstream(conn);
+}
+
+void UringWorker::connectUpstream(UringConnection& conn) {
+    ResolvedAddress address;
+    if (resolver->lookup(conn.target, address)) {
+        connectTo(conn, address);
+        return;
+    }
+
+    // Not cached: wait for a resolver thread. Client bytes received
+    // meanwhile are queued as they are while connecting.
+    conn.lookup = ++nextLookup;
+    resolving.emplace(conn.lookup, &conn);
+    conn.state = UringConnection::State::Resolving;
+    resolver->resolve(conn.target, conn.lookup, lookups);
+}
+
+void UringWorker::connectTo(UringConnection& conn, const ResolvedAddress& address) {
+    conn.timer.lap(Stage::Resolve);
+    if (address.error != 0) {
+        sendError(conn, 502);
+        return;
+    }
+    conn.addresses = address;
+    conn.nextAddress = 0;
+    connectNext(conn);
+}
+
+void UringWorker::connectNext(UringConnection& conn) {
+    while (conn.nextAddress < conn.addresses.count) {
+        const ResolvedAddress::Address& address = conn.addresses.addrs[conn.nextAddress++];
+        int fd = socket(address.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) continue;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        countEvent(Counter::UpstreamConnects);
+        conn.upstream.fd = fd;
+        sendRequest(conn, true);
+        return;
+    }
+    sendError(conn, 502);
+}
+
+void UringWorker::finishLookups() {
+    uint64_t count;
+    if (read(lookups->fd(), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        TRACE("worker %zu: lookup queue: %s", index, strerror(errno));
+    }
+    for (ResolveQueue::Completion& done : lookups->take()) {
+        // The connection may have been closed while it waited.
+        auto found = resolving.find(done.token);
+        if (found == resolving.end()) continue;
+        UringConnection& conn = *found->second;
+        resolving.erase(found);
+        if (conn.closed || conn.state != UringConnection::State::Resolving) continue;
+        conn.lastActive = Clock::now();
+        connectTo(conn, done.result);
+    }
+}
+
+void UringWorker::sendRequest(UringConnection& conn, bool connect) {
+    int count = conn.request.unparseTo(conn.iov, kMaxRequestIovecs - 1);
+    if (count < 0) {
+        sendError(conn, 431);
+        return;
+    }
+
+    // Body bytes that arrived together with the header block.
+    std::string_view received = conn.heldBuffer >= 0
+        ? std::string_view(buffers.buffer(static_cast<uint16_t>(conn.heldBuffer)), conn.heldLen)
+        : std::string_view(conn.in);
+    size_t head_len = conn.parser.consumed();
+    if (received.size() > head_len) {
+        conn.iov[count].iov_base = const_cast<char*>(received.data() + head_len);
+        conn.iov[count].iov_len = received.size() - head_len;
+        ++count;
+    }
+    conn.msg = msghdr{};
+    conn.msg.msg_iov = conn.iov;
+    conn.msg.msg_iovlen = static_cast<size_t>(count);
+
+    // On a new socket the send is linked to the connect: the kernel issues it
+    // as soon as the connection is established, or cancels it if connecting
+    // fails.
+    io_uring_sqe* sqe;
+    if (connect) {
+        sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = conn.upstream.fd;
+        const ResolvedAddress::Address& address = conn.addresses.addrs[conn.nextAddress - 1];
+        sqe->addr = reinterpret_cast<uint64_t>(&address.addr);
+        sqe->off = address.len;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = conn.tag(ConnOp::Connect);
+        ++conn.inflight;
+    }
+
+    sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn.upstream.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&conn.msg);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = conn.tag(ConnOp::SendRequest);
+    ++conn.inflight;
+    conn.state = UringConnection::State::Connecting;
+}
+
+bool UringWorker::retryUpstream(UringConnection& conn) {
+    if (!conn.pooled || !conn.retryable || !conn.reusable || conn.framer.started() || conn.upstream.recvArmed) {
+        return false;
+    }
+    TRACE("worker %zu: pooled connection to %s was closed, retrying", index, conn.target.origin.text);
+    countEvent(Counter::UpstreamRetries);
+    conn.timer.skip();
+
+    ::close(conn.upstream.fd);
+    conn.upstream = UringConnection::Side{};
+    conn.pooled = false;
+    conn.requestCopied = false;
+    conn.unsent.clear();
+    connectUpstream(conn);
+    return true;
+}
+
+void UringWorker::finishRevalidation(UringConnection& conn) {
+    countEvent(Counter::CacheRevalidations);
+    UringConnection::Pipe& pipe = conn.client.out;
+    std::string not_modified;
+    for (size_t i = pipe.next; i < pipe.chunks.size(); ++i) {
+        const UringConnection::Chunk& chunk = pipe.chunks[i];
+        not_modified.append(buffers.buffer(chunk.buffer) + chunk.offset, chunk.len);
+        recycle(chunk.buffer);
+    }
+    pipe.chunks.clear();
+    pipe.next = 0;
+    // The 304 is complete, which lets release() pool the upstream.
+    pipe.sourceDone = true;
+    conn.captureKey.clear();
+    conn.captured.clear();
+    std::shared_ptr<const CachedResponse> entry = cache->revalidate(conn.stale, not_modified);
+    if (conn.flight) {
+        // Followers get the whole entry.
+        flights->append(*conn.flight, entry->response.data(), entry->response.size());
+        flights->finish(*conn.flight);
+        conn.flight.reset();
+    }
+    sendCached(conn, std::move(entry));
+}
+
+void UringWorker::finishResponse(UringConnection& conn) {
+    conn.client.out.sourceDone = true;
+    if (!conn.captureKey.empty()) {
+        cache->store(std::move(conn.captureKey), conn.request, std::move(conn.captured));
+        conn.captureKey.clear();
+    }
+    // Stored first, so that requests from now on hit the cache.
+    if (conn.flight && conn.flightSent > 0) {
+        flights->finish(*conn.flight);
+        conn.flight.reset();
+    }
+    leaveFlight(conn);
+    if (conn.state == UringConnection::State::Relaying && conn.client.out.queued() == 0) {
+        pipeDrained(conn, false);
+    }
+}
+
+void UringWorker::sendNext(UringConnection& conn, bool upstream) {
+    UringConnection::Side& to = conn.side(upstream);
+    UringConnection::Pipe& pipe = to.out;
+    if (pipe.sending || pipe.queued() == 0 || conn.closed) return;
+    if (!upstream && conn.holdsResponse()) return;
+
+    const UringConnection::Chunk& chunk = pipe.chunks[pipe.next];
+    io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = to.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffers.buffer(chunk.buffer) + chunk.offset);
+    sqe->len = chunk.len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = conn.tag(upstream ? ConnOp::UpstreamSend : ConnOp::ClientSend);
+    ++conn.inflight;
+    pipe.sending = true;
+}
+
+void UringWorker::pipeDrained(UringConnection& conn, bool upstream) {
+    if (upstream) {
+        // The client is done sending and all of it reached the origin.
+        shutdown(conn.upstream.fd, SHUT_WR);
+    } else {
+        // The origin finished its response and all of it was delivered.
+        conn.timer.finish(Stage::Transfer);
+        close(conn);
+    }
+}
+
+void UringWorker::capture(UringConnection& conn, const char* data, size_t len) {
+    if (conn.captured.size() + len > config.cacheMaxObjectBytes) {
+        conn.captureKey.clear();
+        conn.captured = std::string();
+        leaveFlight(conn);
+        return;
+    }
+    conn.captured.append(data, len);
+}
+
+void UringWorker::publish(UringConnection& conn) {
+    if (!conn.framer.headDone() || conn.captureKey.empty()) return;
+    if (conn.flightSent == 0 && !responseSharable(conn.captured)) {
+        leaveFlight(conn);
+        return;
+    }
+    flights->append(*conn.flight, conn.captured.data() + conn.flightSent, conn.captured.size() - conn.flightSent);
+    conn.flightSent = conn.captured.size();
+}
+
+void UringWorker::follow(UringConnection& conn) {
+    // Client bytes received meanwhile are queued as they are while
+    // connecting, in case the follower goes upstream after all.
+    conn.state = UringConnection::State::Following;
+    conn.flightToken = ++nextFlightToken;
+    following[conn.flightToken] = &conn;
+    pullFlight(conn);
+}
+
+void UringWorker::pullFlight(UringConnection& conn) {
+    for (;;) {
+        if (conn.client.out.sourceDone) {
+            conn.timer.finish(Stage::Transfer);
+            close(conn);
+            return;
+        }
+
+        conn.unsent.clear();
+        conn.finalSent = 0;
+        switch (conn.flight->read(conn.flightOffset, conn.unsent, flightQueue, conn.flightToken)) {
+        case Flight::Read::Data: {
+            if (conn.flightOffset == 0) {
+                countEvent(Counter::CoalescedRequests);
+                conn.timer.lap(Stage::FirstByte);
+            }
+            conn.flightOffset += conn.unsent.size();
+            size_t used;
+            if (conn.framer.feed(conn.unsent.data(), conn.unsent.size(), used)) {
+                conn.client.out.sourceDone = true;
+                conn.unsent.resize(used);
+            }
+            if (!conn.unsent.empty()) {
+                sendFlight(conn);
+                return;
+            }
+            break;
+        }
+        case Flight::Read::Wait:
+            return;
+        case Flight::Read::Done:
+            conn.client.out.sourceDone = true;
+            break;
+        case Flight::Read::Abandoned:
+            if (conn.flightOffset > 0) {
+                // Part of the response went out; the rest never comes.
+                close(conn);
+                return;
+            }
+            // Nothing went out: fetch it after all.
+            leaveFlight(conn);
+            conn.framer.reset(false);
+            startUpstream(conn);
+            return;
+        }
+    }
+}
+
+void UringWorker::sendFlight(UringConnection& conn) {
+    io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn.client.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(conn.unsent.data() + conn.finalSent);
+    sqe->len = static_cast<uint32_t>(conn.unsent.size() - conn.finalSent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = conn.tag(ConnOp::FlightSend);
+    ++conn.inflight;
+}
+
+void UringWorker::finishFlights() {
+    uint64_t count;
+    if (read(flightQueue->fd(), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        TRACE("worker %zu: flight queue: %s", index, strerror(errno));
+    }
+    for (uint64_t token : flightQueue->take()) {
+        // The connection may have been closed, or have given up, meanwhile.
+        auto found = following.find(token);
+        if (found == following.end()) continue;
+        UringConnection& conn = *found->second;
+        conn.lastActive = Clock::now();
+        pullFlight(conn);
+    }
+}
+
+void UringWorker::leaveFlight(UringConnection& conn) {
+    if (!conn.flight) return;
+    if (conn.leader) {
+        flights->abandon(*conn.flight);
+    } else {
+        following.erase(conn.flightToken);
+    }
+    conn.flight.reset();
+    conn.leader = false;
+}
+
+void UringWorker::sendError(UringConnection& conn, int status) {
+    if (conn.closed || conn.state == UringConnection::State::Closing) return;
+    countEvent(Counter::ErrorResponses);
+    conn.unsent = errorResponse(status);
+    conn.finalResponse = conn.unsent;
+    conn.finalSent = 0;
+    sendFinal(conn);
+}
+
+void UringWorker::sendCached(UringConnection& conn, std::shared_ptr<const CachedResponse> response) {
+    countEvent(Counter::CacheHits);
+    if (conn.notModified) countEvent(Counter::NotModified);
+    conn.cached = std::move(response);
+    conn.finalResponse = conn.notModified ? conn.cached->notModified : conn.cached->response;
+    conn.finalSent = 0;
+    sendFinal(conn);
+}
+
+void UringWorker::sendFile(UringConnection& conn, std::shared_ptr<const StaticFile> file) {
+    countEvent(Counter::StaticResponses);
+    if (conn.notModified) countEvent(Counter::NotModified);
+    conn.unsent.assign(conn.notModified ? file->notModified : file->head);
+    conn.unsent += "Connection: close\r\n\r\n";
+    conn.finalResponse = conn.unsent;
+    if (conn.request.methodId != HttpMethod::Head && !conn.notModified) conn.finalBody = file->body;
+    conn.finalSent = 0;
+    conn.file = std::move(file);
+    sendFinal(conn);
+}
+
+void UringWorker::sendFinal(UringConnection& conn) {
+    if (conn.state != UringConnection::State::Closing) {
+        leaveFlight(conn);
+        conn.state = UringConnection::State::Closing;
+        if (conn.upstream.fd >= 0) {
+            io_uring_sqe* sqe = ring.getSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = conn.upstream.fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = conn.tag(ConnOp::Cancel);
+            ++conn.inflight;
+        }
+    }
+
+    // A completion reports at most INT_MAX bytes; a large file takes several.
+    constexpr size_t kMaxSend = size_t(1) << 30;
+    size_t head_len = conn.finalResponse.size();
+    size_t count = 0;
+    if (conn.finalSent < head_len) {
+        conn.finalIov[count++] = {const_cast<char*>(conn.finalResponse.data()) + conn.finalSent,
+                                  head_len - conn.finalSent};
+    }
+    size_t body_sent = conn.finalSent - std::min(conn.finalSent, head_len);
+    if (body_sent < conn.finalBody.size()) {
+        conn.finalIov[count++] = {const_cast<char*>(conn.finalBody.data()) + body_sent,
+                                  std::min(conn.finalBody.size() - body_sent, kMaxSend)};
+    }
+    conn.finalMsg = msghdr{};
+    conn.finalMsg.msg_iov = conn.finalIov;
+    conn.finalMsg.msg_iovlen = count;
+
+    io_uring_sqe* sqe = ring.getSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn.client.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&conn.finalMsg);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = conn.tag(ConnOp::SendFinal);
+    ++conn.inflight;
+}
+
+void UringWorker::close(UringConnection& conn) {
+    if (conn.closed) return;
+    conn.closed = true;
+    countEvent(Counter::ConnectionsClosed);
+    leaveFlight(conn);
+    for (UringConnection::Side* side : {&conn.client, &conn.upstream}) {
+        if (side->fd < 0) continue;
+        io_uring_sqe* sqe = ring.getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = side->fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = conn.tag(ConnOp::Cancel);
+        ++conn.inflight;
+    }
+}
+
+void UringWorker::release(UringConnection& conn) {
+    if (!conn.closed || conn.inflight > 0) return;
+
+    if (conn.lookup != 0) resolving.erase(conn.lookup); // In case it is still waiting.
+    if (conn.heldBuffer >= 0) recycle(static_cast<uint16_t>(conn.heldBuffer));
+    bool keep_upstream = conn.upstream.fd >= 0 && conn.upstreamReusable();
+    for (UringConnection::Side* side : {&conn.client, &conn.upstream}) {
+        for (size_t i = side->out.next; i < side->out.chunks.size(); ++i) recycle(side->out.chunks[i].buffer);
+        if (side == &conn.upstream && keep_upstream) {
+            pool.release(conn.target.origin, side->fd);
+        } else if (side->fd >= 0) {
+            ::close(side->fd);
+        }
+    }
+    starved.erase(std::remove(starved.begin(), starved.end(), &conn), starved.end());
+
+    size_t slot = conn.slot;
+    if (slot + 1 != connections.size()) {
+        std::swap(connections[slot], connections.back());
+        connections[slot]->slot = slot;
+    }
+    connections.pop_back();
+}
+
+void UringWorker::recycle(uint16_t buffer) {
+    buffers.recycle(buffer);
+    if (starved.empty()) return;
+
+    std::vector<UringConnection*> waiting;
+    waiting.swap(starved);
+    for (UringConnection* conn : waiting) {
+        for (bool upstream : {false, true}) {
+            UringConnection::Side& side = conn->side(upstream);
+            if (!side.starved) continue;
+            side.starved = false;
+            if (!conn->closed && !side.recvArmed && !side.paused) armRecv(*conn, upstream);
+        }
+    }
+}
+
+void UringWorker::closeIdleConnections() {
+    pool.closeExpired();
+    Clock::time_point deadline = Clock::now() - std::chrono::milliseconds(config.idleTimeoutMs);
+    for (auto& conn : connections) {
+        if (conn->closed || conn->lastActive >= deadline) continue;
+        if (conn->state == UringConnection::State::ReadingRequest && !conn->in.empty()) {
+            // A partial request that never completed, e.g. a slowloris client.
+            sendError(*conn, 408);
+        } else {
+            close(*conn);
+        }
+    }
+}
+
+#endif // PROXY_HAVE_IO_URING
@@ -0,0 +1,366 @@
+/*
+ * proxy_uring.hpp -- io_uring I/O engine for the proxy server.
+ *
+ * With epoll every request costs an epoll_wait() plus one syscall per
+ * accept, recv and send. UringWorker instead queues those operations in a
+ * submission ring shared with the kernel and submits a whole batch, waiting
+ * for completions, with a single io_uring_enter() per loop iteration:
+ *
+ *   - one multishot accept keeps producing a completion per new connection,
+ *   - every socket has one multishot recv that picks its buffers from a
+ *     provided buffer ring, so no buffer is tied up by an idle connection;
+ *     the first buffer of a request is parsed in place by the
+ *     RequestParser without being copied,
+ *   - connecting to the origin and sending the rewritten request are linked,
+ *     the send going out straight from the request's unparseTo() iovecs as
+ *     soon as the connect completes, without a round trip through the loop.
+ *
+ * liburing is not required: the ring is driven through the raw syscalls and
+ * <linux/io_uring.h>. Multishot recv and buffer rings need Linux 6.0; on an
+ * older kernel (or where io_uring is forbidden) UringWorker::start() fails
+ * with errno ENOSYS, EINVAL or EPERM and ProxyServer falls back to epoll.
+ * Define PROXY_NO_IO_URING to leave the engine out altogether.
+ */
+
+#pragma once
+
+#if !defined(PROXY_NO_IO_URING) && defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define PROXY_HAVE_IO_URING 1
+#else
+#define PROXY_HAVE_IO_URING 0
+#endif
+
+#if PROXY_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "proxy_server.hpp"
+
+/*
+ * IoRing class
+ *
+ * A submission and completion queue pair mapped from the kernel.
+ */
+class IoRing {
+public:
+    IoRing() = default;
+    ~IoRing();
+
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    /*
+     * init() method: Creates a ring with room for `entries` submissions.
+     * The ring is created disabled so that it can be set up on one thread
+     * and used by another; enable() must be called from the thread that
+     * will submit to it.
+     * Returns 0 on success, -1 on failure (with errno set).
+     */
+    int init(unsigned entries);
+
+    /*
+     * enable() method: Makes the calling thread the ring's only submitter.
+     * Returns 0 on success, -1 on failure (with errno set).
+     */
+    int enable();
+
+    /*
+     * getSqe() method: Returns a zeroed submission queue entry to fill in.
+     * If the queue is full, what is queued is submitted first.
+     */
+    io_uring_sqe* getSqe();
+
+    /*
+     * submit() method: Hands the queued entries to the kernel and waits
+     * until at least `wait` completions are available.
+     * Returns 0 on success, -1 on failure (with errno set).
+     */
+    int submit(unsigned wait);
+
+    /*
+     * forEachCompletion() method: Calls `f(const io_uring_cqe&)` for every
+     * available completion and then frees them. `f` may queue new entries.
+     */
+    template <class F>
+    void forEachCompletion(F&& f) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            // Copied so that the slot can be handed back before `f` runs.
+            io_uring_cqe cqe = cqes[head & cqMask];
+            ++head;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            f(cqe);
+            if (head == tail) tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    int fd() const { return ringFd; }
+
+private:
+    int ringFd = -1;
+    bool disabled = false;
+
+    // Submission queue.
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    io_uring_sqe* sqes = nullptr;
+    unsigned sqeTail = 0; // Next entry to hand out; published by submit().
+
+    // Completion queue.
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    // The mapping holding both rings, and the one of the entries.
+    void* rings = nullptr;
+    size_t ringsSize = 0;
+    size_t sqesSize = 0;
+};
+
+/*
+ * BufferRing class
+ *
+ * A group of equally sized receive buffers provided to the kernel. A recv
+ * submitted with IOSQE_BUFFER_SELECT takes the next free buffer when data
+ * arrives and reports its id in the completion; the buffer belongs to the
+ * application until recycle() gives it back.
+ */
+class BufferRing {
+public:
+    BufferRing() = default;
+    ~BufferRing();
+
+    BufferRing(const BufferRing&) = delete;
+    BufferRing& operator=(const BufferRing&) = delete;
+
+    /*
+     * init() method: Registers `count` buffers of `size` bytes each with
+     * `ring` as buffer group `group`. `count` must be a power of two.
+     * Returns 0 on success, -1 on failure (with errno set).
+     */
+    int init(IoRing& ring, uint16_t group, unsigned count, size_t size);
+
+    char* buffer(uint16_t id) { return storage.get() + size_t(id) * size; }
+    size_t bufferSize() const { return size; }
+    uint16_t group() const { return groupId; }
+
+    /*
+     * recycle() method: Returns a buffer to the kernel.
+     */
+    void recycle(uint16_t id);
+
+private:
+    int ringFd = -1;
+    // The ring's entries. io_uring_buf_ring is not used: compiled as C++ its
+    // flexible array member does not start at offset 0 as the kernel expects.
+    io_uring_buf* ring = nullptr;
+    size_t ringSize = 0;
+    unsigned mask = 0;
+    uint16_t tail = 0;
+    uint16_t groupId = 0;
+    size_t size = 0;
+    std::unique_ptr<char[]> storage;
+};
+
+// Per-connection state; defined in proxy_uring.cpp.
+struct UringConnection;
+
+/*
+ * UringWorker class
+ *
+ * Worker driving its sockets through an IoRing.
+ */
+class UringWorker : public Worker {
+public:
+    // Provided receive buffers per worker, and their size.
+    static constexpr unsigned kBufferCount = 1024;
+    static constexpr size_t kBufferSize = 16 * 1024;
+
+    UringWorker(const ServerConfig& config, size_t index, ResponseCache* cache, FlightTable* flights,
+                StaticFiles* files, Resolver* resolver);
+    ~UringWorker() override;
+
+    UringWorker(const UringWorker&) = delete;
+    UringWorker& operator=(const UringWorker&) = delete;
+
+    int start() override;
+    void stop() override;
+    void join() override;
+    size_t connectionCount() const override { return connections.size(); }
+
+private:
+    // Event loop body, run on the worker thread.
+    void run();
+
+    // Dispatches one completion.
+    void handleCompletion(const io_uring_cqe& cqe);
+
+    // Queue the worker-wide operations.
+    void armAccept();
+    void armWake();
+    void armTimer();
+    void armLookups();
+    void armFlights();
+
+    // Queues the multishot recv of the client or upstream socket.
+    void armRecv(UringConnection& conn, bool upstream);
+
+    // Handle completions of the corresponding operations.
+    void onAccept(const io_uring_cqe& cqe);
+    void onRecv(UringConnection& conn, bool upstream, const io_uring_cqe& cqe);
+    void onSend(UringConnection& conn, bool upstream, int res);
+    void onConnect(UringConnection& conn, int res);
+    void onRequestSent(UringConnection& conn, int res);
+
+    // Feeds client bytes to the parser while the request head is incomplete.
+    void readRequest(UringConnection& conn, uint16_t buffer, size_t len);
+
+    // Acts on a complete request: answers it with a file from the document
+    // root or from the cache, follows a flight, or rewrites it and sends it
+    // upstream.
+    void dispatchRequest(UringConnection& conn);
+
+    // Sends the request on a pooled connection to the origin server or on a
+    // new one.
+    void startUpstream(UringConnection& conn);
+
+    // Finds the address of the origin of the request, from the resolver's
+    // cache or by waiting for a lookup, and connects to it.
+    void connectUpstream(UringConnection& conn);
+
+    // Connects to the resolved origin addresses.
+    void connectTo(UringConnection& conn, const ResolvedAddress& address);
+
+    // Opens a socket for the first of the origin's addresses that takes one
+    // and queues the connect, or answers 502 once none is left.
+    void connectNext(UringConnection& conn);
+
+    // Connects the connections whose lookups have finished.
+    void finishLookups();
+
+    // Queues the send of the request, linked to a connect first if the
+    // upstream socket is new.
+    void sendRequest(UringConnection& conn, bool connect);
+
+    // Called when a pooled upstream closed or failed before answering. If
+    // the request may be sent again, starts over on a new connection and
+    // returns true.
+    bool retryUpstream(UringConnection& conn);
+
+    // Called when the origin answered a revalidation with 304: refreshes
+    // the stale entry from the response queued to the client, which is
+    // dropped, and answers the client from the entry.
+    void finishRevalidation(UringConnection& conn);
+
+    // The origin is done with the response, by completing it or by closing
+    // the connection: stores it in the cache if it was captured.
+    void finishResponse(UringConnection& conn);
+
+    // Queues the next chunk of a pipe, if any and none is being sent.
+    void sendNext(UringConnection& conn, bool upstream);
+
+    // Called when a pipe has nothing left to send.
+    void pipeDrained(UringConnection& conn, bool upstream);
+
+    // Appends response bytes to the copy being made for the cache, giving
+    // up once the response is too large to store.
+    void capture(UringConnection& conn, const char* data, size_t len);
+
+    // Copies what the leader of a flight has captured to the flight, once
+    // the head shows that the response may be shared, or ends the flight if
+    // it may not.
+    void publish(UringConnection& conn);
+
+    // Makes `conn` a follower of the flight it joined.
+    void follow(UringConnection& conn);
+
+    // Queues the send of what the flight of a follower has for it, and
+    // closes the connection once it has sent all of it. A follower whose
+    // leader gave up before sending anything goes upstream itself.
+    void pullFlight(UringConnection& conn);
+
+    // Queues the rest of what a follower read from its flight.
+    void sendFlight(UringConnection& conn);
+
+    // Goes on with the followers whose flights have more for them.
+    void finishFlights();
+
+    // Drops the flight of `conn`, ending it if `conn` leads it.
+    void leaveFlight(UringConnection& conn);
+
+    // Sends a canned error response and closes the connection after it.
+    void sendError(UringConnection& conn, int status);
+
+    // Answers the client from the cache and closes the connection after it.
+    void sendCached(UringConnection& conn, std::shared_ptr<const CachedResponse> response);
+
+    // Answers the client with a file from the document root, sent from its
+    // mapping, and closes the connection after it.
+    void sendFile(UringConnection& conn, std::shared_ptr<const StaticFile> file);
+
+    // Cancels the upstream and queues the rest of the final response of a
+    // Closing connection.
+    void sendFinal(UringConnection& conn);
+
+    // Cancels everything in flight for `conn`; the connection is freed once
+    // the last of its operations has completed.
+    void close(UringConnection& conn);
+
+    // Frees `conn` if it is closed and nothing refers to it any more; a
+    // reusable upstream goes back to the pool.
+    void release(UringConnection& conn);
+
+    // Gives a provided buffer back, re-arming recvs that ran out of them.
+    void recycle(uint16_t buffer);
+
+    // Closes connections that have been idle for longer than the timeout.
+    void closeIdleConnections();
+
+    const ServerConfig& config;
+    const size_t index;
+    ResponseCache* const cache; // Shared by all workers; null if disabled.
+    FlightTable* const flights; // Shared by all workers; null if the cache is disabled.
+    StaticFiles* const files;   // Shared by all workers; null without a document root.
+    Resolver* const resolver;   // Shared by all workers.
+    UpstreamPool pool;
+    int listenFd = -1;
+    int wakeFd = -1;
+    uint64_t wakeValue = 0;
+    __kernel_timespec sweepInterval{};
+    bool running = false;
+    IoRing ring;
+    BufferRing buffers;
+    std::thread thread;
+
+    // Live connections, including closed ones with operations in flight;
+    // each one stores its own position for O(1) removal.
+    std::vector<std::unique_ptr<UringConnection>> connections;
+
+    // Connections whose recv stopped because no buffer was free.
+    std::vector<UringConnection*> starved;
+
+    // Lookups of this worker's connections; the resolver may outlive it.
+    std::shared_ptr<ResolveQueue> lookups = std::make_shared<ResolveQueue>();
+    uint64_t nextLookup = 0;
+    std::unordered_map<uint64_t, UringConnection*> resolving; // By lookup token.
+
+    // Followers of this worker waiting for flights, which other workers lead.
+    std::shared_ptr<FlightQueue> flightQueue = std::make_shared<FlightQueue>();
+    uint64_t nextFlightToken = 0;
+    std::unordered_map<uint64_t, UringConnection*> following; // By flight token.
+};
+
+#endif // PROXY_HAVE_IO_URING